@@ -59,8 +59,13 @@ $(LIBFREESPACE_MSG_GEN) : $(LIBFREESPACE_MSG_GEN_SCRIPT) $(LIBFREESPACE_MSG_GEN_
 LIBFREESPACE_MSG_GEN_SRCS := \
 	$(LIBFREESPACE_GEN_DIR)/freespace_printers.c \
 	$(LIBFREESPACE_GEN_DIR)/freespace_codecs.c \
+	$(LIBFREESPACE_GEN_DIR)/freespace_batch.c \
 	$(LIBFREESPACE_GEN_DIR)/include/freespace_printers.h \
-	$(LIBFREESPACE_GEN_DIR)/include/freespace_codecs.h
+	$(LIBFREESPACE_GEN_DIR)/include/freespace_codecs.h \
+	$(LIBFREESPACE_GEN_DIR)/include/freespace_views.h \
+	$(LIBFREESPACE_GEN_DIR)/include/freespace_batch.h \
+	$(LIBFREESPACE_GEN_DIR)/include/freespace_encoded.h \
+	$(LIBFREESPACE_GEN_DIR)/include/freespace_messages.hpp
 
 $(LIBFREESPACE_MSG_GEN_SRCS) : $(LIBFREESPACE_MSG_GEN)
 
@@ -86,7 +91,8 @@ else
 
 LOCAL_SRC_FILES += \
 	../../obj/libfreespace/freespace_printers.c \
-	../../obj/libfreespace/freespace_codecs.c
+	../../obj/libfreespace/freespace_codecs.c \
+	../../obj/libfreespace/freespace_batch.c
 
 $(addprefix $(LOCAL_PATH)/, $(LOCAL_SRC_FILES)) : $(LIBFREESPACE_MSG_GEN) $(LIBFREESPACE_CONF_FILE)
 
@@ -0,0 +1,875 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Codec micro-benchmarks.
+//
+// The codecs are generated in test mode, so every message has both an
+// encoder and a decoder. That lets the benchmark build its own corpus:
+// random field values for every message and HID protocol version are
+// encoded, decoded and encoded again, and the reports that survive the
+// round trip unchanged are what gets timed.
+//
+// Results are written one per line, as JSON objects or CSV, so that
+// runs from different releases can be compared by a script.
+
+#include <freespace/freespace_codecs.h>
+#include <freespace/freespace_dceout.h>
+#include <freespace/freespace_printers.h>
+#include <freespace/freespace_util.h>
+#include <freespace/freespace_views.h>
+#include <freespace_config.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#endif
+
+#ifndef FREESPACE_BENCH_CODEC_MODE
+#define FREESPACE_BENCH_CODEC_MODE "unknown"
+#endif
+#ifndef FREESPACE_BENCH_BUILD_TYPE
+#define FREESPACE_BENCH_BUILD_TYPE "unknown"
+#endif
+#ifndef FREESPACE_BENCH_SYNTHESIZED
+#define FREESPACE_BENCH_SYNTHESIZED "unknown"
+#endif
+
+#define MAX_REPORT_SIZE 256
+#define VARIANTS 32
+#define MIX_SIZE 4096
+
+enum op {
+    OP_DECODE,
+    OP_DECODE_TRUSTED,
+    OP_DECODE_STRICT,
+    OP_ENCODE,
+    OP_PRINT,
+    OP_JSON,
+    OP_CSV,
+    OP_PRINT_SNPRINTF,
+    OP_DECODE_ANGPOS,
+    OP_DECODE_SWITCH,
+    OP_DECODE_COMPACT,
+    OP_DECODE_CPP,
+    OP_UTIL,
+    OP_CONVERT,
+    OP_DECODE_FIELD,
+    OP_VIEW_FIELD,
+    OP_DECODE_MOTION,
+    OP_VIEW_MOTION,
+    OP_BATCH_SCALAR,
+    OP_BATCH_SSE2,
+    OP_BATCH_AVX2
+};
+
+static const char* const opNames[] = { "decode", "decodeTrusted", "decodeStrict", "encode", "print", "json", "csv",
+                                      "printSnprintf", "decodeAngPos", "decodeBySwitch", "decodeCompact", "decodeCpp",
+                                      "util", "convertMotionEngineOutputs", "decodeField", "viewField", "decodeMotion",
+                                      "viewMotion", "batchScalar", "batchSse2", "batchAvx2" };
+
+struct sample {
+    uint8_t report[MAX_REPORT_SIZE];
+    int length;
+    uint8_t ver;
+    struct freespace_message message;
+};
+
+// All of the samples of one message and version.
+struct group {
+    int messageType;
+    uint8_t ver;
+    int first;
+    int count;
+};
+
+struct mixEntry {
+    const char* name;
+    int weight;
+};
+
+// Message mixes seen from real devices. Each entry is picked in
+// proportion to its weight, from whichever versions of the message
+// exist, preferring version 2.
+struct mix {
+    const char* name;
+    struct mixEntry entries[4];
+};
+
+static const struct mix mixes[] = {
+    { "handheld", { { "BodyFrame", 90 }, { "UserFrame", 8 }, { "LinkStatus", 1 }, { "BatteryLevel", 1 } } },
+    { "motionEngine", { { "MotionEngineOutput", 98 }, { "LinkStatus", 1 }, { "BatteryLevel", 1 } } },
+    { "dceOut", { { "DceOutV3", 50 }, { "DceOutV4T0", 40 }, { "DceOutV4T1", 10 } } },
+    { "userFrame", { { "UserFrame", 98 }, { "LinkStatus", 1 }, { "BatteryLevel", 1 } } },
+};
+
+typedef int (*utilFunction)(struct freespace_MotionEngineOutput const*, struct MultiAxisSensor*);
+
+struct util {
+    const char* name;
+    utilFunction function;
+};
+
+// Extract every section of a packet with the individual getters.
+static int getAllSections(struct freespace_MotionEngineOutput const* meOutPkt, struct MultiAxisSensor* sensor) {
+    struct MotionEngineOutputSensors s;
+    int rc = 0;
+
+    rc += freespace_util_getAcceleration(meOutPkt, &s.acceleration);
+    rc += freespace_util_getAccNoGravity(meOutPkt, &s.accNoGravity);
+    rc += freespace_util_getAngularVelocity(meOutPkt, &s.angularVelocity);
+    rc += freespace_util_getMagnetometer(meOutPkt, &s.magnetometer);
+    rc += freespace_util_getTemperature(meOutPkt, &s.temperature);
+    rc += freespace_util_getInclination(meOutPkt, &s.inclination);
+    rc += freespace_util_getCompassHeading(meOutPkt, &s.compassHeading);
+    rc += freespace_util_getAngPos(meOutPkt, &s.angPos);
+    rc += freespace_util_getActClass(meOutPkt, &s.actClass);
+    *sensor = s.angPos;
+    return rc;
+}
+
+// Extract every section of a packet in one call.
+static int parseAllSections(struct freespace_MotionEngineOutput const* meOutPkt, struct MultiAxisSensor* sensor) {
+    struct MotionEngineOutputSensors s;
+    int rc;
+
+    rc = freespace_util_parseMotionEngineOutput(meOutPkt, &s);
+    *sensor = s.angPos;
+    return rc + s.present;
+}
+
+static const struct util utils[] = {
+    { "getAcceleration", freespace_util_getAcceleration },
+    { "getAccNoGravity", freespace_util_getAccNoGravity },
+    { "getAngularVelocity", freespace_util_getAngularVelocity },
+    { "getMagnetometer", freespace_util_getMagnetometer },
+    { "getTemperature", freespace_util_getTemperature },
+    { "getInclination", freespace_util_getInclination },
+    { "getCompassHeading", freespace_util_getCompassHeading },
+    { "getAngPos", freespace_util_getAngPos },
+    { "getActClass", freespace_util_getActClass },
+    { "getAllSections", getAllSections },
+    { "parseMotionEngineOutput", parseAllSections },
+};
+
+// The MotionEngineOutput sections, one per FREESPACE_ME_* bit.
+#define SECTIONS 9
+
+// Values converted by freespace_util_convertMotionEngineOutputs, indexed by
+// section, coordinate (w, x, y, z) and packet.
+static float convertedValues[SECTIONS][4][VARIANTS];
+
+static const int meFormats[] = { 0, 1, 3 };
+
+// freespace::decode() from the C++ message API, in freespace_bench_cpp.cpp.
+int freespace_bench_decodeCpp(const uint8_t* report, int length, uint8_t ver);
+
+struct dceOut {
+    const char* name;
+    enum freespace_dceOutType type;
+};
+
+static const struct dceOut dceOuts[] = {
+    { "DceOutV2", FREESPACE_DCEOUT_V2 },
+    { "DceOutV3", FREESPACE_DCEOUT_V3 },
+    { "DceOutV4T0", FREESPACE_DCEOUT_V4T0 },
+    { "DceOutV4T1", FREESPACE_DCEOUT_V4T1 },
+};
+
+// The reports and decoded fields of a DceOut batch.
+static enum freespace_dceOutType dceOutType;
+static uint8_t dceOutReports[MIX_SIZE * MAX_REPORT_SIZE];
+static int16_t dceOutValues[10][MIX_SIZE];
+static uint32_t dceOutSampleBase[MIX_SIZE];
+static uint8_t dceOutBytes[3][MIX_SIZE];
+
+static struct sample* samples;
+static int numSamples;
+static struct group* groups;
+static int numGroups;
+
+static double minTimeNs = 20e6;
+static int repetitions = 3;
+static const char* filter = NULL;
+static int csv = 0;
+static volatile int sink;
+
+static double nowNs(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double) count.QuadPart * 1e9 / (double) frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+#endif
+}
+
+// A small deterministic generator, so every run times the same corpus.
+static uint32_t randomState = 12345;
+
+static uint32_t nextRandom(void) {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+static int findMessage(const char* name) {
+    int i;
+    for (i = 0; freespace_messageName(i) != NULL; i++) {
+        if (strcmp(freespace_messageName(i), name) == 0) {
+            return i;
+        }
+    }
+    return -1;
+}
+
+/******************************************************************************
+ * Corpus
+ */
+
+static int addGroup(int messageType, uint8_t ver) {
+    struct group* g;
+    int i;
+    int failures = 0;
+
+    samples = (struct sample*) realloc(samples, (numSamples + VARIANTS) * sizeof(struct sample));
+    groups = (struct group*) realloc(groups, (numGroups + 1) * sizeof(struct group));
+    if (samples == NULL || groups == NULL) {
+        fprintf(stderr, "out of memory\n");
+        exit(1);
+    }
+    g = &groups[numGroups];
+    g->messageType = messageType;
+    g->ver = ver;
+    g->first = numSamples;
+    g->count = 0;
+
+    for (i = 0; i < VARIANTS; i++) {
+        struct sample* s = &samples[numSamples + g->count];
+        struct freespace_message m;
+        uint8_t check[MAX_REPORT_SIZE];
+        uint8_t* bytes = (uint8_t*) &m;
+        int length;
+        int j;
+
+        for (j = 0; j < (int) sizeof(m); j++) {
+            bytes[j] = (uint8_t) nextRandom();
+        }
+        m.messageType = messageType;
+        m.ver = ver;
+        if (messageType == FREESPACE_MESSAGE_MOTIONENGINEOUTPUT) {
+            // Real packets use one of the documented formats with all
+            // of its sections enabled.
+            m.motionEngineOutput.formatSelect = (uint8_t) meFormats[i % 3];
+            m.motionEngineOutput.ff0 = m.motionEngineOutput.ff1 = m.motionEngineOutput.ff2 = 1;
+            m.motionEngineOutput.ff3 = m.motionEngineOutput.ff4 = m.motionEngineOutput.ff5 = 1;
+            m.motionEngineOutput.ff6 = m.motionEngineOutput.ff7 = 1;
+        }
+        if (messageType == FREESPACE_MESSAGE_USERFRAME) {
+            // Keep B^2 + C^2 + D^2 below 16384^2, as in a real unit
+            // quaternion, so that version 2 computes a nonzero A.
+            m.userFrame.angularPosB = (int16_t) ((int) (nextRandom() % 18001) - 9000);
+            m.userFrame.angularPosC = (int16_t) ((int) (nextRandom() % 18001) - 9000);
+            m.userFrame.angularPosD = (int16_t) ((int) (nextRandom() % 18001) - 9000);
+        }
+
+        memset(s->report, 0, sizeof(s->report));
+        length = freespace_encode_message(&m, s->report, sizeof(s->report));
+        if (length <= 0) {
+            // This version of the message doesn't exist.
+            break;
+        }
+        if (freespace_decode_message(s->report, length, &s->message, ver) != FREESPACE_SUCCESS ||
+            s->message.messageType != messageType) {
+            // Another message with the same IDs decodes first, which
+            // happens to a few requests and responses in test mode.
+            break;
+        }
+        memset(check, 0, sizeof(check));
+        if (freespace_encode_message(&s->message, check, sizeof(check)) != length ||
+            memcmp(check, s->report, length) != 0) {
+            fprintf(stderr, "round trip failed: %s version %d\n", freespace_messageName(messageType), ver);
+            failures++;
+            break;
+        }
+        if (freespace_decode_messageValidated(s->report, length, &m, ver, FREESPACE_VALIDATION_STRICT) != FREESPACE_SUCCESS) {
+            fprintf(stderr, "strict decode failed: %s version %d\n", freespace_messageName(messageType), ver);
+            failures++;
+            break;
+        }
+        s->length = length;
+        s->ver = ver;
+        g->count++;
+    }
+
+    if (g->count > 0) {
+        numSamples += g->count;
+        numGroups++;
+    }
+    return failures;
+}
+
+static int buildCorpus(void) {
+    int failures = 0;
+    int t;
+    int ver;
+
+    for (t = 0; freespace_messageName(t) != NULL; t++) {
+        for (ver = 0; ver <= 2; ver++) {
+            failures += addGroup(t, (uint8_t) ver);
+        }
+    }
+    return failures;
+}
+
+static const struct group* findGroup(int messageType) {
+    const struct group* best = NULL;
+    int i;
+    for (i = 0; i < numGroups; i++) {
+        if (groups[i].messageType == messageType && (best == NULL || groups[i].ver > best->ver)) {
+            best = &groups[i];
+        }
+    }
+    return best;
+}
+
+// Point every array of a batch conversion at convertedValues.
+static void bindConvertedValues(struct MotionEngineOutputArrays* arrays) {
+    struct MultiAxisSensorArrays* members[SECTIONS];
+    int i;
+
+    members[0] = &arrays->acceleration;
+    members[1] = &arrays->accNoGravity;
+    members[2] = &arrays->angularVelocity;
+    members[3] = &arrays->magnetometer;
+    members[4] = &arrays->temperature;
+    members[5] = &arrays->inclination;
+    members[6] = &arrays->compassHeading;
+    members[7] = &arrays->angPos;
+    members[8] = &arrays->actClass;
+    for (i = 0; i < SECTIONS; i++) {
+        members[i]->w = convertedValues[i][0];
+        members[i]->x = convertedValues[i][1];
+        members[i]->y = convertedValues[i][2];
+        members[i]->z = convertedValues[i][3];
+    }
+}
+
+// Copy the MotionEngineOutput packets of the samples into one array.
+static void gatherPackets(struct freespace_MotionEngineOutput* packets, struct sample* const* list, int count) {
+    int i;
+    for (i = 0; i < count; i++) {
+        packets[i] = list[i]->message.motionEngineOutput;
+    }
+}
+
+/******************************************************************************
+ * Timing
+ */
+
+// The size of the queue element that freespace_decode_compact would use
+// for a message type.
+static int compactElementSize(int messageType) {
+    switch (freespace_messageSizeClass(messageType)) {
+        case FREESPACE_SIZE_CLASS_8:
+            return (int) sizeof(struct freespace_compactMessage8);
+        case FREESPACE_SIZE_CLASS_24:
+            return (int) sizeof(struct freespace_compactMessage24);
+        case FREESPACE_SIZE_CLASS_40:
+            return (int) sizeof(struct freespace_compactMessage40);
+        default:
+            return (int) sizeof(struct freespace_compactMessageLarge);
+    }
+}
+
+// Copy the reports of the samples back to back, and point every array of
+// a DceOut batch at the dceOut arrays. Returns the stride.
+static int gatherDceOut(struct freespace_dceOutBatch* out, struct sample* const* list, int count) {
+    int stride = list[0]->length;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        memcpy(&dceOutReports[i * stride], list[i]->report, stride);
+    }
+    out->sampleBase = dceOutSampleBase;
+    out->ax = dceOutValues[0];
+    out->ay = dceOutValues[1];
+    out->az = dceOutValues[2];
+    out->rx = dceOutValues[3];
+    out->ry = dceOutValues[4];
+    out->rz = dceOutValues[5];
+    out->mx = dceOutValues[6];
+    out->my = dceOutValues[7];
+    out->mz = dceOutValues[8];
+    out->temperature = dceOutValues[9];
+    out->flags = dceOutBytes[0];
+    out->buttons = dceOutBytes[1];
+    out->deltaWheel = (int8_t*) dceOutBytes[2];
+    return stride;
+}
+
+// Run an operation over the samples until the minimum time has passed,
+// and return the time per operation of the fastest repetition.
+static double measure(enum op op, struct sample* const* list, int count, utilFunction function) {
+    struct freespace_message scratch;
+    struct freespace_compactMessage8 compact8;
+    struct freespace_compactMessage24 compact24;
+    struct freespace_compactMessage40 compact40;
+    struct freespace_compactMessageLarge compactLarge;
+    struct MultiAxisSensor sensor;
+    struct freespace_MotionEngineOutput packets[VARIANTS];
+    struct MotionEngineOutputArrays arrays;
+    struct freespace_dceOutBatch batch;
+    char text[FREESPACE_PRINT_MAX_LENGTH];
+    uint8_t report[MAX_REPORT_SIZE];
+    double best = 0;
+    int stride = 0;
+    int rep;
+    int i;
+
+    if (op == OP_CONVERT) {
+        gatherPackets(packets, list, count);
+        bindConvertedValues(&arrays);
+    }
+    if (op >= OP_BATCH_SCALAR && op <= OP_BATCH_AVX2) {
+        stride = gatherDceOut(&batch, list, count);
+        freespace_setDceOutSimd((enum freespace_dceOutSimd) (FREESPACE_DCEOUT_SCALAR + (op - OP_BATCH_SCALAR)));
+        if (freespace_decodeDceOutBatch(dceOutType, dceOutReports, stride, count, &batch) != count) {
+            fprintf(stderr, "batch decode failed: %s\n", freespace_messageName(list[0]->message.messageType));
+        }
+    }
+
+    for (rep = 0; rep < repetitions; rep++) {
+        double start = nowNs();
+        double elapsed;
+        long operations = 0;
+        int total = 0;
+
+        do {
+            switch (op) {
+                case OP_DECODE:
+                    for (i = 0; i < count; i++) {
+                        total += freespace_decode_message(list[i]->report, list[i]->length, &scratch, list[i]->ver);
+                    }
+                    break;
+                case OP_DECODE_TRUSTED:
+                    for (i = 0; i < count; i++) {
+                        total += freespace_decode_messageValidated(list[i]->report, list[i]->length, &scratch, list[i]->ver,
+                                                                   FREESPACE_VALIDATION_TRUSTED);
+                    }
+                    break;
+                case OP_DECODE_STRICT:
+                    for (i = 0; i < count; i++) {
+                        total += freespace_decode_messageValidated(list[i]->report, list[i]->length, &scratch, list[i]->ver,
+                                                                   FREESPACE_VALIDATION_STRICT);
+                    }
+                    break;
+                case OP_DECODE_ANGPOS:
+                    // Decode and read the whole orientation, as a
+                    // position tracker would.
+                    for (i = 0; i < count; i++) {
+                        total += freespace_decode_message(list[i]->report, list[i]->length, &scratch, list[i]->ver);
+                        if (scratch.messageType == FREESPACE_MESSAGE_USERFRAME) {
+                            total += freespace_UserFrame_angularPosA(&scratch.userFrame, list[i]->ver) +
+                                     scratch.userFrame.angularPosB + scratch.userFrame.angularPosC +
+                                     scratch.userFrame.angularPosD;
+                        }
+                    }
+                    break;
+                case OP_DECODE_SWITCH:
+                    // The nested switch dispatch that the decode tables
+                    // replaced.
+                    for (i = 0; i < count; i++) {
+                        total += freespace_decode_messageBySwitch(list[i]->report, list[i]->length, &scratch, list[i]->ver);
+                    }
+                    break;
+                case OP_DECODE_COMPACT:
+                    // Decode into the smallest queue element that
+                    // holds the message, as a queue of size classes
+                    // would.
+                    for (i = 0; i < count; i++) {
+                        const uint8_t* r = list[i]->report;
+                        int length = list[i]->length;
+                        uint8_t ver = list[i]->ver;
+                        switch (freespace_messageSizeClass(freespace_decode_messageType(r, length, ver))) {
+                            case FREESPACE_SIZE_CLASS_8:
+                                total += freespace_decode_compact(r, length, &compact8.header, sizeof(compact8), ver);
+                                break;
+                            case FREESPACE_SIZE_CLASS_24:
+                                total += freespace_decode_compact(r, length, &compact24.header, sizeof(compact24), ver);
+                                break;
+                            case FREESPACE_SIZE_CLASS_40:
+                                total += freespace_decode_compact(r, length, &compact40.header, sizeof(compact40), ver);
+                                break;
+                            default:
+                                total += freespace_decode_compact(r, length, &compactLarge.header, sizeof(compactLarge), ver);
+                                break;
+                        }
+                    }
+                    break;
+                case OP_DECODE_CPP:
+                    for (i = 0; i < count; i++) {
+                        total += freespace_bench_decodeCpp(list[i]->report, list[i]->length, list[i]->ver);
+                    }
+                    break;
+                case OP_ENCODE:
+                    for (i = 0; i < count; i++) {
+                        total += freespace_encode_message(&list[i]->message, report, sizeof(report));
+                    }
+                    break;
+                case OP_PRINT:
+                    for (i = 0; i < count; i++) {
+                        total += freespace_formatMessage(text, sizeof(text), &list[i]->message, FREESPACE_PRINT_TEXT);
+                    }
+                    break;
+                case OP_JSON:
+                    for (i = 0; i < count; i++) {
+                        total += freespace_formatMessage(text, sizeof(text), &list[i]->message, FREESPACE_PRINT_JSON);
+                    }
+                    break;
+                case OP_CSV:
+                    for (i = 0; i < count; i++) {
+                        total += freespace_formatMessage(text, sizeof(text), &list[i]->message, FREESPACE_PRINT_CSV);
+                    }
+                    break;
+                case OP_PRINT_SNPRINTF:
+                    // The snprintf printers that the formatter replaced.
+                    for (i = 0; i < count; i++) {
+                        total += freespace_printMessageSnprintf(text, sizeof(text), &list[i]->message);
+                    }
+                    break;
+                case OP_UTIL:
+                    for (i = 0; i < count; i++) {
+                        total += function(&list[i]->message.motionEngineOutput, &sensor);
+                    }
+                    total += (int) sensor.x;
+                    break;
+                case OP_CONVERT:
+                    total += freespace_util_convertMotionEngineOutputs(packets, count, &arrays);
+                    total += (int) convertedValues[0][1][0];
+                    break;
+                case OP_DECODE_FIELD:
+                    for (i = 0; i < count; i++) {
+                        if (freespace_decode_message(list[i]->report, list[i]->length, &scratch, 2) == FREESPACE_SUCCESS) {
+                            total += scratch.bodyFrame.sequenceNumber;
+                        }
+                    }
+                    break;
+                case OP_VIEW_FIELD:
+                    for (i = 0; i < count; i++) {
+                        if (freespace_view_BodyFrame_v2_matches(list[i]->report, list[i]->length)) {
+                            total += freespace_view_BodyFrame_v2_sequenceNumber(list[i]->report);
+                        }
+                    }
+                    break;
+                case OP_DECODE_MOTION:
+                    for (i = 0; i < count; i++) {
+                        if (freespace_decode_message(list[i]->report, list[i]->length, &scratch, 2) == FREESPACE_SUCCESS) {
+                            total += scratch.bodyFrame.linearAccelX + scratch.bodyFrame.linearAccelY +
+                                     scratch.bodyFrame.linearAccelZ + scratch.bodyFrame.angularVelX +
+                                     scratch.bodyFrame.angularVelY + scratch.bodyFrame.angularVelZ;
+                        }
+                    }
+                    break;
+                case OP_VIEW_MOTION:
+                    for (i = 0; i < count; i++) {
+                        const uint8_t* r = list[i]->report;
+                        if (freespace_view_BodyFrame_v2_matches(r, list[i]->length)) {
+                            total += freespace_view_BodyFrame_v2_linearAccelX(r) + freespace_view_BodyFrame_v2_linearAccelY(r) +
+                                     freespace_view_BodyFrame_v2_linearAccelZ(r) + freespace_view_BodyFrame_v2_angularVelX(r) +
+                                     freespace_view_BodyFrame_v2_angularVelY(r) + freespace_view_BodyFrame_v2_angularVelZ(r);
+                        }
+                    }
+                    break;
+                case OP_BATCH_SCALAR:
+                case OP_BATCH_SSE2:
+                case OP_BATCH_AVX2:
+                    total += freespace_decodeDceOutBatch(dceOutType, dceOutReports, stride, count, &batch);
+                    total += dceOutValues[0][0];
+                    break;
+            }
+            operations += count;
+            elapsed = nowNs() - start;
+        } while (elapsed < minTimeNs);
+
+        sink += total;
+        if (rep == 0 || elapsed / operations < best) {
+            best = elapsed / operations;
+        }
+    }
+    return best;
+}
+
+static void printHeader(void) {
+    if (csv) {
+        printf("# libfreespace %s, codec mode %s, synthesized fields %s, build %s\n",
+               LIBFREESPACE_VERSION, FREESPACE_BENCH_CODEC_MODE, FREESPACE_BENCH_SYNTHESIZED, FREESPACE_BENCH_BUILD_TYPE);
+        printf("suite,op,subject,ver,samples,ns_per_op,ops_per_sec\n");
+    } else {
+        printf("{\"type\":\"meta\",\"version\":\"%s\",\"codecMode\":\"%s\",\"synthesized\":\"%s\",\"buildType\":\"%s\","
+               "\"minTimeMs\":%g,\"repetitions\":%d,\"groups\":%d,\"samples\":%d}\n",
+               LIBFREESPACE_VERSION, FREESPACE_BENCH_CODEC_MODE, FREESPACE_BENCH_SYNTHESIZED, FREESPACE_BENCH_BUILD_TYPE,
+               minTimeNs / 1e6, repetitions, numGroups, numSamples);
+    }
+}
+
+static void printResult(const char* suite, const char* op, const char* subject, int ver, int count, double ns) {
+    if (csv) {
+        printf("%s,%s,%s,%d,%d,%.2f,%.0f\n", suite, op, subject, ver, count, ns, 1e9 / ns);
+    } else {
+        printf("{\"type\":\"result\",\"suite\":\"%s\",\"op\":\"%s\",\"subject\":\"%s\",\"ver\":%d,"
+               "\"samples\":%d,\"nsPerOp\":%.2f,\"opsPerSec\":%.0f}\n",
+               suite, op, subject, ver, count, ns, 1e9 / ns);
+    }
+    fflush(stdout);
+}
+
+static void printMemory(const char* subject, int count, double messageBytes, double compactBytes) {
+    if (csv) {
+        printf("# memory,%s,%d reports,%.1f bytes per report as freespace_message,%.1f in size classes\n",
+               subject, count, messageBytes, compactBytes);
+    } else {
+        printf("{\"type\":\"memory\",\"subject\":\"%s\",\"samples\":%d,\"messageBytes\":%.1f,\"compactBytes\":%.1f}\n",
+               subject, count, messageBytes, compactBytes);
+    }
+    fflush(stdout);
+}
+
+static int selected(const char* suite, const char* subject) {
+    return filter == NULL || strstr(suite, filter) != NULL || strstr(subject, filter) != NULL;
+}
+
+/******************************************************************************
+ * Suites
+ */
+
+// Every operation on every message and version.
+static void runMessages(void) {
+    struct sample* list[VARIANTS];
+    int g;
+    int i;
+    enum op op;
+
+    for (g = 0; g < numGroups; g++) {
+        const char* name = freespace_messageName(groups[g].messageType);
+        if (!selected("message", name)) {
+            continue;
+        }
+        for (i = 0; i < groups[g].count; i++) {
+            list[i] = &samples[groups[g].first + i];
+        }
+        for (op = OP_DECODE; op <= OP_PRINT_SNPRINTF; op++) {
+            printResult("message", opNames[op], name, groups[g].ver, groups[g].count,
+                        measure(op, list, groups[g].count, NULL));
+        }
+        printResult("message", opNames[OP_DECODE_CPP], name, groups[g].ver, groups[g].count,
+                    measure(OP_DECODE_CPP, list, groups[g].count, NULL));
+    }
+}
+
+// Time a mix, and report how much memory a queue of its messages takes
+// as struct freespace_message and in size classes.
+static void timeMix(const char* name, struct sample* const* list) {
+    long compactBytes = 0;
+    enum op op;
+    int i;
+
+    for (op = OP_DECODE; op <= OP_DECODE_CPP; op++) {
+        printResult("mix", opNames[op], name, -1, MIX_SIZE, measure(op, list, MIX_SIZE, NULL));
+    }
+    for (i = 0; i < MIX_SIZE; i++) {
+        compactBytes += compactElementSize(list[i]->message.messageType);
+    }
+    printMemory(name, MIX_SIZE, (double) sizeof(struct freespace_message), (double) compactBytes / MIX_SIZE);
+}
+
+// Streams of mixed messages, in a random order so that the dispatch on
+// the message type is as hard to predict as it is for real input. The
+// "all" mix spreads the stream evenly over every message and version,
+// which is the worst case for the instruction cache.
+static void runMixes(void) {
+    static struct sample* list[MIX_SIZE];
+    int m;
+    int e;
+    int i;
+
+    for (m = 0; m < (int) (sizeof(mixes) / sizeof(mixes[0])); m++) {
+        const struct group* entries[4];
+        int totalWeight = 0;
+
+        if (!selected("mix", mixes[m].name)) {
+            continue;
+        }
+        for (e = 0; e < 4 && mixes[m].entries[e].name != NULL; e++) {
+            entries[e] = findGroup(findMessage(mixes[m].entries[e].name));
+            if (entries[e] == NULL) {
+                fprintf(stderr, "mix %s: no samples of %s\n", mixes[m].name, mixes[m].entries[e].name);
+                return;
+            }
+            totalWeight += mixes[m].entries[e].weight;
+        }
+        for (i = 0; i < MIX_SIZE; i++) {
+            int pick = (int) (nextRandom() % totalWeight);
+            for (e = 0; pick >= mixes[m].entries[e].weight; e++) {
+                pick -= mixes[m].entries[e].weight;
+            }
+            list[i] = &samples[entries[e]->first + nextRandom() % entries[e]->count];
+        }
+        timeMix(mixes[m].name, list);
+    }
+
+    if (selected("mix", "all")) {
+        for (i = 0; i < MIX_SIZE; i++) {
+            const struct group* g = &groups[nextRandom() % numGroups];
+            list[i] = &samples[g->first + nextRandom() % g->count];
+        }
+        timeMix("all", list);
+    }
+}
+
+// The utility functions on MotionEngineOutput, one format at a time.
+static void runUtil(void) {
+    struct sample* list[VARIANTS];
+    const struct group* g = findGroup(FREESPACE_MESSAGE_MOTIONENGINEOUTPUT);
+    char subject[64];
+    int f;
+    int u;
+    int i;
+    int count;
+
+    if (g == NULL) {
+        return;
+    }
+    for (f = 0; f < (int) (sizeof(meFormats) / sizeof(meFormats[0])); f++) {
+        sprintf(subject, "MotionEngineOutput/format%d", meFormats[f]);
+        if (!selected("util", subject)) {
+            continue;
+        }
+        count = 0;
+        for (i = 0; i < g->count; i++) {
+            if (samples[g->first + i].message.motionEngineOutput.formatSelect == meFormats[f]) {
+                list[count++] = &samples[g->first + i];
+            }
+        }
+        for (u = 0; u < (int) (sizeof(utils) / sizeof(utils[0])); u++) {
+            printResult("util", utils[u].name, subject, g->ver, count, measure(OP_UTIL, list, count, utils[u].function));
+        }
+        printResult("util", opNames[OP_CONVERT], subject, g->ver, count, measure(OP_CONVERT, list, count, NULL));
+    }
+}
+
+// Reading a few fields of version 2 BodyFrame reports through the view
+// accessors, against decoding the whole message to read them: one field
+// (sequenceNumber), and the six motion fields.
+static void runViews(void) {
+    struct sample* list[VARIANTS];
+    const struct group* g = findGroup(FREESPACE_MESSAGE_BODYFRAME);
+    enum op op;
+    int i;
+
+    if (g == NULL || g->ver != 2 || !selected("view", "BodyFrame")) {
+        return;
+    }
+    for (i = 0; i < g->count; i++) {
+        list[i] = &samples[g->first + i];
+    }
+    for (op = OP_DECODE_FIELD; op <= OP_VIEW_MOTION; op++) {
+        printResult("view", opNames[op], "BodyFrame", g->ver, g->count, measure(op, list, g->count, NULL));
+    }
+}
+
+// Decoding streams of DceOut reports of one type with
+// freespace_decodeDceOutBatch, on each instruction set that the CPU
+// supports, against decoding them one at a time.
+static void runDceOut(void) {
+    static struct sample* list[MIX_SIZE];
+    int d;
+    int i;
+    enum op op;
+
+    for (d = 0; d < (int) (sizeof(dceOuts) / sizeof(dceOuts[0])); d++) {
+        const struct group* g = findGroup(findMessage(dceOuts[d].name));
+
+        if (g == NULL || g->ver != 2 || !selected("dceOut", dceOuts[d].name)) {
+            continue;
+        }
+        for (i = 0; i < MIX_SIZE; i++) {
+            list[i] = &samples[g->first + i % g->count];
+        }
+        dceOutType = dceOuts[d].type;
+        printResult("dceOut", opNames[OP_DECODE], dceOuts[d].name, g->ver, MIX_SIZE, measure(OP_DECODE, list, MIX_SIZE, NULL));
+        for (op = OP_BATCH_SCALAR; op <= OP_BATCH_AVX2; op++) {
+            enum freespace_dceOutSimd simd = (enum freespace_dceOutSimd) (FREESPACE_DCEOUT_SCALAR + (op - OP_BATCH_SCALAR));
+            if (freespace_setDceOutSimd(simd) == simd) {
+                printResult("dceOut", opNames[op], dceOuts[d].name, g->ver, MIX_SIZE, measure(op, list, MIX_SIZE, NULL));
+            }
+        }
+    }
+    freespace_setDceOutSimd(FREESPACE_DCEOUT_AVX2);
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-t <ms>] [-r <repetitions>] [-f json|csv] [filter]\n", name);
+    fprintf(stderr, "  -t <ms>           minimum time per measurement (default 20)\n");
+    fprintf(stderr, "  -r <repetitions>  measurements per result; the fastest is reported (default 3)\n");
+    fprintf(stderr, "  -f json|csv       output format (default json)\n");
+    fprintf(stderr, "  filter            only run suites, messages or mixes whose name contains this\n");
+}
+
+int main(int argc, char* argv[]) {
+    int i;
+
+    for (i = 1; i < argc; i++) {
+        if (strcmp(argv[i], "-t") == 0 && i + 1 < argc) {
+            minTimeNs = atof(argv[++i]) * 1e6;
+        } else if (strcmp(argv[i], "-r") == 0 && i + 1 < argc) {
+            repetitions = atoi(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < argc) {
+            csv = strcmp(argv[++i], "csv") == 0;
+        } else if (argv[i][0] != '-' && filter == NULL) {
+            filter = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    if (repetitions < 1) {
+        repetitions = 1;
+    }
+
+    if (buildCorpus() != 0) {
+        return 1;
+    }
+    printHeader();
+    runMessages();
+    runMixes();
+    runUtil();
+    runViews();
+    runDceOut();
+
+    free(samples);
+    free(groups);
+    return 0;
+}
@@ -0,0 +1,29 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// The C++ message API, called from freespace_bench.
+
+#include <freespace/freespace_messages.hpp>
+
+extern "C" int freespace_bench_decodeCpp(const uint8_t* report, int length, uint8_t ver);
+
+// Decode a report into the freespace::Message variant, and return the
+// index of the alternative it holds.
+int freespace_bench_decodeCpp(const uint8_t* report, int length, uint8_t ver) {
+    freespace::Message m = freespace::decode(freespace::ConstBytes(report, static_cast<std::size_t>(length)), ver);
+    return static_cast<int>(m.index());
+}
@@ -0,0 +1,227 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Session recorder benchmark.
+//
+// Writes a recording of the given size, then times opening it, seeking
+// to random times and reading it through. Last, the footer is cut off
+// and opening is timed again, which scans the record headers the way a
+// recording left by a crashed program is read.
+//
+// Results are written one per line, as JSON objects or CSV, in the same
+// form as freespace_bench.
+
+#include <freespace/freespace_record.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <time.h>
+#include <unistd.h>
+#endif
+
+#define REPORT_SIZE 20
+#define SEEKS 100000
+#define FOOTER_SIZE 32
+
+static int csv = 0;
+static volatile uint64_t sink;
+
+static double nowNs(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (double) count.QuadPart * 1e9 / (double) frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (double) now.tv_sec * 1e9 + (double) now.tv_nsec;
+#endif
+}
+
+static uint32_t randomState = 12345;
+
+static uint32_t nextRandom(void) {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+static void printResult(const char* op, const char* subject, uint64_t count, double ns) {
+    if (csv) {
+        printf("record,%s,%s,-1,%llu,%.2f,%.0f\n", op, subject, (unsigned long long) count, ns, 1e9 / ns);
+    } else {
+        printf("{\"type\":\"result\",\"suite\":\"record\",\"op\":\"%s\",\"subject\":\"%s\",\"ver\":-1,"
+               "\"samples\":%llu,\"nsPerOp\":%.2f,\"opsPerSec\":%.0f}\n",
+               op, subject, (unsigned long long) count, ns, 1e9 / ns);
+    }
+    fflush(stdout);
+}
+
+// Open the recording and return the time it took, or a negative value.
+static double timeOpen(const char* path, uint64_t reports) {
+    struct freespace_recording* recording;
+    struct freespace_recordingInfo info;
+    double start = nowNs();
+    double elapsed;
+
+    if (freespace_recording_open(&recording, path) != FREESPACE_SUCCESS) {
+        fprintf(stderr, "can't open %s\n", path);
+        return -1;
+    }
+    elapsed = nowNs() - start;
+    freespace_recording_getInfo(recording, &info);
+    freespace_recording_close(recording);
+    if (info.reportCount != reports) {
+        fprintf(stderr, "%s has %llu reports, expected %llu\n", path,
+                (unsigned long long) info.reportCount, (unsigned long long) reports);
+        return -1;
+    }
+    return elapsed;
+}
+
+static void usage(const char* name) {
+    fprintf(stderr, "Usage: %s [-m <megabytes>] [-f json|csv] [-k] [path]\n", name);
+    fprintf(stderr, "  -m <megabytes>    size of the recording (default 4096)\n");
+    fprintf(stderr, "  -f json|csv       output format (default json)\n");
+    fprintf(stderr, "  -k                keep the recording\n");
+    fprintf(stderr, "  path              where to write it (default freespace_record_bench.rec)\n");
+}
+
+int main(int argc, char* argv[]) {
+    const char* path = "freespace_record_bench.rec";
+    struct freespace_recorder* recorder;
+    struct freespace_recording* recording;
+    struct freespace_recordedReport report;
+    uint8_t data[REPORT_SIZE];
+    double megabytes = 4096;
+    int keep = 0;
+    char subject[32];
+    uint64_t reports;
+    uint64_t i;
+    uint64_t cursor;
+    double start;
+    double elapsed;
+    int rc = 0;
+
+    for (i = 1; i < (uint64_t) argc; i++) {
+        if (strcmp(argv[i], "-m") == 0 && i + 1 < (uint64_t) argc) {
+            megabytes = atof(argv[++i]);
+        } else if (strcmp(argv[i], "-f") == 0 && i + 1 < (uint64_t) argc) {
+            csv = strcmp(argv[++i], "csv") == 0;
+        } else if (strcmp(argv[i], "-k") == 0) {
+            keep = 1;
+        } else if (argv[i][0] != '-') {
+            path = argv[i];
+        } else {
+            usage(argv[0]);
+            return 2;
+        }
+    }
+    // Each record is a 16 byte header and the report.
+    reports = (uint64_t) (megabytes * 1048576 / (16 + REPORT_SIZE));
+    sprintf(subject, "%.0fMB", megabytes);
+    if (csv) {
+        printf("suite,op,subject,ver,samples,ns_per_op,ops_per_sec\n");
+    }
+
+    // Reports one millisecond apart.
+    if (freespace_recorder_open(&recorder, path) != FREESPACE_SUCCESS) {
+        fprintf(stderr, "can't create %s\n", path);
+        return 1;
+    }
+    memset(data, 0, sizeof(data));
+    start = nowNs();
+    for (i = 0; i < reports; i++) {
+        memcpy(data, &i, sizeof(i));
+        if (freespace_recorder_write(recorder, i * 1000, 1, 2, data, sizeof(data)) != FREESPACE_SUCCESS) {
+            fprintf(stderr, "write failed after %llu reports\n", (unsigned long long) i);
+            freespace_recorder_close(recorder);
+            return 1;
+        }
+    }
+    if (freespace_recorder_close(recorder) != FREESPACE_SUCCESS) {
+        fprintf(stderr, "can't finish %s\n", path);
+        return 1;
+    }
+    printResult("write", subject, reports, (nowNs() - start) / reports);
+
+    elapsed = timeOpen(path, reports);
+    if (elapsed < 0) {
+        return 1;
+    }
+    printResult("open", subject, 1, elapsed);
+
+    if (freespace_recording_open(&recording, path) != FREESPACE_SUCCESS) {
+        return 1;
+    }
+    start = nowNs();
+    for (i = 0; i < SEEKS; i++) {
+        uint64_t t = ((uint64_t) nextRandom() << 32 | nextRandom()) % reports * 1000;
+        freespace_recording_seek(recording, t, &cursor);
+        if (freespace_recording_next(recording, &cursor, &report) != FREESPACE_SUCCESS || report.timestampUs != t) {
+            fprintf(stderr, "seek to %llu failed\n", (unsigned long long) t);
+            rc = 1;
+            break;
+        }
+    }
+    printResult("seek", subject, SEEKS, (nowNs() - start) / SEEKS);
+
+    start = nowNs();
+    freespace_recording_seek(recording, 0, &cursor);
+    for (i = 0; freespace_recording_next(recording, &cursor, &report) == FREESPACE_SUCCESS; i++) {
+        sink += report.report[0];
+    }
+    printResult("read", subject, i, (nowNs() - start) / i);
+    freespace_recording_close(recording);
+    if (i != reports) {
+        fprintf(stderr, "read %llu reports, expected %llu\n", (unsigned long long) i, (unsigned long long) reports);
+        rc = 1;
+    }
+
+#ifndef _WIN32
+    // Without the footer, opening has to scan the record headers.
+    if (!keep) {
+        FILE* fp = fopen(path, "rb");
+        long long size = 0;
+        if (fp != NULL) {
+            fseeko(fp, 0, SEEK_END);
+            size = (long long) ftello(fp);
+            fclose(fp);
+        }
+        if (size > FOOTER_SIZE && truncate(path, (off_t) (size - FOOTER_SIZE)) == 0) {
+            elapsed = timeOpen(path, reports);
+            if (elapsed < 0) {
+                rc = 1;
+            } else {
+                printResult("openScan", subject, 1, elapsed);
+            }
+        }
+    }
+#endif
+
+    if (!keep) {
+        remove(path);
+    }
+    return rc;
+}
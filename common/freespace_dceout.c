@@ -0,0 +1,386 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <freespace/freespace_dceout.h>
+#include <stddef.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#define DCEOUT_HAVE_SSE2
+#include <emmintrin.h>
+#endif
+
+#if defined(DCEOUT_HAVE_SSE2) && defined(__GNUC__) && (defined(__x86_64__) || defined(__i386__))
+#define DCEOUT_HAVE_AVX2
+#include <immintrin.h>
+#endif
+
+#define DCEOUT_AXES 10 // ax, ay, az, rx, ry, rz, mx, my, mz, temperature
+#define DCEOUT_NONE -1
+
+/*
+ * Byte offsets of each field within a report, and how the 16 byte
+ * vector loads used by the SIMD paths map onto the int16 fields. The
+ * vector lanes hold consecutive little-endian int16 values starting at
+ * vecOffset, and vecLanes gives the axis held in each lane.
+ */
+struct DceOutLayout {
+    uint8_t size;
+    uint8_t id;
+    int16_t subId;
+    int8_t sampleBase;
+    uint8_t sampleBaseWidth;
+    int8_t axes[DCEOUT_AXES];
+    int8_t flags;
+    int8_t buttons;
+    int8_t deltaWheel;
+    uint8_t numVecs;
+    int8_t vecOffset[2];
+    int8_t vecLanes[2][8];
+};
+
+static const struct DceOutLayout layouts[] = {
+    // FREESPACE_DCEOUT_V2
+    {31, 39, DCEOUT_NONE, 4, 4,
+     {8, 10, 12, 14, 16, 18, 20, 22, 24, 26}, 28, 29, 30,
+     2, {8, 12}, {{0, 1, 2, 3, 4, 5, 6, 7},
+                  {DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, 8, 9}}},
+    // FREESPACE_DCEOUT_V3
+    {20, 40, DCEOUT_NONE, 4, 1,
+     {6, 8, 10, 12, 14, 16, DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, 18}, 5, DCEOUT_NONE, DCEOUT_NONE,
+     1, {4, 0}, {{DCEOUT_NONE, 0, 1, 2, 3, 4, 5, 9}}},
+    // FREESPACE_DCEOUT_V4T0
+    {20, 41, 0, 5, 1,
+     {6, 8, 10, 12, 14, 16, DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, 18}, DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE,
+     1, {4, 0}, {{DCEOUT_NONE, 0, 1, 2, 3, 4, 5, 9}}},
+    // FREESPACE_DCEOUT_V4T1
+    {15, 41, 1, 5, 1,
+     {DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, 6, 8, 10, DCEOUT_NONE}, 12, 13, 14,
+     1, {0, 0}, {{DCEOUT_NONE, DCEOUT_NONE, DCEOUT_NONE, 6, 7, 8, DCEOUT_NONE, DCEOUT_NONE}}},
+};
+
+static void getAxes(const struct freespace_dceOutBatch* out, int16_t* axes[DCEOUT_AXES]) {
+    axes[0] = out->ax;
+    axes[1] = out->ay;
+    axes[2] = out->az;
+    axes[3] = out->rx;
+    axes[4] = out->ry;
+    axes[5] = out->rz;
+    axes[6] = out->mx;
+    axes[7] = out->my;
+    axes[8] = out->mz;
+    axes[9] = out->temperature;
+}
+
+// Decode the fields that the vector paths leave alone: the sample
+// number and the single byte fields.
+static void decodeBytes(const struct DceOutLayout* layout,
+                        const uint8_t* reports,
+                        int stride,
+                        int count,
+                        const struct freespace_dceOutBatch* out) {
+    const uint8_t* r;
+    int i;
+
+    if (out->sampleBase != NULL) {
+        r = reports + layout->sampleBase;
+        if (layout->sampleBaseWidth == 4) {
+            for (i = 0; i < count; i++, r += stride) {
+                out->sampleBase[i] = (uint32_t) r[0] | ((uint32_t) r[1] << 8) | ((uint32_t) r[2] << 16) | ((uint32_t) r[3] << 24);
+            }
+        } else {
+            for (i = 0; i < count; i++, r += stride) {
+                out->sampleBase[i] = r[0];
+            }
+        }
+    }
+    if (out->flags != NULL && layout->flags != DCEOUT_NONE) {
+        r = reports + layout->flags;
+        for (i = 0; i < count; i++, r += stride) {
+            out->flags[i] = r[0];
+        }
+    }
+    if (out->buttons != NULL && layout->buttons != DCEOUT_NONE) {
+        r = reports + layout->buttons;
+        for (i = 0; i < count; i++, r += stride) {
+            out->buttons[i] = r[0];
+        }
+    }
+    if (out->deltaWheel != NULL && layout->deltaWheel != DCEOUT_NONE) {
+        r = reports + layout->deltaWheel;
+        for (i = 0; i < count; i++, r += stride) {
+            out->deltaWheel[i] = (int8_t) r[0];
+        }
+    }
+}
+
+static void decodeAxesScalar(const struct DceOutLayout* layout,
+                             const uint8_t* reports,
+                             int stride,
+                             int first,
+                             int count,
+                             int16_t* axes[DCEOUT_AXES]) {
+    int a;
+    int i;
+
+    for (a = 0; a < DCEOUT_AXES; a++) {
+        if (axes[a] == NULL || layout->axes[a] == DCEOUT_NONE) {
+            continue;
+        }
+        for (i = first; i < first + count; i++) {
+            const uint8_t* b = reports + (size_t) i * stride + layout->axes[a];
+            axes[a][i] = (int16_t) (b[0] | (b[1] << 8));
+        }
+    }
+}
+
+// The number of reports from the start that the vector paths can
+// handle. A vector load may run past the end of a short report into
+// the next one, so the last reports may need the scalar path.
+static int vectorSafeCount(const struct DceOutLayout* layout, int stride, int count) {
+    int maxEnd = 0;
+    int v;
+    int n;
+
+    for (v = 0; v < layout->numVecs; v++) {
+        if (layout->vecOffset[v] + 16 > maxEnd) {
+            maxEnd = layout->vecOffset[v] + 16;
+        }
+    }
+    if (maxEnd <= stride) {
+        return count;
+    }
+
+    // Report n - 1 is safe when its loads end inside the buffer.
+    n = count;
+    while (n > 0 && (size_t) (n - 1) * stride + maxEnd > (size_t) count * stride) {
+        n--;
+    }
+    return n;
+}
+
+#ifdef DCEOUT_HAVE_SSE2
+static void decodeAxesSSE2(const struct DceOutLayout* layout,
+                           const uint8_t* reports,
+                           int stride,
+                           int first,
+                           int count,
+                           int16_t* axes[DCEOUT_AXES]) {
+    int i;
+    int v;
+    int k;
+
+    for (i = first; i + 8 <= count; i += 8) {
+        for (v = 0; v < layout->numVecs; v++) {
+            const uint8_t* r = reports + (size_t) i * stride + layout->vecOffset[v];
+            __m128i t0, t1, t2, t3, t4, t5, t6, t7;
+            __m128i u0, u1, u2, u3, u4, u5, u6, u7;
+            __m128i cols[8];
+
+            // Transpose 8 reports x 8 int16 lanes into 8 axes x 8 reports.
+            t0 = _mm_loadu_si128((const __m128i*) (r));
+            t1 = _mm_loadu_si128((const __m128i*) (r + stride));
+            t2 = _mm_loadu_si128((const __m128i*) (r + 2 * stride));
+            t3 = _mm_loadu_si128((const __m128i*) (r + 3 * stride));
+            t4 = _mm_loadu_si128((const __m128i*) (r + 4 * stride));
+            t5 = _mm_loadu_si128((const __m128i*) (r + 5 * stride));
+            t6 = _mm_loadu_si128((const __m128i*) (r + 6 * stride));
+            t7 = _mm_loadu_si128((const __m128i*) (r + 7 * stride));
+
+            u0 = _mm_unpacklo_epi16(t0, t1);
+            u1 = _mm_unpackhi_epi16(t0, t1);
+            u2 = _mm_unpacklo_epi16(t2, t3);
+            u3 = _mm_unpackhi_epi16(t2, t3);
+            u4 = _mm_unpacklo_epi16(t4, t5);
+            u5 = _mm_unpackhi_epi16(t4, t5);
+            u6 = _mm_unpacklo_epi16(t6, t7);
+            u7 = _mm_unpackhi_epi16(t6, t7);
+
+            t0 = _mm_unpacklo_epi32(u0, u2);
+            t1 = _mm_unpackhi_epi32(u0, u2);
+            t2 = _mm_unpacklo_epi32(u1, u3);
+            t3 = _mm_unpackhi_epi32(u1, u3);
+            t4 = _mm_unpacklo_epi32(u4, u6);
+            t5 = _mm_unpackhi_epi32(u4, u6);
+            t6 = _mm_unpacklo_epi32(u5, u7);
+            t7 = _mm_unpackhi_epi32(u5, u7);
+
+            cols[0] = _mm_unpacklo_epi64(t0, t4);
+            cols[1] = _mm_unpackhi_epi64(t0, t4);
+            cols[2] = _mm_unpacklo_epi64(t1, t5);
+            cols[3] = _mm_unpackhi_epi64(t1, t5);
+            cols[4] = _mm_unpacklo_epi64(t2, t6);
+            cols[5] = _mm_unpackhi_epi64(t2, t6);
+            cols[6] = _mm_unpacklo_epi64(t3, t7);
+            cols[7] = _mm_unpackhi_epi64(t3, t7);
+
+            for (k = 0; k < 8; k++) {
+                int a = layout->vecLanes[v][k];
+                if (a != DCEOUT_NONE && axes[a] != NULL) {
+                    _mm_storeu_si128((__m128i*) (axes[a] + i), cols[k]);
+                }
+            }
+        }
+    }
+    decodeAxesScalar(layout, reports, stride, i, count - i, axes);
+}
+#endif
+
+#ifdef DCEOUT_HAVE_AVX2
+// Like decodeAxesSSE2, but 16 reports at a time. Reports i..i+7 go in
+// the low 128 bit lane and i+8..i+15 in the high one. The unpacks work
+// within each lane, so every result holds one axis for all 16 reports.
+__attribute__((target("avx2")))
+static void decodeAxesAVX2(const struct DceOutLayout* layout,
+                           const uint8_t* reports,
+                           int stride,
+                           int count,
+                           int16_t* axes[DCEOUT_AXES]) {
+    int i;
+    int v;
+    int k;
+
+    for (i = 0; i + 16 <= count; i += 16) {
+        for (v = 0; v < layout->numVecs; v++) {
+            const uint8_t* r = reports + (size_t) i * stride + layout->vecOffset[v];
+            const uint8_t* h = r + (size_t) 8 * stride;
+            __m256i t[8];
+            __m256i u[8];
+            __m256i cols[8];
+
+            for (k = 0; k < 8; k++) {
+                t[k] = _mm256_inserti128_si256(
+                    _mm256_castsi128_si256(_mm_loadu_si128((const __m128i*) (r + k * stride))),
+                    _mm_loadu_si128((const __m128i*) (h + k * stride)), 1);
+            }
+
+            u[0] = _mm256_unpacklo_epi16(t[0], t[1]);
+            u[1] = _mm256_unpackhi_epi16(t[0], t[1]);
+            u[2] = _mm256_unpacklo_epi16(t[2], t[3]);
+            u[3] = _mm256_unpackhi_epi16(t[2], t[3]);
+            u[4] = _mm256_unpacklo_epi16(t[4], t[5]);
+            u[5] = _mm256_unpackhi_epi16(t[4], t[5]);
+            u[6] = _mm256_unpacklo_epi16(t[6], t[7]);
+            u[7] = _mm256_unpackhi_epi16(t[6], t[7]);
+
+            t[0] = _mm256_unpacklo_epi32(u[0], u[2]);
+            t[1] = _mm256_unpackhi_epi32(u[0], u[2]);
+            t[2] = _mm256_unpacklo_epi32(u[1], u[3]);
+            t[3] = _mm256_unpackhi_epi32(u[1], u[3]);
+            t[4] = _mm256_unpacklo_epi32(u[4], u[6]);
+            t[5] = _mm256_unpackhi_epi32(u[4], u[6]);
+            t[6] = _mm256_unpacklo_epi32(u[5], u[7]);
+            t[7] = _mm256_unpackhi_epi32(u[5], u[7]);
+
+            cols[0] = _mm256_unpacklo_epi64(t[0], t[4]);
+            cols[1] = _mm256_unpackhi_epi64(t[0], t[4]);
+            cols[2] = _mm256_unpacklo_epi64(t[1], t[5]);
+            cols[3] = _mm256_unpackhi_epi64(t[1], t[5]);
+            cols[4] = _mm256_unpacklo_epi64(t[2], t[6]);
+            cols[5] = _mm256_unpackhi_epi64(t[2], t[6]);
+            cols[6] = _mm256_unpacklo_epi64(t[3], t[7]);
+            cols[7] = _mm256_unpackhi_epi64(t[3], t[7]);
+
+            for (k = 0; k < 8; k++) {
+                int a = layout->vecLanes[v][k];
+                if (a != DCEOUT_NONE && axes[a] != NULL) {
+                    _mm256_storeu_si256((__m256i*) (axes[a] + i), cols[k]);
+                }
+            }
+        }
+    }
+    decodeAxesSSE2(layout, reports, stride, i, count, axes);
+}
+#endif
+
+static enum freespace_dceOutSimd bestSimd() {
+#if defined(DCEOUT_HAVE_AVX2)
+    __builtin_cpu_init();
+    if (__builtin_cpu_supports("avx2")) {
+        return FREESPACE_DCEOUT_AVX2;
+    }
+#endif
+#if defined(DCEOUT_HAVE_SSE2)
+    return FREESPACE_DCEOUT_SSE2;
+#else
+    return FREESPACE_DCEOUT_SCALAR;
+#endif
+}
+
+static int simdLevel = -1;
+
+LIBFREESPACE_API enum freespace_dceOutSimd freespace_setDceOutSimd(enum freespace_dceOutSimd simd) {
+    enum freespace_dceOutSimd best = bestSimd();
+
+    simdLevel = simd < best ? simd : best;
+    return (enum freespace_dceOutSimd) simdLevel;
+}
+
+LIBFREESPACE_API int freespace_decodeDceOutBatch(enum freespace_dceOutType type,
+                                                 const uint8_t* reports,
+                                                 int stride,
+                                                 int count,
+                                                 const struct freespace_dceOutBatch* out) {
+    const struct DceOutLayout* layout;
+    int16_t* axes[DCEOUT_AXES];
+    int subIdOffset;
+    int vectorCount;
+    int n;
+
+    if (type < FREESPACE_DCEOUT_V2 || type > FREESPACE_DCEOUT_V4T1 || out == NULL || count < 0) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    layout = &layouts[type];
+    if (stride < layout->size) {
+        return FREESPACE_ERROR_BUFFER_TOO_SMALL;
+    }
+
+    // Only decode the leading run of reports of the right type.
+    subIdOffset = layout->sampleBase - 1;
+    for (n = 0; n < count; n++) {
+        const uint8_t* r = reports + (size_t) n * stride;
+        if (r[0] != layout->id || (layout->subId != DCEOUT_NONE && r[subIdOffset] != layout->subId)) {
+            break;
+        }
+    }
+    count = n;
+
+    if (simdLevel < 0) {
+        simdLevel = bestSimd();
+    }
+
+    getAxes(out, axes);
+    vectorCount = vectorSafeCount(layout, stride, count);
+    switch (simdLevel) {
+#ifdef DCEOUT_HAVE_AVX2
+    case FREESPACE_DCEOUT_AVX2:
+        decodeAxesAVX2(layout, reports, stride, vectorCount, axes);
+        break;
+#endif
+#ifdef DCEOUT_HAVE_SSE2
+    case FREESPACE_DCEOUT_SSE2:
+        decodeAxesSSE2(layout, reports, stride, 0, vectorCount, axes);
+        break;
+#endif
+    default:
+        vectorCount = 0;
+        break;
+    }
+    decodeAxesScalar(layout, reports, stride, vectorCount, count - vectorCount, axes);
+    decodeBytes(layout, reports, stride, count, out);
+
+    return count;
+}
@@ -0,0 +1,699 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <freespace/freespace_record.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#ifdef _WIN32
+#include <windows.h>
+#else
+#include <fcntl.h>
+#include <sys/mman.h>
+#include <sys/stat.h>
+#include <time.h>
+#include <unistd.h>
+#endif
+
+// File layout, all little-endian:
+//
+//   file header:   "FSRECORD", uint16 format version, uint16 0,
+//                  uint32 reports per index entry
+//   record header: uint64 timestamp, int32 device ID, uint8 kind,
+//                  uint8 hVer, uint16 payload length
+//   record:        header, then the payload
+//   footer:        "FSRECEND", uint64 report count, uint64 number of
+//                  index blocks, uint64 offset of the directory
+//
+// A report record's payload is the raw report. An index block is a
+// record whose payload is a uint32 entry count, a uint32 0, and then
+// the entries, each a uint64 timestamp and the uint64 offset of a
+// report record. The block's timestamp is that of its first entry.
+//
+// Closing the recorder appends the directory, a run of records that
+// list the uint64 timestamp and uint64 offset of every index block,
+// and then the footer. They let the reader find every index block
+// without touching the rest of the file. Since the directory is made
+// of records, a file whose footer was cut off still reads correctly.
+
+#define FILE_MAGIC "FSRECORD"
+#define FOOTER_MAGIC "FSRECEND"
+#define FORMAT_VERSION 1
+#define FILE_HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 16
+#define FOOTER_SIZE 32
+#define INDEX_HEADER_SIZE 8
+#define INDEX_ENTRY_SIZE 16
+#define DIRECTORY_ENTRY_SIZE 16
+#define DIRECTORY_RECORD_ENTRIES (0xffff / DIRECTORY_ENTRY_SIZE)
+
+#define KIND_REPORT 0
+#define KIND_INDEX 1
+#define KIND_DIRECTORY 2
+
+// Every INDEX_STRIDE reports get an index entry, and every
+// INDEX_BLOCK_ENTRIES entries are written out as an index block. That
+// keeps the index to about 0.4 bytes per report, and a seek reads at
+// most INDEX_STRIDE record headers past the index.
+#define INDEX_STRIDE 64
+#define INDEX_BLOCK_ENTRIES 256
+
+#define WRITE_BUFFER_SIZE (1 << 20)
+
+struct indexBlock {
+    uint64_t timestampUs;     // Timestamp of the first entry
+    uint64_t offset;          // Offset of the index block record
+};
+
+struct freespace_recorder {
+    FILE* fp;
+    uint8_t* buffer;
+    int used;
+    uint64_t offset;          // File offset of buffer[0]
+    uint64_t reportCount;
+    int numEntries;
+    uint8_t entries[INDEX_BLOCK_ENTRIES * INDEX_ENTRY_SIZE];
+    struct indexBlock* blocks;
+    int numBlocks;
+    int blockCapacity;
+    int error;
+};
+
+struct freespace_recording {
+    const uint8_t* data;
+    uint64_t size;
+    uint64_t end;             // End of the records
+    uint64_t reportCount;
+    int complete;
+    struct indexBlock* blocks;
+    int numBlocks;
+    int blockCapacity;
+#ifdef _WIN32
+    HANDLE file;
+    HANDLE mapping;
+#endif
+};
+
+static void put16(uint8_t* p, uint16_t v) {
+    p[0] = (uint8_t) v;
+    p[1] = (uint8_t) (v >> 8);
+}
+
+static void put32(uint8_t* p, uint32_t v) {
+    put16(p, (uint16_t) v);
+    put16(p + 2, (uint16_t) (v >> 16));
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+    put32(p, (uint32_t) v);
+    put32(p + 4, (uint32_t) (v >> 32));
+}
+
+static uint16_t get16(const uint8_t* p) {
+    return (uint16_t) (p[0] | (p[1] << 8));
+}
+
+static uint32_t get32(const uint8_t* p) {
+    return (uint32_t) get16(p) | ((uint32_t) get16(p + 2) << 16);
+}
+
+static uint64_t get64(const uint8_t* p) {
+    return (uint64_t) get32(p) | ((uint64_t) get32(p + 4) << 32);
+}
+
+static void putRecordHeader(uint8_t* p, uint64_t timestampUs, FreespaceDeviceId id, int kind, uint8_t hVer, int length) {
+    put64(p, timestampUs);
+    put32(p + 8, (uint32_t) id);
+    p[12] = (uint8_t) kind;
+    p[13] = hVer;
+    put16(p + 14, (uint16_t) length);
+}
+
+/******************************************************************************
+ * Recorder
+ */
+
+static int flushBuffer(struct freespace_recorder* r) {
+    if (r->used > 0 && fwrite(r->buffer, 1, r->used, r->fp) != (size_t) r->used) {
+        r->error = FREESPACE_ERROR_IO;
+    }
+    r->offset += r->used;
+    r->used = 0;
+    return r->error;
+}
+
+// Make room for length more bytes in the buffer.
+static int reserve(struct freespace_recorder* r, int length) {
+    if (r->used + length > WRITE_BUFFER_SIZE) {
+        return flushBuffer(r);
+    }
+    return r->error;
+}
+
+static int addBlock(struct indexBlock** blocks, int* numBlocks, int* capacity,
+                    uint64_t timestampUs, uint64_t offset) {
+    if (*numBlocks == *capacity) {
+        int newCapacity = *capacity == 0 ? 64 : *capacity * 2;
+        struct indexBlock* newBlocks = (struct indexBlock*) realloc(*blocks, newCapacity * sizeof(struct indexBlock));
+        if (newBlocks == NULL) {
+            return FREESPACE_ERROR_OUT_OF_MEMORY;
+        }
+        *blocks = newBlocks;
+        *capacity = newCapacity;
+    }
+    (*blocks)[*numBlocks].timestampUs = timestampUs;
+    (*blocks)[*numBlocks].offset = offset;
+    (*numBlocks)++;
+    return FREESPACE_SUCCESS;
+}
+
+static int writeIndexBlock(struct freespace_recorder* r) {
+    int length = INDEX_HEADER_SIZE + r->numEntries * INDEX_ENTRY_SIZE;
+    uint64_t timestampUs = get64(r->entries);
+    uint8_t* p;
+    int rc;
+
+    if (r->numEntries == 0) {
+        return FREESPACE_SUCCESS;
+    }
+    rc = reserve(r, RECORD_HEADER_SIZE + length);
+    if (rc != FREESPACE_SUCCESS) {
+        return rc;
+    }
+    rc = addBlock(&r->blocks, &r->numBlocks, &r->blockCapacity, timestampUs, r->offset + r->used);
+    if (rc != FREESPACE_SUCCESS) {
+        return rc;
+    }
+    p = r->buffer + r->used;
+    putRecordHeader(p, timestampUs, 0, KIND_INDEX, 0, length);
+    put32(p + RECORD_HEADER_SIZE, (uint32_t) r->numEntries);
+    put32(p + RECORD_HEADER_SIZE + 4, 0);
+    memcpy(p + RECORD_HEADER_SIZE + INDEX_HEADER_SIZE, r->entries, r->numEntries * INDEX_ENTRY_SIZE);
+
+    r->used += RECORD_HEADER_SIZE + length;
+    r->numEntries = 0;
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API uint64_t freespace_recorder_timestamp(void) {
+#ifdef _WIN32
+    LARGE_INTEGER count;
+    LARGE_INTEGER frequency;
+    QueryPerformanceCounter(&count);
+    QueryPerformanceFrequency(&frequency);
+    return (uint64_t) (count.QuadPart / frequency.QuadPart) * 1000000 +
+           (uint64_t) (count.QuadPart % frequency.QuadPart) * 1000000 / frequency.QuadPart;
+#else
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (uint64_t) now.tv_sec * 1000000 + (uint64_t) now.tv_nsec / 1000;
+#endif
+}
+
+LIBFREESPACE_API int freespace_recorder_open(struct freespace_recorder** recorder,
+                                             const char* path) {
+    struct freespace_recorder* r;
+
+    r = (struct freespace_recorder*) calloc(1, sizeof(struct freespace_recorder));
+    if (r == NULL) {
+        return FREESPACE_ERROR_OUT_OF_MEMORY;
+    }
+    r->buffer = (uint8_t*) malloc(WRITE_BUFFER_SIZE);
+    if (r->buffer == NULL) {
+        free(r);
+        return FREESPACE_ERROR_OUT_OF_MEMORY;
+    }
+    r->fp = fopen(path, "wb");
+    if (r->fp == NULL) {
+        free(r->buffer);
+        free(r);
+        return FREESPACE_ERROR_ACCESS;
+    }
+    memcpy(r->buffer, FILE_MAGIC, 8);
+    put16(r->buffer + 8, FORMAT_VERSION);
+    put16(r->buffer + 10, 0);
+    put32(r->buffer + 12, INDEX_STRIDE);
+    r->used = FILE_HEADER_SIZE;
+
+    *recorder = r;
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_recorder_write(struct freespace_recorder* recorder,
+                                              uint64_t timestampUs,
+                                              FreespaceDeviceId id,
+                                              uint8_t hVer,
+                                              const uint8_t* report,
+                                              int length) {
+    struct freespace_recorder* r = recorder;
+    uint8_t* p;
+    int rc;
+
+    if (r == NULL || report == NULL || length < 0) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    if (length > 0xffff) {
+        return FREESPACE_ERROR_SEND_TOO_LARGE;
+    }
+    rc = reserve(r, RECORD_HEADER_SIZE + length);
+    if (rc != FREESPACE_SUCCESS) {
+        return rc;
+    }
+
+    if (r->reportCount % INDEX_STRIDE == 0) {
+        p = r->entries + r->numEntries * INDEX_ENTRY_SIZE;
+        put64(p, timestampUs);
+        put64(p + 8, r->offset + r->used);
+        r->numEntries++;
+    }
+
+    p = r->buffer + r->used;
+    putRecordHeader(p, timestampUs, id, KIND_REPORT, hVer, length);
+    memcpy(p + RECORD_HEADER_SIZE, report, length);
+    r->used += RECORD_HEADER_SIZE + length;
+    r->reportCount++;
+
+    if (r->numEntries == INDEX_BLOCK_ENTRIES) {
+        return writeIndexBlock(r);
+    }
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_recorder_close(struct freespace_recorder* recorder) {
+    struct freespace_recorder* r = recorder;
+    uint64_t directory;
+    int rc;
+    int i;
+    int j;
+
+    if (r == NULL) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    rc = writeIndexBlock(r);
+    directory = r->offset + r->used;
+    for (i = 0; i < r->numBlocks && rc == FREESPACE_SUCCESS; i += DIRECTORY_RECORD_ENTRIES) {
+        int count = r->numBlocks - i < DIRECTORY_RECORD_ENTRIES ? r->numBlocks - i : DIRECTORY_RECORD_ENTRIES;
+        rc = reserve(r, RECORD_HEADER_SIZE + count * DIRECTORY_ENTRY_SIZE);
+        if (rc == FREESPACE_SUCCESS) {
+            uint8_t* p = r->buffer + r->used;
+            putRecordHeader(p, 0, 0, KIND_DIRECTORY, 0, count * DIRECTORY_ENTRY_SIZE);
+            p += RECORD_HEADER_SIZE;
+            for (j = 0; j < count; j++, p += DIRECTORY_ENTRY_SIZE) {
+                put64(p, r->blocks[i + j].timestampUs);
+                put64(p + 8, r->blocks[i + j].offset);
+            }
+            r->used += RECORD_HEADER_SIZE + count * DIRECTORY_ENTRY_SIZE;
+        }
+    }
+    if (rc == FREESPACE_SUCCESS) {
+        rc = reserve(r, FOOTER_SIZE);
+    }
+    if (rc == FREESPACE_SUCCESS) {
+        uint8_t* p = r->buffer + r->used;
+        memcpy(p, FOOTER_MAGIC, 8);
+        put64(p + 8, r->reportCount);
+        put64(p + 16, (uint64_t) r->numBlocks);
+        put64(p + 24, directory);
+        r->used += FOOTER_SIZE;
+        rc = flushBuffer(r);
+    }
+    if (fclose(r->fp) != 0 && rc == FREESPACE_SUCCESS) {
+        rc = FREESPACE_ERROR_IO;
+    }
+    free(r->blocks);
+    free(r->buffer);
+    free(r);
+    return rc;
+}
+
+/******************************************************************************
+ * Reader
+ */
+
+static int mapFile(struct freespace_recording* rec, const char* path) {
+#ifdef _WIN32
+    LARGE_INTEGER size;
+
+    rec->file = CreateFileA(path, GENERIC_READ, FILE_SHARE_READ | FILE_SHARE_WRITE, NULL,
+                            OPEN_EXISTING, FILE_ATTRIBUTE_NORMAL, NULL);
+    if (rec->file == INVALID_HANDLE_VALUE) {
+        return FREESPACE_ERROR_NOT_FOUND;
+    }
+    if (!GetFileSizeEx(rec->file, &size)) {
+        CloseHandle(rec->file);
+        return FREESPACE_ERROR_IO;
+    }
+    rec->size = (uint64_t) size.QuadPart;
+    if (rec->size < FILE_HEADER_SIZE) {
+        CloseHandle(rec->file);
+        return FREESPACE_ERROR_MALFORMED_MESSAGE;
+    }
+    rec->mapping = CreateFileMapping(rec->file, NULL, PAGE_READONLY, 0, 0, NULL);
+    if (rec->mapping == NULL) {
+        CloseHandle(rec->file);
+        return FREESPACE_ERROR_IO;
+    }
+    rec->data = (const uint8_t*) MapViewOfFile(rec->mapping, FILE_MAP_READ, 0, 0, 0);
+    if (rec->data == NULL) {
+        CloseHandle(rec->mapping);
+        CloseHandle(rec->file);
+        return FREESPACE_ERROR_OUT_OF_MEMORY;
+    }
+    return FREESPACE_SUCCESS;
+#else
+    struct stat st;
+    void* data;
+    int fd;
+
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return FREESPACE_ERROR_NOT_FOUND;
+    }
+    if (fstat(fd, &st) != 0) {
+        close(fd);
+        return FREESPACE_ERROR_IO;
+    }
+    rec->size = (uint64_t) st.st_size;
+    if (rec->size < FILE_HEADER_SIZE || rec->size != (uint64_t) (size_t) rec->size) {
+        close(fd);
+        return FREESPACE_ERROR_MALFORMED_MESSAGE;
+    }
+    data = mmap(NULL, (size_t) rec->size, PROT_READ, MAP_SHARED, fd, 0);
+    close(fd);
+    if (data == MAP_FAILED) {
+        return FREESPACE_ERROR_OUT_OF_MEMORY;
+    }
+    rec->data = (const uint8_t*) data;
+    return FREESPACE_SUCCESS;
+#endif
+}
+
+static void unmapFile(struct freespace_recording* rec) {
+#ifdef _WIN32
+    UnmapViewOfFile(rec->data);
+    CloseHandle(rec->mapping);
+    CloseHandle(rec->file);
+#else
+    munmap((void*) rec->data, (size_t) rec->size);
+#endif
+}
+
+// The bounds checks below subtract from the end of the range rather
+// than add to offsets, since the offsets come from the file and adding
+// to one can wrap around. rec->end is never below FILE_HEADER_SIZE.
+
+// Check that a record header starts within the records. Offsets read
+// from the index must pass this before they are used.
+static int validRecord(const struct freespace_recording* rec, uint64_t offset) {
+    return FILE_HEADER_SIZE <= offset && offset <= rec->end - RECORD_HEADER_SIZE;
+}
+
+// Check that an index block record lies within the records.
+static int validIndex(const struct freespace_recording* rec, uint64_t offset) {
+    const uint8_t* p;
+    int length;
+
+    if (!validRecord(rec, offset) || rec->end - offset - RECORD_HEADER_SIZE < INDEX_HEADER_SIZE) {
+        return 0;
+    }
+    p = rec->data + offset;
+    length = get16(p + 14);
+    return p[12] == KIND_INDEX &&
+           get32(p + RECORD_HEADER_SIZE) > 0 &&
+           (uint64_t) length <= rec->end - offset - RECORD_HEADER_SIZE &&
+           (uint64_t) get32(p + RECORD_HEADER_SIZE) * INDEX_ENTRY_SIZE + INDEX_HEADER_SIZE == (uint64_t) length;
+}
+
+// Get the report offset of an index entry, or fallback if the entry
+// points outside the records.
+static uint64_t entryOffset(const struct freespace_recording* rec, const uint8_t* entry, uint64_t fallback) {
+    uint64_t offset = get64(entry + 8);
+    return validRecord(rec, offset) ? offset : fallback;
+}
+
+// Get the entries of an index block, or NULL if the block is damaged.
+// The blocks are only checked here, when they are used, so that
+// opening a recording doesn't have to read every one of them.
+static const uint8_t* blockEntries(const struct freespace_recording* rec, const struct indexBlock* block, int* numEntries) {
+    const uint8_t* p;
+    if (!validIndex(rec, block->offset)) {
+        return NULL;
+    }
+    p = rec->data + block->offset + RECORD_HEADER_SIZE;
+    *numEntries = (int) get32(p);
+    return p + INDEX_HEADER_SIZE;
+}
+
+// Read the index block directory that the footer points to.
+static int readFooter(struct freespace_recording* rec) {
+    const uint8_t* footer;
+    uint64_t numBlocks;
+    uint64_t offset;
+    uint64_t limit;
+
+    if (rec->size < FILE_HEADER_SIZE + FOOTER_SIZE) {
+        return 0;
+    }
+    limit = rec->size - FOOTER_SIZE;
+    footer = rec->data + limit;
+    numBlocks = get64(footer + 16);
+    offset = get64(footer + 24);
+    if (memcmp(footer, FOOTER_MAGIC, 8) != 0 || offset < FILE_HEADER_SIZE || offset > limit) {
+        return 0;
+    }
+    rec->end = offset;
+    while (offset <= limit - RECORD_HEADER_SIZE) {
+        const uint8_t* p = rec->data + offset;
+        int length = get16(p + 14);
+        int i;
+        if (p[12] != KIND_DIRECTORY || length % DIRECTORY_ENTRY_SIZE != 0 ||
+            (uint64_t) length > limit - offset - RECORD_HEADER_SIZE) {
+            break;
+        }
+        for (i = 0; i < length; i += DIRECTORY_ENTRY_SIZE) {
+            uint64_t block = get64(p + RECORD_HEADER_SIZE + i + 8);
+            if (!validRecord(rec, block) ||
+                (rec->numBlocks > 0 && block <= rec->blocks[rec->numBlocks - 1].offset) ||
+                addBlock(&rec->blocks, &rec->numBlocks, &rec->blockCapacity,
+                         get64(p + RECORD_HEADER_SIZE + i), block) != FREESPACE_SUCCESS) {
+                rec->numBlocks = 0;
+                return 0;
+            }
+        }
+        offset += RECORD_HEADER_SIZE + length;
+    }
+    if (offset != limit || (uint64_t) rec->numBlocks != numBlocks) {
+        rec->numBlocks = 0;
+        return 0;
+    }
+    rec->reportCount = get64(footer + 8);
+    rec->complete = 1;
+    return 1;
+}
+
+// Without a footer, walk the record headers to find the index blocks
+// and the end of the last whole record.
+static int scanRecords(struct freespace_recording* rec) {
+    uint64_t offset = FILE_HEADER_SIZE;
+    int rc;
+
+    rec->end = rec->size;
+    rec->reportCount = 0;
+    while (offset <= rec->size - RECORD_HEADER_SIZE) {
+        const uint8_t* p = rec->data + offset;
+        int length = get16(p + 14);
+        uint64_t next;
+        if ((uint64_t) length > rec->size - offset - RECORD_HEADER_SIZE) {
+            break;
+        }
+        next = offset + RECORD_HEADER_SIZE + length;
+        if (p[12] == KIND_INDEX) {
+            if (validIndex(rec, offset)) {
+                rc = addBlock(&rec->blocks, &rec->numBlocks, &rec->blockCapacity, get64(p), offset);
+                if (rc != FREESPACE_SUCCESS) {
+                    return rc;
+                }
+            }
+        } else if (p[12] == KIND_REPORT) {
+            rec->reportCount++;
+        }
+        offset = next;
+    }
+    rec->end = offset;
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_recording_open(struct freespace_recording** recording,
+                                              const char* path) {
+    struct freespace_recording* rec;
+    int rc;
+
+    rec = (struct freespace_recording*) calloc(1, sizeof(struct freespace_recording));
+    if (rec == NULL) {
+        return FREESPACE_ERROR_OUT_OF_MEMORY;
+    }
+    rc = mapFile(rec, path);
+    if (rc != FREESPACE_SUCCESS) {
+        free(rec);
+        return rc;
+    }
+    if (memcmp(rec->data, FILE_MAGIC, 8) != 0 || get16(rec->data + 8) != FORMAT_VERSION) {
+        freespace_recording_close(rec);
+        return FREESPACE_ERROR_MALFORMED_MESSAGE;
+    }
+
+    if (!readFooter(rec)) {
+        rc = scanRecords(rec);
+        if (rc != FREESPACE_SUCCESS) {
+            freespace_recording_close(rec);
+            return rc;
+        }
+    }
+    *recording = rec;
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API void freespace_recording_close(struct freespace_recording* recording) {
+    if (recording == NULL) {
+        return;
+    }
+    unmapFile(recording);
+    free(recording->blocks);
+    free(recording);
+}
+
+LIBFREESPACE_API int freespace_recording_getInfo(struct freespace_recording* recording,
+                                                 struct freespace_recordingInfo* info) {
+    struct freespace_recordedReport report;
+    uint64_t cursor = FILE_HEADER_SIZE;
+    const uint8_t* entries;
+    int numEntries;
+
+    if (recording == NULL || info == NULL) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    info->reportCount = recording->reportCount;
+    info->complete = recording->complete;
+    info->firstTimestampUs = 0;
+    info->lastTimestampUs = 0;
+    if (freespace_recording_next(recording, &cursor, &report) == FREESPACE_SUCCESS) {
+        info->firstTimestampUs = report.timestampUs;
+        info->lastTimestampUs = report.timestampUs;
+    }
+
+    // Start from the last index entry, so at most INDEX_STRIDE reports
+    // are read.
+    if (recording->numBlocks > 0) {
+        entries = blockEntries(recording, &recording->blocks[recording->numBlocks - 1], &numEntries);
+        if (entries != NULL) {
+            cursor = entryOffset(recording, entries + (numEntries - 1) * INDEX_ENTRY_SIZE, cursor);
+        }
+    }
+    while (freespace_recording_next(recording, &cursor, &report) == FREESPACE_SUCCESS) {
+        info->lastTimestampUs = report.timestampUs;
+    }
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_recording_seek(struct freespace_recording* recording,
+                                              uint64_t timestampUs,
+                                              uint64_t* cursor) {
+    const struct freespace_recording* rec = recording;
+    const uint8_t* entries;
+    int numEntries;
+    uint64_t offset = FILE_HEADER_SIZE;
+    int lo;
+    int hi;
+
+    if (rec == NULL || cursor == NULL) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+
+    // Find the last index entry before the time. The first report at
+    // or after the time comes after it, even when several reports share
+    // a timestamp.
+    lo = 0;
+    hi = rec->numBlocks;
+    while (lo < hi) {
+        int mid = lo + (hi - lo) / 2;
+        if (rec->blocks[mid].timestampUs < timestampUs) {
+            lo = mid + 1;
+        } else {
+            hi = mid;
+        }
+    }
+    if (lo > 0) {
+        entries = blockEntries(rec, &rec->blocks[lo - 1], &numEntries);
+        if (entries != NULL) {
+            lo = 1;
+            hi = numEntries;
+            while (lo < hi) {
+                int mid = lo + (hi - lo) / 2;
+                if (get64(entries + mid * INDEX_ENTRY_SIZE) < timestampUs) {
+                    lo = mid + 1;
+                } else {
+                    hi = mid;
+                }
+            }
+            offset = entryOffset(rec, entries + (lo - 1) * INDEX_ENTRY_SIZE, FILE_HEADER_SIZE);
+        }
+    }
+
+    // Walk forward to the first report at or after the time. An entry
+    // that points into the middle of a record can walk off the end.
+    while (offset <= rec->end - RECORD_HEADER_SIZE) {
+        const uint8_t* p = rec->data + offset;
+        if (p[12] == KIND_REPORT && get64(p) >= timestampUs) {
+            break;
+        }
+        offset += RECORD_HEADER_SIZE + get16(p + 14);
+    }
+    *cursor = offset < rec->end ? offset : rec->end;
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_recording_next(struct freespace_recording* recording,
+                                              uint64_t* cursor,
+                                              struct freespace_recordedReport* report) {
+    const struct freespace_recording* rec = recording;
+    uint64_t offset;
+
+    if (rec == NULL || cursor == NULL || report == NULL) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    for (offset = *cursor; offset <= rec->end - RECORD_HEADER_SIZE; ) {
+        const uint8_t* p = rec->data + offset;
+        int length = get16(p + 14);
+        if ((uint64_t) length > rec->end - offset - RECORD_HEADER_SIZE) {
+            break;
+        }
+        offset += RECORD_HEADER_SIZE + length;
+        if (p[12] != KIND_REPORT) {
+            continue;
+        }
+        report->timestampUs = get64(p);
+        report->id = (FreespaceDeviceId) get32(p + 8);
+        report->hVer = p[13];
+        report->length = length;
+        report->report = p + RECORD_HEADER_SIZE;
+        *cursor = offset;
+        return FREESPACE_SUCCESS;
+    }
+    *cursor = rec->end;
+    return FREESPACE_ERROR_NO_DATA;
+}
@@ -0,0 +1,101 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2009-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#include <freespace/freespace_template.h>
+#include <string.h>
+
+LIBFREESPACE_API int freespace_template_init(struct freespace_messageTemplate* t,
+                                             FreespaceDeviceId id,
+                                             struct freespace_message* message) {
+    struct FreespaceDeviceInfo info;
+    int rc;
+
+    // Address is reserved for now and must be set to 0 by the caller.
+    if (message->dest == 0) {
+        message->dest = FREESPACE_RESERVED_ADDRESS;
+    }
+
+    rc = freespace_getDeviceInfo(id, &info);
+    if (rc != FREESPACE_SUCCESS) {
+        return rc;
+    }
+
+    message->ver = info.hVer;
+    rc = freespace_encode_message(message, t->message, FREESPACE_MAX_OUTPUT_MESSAGE_SIZE);
+    if (rc <= FREESPACE_SUCCESS) {
+        return rc;
+    }
+    t->length = rc;
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_template_initEncoded(struct freespace_messageTemplate* t,
+                                                    const uint8_t* message,
+                                                    int length) {
+    if (length <= 0 || length > FREESPACE_MAX_OUTPUT_MESSAGE_SIZE) {
+        return FREESPACE_ERROR_SEND_TOO_LARGE;
+    }
+    memcpy(t->message, message, length);
+    t->length = length;
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_template_set(struct freespace_messageTemplate* t,
+                                            uint32_t field,
+                                            uint32_t value) {
+    int offset = field & 0xff;
+    int width = (field >> 8) & 0xff;
+    int shift = (field >> 16) & 0xff;
+    uint8_t mask = (uint8_t) (field >> 24);
+    uint8_t* b = t->message + offset;
+
+    if (offset + (width == 0 ? 1 : width) > t->length) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+
+    switch (width) {
+        case 0:
+            *b = (uint8_t) ((*b & ~(mask << shift)) | ((value & mask) << shift));
+            break;
+        case 4:
+            b[3] = (uint8_t) (value >> 24);
+            b[2] = (uint8_t) (value >> 16);
+            // Fall through
+        case 2:
+            b[1] = (uint8_t) (value >> 8);
+            // Fall through
+        case 1:
+            b[0] = (uint8_t) value;
+            break;
+        default:
+            return FREESPACE_ERROR_UNEXPECTED;
+    }
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_template_send(FreespaceDeviceId id,
+                                             const struct freespace_messageTemplate* t) {
+    return freespace_private_send(id, t->message, t->length);
+}
+
+LIBFREESPACE_API int freespace_template_sendAsync(FreespaceDeviceId id,
+                                                  const struct freespace_messageTemplate* t,
+                                                  unsigned int timeoutMs,
+                                                  freespace_sendCallback callback,
+                                                  void* cookie) {
+    return freespace_private_sendAsync(id, t->message, t->length, timeoutMs, callback, cookie);
+}
@@ -16,6 +16,13 @@
  */
 
 #include <freespace/freespace_util.h>
+#include <stddef.h>
+#include <string.h>
+
+#if defined(__SSE2__) || defined(_M_X64) || (defined(_M_IX86_FP) && _M_IX86_FP >= 2)
+#include <emmintrin.h>
+#define FREESPACE_UTIL_SSE2
+#endif
 
 /******************************************************************************
  * freespace_util_getAcceleration
@@ -493,3 +500,295 @@ LIBFREESPACE_API int freespace_util_getActClass(struct freespace_MotionEngineOut
     return 0;
 }
 
+
+/******************************************************************************
+ * freespace_util_parseMotionEngineOutput
+ */
+
+// Size in bytes of the section selected by each format flag. Formats 0, 1 and 3
+// share these sizes, so a single layout serves all of them. The last section
+// never needs skipping, so its size does not matter.
+#define ME_SECTION_SIZE(n) ((n) == 5 ? 2 : (n) == 6 ? 8 : 6)
+#define ME_SKIP(f, n) ((((f) >> (n)) & 1) * ME_SECTION_SIZE(n))
+#define ME_LAYOUT(f) { 0, \
+    ME_SKIP(f, 0), \
+    ME_SKIP(f, 0) + ME_SKIP(f, 1), \
+    ME_SKIP(f, 0) + ME_SKIP(f, 1) + ME_SKIP(f, 2), \
+    ME_SKIP(f, 0) + ME_SKIP(f, 1) + ME_SKIP(f, 2) + ME_SKIP(f, 3), \
+    ME_SKIP(f, 0) + ME_SKIP(f, 1) + ME_SKIP(f, 2) + ME_SKIP(f, 3) + ME_SKIP(f, 4), \
+    ME_SKIP(f, 0) + ME_SKIP(f, 1) + ME_SKIP(f, 2) + ME_SKIP(f, 3) + ME_SKIP(f, 4) + ME_SKIP(f, 5), \
+    ME_SKIP(f, 0) + ME_SKIP(f, 1) + ME_SKIP(f, 2) + ME_SKIP(f, 3) + ME_SKIP(f, 4) + ME_SKIP(f, 5) + ME_SKIP(f, 6) }
+#define ME_LAYOUT4(f) ME_LAYOUT(f), ME_LAYOUT((f) + 1), ME_LAYOUT((f) + 2), ME_LAYOUT((f) + 3)
+#define ME_LAYOUT16(f) ME_LAYOUT4(f), ME_LAYOUT4((f) + 4), ME_LAYOUT4((f) + 8), ME_LAYOUT4((f) + 12)
+#define ME_LAYOUT64(f) ME_LAYOUT16(f), ME_LAYOUT16((f) + 16), ME_LAYOUT16((f) + 32), ME_LAYOUT16((f) + 48)
+
+// Offset into meData of the section for each flag, indexed by the format flags.
+static const uint8_t meLayout[256][8] = {
+    ME_LAYOUT64(0), ME_LAYOUT64(64), ME_LAYOUT64(128), ME_LAYOUT64(192)
+};
+
+enum { AXIS_W, AXIS_X, AXIS_Y, AXIS_Z };
+
+// How a section is converted. Values are read in order, scaled exactly as the
+// freespace_util_get* functions do, and stored in the listed coordinates.
+struct meSection {
+    uint16_t present;   // FREESPACE_ME_* bit, 0 if the section is not extracted
+    uint16_t member;    // offset of the MultiAxisSensor in MotionEngineOutputSensors
+    uint16_t arrays;    // offset of the MultiAxisSensorArrays in MotionEngineOutputArrays
+    uint8_t width;      // bytes per value: 2 for int16, 1 for int8
+    uint8_t count;      // number of values
+    uint8_t axes[4];    // coordinate each value is stored in
+    float scale;
+};
+
+#define ME_MEMBER(name) ((uint16_t) offsetof(struct MotionEngineOutputSensors, name)), \
+                        ((uint16_t) offsetof(struct MotionEngineOutputArrays, name))
+#define ME_XYZ(bit, name, scale) { bit, ME_MEMBER(name), 2, 3, { AXIS_X, AXIS_Y, AXIS_Z }, scale }
+#define ME_NONE { 0, 0, 0, 0, 0, { 0 }, 0 }
+
+// Sections indexed by format flag, for each formatSelect.
+static const struct meSection meSections[4][8] = {
+    { // Format 0
+        ME_NONE, // Mouse
+        ME_XYZ(FREESPACE_ME_ACCELERATION, acceleration, 1024.0f), // Q10
+        ME_XYZ(FREESPACE_ME_ACC_NO_GRAVITY, accNoGravity, 1024.0f), // Q10
+        ME_XYZ(FREESPACE_ME_ANGULAR_VELOCITY, angularVelocity, 1024.0f), // Q10
+        ME_XYZ(FREESPACE_ME_MAGNETOMETER, magnetometer, 4096.0f), // Q12
+        { FREESPACE_ME_TEMPERATURE, ME_MEMBER(temperature), 2, 1, { AXIS_W }, 128.0f }, // Q7
+        { FREESPACE_ME_ANG_POS, ME_MEMBER(angPos), 2, 4, { AXIS_W, AXIS_X, AXIS_Y, AXIS_Z }, 16384.0f },
+        ME_NONE,
+    },
+    { // Format 1
+        ME_XYZ(FREESPACE_ME_ACCELERATION, acceleration, 100.0f), // 0.01g
+        ME_XYZ(FREESPACE_ME_ACC_NO_GRAVITY, accNoGravity, 100.0f), // 0.01g
+        ME_XYZ(FREESPACE_ME_ANGULAR_VELOCITY, angularVelocity, 100.0f),
+        ME_XYZ(FREESPACE_ME_MAGNETOMETER, magnetometer, 1000.0f), // 0.001 gauss
+        ME_XYZ(FREESPACE_ME_INCLINATION, inclination, 10.0f), // 0.1 degrees
+        { FREESPACE_ME_COMPASS_HEADING, ME_MEMBER(compassHeading), 2, 1, { AXIS_X }, 10.0f }, // 0.1 degrees
+        { FREESPACE_ME_ANG_POS, ME_MEMBER(angPos), 2, 4, { AXIS_X, AXIS_Y, AXIS_Z, AXIS_W }, 16384.0f },
+        { FREESPACE_ME_ACT_CLASS, ME_MEMBER(actClass), 1, 2, { AXIS_X, AXIS_Y }, 1.0f }, // Q0
+    },
+    { // Format 2 has no calibrated sections
+        ME_NONE, ME_NONE, ME_NONE, ME_NONE, ME_NONE, ME_NONE, ME_NONE, ME_NONE,
+    },
+    { // Format 3
+        ME_NONE, // Mouse
+        ME_XYZ(FREESPACE_ME_ACCELERATION, acceleration, 256.0f), // Q8
+        ME_XYZ(FREESPACE_ME_ACC_NO_GRAVITY, accNoGravity, 256.0f), // Q8
+        ME_XYZ(FREESPACE_ME_ANGULAR_VELOCITY, angularVelocity, 512.0f), // Q9
+        ME_XYZ(FREESPACE_ME_MAGNETOMETER, magnetometer, 32.0f), // Q5
+        { FREESPACE_ME_TEMPERATURE, ME_MEMBER(temperature), 2, 1, { AXIS_W }, 128.0f }, // Q7
+        { FREESPACE_ME_ANG_POS, ME_MEMBER(angPos), 2, 4, { AXIS_W, AXIS_X, AXIS_Y, AXIS_Z }, 16384.0f },
+        ME_NONE,
+    },
+};
+
+// The format flags of a packet as a bitmask, ff0 in bit 0.
+static unsigned int meFormatFlags(struct freespace_MotionEngineOutput const * meOutPkt) {
+    return (meOutPkt->ff0 == 1) << 0 | (meOutPkt->ff1 == 1) << 1 |
+           (meOutPkt->ff2 == 1) << 2 | (meOutPkt->ff3 == 1) << 3 |
+           (meOutPkt->ff4 == 1) << 4 | (meOutPkt->ff5 == 1) << 5 |
+           (meOutPkt->ff6 == 1) << 6 | (meOutPkt->ff7 == 1) << 7;
+}
+
+LIBFREESPACE_API int freespace_util_parseMotionEngineOutput(struct freespace_MotionEngineOutput const * meOutPkt,
+                                                            struct MotionEngineOutputSensors * sensors) {
+
+    const struct meSection* sections;
+    const uint8_t* layout;
+    unsigned int flags;
+    int i;
+    int v;
+
+    if (meOutPkt->formatSelect > 3) {
+        return -3; // The format number was unrecognized
+    }
+    sections = meSections[meOutPkt->formatSelect];
+
+    flags = meFormatFlags(meOutPkt);
+    layout = meLayout[flags];
+
+    sensors->present = 0;
+    for (i = 0; flags != 0; i++, flags >>= 1) {
+        const struct meSection* section = &sections[i];
+        const uint8_t* data = &meOutPkt->meData[layout[i]];
+        struct MultiAxisSensor* sensor;
+        float* coords[4];
+
+        if ((flags & 1) == 0 || section->present == 0) {
+            continue;
+        }
+        sensor = (struct MultiAxisSensor*) ((char*) sensors + section->member);
+        coords[AXIS_W] = &sensor->w;
+        coords[AXIS_X] = &sensor->x;
+        coords[AXIS_Y] = &sensor->y;
+        coords[AXIS_Z] = &sensor->z;
+
+        for (v = 0; v < section->count; v++) {
+            if (section->width == 2) {
+                int16_t axisVal = data[1] << 8 | data[0];
+                *coords[section->axes[v]] = ((float) axisVal) / section->scale;
+                data += 2;
+            } else {
+                int8_t flagVal = data[0];
+                *coords[section->axes[v]] = ((float) flagVal) / section->scale;
+                data += 1;
+            }
+        }
+        sensors->present |= section->present;
+    }
+
+    return 0;
+}
+
+/******************************************************************************
+ * freespace_util_convertMotionEngineOutputs
+ */
+
+// The int16 words of meData that can hold section data, in groups of four.
+#define ME_WORDS 20
+#define ME_MAX_VALUES 32
+#define ME_BATCH 64
+
+// One value converted for every packet of a batch.
+struct meValue {
+    uint8_t offset;     // offset in meData
+    uint8_t width;      // bytes: 2 for int16, 1 for int8
+    float scale;
+    float* out;         // array receiving the value of each packet
+};
+
+// Dividing by a power of two gives exactly the same float as multiplying by
+// its reciprocal, so only those scales may use the cheaper multiply.
+static int isPowerOfTwo(float scale) {
+    uint32_t bits;
+    memcpy(&bits, &scale, sizeof(bits));
+    return (bits & 0x007fffff) == 0;
+}
+
+LIBFREESPACE_API int freespace_util_convertMotionEngineOutputs(struct freespace_MotionEngineOutput const * meOutPkts,
+                                                               int count,
+                                                               struct MotionEngineOutputArrays * arrays) {
+
+    const struct meSection* sections;
+    const uint8_t* layout;
+    unsigned int flags;
+    struct meValue values[ME_MAX_VALUES];
+    float scales[ME_WORDS];
+    float factors[ME_WORDS];        // reciprocal or divisor of each word
+    uint8_t multiply[ME_WORDS / 4]; // whether a group uses the reciprocals
+    float block[ME_BATCH][ME_WORDS];
+    int numValues = 0;
+    int first;
+    int n;
+    int groups = 0;
+    int i;
+    int v;
+    int w;
+    int k;
+
+    arrays->present = 0;
+    if (count <= 0) {
+        return 0;
+    }
+    if (meOutPkts[0].formatSelect > 3) {
+        return -3; // The format number was unrecognized
+    }
+    sections = meSections[meOutPkts[0].formatSelect];
+    flags = meFormatFlags(&meOutPkts[0]);
+    layout = meLayout[flags];
+
+    for (k = 1; k < count; k++) {
+        if (meOutPkts[k].formatSelect != meOutPkts[0].formatSelect || meFormatFlags(&meOutPkts[k]) != flags) {
+            return -4; // The packets do not share one layout
+        }
+    }
+
+    // List the values to convert and the scale of each word
+    for (w = 0; w < ME_WORDS; w++) {
+        scales[w] = 1.0f;
+    }
+    for (i = 0; i < 8; i++) {
+        const struct meSection* section = &sections[i];
+        struct MultiAxisSensorArrays* dst;
+        float* coords[4];
+
+        if (((flags >> i) & 1) == 0 || section->present == 0) {
+            continue;
+        }
+        arrays->present |= section->present;
+        dst = (struct MultiAxisSensorArrays*) ((char*) arrays + section->arrays);
+        coords[AXIS_W] = dst->w;
+        coords[AXIS_X] = dst->x;
+        coords[AXIS_Y] = dst->y;
+        coords[AXIS_Z] = dst->z;
+
+        for (v = 0; v < section->count; v++) {
+            int offset = layout[i] + v * section->width;
+
+            if (coords[section->axes[v]] == NULL) {
+                continue;
+            }
+            values[numValues].offset = (uint8_t) offset;
+            values[numValues].width = section->width;
+            values[numValues].scale = section->scale;
+            values[numValues].out = coords[section->axes[v]];
+            numValues++;
+            if (section->width == 2) {
+                scales[offset / 2] = section->scale;
+                groups = (offset / 8 + 1 > groups) ? offset / 8 + 1 : groups;
+            }
+        }
+    }
+    for (i = 0; i < groups; i++) {
+        multiply[i] = 1;
+        for (w = 4 * i; w < 4 * i + 4; w++) {
+            multiply[i] = multiply[i] && isPowerOfTwo(scales[w]);
+        }
+        for (w = 4 * i; w < 4 * i + 4; w++) {
+            factors[w] = multiply[i] ? 1.0f / scales[w] : scales[w];
+        }
+    }
+
+    // Convert the words of a block of packets four at a time, then copy each
+    // value to its array in one contiguous run
+    for (first = 0; first < count; first += ME_BATCH) {
+        n = (count - first < ME_BATCH) ? count - first : ME_BATCH;
+
+        for (k = 0; k < n; k++) {
+            const uint8_t* data = meOutPkts[first + k].meData;
+
+            for (i = 0; i < groups; i++) {
+#ifdef FREESPACE_UTIL_SSE2
+                __m128i words = _mm_loadl_epi64((const __m128i*) &data[8 * i]);
+                __m128 axes = _mm_cvtepi32_ps(_mm_srai_epi32(_mm_unpacklo_epi16(words, words), 16));
+                __m128 f = _mm_loadu_ps(&factors[4 * i]);
+                _mm_storeu_ps(&block[k][4 * i], multiply[i] ? _mm_mul_ps(axes, f) : _mm_div_ps(axes, f));
+#else
+                for (w = 4 * i; w < 4 * i + 4; w++) {
+                    int16_t axisVal = data[2 * w + 1] << 8 | data[2 * w];
+                    block[k][w] = multiply[i] ? ((float) axisVal) * factors[w] : ((float) axisVal) / factors[w];
+                }
+#endif
+            }
+        }
+
+        for (v = 0; v < numValues; v++) {
+            float* out = values[v].out + first;
+
+            if (values[v].width == 2) {
+                w = values[v].offset / 2;
+                for (k = 0; k < n; k++) {
+                    out[k] = block[k][w];
+                }
+            } else {
+                for (k = 0; k < n; k++) {
+                    int8_t flagVal = meOutPkts[first + k].meData[values[v].offset];
+                    out[k] = ((float) flagVal) / values[v].scale;
+                }
+            }
+        }
+    }
+
+    return 0;
+}
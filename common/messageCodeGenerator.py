@@ -20,6 +20,7 @@
 import sys
 import argparse
 import os
+from StringIO import StringIO
 
 def compareMessages(a, b):
     # Sort ID[0] before ID[1] before ID[2]
@@ -54,10 +55,18 @@ class MessageCodeGenerator:
 
     inclDir = ""
     srcDir  = ""
+    mode    = "unrolled"
+    packedFlags = False
+    synthesized = "exact"
+    test = False
 
-    def __init__(self, incl, src):
+    def __init__(self, incl, src, mode="unrolled", packedFlags=False, synthesized="exact", test=False):
         self.inclDir = incl
         self.srcDir = src
+        self.mode = mode
+        self.packedFlags = packedFlags
+        self.synthesized = synthesized
+        self.test = test
 
     def writeMessages(self, messages):
         messages.sort(compareMessages)
@@ -65,8 +74,11 @@ class MessageCodeGenerator:
 
         codecsFileName = "freespace_codecs"
         printersFileName = "freespace_printers"
+        viewsFileName = "freespace_views"
+        batchFileName = "freespace_batch"
         codecsHdrPath = os.path.join(self.inclDir, codecsFileName + ".h")
         printerHdrPath = os.path.join(self.inclDir, printersFileName + ".h")
+        viewsHdrPath = os.path.join(self.inclDir, viewsFileName + ".h")
         codecsSrcPath = os.path.join(self.srcDir, codecsFileName + ".c")
         printersSrcPath = os.path.join(self.srcDir, printersFileName + ".c")
 
@@ -78,42 +90,76 @@ class MessageCodeGenerator:
         self.writeHFileHeader(printersHFile, printersFileName)
         printersHFile.write('#include "' + codecsFileName + '.h"\n')
         printersHFile.write('#include <stdio.h>\n\n')
-        self.writePrintMessageHeader(printersHFile)
+        self.writePrintMessageHeader(printersHFile, messages)
         
         codecsCFile = open(codecsSrcPath, "w")
         self.writeCFileHeader(codecsCFile, codecsFileName)
+        codecsCFile.write('#include <stddef.h>\n')
         codecsCFile.write('#include <stdio.h>\n')
         codecsCFile.write('#include <math.h>\n')
-        codecsCFile.write('\n#ifdef _WIN32\n')
-        codecsCFile.write('#define STRICT_DECODE_LENGTH 0\n')
-        codecsCFile.write('#else\n')
-        codecsCFile.write('#define STRICT_DECODE_LENGTH 0\n')
-        codecsCFile.write('#endif\n\n')
-        codecsCFile.write('#undef CODECS_PRINTF\n')
+        codecsCFile.write('\n#undef CODECS_PRINTF\n')
         codecsCFile.write('//#define CODECS_DEBUG\n')
         codecsCFile.write('#ifdef CODECS_DEBUG\n')
         codecsCFile.write('#define CODECS_PRINTF printf\n')
         codecsCFile.write('#else\n')
         codecsCFile.write('#define CODECS_PRINTF(...)\n')
         codecsCFile.write('#endif\n\n')
-        self.writeBitHelper(codecsCFile)
+        # The codecs are generated first, so that only the helpers they
+        # call are written ahead of them.
+        codecsBody = StringIO()
+        if self.mode == "table":
+            writeCodecTables(messages, codecsBody, self.packedFlags)
         
         printersCFile = open(printersSrcPath, "w")
         self.writeCFileHeader(printersCFile, printersFileName)
-        self.writePrintMessageBody(messages, printersCFile)
+        self.writePrintFormatter(printersCFile)
         
         for message in messages:
             fields = extractFields(message)
             # Data structure to hold the message
-            writeStruct(message, fields, codecsHFile)
+            writeStruct(message, fields, codecsHFile, self.packedFlags)
 
         self.writeUnionStruct(codecsHFile, messages)
 
         for message in messages:
-            writeCodecs(message, codecsHFile, codecsCFile)
+            writeCodecs(message, codecsHFile, codecsBody, self.mode, self.packedFlags, self.synthesized)
             writePrinter(message, printersHFile, printersCFile)
 
-        self.writeUnionDecodeEncodeBodies(codecsCFile, messages)
+        self.writeUnionDecodeEncodeBodies(codecsBody, messages)
+        self.writeBitHelper(codecsCFile, codecsBody.getvalue())
+        writeSynthesizedHelpers(codecsCFile, self.synthesized)
+        codecsCFile.write(codecsBody.getvalue())
+        self.writePrintMessageBody(messages, printersCFile)
+
+        viewsHFile = open(viewsHdrPath, "w")
+        self.writeHFileHeader(viewsHFile, viewsFileName)
+        self.writeViewsHeader(viewsHFile)
+        for message in messages:
+            writeViews(message, viewsHFile)
+        self.writeHFileTrailer(viewsHFile, viewsFileName)
+        viewsHFile.close()
+
+        batchHFile = open(os.path.join(self.inclDir, batchFileName + ".h"), "w")
+        self.writeHFileHeader(batchHFile, batchFileName)
+        writeBatchHeader(messages, batchHFile)
+        self.writeHFileTrailer(batchHFile, batchFileName)
+        batchHFile.close()
+
+        encodedFileName = "freespace_encoded"
+        encodedHFile = open(os.path.join(self.inclDir, encodedFileName + ".h"), "w")
+        self.writeHFileHeader(encodedHFile, encodedFileName)
+        writeEncodedHeader(messages, encodedHFile)
+        self.writeHFileTrailer(encodedHFile, encodedFileName)
+        encodedHFile.close()
+
+        cppHFile = open(os.path.join(self.inclDir, "freespace_messages.hpp"), "w")
+        writeCppHeader(messages, cppHFile, self.synthesized)
+        cppHFile.close()
+
+        batchCFile = open(os.path.join(self.srcDir, batchFileName + ".c"), "w")
+        self.writeCFileHeader(batchCFile, batchFileName)
+        writeBatchBody(messages, batchCFile)
+        batchCFile.close()
             
         self.writeHFileTrailer(codecsHFile, codecsFileName)
         self.writeHFileTrailer(printersHFile, printersFileName)
@@ -122,62 +168,40 @@ class MessageCodeGenerator:
         printersHFile.close()
         printersCFile.close()
     
-    def writeBitHelper(self, outHeader):
+    def writeBitHelper(self, outHeader, code):
         outHeader.write('''
-static uint32_t toUint32(const uint8_t * a) {
-#ifdef FREESPACE_LITTLE_ENDIAN
-    return ((((uint32_t) a[3])) << 24) | ((((uint32_t) a[2])) << 16) | ((((uint32_t) a[1])) << 8) | (uint32_t) a[0];
-#else
-    return ((((uint32_t) a[0])) << 24) | ((((uint32_t) a[1])) << 16) | ((((uint32_t) a[2])) << 8) | (uint32_t) a[3];
-#endif
-}
-
-static uint16_t toUint16(const uint8_t * a) {
-#ifdef FREESPACE_LITTLE_ENDIAN
-    return ((((uint16_t) a[1])) << 8) | (uint16_t) a[0];
-#else
-    return ((((uint16_t) a[0])) << 8) | (uint16_t) a[1];
-#endif
-}
-
-static uint8_t toUint8(const uint8_t * a) {
-    return (uint8_t) *a;
-}
-
-static int32_t toInt32(const uint8_t * a) {
-#ifdef FREESPACE_LITTLE_ENDIAN
-    return (int32_t) (((((int32_t) a[3])) << 24) | ((((uint32_t) a[2])) << 16) | ((((uint32_t) a[1])) << 8) | (uint32_t) a[0]);
+// Reports are little endian. The fields are copied with memcpy, which
+// compilers turn into a single unaligned load or store, and byte swapped
+// on big endian hosts.
+#ifndef FREESPACE_LITTLE_ENDIAN
+#if defined(__GNUC__)
+#define CODECS_SWAP16(x) __builtin_bswap16(x)
+#define CODECS_SWAP32(x) __builtin_bswap32(x)
 #else
-    return (int32_t) (((((int32_t) a[0])) << 24) | ((((uint32_t) a[1])) << 16) | ((((uint32_t) a[2])) << 8) | (uint32_t) a[3]);
+#define CODECS_SWAP16(x) ((uint16_t) (((x) >> 8) | ((x) << 8)))
+#define CODECS_SWAP32(x) (((x) >> 24) | (((x) >> 8) & 0xff00) | (((x) << 8) & 0xff0000) | ((x) << 24))
 #endif
-}
-
-static int16_t toInt16(const uint8_t * a) {
-#ifdef FREESPACE_LITTLE_ENDIAN
-    return (((int16_t) a[1]) << 8) | a[0];
-#else
-    return (((int16_t) a[0]) << 8) | a[1];
 #endif
-}
-
-static int8_t toInt8(const uint8_t * a) {
-    return (int8_t) *a;
-}
-
-static uint8_t getBit(uint8_t a, uint16_t whichBit) {
-    return (uint8_t) (a >> whichBit) & 0x01;
-}
-
-static uint8_t getNibble(uint8_t a, uint16_t whichNibble) {
-    return (uint8_t) (a >> (whichNibble*4)) & 0x0F;
-}
-
-static uint8_t byteFromNibbles(uint8_t lsn, uint8_t msn) {
-    return lsn | (msn << 4);
-}
-
 
 ''')
+        # Only the helpers that the codecs call are written, since the
+        # codec mode, the messages and the host's byte order each leave
+        # some of them unused. Those called only on big endian hosts are
+        # only compiled there.
+        common, bigEndian = splitByteOrderCode(code)
+        emitted = {}
+        for name, definition in reversed(BIT_HELPERS):
+            call = name + "("
+            if call in common:
+                emitted[name] = definition
+                common += definition
+            elif call in bigEndian:
+                emitted[name] = "#ifndef FREESPACE_LITTLE_ENDIAN\n" + definition + "#endif\n"
+                bigEndian += definition
+        for name, definition in BIT_HELPERS:
+            if name in emitted:
+                outHeader.write(emitted[name] + "\n")
+        outHeader.write("\n")
 
     def writeHFileHeader(self, outHeader, name):
         # Print the struct, and define the message functions
@@ -202,49 +226,407 @@ static uint8_t byteFromNibbles(uint8_t lsn, uint8_t msn) {
 #include <string.h>
 '''%name)
         
-    def writePrintMessageBody(self, messages, outFile):
-        outFile.write('''
-static void printUnknown(const char* name, const uint8_t* buffer, int length) {
+    def writePrintFormatter(self, outFile):
+        outFile.write('''#include <stddef.h>
+
+// The printers format straight into the caller's buffer instead of
+// going through snprintf. Each message has a table of its fields, and
+// one loop formats any message in any of the formats.
+
+enum printType {
+    PRINT_UINT8,
+    PRINT_INT8,
+    PRINT_UINT16,
+    PRINT_INT16,
+    PRINT_UINT32,
+    PRINT_INT32,
+    PRINT_INT
+};
+
+// The names are stored with the separators that come before them in
+// each format, " name=" in text and ",\"name\":" in JSON, so that each
+// takes one copy. The text form drops its space for the first field.
+struct printField {
+    const char* text;
+    const char* json;
+    uint8_t nameLength;
+    uint8_t type;
+    uint8_t count;
+    uint16_t offset;
+};
+
+struct printMessage {
+    const char* name;
+    uint8_t nameLength;
+    uint8_t numFields;
+    uint16_t maxLength; // The longest output in any format, with the terminator
+    const struct printField* fields;
+};
+
+static const char digitPairs[] = "00010203040506070809101112131415161718192021222324252627282930313233343536373839404142434445464748495051525354555657585960616263646566676869707172737475767778798081828384858687888990919293949596979899";
+
+static int countDigits(uint32_t v) {
+    if (v < 10) return 1;
+    if (v < 100) return 2;
+    if (v < 1000) return 3;
+    if (v < 10000) return 4;
+    if (v < 100000) return 5;
+    if (v < 1000000) return 6;
+    if (v < 10000000) return 7;
+    if (v < 100000000) return 8;
+    if (v < 1000000000) return 9;
+    return 10;
+}
+
+// Write the digits from the end, two at a time.
+static char* putUint(char* p, uint32_t v) {
+    char* end = p + countDigits(v);
+    char* t = end;
+
+    while (v >= 100) {
+        int d = (int) (v % 100) * 2;
+        v /= 100;
+        t -= 2;
+        t[0] = digitPairs[d];
+        t[1] = digitPairs[d + 1];
+    }
+    if (v >= 10) {
+        t[-2] = digitPairs[v * 2];
+        t[-1] = digitPairs[v * 2 + 1];
+    } else {
+        t[-1] = (char) ('0' + v);
+    }
+    return end;
+}
+
+// Names are short, and a plain loop copies them faster than a call to
+// memcpy with a variable length.
+static char* putName(char* p, const char* name, int length) {
+    while (length-- > 0) {
+        *p++ = *name++;
+    }
+    return p;
+}
+
+static char* putInt(char* p, int32_t v) {
+    if (v < 0) {
+        *p++ = '-';
+        return putUint(p, 0u - (uint32_t) v);
+    }
+    return putUint(p, (uint32_t) v);
+}
+
+static char* putValue(char* p, const struct printField* f, const uint8_t* body, int i) {
+    const uint8_t* v = body + f->offset;
+    switch (f->type) {
+        case PRINT_UINT8:
+            return putUint(p, ((const uint8_t*) v)[i]);
+        case PRINT_INT8:
+            return putInt(p, ((const int8_t*) v)[i]);
+        case PRINT_UINT16:
+            return putUint(p, ((const uint16_t*) v)[i]);
+        case PRINT_INT16:
+            return putInt(p, ((const int16_t*) v)[i]);
+        case PRINT_UINT32:
+            return putUint(p, ((const uint32_t*) v)[i]);
+        case PRINT_INT32:
+            return putInt(p, ((const int32_t*) v)[i]);
+        default:
+            return putInt(p, ((const int*) v)[i]);
+    }
+}
+
+static char* putText(char* p, const struct printMessage* pm, const uint8_t* body) {
+    int i;
+    int j;
+
+    p = putName(p, pm->name, pm->nameLength);
+    *p++ = '(';
+    for (i = 0; i < pm->numFields; i++) {
+        const struct printField* f = &pm->fields[i];
+        int skip = (i == 0);
+        p = putName(p, f->text + skip, f->nameLength + 2 - skip);
+        if (f->count == 1) {
+            p = putValue(p, f, body, 0);
+            continue;
+        }
+        *p++ = '[';
+        for (j = 0; j < f->count; j++) {
+            if (j > 0) {
+                *p++ = ' ';
+            }
+            p = putValue(p, f, body, j);
+        }
+        *p++ = ']';
+    }
+    *p++ = ')';
+    return p;
+}
+
+static char* putJson(char* p, const struct printMessage* pm, const uint8_t* body) {
+    int i;
+    int j;
+
+    memcpy(p, "{\\"message\\":\\"", 12);
+    p += 12;
+    p = putName(p, pm->name, pm->nameLength);
+    *p++ = '"';
+    for (i = 0; i < pm->numFields; i++) {
+        const struct printField* f = &pm->fields[i];
+        p = putName(p, f->json, f->nameLength + 4);
+        if (f->count == 1) {
+            p = putValue(p, f, body, 0);
+            continue;
+        }
+        *p++ = '[';
+        for (j = 0; j < f->count; j++) {
+            if (j > 0) {
+                *p++ = ',';
+            }
+            p = putValue(p, f, body, j);
+        }
+        *p++ = ']';
+    }
+    *p++ = '}';
+    return p;
+}
+
+static char* putCsv(char* p, const struct printMessage* pm, const uint8_t* body) {
+    int i;
+    int j;
+
+    p = putName(p, pm->name, pm->nameLength);
+    for (i = 0; i < pm->numFields; i++) {
+        const struct printField* f = &pm->fields[i];
+        for (j = 0; j < f->count; j++) {
+            *p++ = ',';
+            p = putValue(p, f, body, j);
+        }
+    }
+    return p;
+}
+
+static char* putCsvHeader(char* p, const struct printMessage* pm) {
     int i;
-    printf("%s(", name);
-    for (i = 0; i < length; ++i) {
-        printf("%02x ", (uint8_t) buffer[i]);
+    int j;
+
+    memcpy(p, "message", 7);
+    p += 7;
+    for (i = 0; i < pm->numFields; i++) {
+        const struct printField* f = &pm->fields[i];
+        for (j = 0; j < f->count; j++) {
+            *p++ = ',';
+            p = putName(p, f->text + 1, f->nameLength);
+            if (f->count > 1) {
+                p = putUint(p, j);
+            }
+        }
+    }
+    return p;
+}
+
+// Format a message struct. When dest is big enough for the longest
+// possible output, format straight into it. Otherwise format into a
+// local buffer and copy the result if it fits.
+static int formatStruct(char* dest, int maxlen, const struct printMessage* pm, const void* s, int format) {
+    char tmp[FREESPACE_PRINT_MAX_LENGTH];
+    char* start = (dest != NULL && maxlen >= pm->maxLength) ? dest : tmp;
+    char* p;
+    int n;
+
+    if (s == NULL) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    switch (format) {
+        case FREESPACE_PRINT_TEXT:
+            p = putText(start, pm, (const uint8_t*) s);
+            break;
+        case FREESPACE_PRINT_JSON:
+            p = putJson(start, pm, (const uint8_t*) s);
+            break;
+        case FREESPACE_PRINT_CSV:
+            p = putCsv(start, pm, (const uint8_t*) s);
+            break;
+        case FREESPACE_PRINT_CSV_HEADER:
+            p = putCsvHeader(start, pm);
+            break;
+        default:
+            return FREESPACE_ERROR_UNEXPECTED;
+    }
+    *p = '\\0';
+    n = (int) (p - start);
+    if (start == tmp) {
+        if (dest == NULL || n >= maxlen) {
+            return FREESPACE_ERROR_BUFFER_TOO_SMALL;
+        }
+        memcpy(dest, tmp, n + 1);
     }
-    printf(")\\n");
+    return n;
 }
+''')
 
-int freespace_printMessageStr(char* dest, int maxlen, const struct freespace_message* s) {
-    switch(s->messageType) {''')
+    def writePrintMessageBody(self, messages, outFile):
+        outFile.write('''
+static const struct printMessage* const printMessages[] = {''')
         for message in messages:
-            #if (not message.decode):
-            #    continue
             outFile.write('''
-    case %(enumName)s:
-        return freespace_print%(messageName)sStr(dest, maxlen, &(s->%(structName)s));
-        break;'''%{'enumName':message.enumName, 
-                   'messageName':message.name, 
-                   'structName':message.structName})
+    &print%s,''' % message.name)
         outFile.write('''
-    default:
+};
+
+// All of the message structs are members of the same union, so any
+// member gives the start of the message struct.
+#define MESSAGE_BODY(s) ((const void*) &(s)->%(structName)s)
+%(printBody)s
+LIBFREESPACE_API int freespace_formatMessage(char* dest, int maxlen, const struct freespace_message* s, enum freespace_printFormat format) {%(copy)s
+    if (s == NULL || s->messageType < 0 || s->messageType >= (int) (sizeof(printMessages) / sizeof(printMessages[0]))) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    return formatStruct(dest, maxlen, printMessages[s->messageType], %(body)s, format);
+}
+
+LIBFREESPACE_API const char* freespace_messageName(int messageType) {
+    if (messageType < 0 || messageType >= (int) (sizeof(printMessages) / sizeof(printMessages[0]))) {
+        return NULL;
+    }
+    return printMessages[messageType]->name;
+}
+
+LIBFREESPACE_API int freespace_formatCsvHeader(char* dest, int maxlen, int messageType) {
+    if (messageType < 0 || messageType >= (int) (sizeof(printMessages) / sizeof(printMessages[0]))) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    return formatStruct(dest, maxlen, printMessages[messageType], printMessages, FREESPACE_PRINT_CSV_HEADER);
+}
+
+int freespace_printMessageStr(char* dest, int maxlen, const struct freespace_message* s) {%(copy)s
+    if (s == NULL || s->messageType < 0 || s->messageType >= (int) (sizeof(printMessages) / sizeof(printMessages[0]))) {
         return -1;
     }
+    return formatStruct(dest, maxlen, printMessages[s->messageType], %(body)s, FREESPACE_PRINT_TEXT);
 }
 
-void freespace_printMessage(FILE* fp, const struct freespace_message * s) {
-    char buf[1024];
-    int rc = freespace_printMessageStr(buf, sizeof(buf), s);
-    
+LIBFREESPACE_API int freespace_writeMessage(FILE* fp, const struct freespace_message* s, enum freespace_printFormat format) {
+    char buf[FREESPACE_PRINT_MAX_LENGTH + 1];
+    int rc = freespace_formatMessage(buf, FREESPACE_PRINT_MAX_LENGTH, s, format);
+
     if (rc < 0) {
+        return rc;
+    }
+    buf[rc++] = '\\n';
+    if (fwrite(buf, 1, rc, fp) != (size_t) rc) {
+        return FREESPACE_ERROR_IO;
+    }
+    return rc;
+}
+
+void freespace_printMessage(FILE* fp, const struct freespace_message * s) {
+    if (freespace_writeMessage(fp, s, FREESPACE_PRINT_TEXT) < 0) {
         fprintf(fp, "invalid messages\\n");
-        return;
     }
-    fprintf(fp, "%s\\n", buf);
+}
+
+''' % self.printBodyCode(messages))
+        if self.test:
+            self.writeSnprintfPrintBody(messages, outFile)
+
+    # With lazy synthesized fields the decoders leave those fields unset,
+    # so the messages that have them are printed from a copy filled in by
+    # their getters.
+    def printBodyCode(self, messages):
+        d = {'structName': messages[0].structName, 'printBody': '',
+             'copy': '', 'body': 'MESSAGE_BODY(s)'}
+        lazy = [message for message in messages if message.decode and len(synthesizedFields(message)) > 0]
+        if self.synthesized != "lazy" or len(lazy) == 0:
+            return d
+        code = '''
+// The body to print: the message itself, or a copy with its synthesized
+// fields filled in from the getters.
+static const void* printBody(const struct freespace_message* s, struct freespace_message* copy) {
+    switch (s->messageType) {
+'''
+        for message in lazy:
+            code += '''    case %(enumName)s:
+        copy->%(structName)s = s->%(structName)s;
+''' % {'enumName': message.enumName, 'structName': message.structName}
+            for name in synthesizedFields(message):
+                code += "        copy->%(structName)s.%(field)s = freespace_%(name)s_%(field)s(&s->%(structName)s, s->ver);\n" % {
+                    'structName': message.structName, 'field': name, 'name': message.name}
+            code += "        return &copy->%s;\n" % message.structName
+        code += '''    default:
+        return MESSAGE_BODY(s);
+    }
+}
+'''
+        d['printBody'] = code
+        d['copy'] = "\n    struct freespace_message copy;\n"
+        d['body'] = 'printBody(s, &copy)'
+        return d
+
+    # The printers as they were before the shared formatter: one snprintf
+    # call per message, printing the scalar fields with %d.
+    def writeSnprintfPrintBody(self, messages, outFile):
+        for message in messages:
+            fields = [field for field in extractFields(message) if field['count'] == 1]
+            synthesized = synthesizedFields(message)
+            args = []
+            for field in fields:
+                if field['name'] in synthesized:
+                    args.append(", (int) freespace_%s_%s(s, ver)" % (message.name, field['name']))
+                else:
+                    args.append(", (int) s->%s" % field['name'])
+            outFile.write('''static int printSnprintf%(name)s(char* dest, int maxlen, const struct freespace_%(name)s* s%(ver)s) {
+    int n;
+%(unused)s#ifdef _WIN32
+    n = sprintf_s(dest, maxlen, "%(name)s(%(format)s)"%(args)s);
+#else
+    n = snprintf(dest, maxlen, "%(name)s(%(format)s)"%(args)s);
+#endif
+    if (n < 0) {
+        return FREESPACE_ERROR_BUFFER_TOO_SMALL;
+    }
+    return n;
+}
+
+''' % {'name': message.name,
+       'format': " ".join(["%s=%%d" % field['name'] for field in fields]),
+       'args': "".join(args),
+       'ver': ", uint8_t ver" if len(synthesized) > 0 else "",
+       'unused': "    (void) s;\n" if len(fields) == 0 else ""})
+        outFile.write('''LIBFREESPACE_API int freespace_printMessageSnprintf(char* dest, int maxlen, const struct freespace_message* s) {
+    switch (s->messageType) {''')
+        for message in messages:
+            outFile.write('''
+    case %(enumName)s:
+        return printSnprintf%(name)s(dest, maxlen, &s->%(structName)s%(ver)s);''' %
+                          {'enumName': message.enumName, 'name': message.name, 'structName': message.structName,
+                           'ver': ", s->ver" if len(synthesizedFields(message)) > 0 else ""})
+        outFile.write('''
+    default:
+        return -1;
+    }
 }
 
 ''')
     
-    def writePrintMessageHeader(self, outFile):
+    def writePrintMessageHeader(self, outFile, messages):
         outFile.write('''
+/**
+ * Output formats for freespace_formatMessage().
+ */
+enum freespace_printFormat {
+    FREESPACE_PRINT_TEXT,      /**< Name(field=value field=[value value]) */
+    FREESPACE_PRINT_JSON,      /**< {"message":"Name","field":value,"field":[value,value]} */
+    FREESPACE_PRINT_CSV,       /**< Name,value,value,value */
+    FREESPACE_PRINT_CSV_HEADER /**< message,field,field0,field1: the columns of FREESPACE_PRINT_CSV */
+};
+
+/**
+ * A buffer of this many characters holds any formatted message, in any
+ * format, with its terminator.
+ */
+#define FREESPACE_PRINT_MAX_LENGTH %d
+
 /**
  * Pretty print a Freespace message to the terminal.
  *
@@ -263,8 +645,89 @@ LIBFREESPACE_API void freespace_printMessage(FILE* fp, const struct freespace_me
  */
 LIBFREESPACE_API int freespace_printMessageStr(char* dest, int maxlen, const struct freespace_message* s);
 
+/**
+ * Format a message as one line of text, JSON or CSV. No newline is
+ * added. Numbers are always formatted the same way, whatever the locale.
+ *
+ * @param dest the destination string
+ * @param maxlen the length of the passed in string
+ * @param s the message to format
+ * @param format the output format
+ * @return the number of characters formatted, not counting the terminator, or an error
+ */
+LIBFREESPACE_API int freespace_formatMessage(char* dest, int maxlen, const struct freespace_message* s, enum freespace_printFormat format);
+
+/**
+ * Get the name of a message type.
+ *
+ * @param messageType the message type, from enum MessageTypes
+ * @return the name, or NULL if the message type is unknown
+ */
+LIBFREESPACE_API const char* freespace_messageName(int messageType);
+
+/**
+ * Format the CSV column names for a message type, matching the
+ * FREESPACE_PRINT_CSV lines of that type.
+ *
+ * @param dest the destination string
+ * @param maxlen the length of the passed in string
+ * @param messageType the message type, from enum MessageTypes
+ * @return the number of characters formatted, not counting the terminator, or an error
+ */
+LIBFREESPACE_API int freespace_formatCsvHeader(char* dest, int maxlen, int messageType);
+
+/**
+ * Write a message to a file as one line of text, JSON or CSV.
+ *
+ * @param fp the file pointer to write to
+ * @param s the message to write
+ * @param format the output format
+ * @return the number of characters written, or an error
+ */
+LIBFREESPACE_API int freespace_writeMessage(FILE* fp, const struct freespace_message* s, enum freespace_printFormat format);
+
+''' % max([printMaxLength(message) for message in messages]))
+        if self.test:
+            outFile.write('''/**
+ * Print a message the way freespace_printMessageStr() once did, with one
+ * snprintf call that leaves out array fields. Only generated in test
+ * mode, as a baseline for freespace_bench.
+ *
+ * @param dest the destination string
+ * @param maxlen the length of the passed in string
+ * @param s the struct to print
+ * @return the number of characters printed, or an error
+ */
+LIBFREESPACE_API int freespace_printMessageSnprintf(char* dest, int maxlen, const struct freespace_message* s);
+
 ''')
     
+    def writeViewsHeader(self, outFile):
+        outFile.write('''/**
+ * @defgroup views Message Views
+ *
+ * Inline accessors that read one field straight out of a raw report,
+ * without decoding the whole message into a freespace_message. There
+ * is one accessor per field for each HID protocol version of each
+ * received message:
+ *
+ *     freespace_view_<message>_v<version>_<field>(report)
+ *     freespace_view_<message>_v<version>_<field>(report, index)   (array fields)
+ *
+ * The accessors don't check the report, so first call
+ * freespace_view_<message>_v<version>_matches(report, length) unless
+ * the report type is already known. Synthesized fields such as
+ * angularPosA have no accessor.
+ */
+
+#if defined(_MSC_VER) && !defined(__cplusplus)
+#define FREESPACE_VIEW_INLINE static __inline
+#else
+#define FREESPACE_VIEW_INLINE static inline
+#endif
+
+''')
+
     def writeDoxygenModuleDef(self, outFile):
         outFile.write('''
 /**
@@ -311,8 +774,25 @@ struct freespace_message {
     };
 };
 
+/** @ingroup messages
+ * How carefully freespace_decode_message() checks a report.
+ */
+enum freespace_validation {
+    /** Check the report ID and that the report is long enough once, while
+     * choosing the decoder, and skip the decoder's own checks. */
+    FREESPACE_VALIDATION_TRUSTED,
+    /** Check the report ID and that the report is long enough in both
+     * the dispatch and the decoder. This is the default. */
+    FREESPACE_VALIDATION_DEFAULT,
+    /** Also require the exact report length and that reserved bits are
+     * zero. Meant for fuzzing and diagnosing devices, since reports
+     * from newer firmware may use bits that are reserved here. */
+    FREESPACE_VALIDATION_STRICT
+};
+
 /** @ingroup messages
  * Decode an arbitrary message. Fill out the corresponding values in struct s.
+ * The report is checked at the level set by freespace_setDecodeValidation().
  *
  * @param message the message to decode that was received from the Freespace device
  * @param length the length of the received message
@@ -322,6 +802,36 @@ struct freespace_message {
  */
 LIBFREESPACE_API int freespace_decode_message(const uint8_t* message, int length, struct freespace_message* s, uint8_t ver);
 
+/** @ingroup messages
+ * Decode an arbitrary message, checking it at a given level.
+ *
+ * @param message the message to decode that was received from the Freespace device
+ * @param length the length of the received message
+ * @param s the preallocated freespace_message struct to decode into
+ * @param ver the HID protocol version to use to decode the message
+ * @param validation one of the freespace_validation levels
+ * @return FREESPACE_SUCESS, FREESPACE_ERROR_MALFORMED_MESSAGE if a strict
+ *         check fails, or another error code
+ */
+LIBFREESPACE_API int freespace_decode_messageValidated(const uint8_t* message, int length, struct freespace_message* s, uint8_t ver, int validation);
+
+/** @ingroup messages
+ * Set the validation level used by freespace_decode_message(), and so
+ * by the messages passed to receive callbacks. The level is shared by
+ * the whole process, so set it before opening devices.
+ *
+ * @param validation one of the freespace_validation levels
+ * @return FREESPACE_SUCCESS or FREESPACE_ERROR_UNEXPECTED for an unknown level
+ */
+LIBFREESPACE_API int freespace_setDecodeValidation(int validation);
+
+/** @ingroup messages
+ * Get the validation level used by freespace_decode_message().
+ *
+ * @return one of the freespace_validation levels
+ */
+LIBFREESPACE_API int freespace_getDecodeValidation(void);
+
 /** @ingroup messages
  * Encode an arbitrary message.
  *
@@ -332,62 +842,463 @@ LIBFREESPACE_API int freespace_decode_message(const uint8_t* message, int length
  */
 LIBFREESPACE_API int freespace_encode_message(struct freespace_message* message, uint8_t* msgBuf, int maxLength);
 
-''')
+/** @ingroup messages
+ * The header of a decoded message stored by freespace_decode_compact().
+ * The message struct follows immediately after the header, and
+ * FREESPACE_COMPACT_BODY() gives a pointer to it.
+ */
+struct freespace_compactMessage {
+    uint16_t messageType;
+    uint8_t ver;   /**< HID protocol version */
+    uint8_t len;   /**< Length, used in version 2 only */
+    uint8_t dest;  /**< Destination, used in version 2 only */
+    uint8_t src;   /**< Source, used in version 2 only */
+    uint16_t size; /**< The size of the message struct after the header */
+};
 
-    def writeUnionDecodeEncodeBodies(self, file, messages):
-        file.write('''
-LIBFREESPACE_API int freespace_decode_message(const uint8_t* message, int length, struct freespace_message* s, uint8_t ver) {
-    if (length == 0) {
-        return -1;
-    }
+/** @ingroup messages
+ * Get the message struct of a freespace_compactMessage. name is the
+ * message name, as in FREESPACE_COMPACT_BODY(c, DceOutV3).
+ */
+#define FREESPACE_COMPACT_BODY(c, name) ((struct freespace_ ## name*) ((struct freespace_compactMessage*) (c) + 1))
 
-    switch (ver) {\n''')
-        subIdMap = [1, 1, 4] # A lookup table that tells where in the message to find the sub ID. The HID version is the index to the table.
-        for v in range(3):
-            usedIDs = []
-            file.write("\t\tcase %d:\n" % v)
-            file.write("\t\t\tswitch(message[0]) {\n")
-            for message in messages:
-                if (not message.decode) or len(message.ID[v]) == 0:
-                    continue
-                if message.ID[v]['constID'] in usedIDs:
-                    continue
-                file.write("\t\t\t\tcase %d:"%message.ID[v]['constID'])
-                if message.ID[v].has_key('subId'):
-                    file.write('''
-                    switch (message[%d]) {''' % subIdMap[v])
-                    for subMessage in messages:
-                        if (not subMessage.decode) or len(subMessage.ID[v]) == 0:
-                            continue
-                        if subMessage.ID[v]['constID'] == message.ID[v]['constID']:
-                            file.write('''
-                        case %(subId)d:
-                            s->messageType = %(messageType)s;
-                            return freespace_decode%(subName)s(message, length, s, ver);'''
-                            %{'subId':subMessage.ID[v]['subId']['id'],
-                           'subName':subMessage.name,
-                           'messageType':subMessage.enumName})                
-            
-                    file.write('''
-                        default:
-                            return FREESPACE_ERROR_MALFORMED_MESSAGE;
-                    }\n''')
-                else:
-                    file.write('''
-                    s->messageType = %(messageType)s;
-                    return freespace_decode%(name)s(message, length, s, ver);
-'''%{'messageType':message.enumName,
-                     'name':message.name})
-                    
-                usedIDs.append(message.ID[v]['constID'])
-            file.write('''                default:
-                    return FREESPACE_ERROR_MALFORMED_MESSAGE;
-            }\n''')
+/** @ingroup messages
+ * Size classes for storing decoded messages in queues. Each class has
+ * a matching element type that holds any message whose struct fits,
+ * so a queue can keep one array per class rather than using struct
+ * freespace_message for everything.
+ */
+enum freespace_sizeClass {
+    FREESPACE_SIZE_CLASS_8,     /**< struct freespace_compactMessage8 */
+    FREESPACE_SIZE_CLASS_24,    /**< struct freespace_compactMessage24 */
+    FREESPACE_SIZE_CLASS_40,    /**< struct freespace_compactMessage40 */
+    FREESPACE_SIZE_CLASS_LARGE  /**< struct freespace_compactMessageLarge */
+};
+
+/** @ingroup messages
+ * Queue element for messages with a struct of up to 8 bytes.
+ */
+struct freespace_compactMessage8 {
+    struct freespace_compactMessage header;
+    union {
+        uint32_t align;
+        uint8_t bytes[8];
+    } body;
+};
+
+/** @ingroup messages
+ * Queue element for messages with a struct of up to 24 bytes.
+ */
+struct freespace_compactMessage24 {
+    struct freespace_compactMessage header;
+    union {
+        uint32_t align;
+        uint8_t bytes[24];
+    } body;
+};
+
+/** @ingroup messages
+ * Queue element for messages with a struct of up to 40 bytes.
+ */
+struct freespace_compactMessage40 {
+    struct freespace_compactMessage header;
+    union {
+        uint32_t align;
+        uint8_t bytes[40];
+    } body;
+};
+
+/** @ingroup messages
+ * Queue element that holds any message.
+ */
+struct freespace_compactMessageLarge {
+    struct freespace_compactMessage header;
+    union {''')
+        for message in messages:
+            file.write("\n\t\tstruct freespace_%(name)s %(varName)s;"%{'name':message.name, 'varName':message.structName})
         file.write('''
-    default:
-        return FREESPACE_ERROR_INVALID_HID_PROTOCOL_VERSION;
-    }
-}
+    } body;
+};
+
+/** @ingroup messages
+ * Get the size of a message struct.
+ *
+ * @param messageType the message type, from enum MessageTypes
+ * @return the size in bytes, or FREESPACE_ERROR_UNEXPECTED for an unknown type
+ */
+LIBFREESPACE_API int freespace_messageStructSize(int messageType);
+
+/** @ingroup messages
+ * Get the smallest size class that holds a message type.
+ *
+ * @param messageType the message type, from enum MessageTypes
+ * @return an enum freespace_sizeClass value, or FREESPACE_ERROR_UNEXPECTED for an unknown type
+ */
+LIBFREESPACE_API int freespace_messageSizeClass(int messageType);
+
+/** @ingroup messages
+ * Decode an arbitrary message into a header followed by only the
+ * message struct, rather than a whole freespace_message. The struct is
+ * zeroed before decoding, so out doesn't need to be cleared first.
+ * The message type can be found with freespace_decode_messageType() to
+ * pick a size class before decoding.
+ *
+ * @param message the message to decode that was received from the Freespace device
+ * @param length the length of the received message
+ * @param out where to store the decoded message. Use one of the
+ *            freespace_compactMessage element types, or other storage
+ *            aligned to 4 bytes.
+ * @param capacity the number of bytes available at out
+ * @param ver the HID protocol version to use to decode the message
+ * @return the number of bytes used at out, or an error code
+ */
+LIBFREESPACE_API int freespace_decode_compact(const uint8_t* message, int length, struct freespace_compactMessage* out, int capacity, uint8_t ver);
+
+/** @ingroup messages
+ * Find the type of a received message without decoding it.
+ *
+ * @param message the message received from the Freespace device
+ * @param length the length of the received message
+ * @param ver the HID protocol version of the message
+ * @return the message type from enum MessageTypes, or an error code
+ */
+LIBFREESPACE_API int freespace_decode_messageType(const uint8_t* message, int length, uint8_t ver);
+
+''')
+        if self.test:
+            file.write('''/** @ingroup messages
+ * Decode an arbitrary message, dispatching through nested switches on
+ * the version, report ID and sub ID the way freespace_decode_message()
+ * once did. Only generated in test mode, as a baseline for freespace_bench.
+ */
+LIBFREESPACE_API int freespace_decode_messageBySwitch(const uint8_t* message, int length, struct freespace_message* s, uint8_t ver);
+
+/** @ingroup messages
+ * Decode every bit and nibble field of every message with each of the
+ * 256 values of its byte, and compare the members with a shift and mask
+ * of the byte. Only generated in test mode, to check the decoders'
+ * shortcuts such as expandBits().
+ *
+ * @return the number of mismatches, each also printed to stdout
+ */
+LIBFREESPACE_API int freespace_checkBitDecoders(void);
+
+''')
+
+    def writeUnionDecodeEncodeBodies(self, file, messages):
+        # Decoding dispatches through per-version tables indexed by the
+        # report ID. Report IDs shared by several messages point at a
+        # second table indexed by the sub ID. Entries hold the message
+        # type + 1, so 0 means no decoder.
+        subIdMap = [1, 1, 4] # A lookup table that tells where in the message to find the sub ID. The HID version is the index to the table.
+        if len(messages) + 1 < 0x80:
+            entryType = "uint8_t"
+            subTableFlag = 0x80
+        else:
+            entryType = "uint16_t"
+            subTableFlag = 0x8000
+        reportTables = []
+        subTables = []
+        for v in range(3):
+            table = [0] * 256
+            for index, message in enumerate(messages):
+                if (not message.decode) or len(message.ID[v]) == 0:
+                    continue
+                constID = message.ID[v]['constID']
+                if message.ID[v].has_key('subId'):
+                    if table[constID] == 0:
+                        subTables.append([0] * 256)
+                        table[constID] = subTableFlag | (len(subTables) - 1)
+                    subTables[table[constID] & ~subTableFlag][message.ID[v]['subId']['id']] = index + 1
+                elif table[constID] == 0:
+                    table[constID] = index + 1
+            reportTables.append(table)
+
+        def writeTable(values):
+            for row in range(0, 256, 16):
+                file.write("        " + ", ".join(["0x%02x" % x for x in values[row:row + 16]]) + ",\n")
+
+        file.write('''
+#define DECODE_SUBTABLE 0x%x
+
+static const uint8_t decodeSubIdOffset[3] = {%s};
+
+// Indexed by HID protocol version and then report ID.
+static const %s decodeReportTable[3][256] = {
+''' % (subTableFlag, ", ".join([str(x) for x in subIdMap]), entryType))
+        for v in range(3):
+            file.write("    { // Version %d\n" % v)
+            writeTable(reportTables[v])
+            file.write("    },\n")
+        file.write('''};
+
+// Indexed by the DECODE_SUBTABLE entry and then sub ID.
+static const %s decodeSubIdTable[%d][256] = {
+''' % (entryType, max(len(subTables), 1)))
+        if len(subTables) == 0:
+            subTables.append([0] * 256)
+        for table in subTables:
+            file.write("    {\n")
+            writeTable(table)
+            file.write("    },\n")
+        file.write('''};
+
+typedef int (*freespace_decoder)(const uint8_t* message, int length, struct freespace_message* s, uint8_t ver);
+
+// Indexed by message type.
+static const freespace_decoder decoders[] = {
+''')
+        for message in messages:
+            if message.decode:
+                file.write("    freespace_decode%s,\n" % message.name)
+            else:
+                file.write("    NULL,\n")
+        file.write('''};
+
+// Indexed by message type. These skip the report ID and length checks.
+static const freespace_decoder trustedDecoders[] = {
+''')
+        for message in messages:
+            if message.decode:
+                file.write("    decode%sTrusted,\n" % message.name)
+            else:
+                file.write("    NULL,\n")
+        file.write('''};
+
+struct DecodeLimits {
+    uint8_t size;           // The length of the report
+    uint8_t reservedCount;  // The number of entries in reservedBits
+    uint16_t reservedFirst; // The first entry in reservedBits
+};
+
+struct ReservedBits {
+    uint8_t byte; // Offset from the start of the payload
+    uint8_t mask; // The bits that must be zero
+};
+
+// Indexed by message type and then HID protocol version.
+static const struct DecodeLimits decodeLimits[][3] = {
+''')
+        reserved = []
+        for message in messages:
+            items = []
+            for v in range(3):
+                if len(message.ID[v]) == 0:
+                    items.append('{0, 0, 0}')
+                    continue
+                bits = reservedBits(message, v)
+                if message.getMessageSize(v) > 0xff or len(reserved) + len(bits) > 0xffff:
+                    raise Exception("%s is too large for the decode limits table" % message.name)
+                items.append('{%d, %d, %d}' % (message.getMessageSize(v), len(bits), len(reserved)))
+                reserved.extend(bits)
+            file.write('    /* %s */ {%s},\n' % (message.enumName, ', '.join(items)))
+        file.write('''};
+
+static const struct ReservedBits reservedBits[] = {
+''')
+        if len(reserved) == 0:
+            reserved.append((0, 0))
+        for row in range(0, len(reserved), 8):
+            file.write("    " + ", ".join(["{%d, 0x%02x}" % x for x in reserved[row:row + 8]]) + ",\n")
+        file.write('''};
+
+static int decodeValidation = FREESPACE_VALIDATION_DEFAULT;
+
+LIBFREESPACE_API int freespace_setDecodeValidation(int validation) {
+    if (validation < FREESPACE_VALIDATION_TRUSTED || validation > FREESPACE_VALIDATION_STRICT) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    decodeValidation = validation;
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_getDecodeValidation(void) {
+    return decodeValidation;
+}
+
+// The extra checks of FREESPACE_VALIDATION_STRICT.
+static int checkStrict(const uint8_t* message, int length, int type, uint8_t ver) {
+    const struct DecodeLimits* limits = &decodeLimits[type][ver];
+    const struct ReservedBits* r = &reservedBits[limits->reservedFirst];
+    const struct ReservedBits* end = r + limits->reservedCount;
+    const uint8_t* payload = message + (ver == 2 ? 4 : 1);
+
+    if (length < limits->size) {
+        CODECS_PRINTF("Length mismatch for message type %d.  Expected %d.  Got %d.\\n", type, limits->size, length);
+        return FREESPACE_ERROR_BUFFER_TOO_SMALL;
+    }
+    if (length != limits->size || (ver == 2 && message[1] != limits->size)) {
+        CODECS_PRINTF("Length mismatch for message type %d.  Expected %d.  Got %d.\\n", type, limits->size, length);
+        return FREESPACE_ERROR_MALFORMED_MESSAGE;
+    }
+    for (; r < end; r++) {
+        if (payload[r->byte] & r->mask) {
+            CODECS_PRINTF("Reserved bits 0x%02x set in byte %d of message type %d.\\n", payload[r->byte] & r->mask, r->byte, type);
+            return FREESPACE_ERROR_MALFORMED_MESSAGE;
+        }
+    }
+    return FREESPACE_SUCCESS;
+}
+
+LIBFREESPACE_API int freespace_decode_messageType(const uint8_t* message, int length, uint8_t ver) {
+    unsigned int entry;
+
+    if (length == 0) {
+        return -1;
+    }
+    if (ver > 2) {
+        return FREESPACE_ERROR_INVALID_HID_PROTOCOL_VERSION;
+    }
+
+    entry = decodeReportTable[ver][message[0]];
+    if (entry & DECODE_SUBTABLE) {
+        if (length <= decodeSubIdOffset[ver]) {
+            return FREESPACE_ERROR_MALFORMED_MESSAGE;
+        }
+        entry = decodeSubIdTable[entry & ~DECODE_SUBTABLE][message[decodeSubIdOffset[ver]]];
+    }
+    if (entry == 0) {
+        return FREESPACE_ERROR_MALFORMED_MESSAGE;
+    }
+    return entry - 1;
+}
+
+// Decodes a report of a known type at any validation level.
+static int decodeAtLevel(const uint8_t* message, int length, struct freespace_message* s, uint8_t ver, int type, int validation) {
+    int rc;
+
+    switch (validation) {
+        case FREESPACE_VALIDATION_TRUSTED:
+            // The report ID was matched above, so the length is the only
+            // check the decoder still needs.
+            if (length < decodeLimits[type][ver].size) {
+                return FREESPACE_ERROR_BUFFER_TOO_SMALL;
+            }
+            s->messageType = type;
+            return trustedDecoders[type](message, length, s, ver);
+        case FREESPACE_VALIDATION_DEFAULT:
+            break;
+        case FREESPACE_VALIDATION_STRICT:
+            rc = checkStrict(message, length, type, ver);
+            if (rc != FREESPACE_SUCCESS) {
+                return rc;
+            }
+            break;
+        default:
+            return FREESPACE_ERROR_UNEXPECTED;
+    }
+    s->messageType = type;
+    return decoders[type](message, length, s, ver);
+}
+
+LIBFREESPACE_API int freespace_decode_messageValidated(const uint8_t* message, int length, struct freespace_message* s, uint8_t ver, int validation) {
+    int type = freespace_decode_messageType(message, length, ver);
+
+    if (type < 0) {
+        return type;
+    }
+    return decodeAtLevel(message, length, s, ver, type, validation);
+}
+
+LIBFREESPACE_API int freespace_decode_message(const uint8_t* message, int length, struct freespace_message* s, uint8_t ver) {
+    int type = freespace_decode_messageType(message, length, ver);
+
+    if (type < 0) {
+        return type;
+    }
+    // Every received report comes through here, so the default level
+    // goes straight to the decoder.
+    if (decodeValidation != FREESPACE_VALIDATION_DEFAULT) {
+        return decodeAtLevel(message, length, s, ver, type, decodeValidation);
+    }
+    s->messageType = type;
+    return decoders[type](message, length, s, ver);
+}
+
+typedef int (*freespace_structDecoder)(const uint8_t* message, int length, void* s, uint8_t ver);
+
+#define STRUCT_DECODER(name) \\
+    static int decodeStruct ## name(const uint8_t* message, int length, void* s, uint8_t ver) { \\
+        return freespace_decode ## name ## Struct(message, length, (struct freespace_ ## name*) s, ver); \\
+    }
+''')
+        for message in messages:
+            if message.decode:
+                file.write("STRUCT_DECODER(%s)\n" % message.name)
+        file.write('''
+// Indexed by message type.
+static const freespace_structDecoder structDecoders[] = {
+''')
+        for message in messages:
+            if message.decode:
+                file.write("    decodeStruct%s,\n" % message.name)
+            else:
+                file.write("    NULL,\n")
+        file.write('''};
+
+// Indexed by message type.
+static const uint16_t structSizes[] = {
+''')
+        for message in messages:
+            file.write("    sizeof(struct freespace_%s),\n" % message.name)
+        file.write('''};
+
+static const uint16_t sizeClassLimits[] = {8, 24, 40};
+
+LIBFREESPACE_API int freespace_messageStructSize(int messageType) {
+    if (messageType < 0 || messageType >= (int) (sizeof(structSizes) / sizeof(structSizes[0]))) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    return structSizes[messageType];
+}
+
+LIBFREESPACE_API int freespace_messageSizeClass(int messageType) {
+    int size = freespace_messageStructSize(messageType);
+    int sizeClass;
+
+    if (size < 0) {
+        return size;
+    }
+    for (sizeClass = FREESPACE_SIZE_CLASS_8; sizeClass < FREESPACE_SIZE_CLASS_LARGE; sizeClass++) {
+        if (size <= sizeClassLimits[sizeClass]) {
+            break;
+        }
+    }
+    return sizeClass;
+}
+
+LIBFREESPACE_API int freespace_decode_compact(const uint8_t* message, int length, struct freespace_compactMessage* out, int capacity, uint8_t ver) {
+    int type = freespace_decode_messageType(message, length, ver);
+    int size;
+    int rc;
+
+    if (type < 0) {
+        return type;
+    }
+    size = sizeof(*out) + structSizes[type];
+    if (capacity < size) {
+        return FREESPACE_ERROR_BUFFER_TOO_SMALL;
+    }
+
+    memset(out + 1, 0, structSizes[type]);
+    rc = structDecoders[type](message, length, out + 1, ver);
+    if (rc != FREESPACE_SUCCESS) {
+        return rc;
+    }
+    out->messageType = (uint16_t) type;
+    out->ver = ver;
+    out->size = structSizes[type];
+    if (ver == 2) {
+        out->len = message[1];
+        out->dest = message[2];
+        out->src = message[3];
+    } else {
+        out->len = 0;
+        out->dest = 0;
+        out->src = 0;
+    }
+    return size;
+}
 ''')
         
         file.write('''
@@ -406,15 +1317,276 @@ LIBFREESPACE_API int freespace_encode_message(struct freespace_message* message,
             return -1;
         }
 }''')
+        if self.test:
+            self.writeSwitchDecodeBody(file, messages, subIdMap)
+            self.writeBitDecoderCheck(file, messages)
+
+    def writeBitDecoderCheck(self, file, messages):
+        size = max([message.getMessageSize(v) for message in messages for v in range(3) if len(message.ID[v])])
+        file.write('''
+LIBFREESPACE_API int freespace_checkBitDecoders(void) {
+    uint8_t report[%d];
+    int failures = 0;
+    int value;
+
+    for (value = 0; value < 256; value++) {''' % size)
+        for message in messages:
+            if not message.decode:
+                continue
+            fields = extractFields(message)
+            packed = []
+            if self.packedFlags:
+                packed = packedFlagFields(message, fields)
+            for v in range(3):
+                if len(message.ID[v]) == 0:
+                    continue
+                offset = 4 if v == 2 else 1
+                bitBytes = [(byte, field) for byte, field in fieldBytes(message, v)
+                            if field.has_key('bits') or field.has_key('nibbles')]
+                if len(bitBytes) == 0:
+                    continue
+                checks = []
+                for byte, field in bitBytes:
+                    mask = 0
+                    for name, cType, shift, partMask in bitFieldParts(field):
+                        checks.append("(int) s.%s != ((value >> %d) & 0x%02X)" % (name, shift, partMask))
+                        mask |= partMask << shift
+                    if field['name'] in packed:
+                        checks.append("s.%s != (value & 0x%02X)" % (field['name'], mask))
+                file.write('''
+        {
+            struct freespace_%(name)s s;
+            memset(report, 0, sizeof(report));
+            report[0] = %(id)d;
+''' % {'name': message.name, 'id': message.ID[v]['constID']})
+                if message.ID[v].has_key('subId'):
+                    file.write("            report[%d] = %d;\n" % (offset, message.ID[v]['subId']['id']))
+                for byte, field in bitBytes:
+                    file.write("            report[%d] = (uint8_t) value;\n" % (offset + byte))
+                file.write('''            if (freespace_decode%(name)sStruct(report, %(size)d, &s, %(v)d) != FREESPACE_SUCCESS ||
+                %(checks)s) {
+                printf("bit decode mismatch: %(name)s version %(v)d, byte 0x%%02x\\n", value);
+                failures++;
+            }
+        }''' % {'name': message.name, 'size': message.getMessageSize(v), 'v': v,
+                  'checks': " ||\n                ".join(checks)})
+        file.write('''
+    }
+    return failures;
+}
+''')
+
+    def writeSwitchDecodeBody(self, file, messages, subIdMap):
+        file.write('''
+
+LIBFREESPACE_API int freespace_decode_messageBySwitch(const uint8_t* message, int length, struct freespace_message* s, uint8_t ver) {
+    if (length == 0) {
+        return -1;
+    }
+
+    switch (ver) {
+''')
+        for v in range(3):
+            usedIDs = []
+            file.write("        case %d:\n" % v)
+            file.write("            switch (message[0]) {\n")
+            for message in messages:
+                if (not message.decode) or len(message.ID[v]) == 0:
+                    continue
+                constID = message.ID[v]['constID']
+                if constID in usedIDs:
+                    continue
+                usedIDs.append(constID)
+                file.write("                case %d:\n" % constID)
+                if message.ID[v].has_key('subId'):
+                    file.write("                    if (length <= %d) {\n" % subIdMap[v])
+                    file.write("                        return FREESPACE_ERROR_MALFORMED_MESSAGE;\n")
+                    file.write("                    }\n")
+                    file.write("                    switch (message[%d]) {\n" % subIdMap[v])
+                    for subMessage in messages:
+                        if (not subMessage.decode) or len(subMessage.ID[v]) == 0 or not subMessage.ID[v].has_key('subId'):
+                            continue
+                        if subMessage.ID[v]['constID'] != constID:
+                            continue
+                        file.write("                        case %d:\n" % subMessage.ID[v]['subId']['id'])
+                        file.write("                            s->messageType = %s;\n" % subMessage.enumName)
+                        file.write("                            return freespace_decode%s(message, length, s, ver);\n" % subMessage.name)
+                    file.write("                        default:\n")
+                    file.write("                            return FREESPACE_ERROR_MALFORMED_MESSAGE;\n")
+                    file.write("                    }\n")
+                else:
+                    file.write("                    s->messageType = %s;\n" % message.enumName)
+                    file.write("                    return freespace_decode%s(message, length, s, ver);\n" % message.name)
+            file.write("                default:\n")
+            file.write("                    return FREESPACE_ERROR_MALFORMED_MESSAGE;\n")
+            file.write("            }\n")
+        file.write('''        default:
+            return FREESPACE_ERROR_INVALID_HID_PROTOCOL_VERSION;
+    }
+}
+''')
+
 
 
+# The static helpers that the codecs can call, each after the helpers
+# it calls itself.
+BIT_HELPERS = [
+    ('toUint32', '''static uint32_t toUint32(const uint8_t * a) {
+    uint32_t v;
+    memcpy(&v, a, sizeof(v));
+#ifdef FREESPACE_LITTLE_ENDIAN
+    return v;
+#else
+    return CODECS_SWAP32(v);
+#endif
+}
+'''),
+    ('toUint16', '''static uint16_t toUint16(const uint8_t * a) {
+    uint16_t v;
+    memcpy(&v, a, sizeof(v));
+#ifdef FREESPACE_LITTLE_ENDIAN
+    return v;
+#else
+    return CODECS_SWAP16(v);
+#endif
+}
+'''),
+    ('toUint8', '''static uint8_t toUint8(const uint8_t * a) {
+    return (uint8_t) *a;
+}
+'''),
+    ('toInt32', '''static int32_t toInt32(const uint8_t * a) {
+    return (int32_t) toUint32(a);
+}
+'''),
+    ('toInt16', '''static int16_t toInt16(const uint8_t * a) {
+    return (int16_t) toUint16(a);
+}
+'''),
+    ('toInt8', '''static int8_t toInt8(const uint8_t * a) {
+    return (int8_t) *a;
+}
+'''),
+    ('fromUint32', '''static void fromUint32(uint8_t * a, uint32_t v) {
+#ifndef FREESPACE_LITTLE_ENDIAN
+    v = CODECS_SWAP32(v);
+#endif
+    memcpy(a, &v, sizeof(v));
+}
+'''),
+    ('fromUint16', '''static void fromUint16(uint8_t * a, uint16_t v) {
+#ifndef FREESPACE_LITTLE_ENDIAN
+    v = CODECS_SWAP16(v);
+#endif
+    memcpy(a, &v, sizeof(v));
+}
+'''),
+    ('byteFromNibbles', '''static uint8_t byteFromNibbles(uint8_t lsn, uint8_t msn) {
+    return lsn | (msn << 4);
+}
+'''),
+    ('expandBits', '''// Spreads bit n of a into the low bit of byte n of the result.
+static uint64_t expandBits(uint8_t a) {
+    uint64_t x = ((uint64_t) a * 0x0101010101010101ULL) & 0x8040201008040201ULL;
+    return ((x + 0x7f7f7f7f7f7f7f7fULL) >> 7) & 0x0101010101010101ULL;
+}
+'''),
+]
+
+# Splits generated code into the lines compiled on every host and the
+# lines compiled only on big endian hosts, from its FREESPACE_LITTLE_ENDIAN
+# conditionals.
+def splitByteOrderCode(code):
+    common = []
+    bigEndian = []
+    # Each open conditional is 'le', 'be' or None when it doesn't test
+    # the byte order.
+    stack = []
+    for line in code.split("\n"):
+        directive = line.strip()
+        if directive.startswith("#ifdef FREESPACE_LITTLE_ENDIAN"):
+            stack.append('le')
+        elif directive.startswith("#ifndef FREESPACE_LITTLE_ENDIAN"):
+            stack.append('be')
+        elif directive.startswith("#if"):
+            stack.append(None)
+        elif directive.startswith("#else") and stack:
+            stack[-1] = {'le': 'be', 'be': 'le', None: None}[stack[-1]]
+        elif directive.startswith("#endif") and stack:
+            stack.pop()
+        elif 'le' in stack:
+            continue
+        elif 'be' in stack:
+            bigEndian.append(line)
+        else:
+            common.append(line)
+    return "\n".join(common), "\n".join(bigEndian)
+
+# The fields of one version of a message that the report carries, as
+# (byte, field) pairs counted from the start of the payload.
+def fieldBytes(message, v):
+    result = []
+    byteCounter = 0
+    if message.ID[v].has_key('subId'):
+        byteCounter += 1
+    for field in message.Fields[v]:
+        if field.has_key('synthesized'):
+            continue
+        if field['name'] == 'RESERVED':
+            byteCounter += field['size']
+        elif field.has_key('cType'):
+            result.append((byteCounter, field))
+            byteCounter += field['typeDecode']['width'] * field['typeDecode']['count']
+        elif field.has_key('bits') or field.has_key('nibbles'):
+            result.append((byteCounter, field))
+            byteCounter += 1
+    return result
+
+# The bits of one version of a message that are reserved and must be
+# zero, as (byte, mask) pairs counted from the start of the payload. Bits
+# past the last named bit of a bit field are reserved too.
+def reservedBits(message, v):
+    reserved = []
+    byteCounter = 0
+    if message.ID[v].has_key('subId'):
+        byteCounter += 1
+    for field in message.Fields[v]:
+        if field.has_key('synthesized'):
+            continue
+        if field['name'] == 'RESERVED':
+            for i in range(field['size']):
+                reserved.append((byteCounter + i, 0xff))
+            byteCounter += field['size']
+        elif field.has_key('cType'):
+            byteCounter += field['typeDecode']['width'] * field['typeDecode']['count']
+        elif field.has_key('bits') or field.has_key('nibbles'):
+            if field.has_key('bits'):
+                parts = [(bit, bit.get('size', 1)) for bit in field['bits']]
+            else:
+                parts = [(nibble, 4) for nibble in field['nibbles']]
+            mask = 0
+            shift = 0
+            for part, sz in parts:
+                if part['name'] == 'RESERVED':
+                    mask |= ((1 << sz) - 1) << shift
+                shift += sz
+            mask |= (0xff << shift) & 0xff
+            if mask != 0:
+                reserved.append((byteCounter, mask))
+            byteCounter += 1
+    return reserved
 
 # --------------------------  Individual Message ------------------------------------
     
-def writeCodecs(message, outHFile, outCFile):
+def writeCodecs(message, outHFile, outCFile, mode="unrolled", packedFlags=False, synthesized="exact"):
     fields = extractFields(message)
     writeCodecHeader(message, fields, outHFile)
-    writeCodecCFile(message, fields, outCFile)
+    if mode == "table":
+        writeTableCodecCFile(message, fields, outCFile, synthesized)
+    else:
+        writeCodecCFile(message, fields, outCFile, packedFlags, synthesized)
+    if message.decode:
+        writeSynthesizedGetters(message, outCFile, synthesized)
             
 def writePrinter(message, outHFile, outCFile):
     writePrinterHeader(message, outHFile)
@@ -432,6 +1604,7 @@ def writeCodecHeader(message, fields, outHeader):
     # Decode function declaration
     if message.decode:
         writeDecodeDecl(message, outHeader)
+        writeSynthesizedGetterDecls(message, outHeader)
         outHeader.write('\n')
     # Encode function declaration
     if message.encode:
@@ -439,20 +1612,23 @@ def writeCodecHeader(message, fields, outHeader):
         outHeader.write('\n')
 
 # Add an entry to the codec file to encode or decode one message
-def writeCodecCFile(message, fields, outFile):
+def writeCodecCFile(message, fields, outFile, packedFlags=False, synthesized="exact"):
     if message.decode:
-        writeDecodeBody(message, fields, outFile)
+        writeDecodeBody(message, fields, outFile, packedFlags, synthesized)
         outFile.write('\n')
 
     if message.encode:
         writeEncodeBody(message, fields, outFile)
         outFile.write('\n')
 
-def writeStruct(message, fields, outHeader):
+def writeStruct(message, fields, outHeader, packedFlags=False):
     outHeader.write("\n")
     if message.Documentation != None:
         outHeader.write("/** @ingroup messages \n * " + message.Documentation + "\n */\n")
     outHeader.write("struct freespace_" + message.name + " {\n")
+    packed = []
+    if packedFlags:
+        packed = packedFlagFields(message, fields)
     if len(fields) > 0:
         for field in fields:
             if len(field['Doc']):
@@ -463,6 +1639,9 @@ def writeStruct(message, fields, outHeader):
             if field['count'] != 1:
                 outHeader.write("[%d]"%field['count'])
             outHeader.write(";\n")
+        for name in packed:
+            outHeader.write("\n\t/** All of the %s bits as one byte, with the reserved bits cleared. Filled in by the decoder only. */\n" % name)
+            outHeader.write("\tuint8_t %s;\n" % name)
     else:
         outHeader.write("\tuint8_t nothing; // This is here to keep the compiler happy.\n")
     outHeader.write("};\n")
@@ -522,6 +1701,90 @@ def extractFields(message):
                     else:
                         nibble['typeDecode'] = fields[nibble['name']]
     return fieldsList
+
+# The names of the bit fields of a message that get a packed member with
+# --packed-flags, in the order they first appear. A bit field whose name
+# is already taken by another member is left out.
+def packedFlagFields(message, fields):
+    names = [field['name'] for field in fields]
+    packed = []
+    for version in message.Fields:
+        for field in version:
+            if (field.has_key('bits') and field['name'] not in names and
+                any(bit['name'] != 'RESERVED' for bit in field['bits'])):
+                names.append(field['name'])
+                packed.append(field['name'])
+    return packed
+
+# The named parts of a bits or nibbles field as (name, type, shift, mask)
+# tuples.
+def bitFieldParts(field):
+    if field.has_key('bits'):
+        parts = [(bit, bit.get('size', 1)) for bit in field['bits']]
+    else:
+        parts = [(nibble, 4) for nibble in field['nibbles']]
+    result = []
+    shift = 0
+    for part, sz in parts:
+        if part['name'] != 'RESERVED':
+            result.append((part['name'], part['typeDecode']['type'], shift, (1 << sz) - 1))
+        shift += sz
+    return result
+
+# Splits the parts of a bits or nibbles field into groups for the decoder.
+# A group of at least BIT_RUN single bit flags in consecutive bit positions
+# and consecutive uint8_t members is spread with expandBits(), which
+# compilers turn into one multiply and one wide store instead of a shift,
+# mask and store per flag. Every other part is a group of its own.
+BIT_RUN = 4
+
+def bitFieldRuns(field, fields):
+    index = dict((f['name'], i) for i, f in enumerate(fields))
+    parts = bitFieldParts(field)
+    runs = []
+    i = 0
+    while i < len(parts):
+        name, cType, shift, mask = parts[i]
+        run = 1
+        while i + run < len(parts):
+            nextName, nextType, nextShift, nextMask = parts[i + run]
+            if (mask != 1 or nextMask != 1 or cType != 'uint8_t' or nextType != 'uint8_t' or
+                nextShift != shift + run or index[nextName] != index[name] + run):
+                break
+            run += 1
+        if run >= BIT_RUN:
+            runs.append(parts[i:i + run])
+        else:
+            runs.extend([[part] for part in parts[i:i + run]])
+        i += run
+    return runs
+
+# Writes the decode of one bits or nibbles field, which has already been
+# loaded into the local "byte".
+def writeBitFieldDecode(field, fields, outFile):
+    for run in bitFieldRuns(field, fields):
+        if len(run) >= BIT_RUN:
+            shift = run[0][2]
+            if shift == 0:
+                outFile.write("\t\t\texpanded = expandBits(byte);\n")
+            else:
+                outFile.write("\t\t\texpanded = expandBits((uint8_t) (byte >> %d));\n" % shift)
+            for j in range(len(run)):
+                if j == 0:
+                    outFile.write("\t\t\ts->%s = (uint8_t) expanded;\n" % run[j][0])
+                else:
+                    outFile.write("\t\t\ts->%s = (uint8_t) (expanded >> %d);\n" % (run[j][0], 8 * j))
+            continue
+        name, cType, shift, mask = run[0]
+        value = "byte"
+        if shift != 0:
+            value = "(byte >> %d)" % shift
+        if shift + mask.bit_length() < 8:
+            value = "(%s & 0x%02X)" % (value, mask)
+        if cType == 'uint8_t':
+            outFile.write("\t\t\ts->%s = (uint8_t) %s;\n" % (name, value))
+        else:
+            outFile.write("\t\t\ts->%s = %s;\n" % (name, value))
     
 def cTypeToTypeInfo(ct, sizeInBytes):
     typeInfo = {'type':ct, 'warning':'no'}
@@ -590,6 +1853,19 @@ def writeDecodeDecl(message, outHeader):
  * @return FREESPACE_SUCCESS or an error
  */
 LIBFREESPACE_API int freespace_decode%(name)s(const uint8_t* message, int length, struct freespace_message* m, uint8_t ver);
+
+/** @ingroup messages
+ * Decode a %(name)s message into just the message struct, without the
+ * rest of a freespace_message. Fields that the message version doesn't
+ * carry are left untouched.
+ *
+ * @param message the message to decode that was received from the Freespace device
+ * @param length the length of the received message
+ * @param s the struct into which to decode
+ * @param ver the protocol version to use for this message
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_decode%(name)sStruct(const uint8_t* message, int length, struct freespace_%(name)s* s, uint8_t ver);
 '''%{'name':message.name})
 
 def writePrintDecl(message, outHeader):
@@ -609,9 +1885,64 @@ LIBFREESPACE_API int freespace_print%(name)sStr(char* dest, int maxlen, const st
  * @return the number of characters actually printed, or an error if it tries to print more than maxlen
  */
 LIBFREESPACE_API int freespace_print%(name)s(FILE* fp, const struct freespace_%(name)s* s);
-
-'''%{'name':message.name})
+/**
+ * Format message struct as one line of text, JSON or CSV.
+ * @param dest the destination string
+ * @param maxlen the length of the passed in string
+ * @param s the struct to format
+ * @param format the output format
+ * @return the number of characters formatted, not counting the terminator, or an error
+ */
+LIBFREESPACE_API int freespace_format%(name)s(char* dest, int maxlen, const struct freespace_%(name)s* s, enum freespace_printFormat format);
+%(note)s
+'''%{'name':message.name, 'note':synthesizedPrintNote(message)})
+
+# The struct printers don't know the version that a message was decoded
+# with, so they can't compute its synthesized fields.
+def synthesizedPrintNote(message):
+    names = synthesizedFields(message)
+    if len(names) == 0:
+        return ""
+    return '''/*
+ * The %(name)s printers print %(fields)s as stored in s, which codecs
+ * generated with lazy synthesized fields leave unset. freespace_formatMessage()
+ * and freespace_printMessage() get it from freespace_%(name)s_%(first)s().
+ */
+''' % {'name':message.name, 'fields':", ".join(names), 'first':names[0]}
     
+# Finds the runs of integer fields in one version of a message that the
+# codecs copy with a single memcpy. A run is an array, or consecutive
+# fields of the same type that are also consecutive members of the message
+# struct, so that the report and the struct hold the same bytes in the same
+# order once the host byte order matches the report's. Returns a dict from
+# the index of the first field of each run to the number of fields in it.
+def bulkCopyRuns(message, v, fields):
+    index = dict((f['name'], i) for i, f in enumerate(fields))
+    wire = message.Fields[v]
+    def copyable(field):
+        return field.has_key('cType') and not field.has_key('synthesized') and field['name'] != 'RESERVED'
+    runs = {}
+    i = 0
+    while i < len(wire):
+        if not copyable(wire[i]):
+            i += 1
+            continue
+        j = i + 1
+        while (j < len(wire) and copyable(wire[j]) and wire[j]['cType'] == wire[i]['cType'] and
+               index[wire[j]['name']] == index[wire[j - 1]['name']] + 1):
+            j += 1
+        if j - i > 1 or wire[i]['typeDecode']['count'] > 1:
+            runs[i] = j - i
+        i = j
+    return runs
+
+# The struct member a run starts at, and the number of bytes in the run.
+def bulkCopyTarget(message, run):
+    size = sum([f['typeDecode']['width'] * f['typeDecode']['count'] for f in run])
+    if len(run) == 1:
+        return "s->%s" % run[0]['name'], size
+    return "(uint8_t*) s + offsetof(struct freespace_%s, %s)" % (message.name, run[0]['name']), size
+
 def writeEncodeBody(message, fields, outFile):
     
     outFile.write("LIBFREESPACE_API int freespace_encode%s(const struct freespace_message* m, uint8_t* message, int maxlength) {\n"%message.name)
@@ -646,13 +1977,33 @@ def writeEncodeBody(message, fields, outFile):
                 byteCounter += 1
 
             # Message fields
-            for field in message.Fields[v]:
+            runs = bulkCopyRuns(message, v, fields)
+            runEnd = 0
+            for fieldIndex, field in enumerate(message.Fields[v]):
                 if field.has_key('synthesized'):
                     continue
                 elementSize = field['size']
                 if field['name'] == 'RESERVED':
                     byteCounter += elementSize
                     continue
+                if fieldIndex in runs:
+                    run = message.Fields[v][fieldIndex:fieldIndex + runs[fieldIndex]]
+                    source, size = bulkCopyTarget(message, run)
+                    if field['typeDecode']['width'] == 1:
+                        outFile.write('\t\t\tmemcpy(&message[%d + offset], %s, %d);\n' % (byteCounter, source.replace('(uint8_t*)', '(const uint8_t*)'), size))
+                    else:
+                        outFile.write('#ifdef FREESPACE_LITTLE_ENDIAN\n')
+                        outFile.write('\t\t\tmemcpy(&message[%d + offset], %s, %d);\n' % (byteCounter, source.replace('(uint8_t*)', '(const uint8_t*)'), size))
+                        outFile.write('#else\n')
+                        counter = byteCounter
+                        for runField in run:
+                            counter = writeFieldEncode(runField, counter, outFile)
+                        outFile.write('#endif\n')
+                    byteCounter += size
+                    runEnd = fieldIndex + runs[fieldIndex]
+                    continue
+                if fieldIndex < runEnd:
+                    continue
                 if field.has_key('bits'):
                     bitoffset = 0
                     exprs = []
@@ -680,15 +2031,7 @@ def writeEncodeBody(message, fields, outFile):
                     outFile.write(');\n')
                     byteCounter += 1
                 elif field.has_key('cType'):
-                    if field['typeDecode']['count'] == 1:
-                        for j in range (field['typeDecode']['width']):
-                            outFile.write('\t\t\tmessage[%d + offset] = s->%s >> %d;\n'%(byteCounter, field['name'], 8 * j))
-                            byteCounter += 1
-                    else:
-                        for i in range (field['typeDecode']['count']):
-                            for j in range (field['typeDecode']['width']):
-                                outFile.write('\t\t\tmessage[%d + offset] = s->%s[%d] >> %d;\n'%(byteCounter, field['name'], i, 8 * j))
-                                byteCounter += 1
+                    byteCounter = writeFieldEncode(field, byteCounter, outFile)
                 else:
                     print ("Unrecognized field type in %s\n" % message.name)
             if v == 2:
@@ -702,12 +2045,83 @@ def writeEncodeBody(message, fields, outFile):
     # End of function
     outFile.write('\r}\n')
 
-def writeDecodeBody(message, fields, outFile):
-    outFile.write("LIBFREESPACE_API int freespace_decode%s(const uint8_t* message, int length, struct freespace_message* m, uint8_t ver) {" %message.name)
+STORE_HELPERS = {1:None, 2:('fromUint16', 'uint16_t'), 4:('fromUint32', 'uint32_t')}
+
+# Writes the encode of one integer field and returns the byte after it.
+def writeFieldEncode(field, byteCounter, outFile):
+    width = field['typeDecode']['width']
+    count = field['typeDecode']['count']
+    for i in range(count):
+        member = "s->%s" % field['name']
+        if count != 1:
+            member += "[%d]" % i
+        if STORE_HELPERS[width] is None:
+            outFile.write('\t\t\tmessage[%d + offset] = %s;\n' % (byteCounter, member))
+        else:
+            helper, cast = STORE_HELPERS[width]
+            outFile.write('\t\t\t%s(&message[%d + offset], (%s) %s);\n' % (helper, byteCounter, cast, member))
+        byteCounter += width
+    return byteCounter
+
+# Writes the decode of one integer field and returns the byte after it.
+def writeFieldDecode(field, byteCounter, outFile):
+    width = field['typeDecode']['width']
+    count = field['typeDecode']['count']
+    for i in range(count):
+        member = "s->%s" % field['name']
+        if count != 1:
+            member += "[%d]" % i
+        outFile.write("\t\t\t%s = %s(&message[%d + offset]);\n" % (member, IntConversionHelper(field['typeDecode']['type']), byteCounter))
+        byteCounter += width
+    return byteCounter
+
+# The public decoders wrap decode<message>Body(), which fills in the
+# fields. Its check argument is 0 only when freespace_decode_messageValidated()
+# has already checked the report ID and length, through the
+# decode<message>Trusted() entry in its table.
+def writeDecodeWrapper(message, outFile):
+    outFile.write('''static int decode%(name)sMessage(const uint8_t* message, int length, struct freespace_message* m, uint8_t ver, int check) {
+    int rc;
+
+    m->ver = ver;
+    rc = decode%(name)sBody(message, length, &(m->%(structName)s), ver, check);
+    if (rc == FREESPACE_SUCCESS && ver == 2) {
+        m->len = message[1];
+        m->dest = message[2];
+        m->src = message[3];
+    }
+    return rc;
+}
+
+LIBFREESPACE_API int freespace_decode%(name)s(const uint8_t* message, int length, struct freespace_message* m, uint8_t ver) {
+    return decode%(name)sMessage(message, length, m, ver, 1);
+}
+
+static int decode%(name)sTrusted(const uint8_t* message, int length, struct freespace_message* m, uint8_t ver) {
+    return decode%(name)sMessage(message, length, m, ver, 0);
+}
+
+LIBFREESPACE_API int freespace_decode%(name)sStruct(const uint8_t* message, int length, struct freespace_%(name)s* s, uint8_t ver) {
+    return decode%(name)sBody(message, length, s, ver, 1);
+}
+
+''' % {'name':message.name, 'structName':message.structName})
+
+def writeDecodeBody(message, fields, outFile, packedFlags=False, synthesized="exact"):
+    packed = []
+    if packedFlags:
+        packed = packedFlagFields(message, fields)
+    bitFields = [field for version in message.Fields for field in version
+                 if field.has_key('bits') or field.has_key('nibbles')]
+    outFile.write("static int decode%(name)sBody(const uint8_t* message, int length, struct freespace_%(name)s* s, uint8_t ver, int check) {" % {'name':message.name})
     outFile.write("\n\tuint8_t offset = 1;\n")
-    if len(fields) > 0:
-        outFile.write("\tstruct freespace_%s* s = &(m->%s);\n\n"%(message.name, message.structName))
-    outFile.write("\tm->ver = ver;\n\n")
+    if len(bitFields) > 0:
+        outFile.write("\tuint8_t byte;\n")
+    if any(len(run) >= BIT_RUN for field in bitFields for run in bitFieldRuns(field, fields)):
+        outFile.write("\tuint64_t expanded;\n")
+    if len(fields) == 0:
+        outFile.write("\t(void) s;\n")
+    outFile.write("\n")
     # Encode switch statement
     outFile.write("\tswitch(ver) {\n")
     byteCounter = 0
@@ -718,129 +2132,1421 @@ def writeDecodeBody(message, fields, outFile):
             outFile.write("\t\tcase %d:\n"%v)
             # Code to check message buffer length and report ID
             if len(message.ID[v]):
-                outFile.write('''            if ((STRICT_DECODE_LENGTH && length != %(size)d) || (!STRICT_DECODE_LENGTH && length < %(size)d)) {
-                CODECS_PRINTF(\"Length mismatch for %%s.  Expected %%d.  Got %%d.\\n\", \"%(name)s\", %(size)d, length);
-                return FREESPACE_ERROR_BUFFER_TOO_SMALL;
-            }
-            if ((uint8_t) message[0] != %(id)d) {
-                return FREESPACE_ERROR_MALFORMED_MESSAGE;
+                outFile.write('''            if (check) {
+                if (length < %(size)d) {
+                    CODECS_PRINTF(\"Length mismatch for %%s.  Expected %%d.  Got %%d.\\n\", \"%(name)s\", %(size)d, length);
+                    return FREESPACE_ERROR_BUFFER_TOO_SMALL;
+                }
+                if ((uint8_t) message[0] != %(id)d) {
+                    return FREESPACE_ERROR_MALFORMED_MESSAGE;
+                }
             }
 '''%{'size':message.getMessageSize(v), 'id':message.ID[v]['constID'], 'name':message.name})
             if v == 2:
                 outFile.write("\t\t\toffset = 4;\n")
-                outFile.write("\t\t\tm->len = message[1];\n")
-                outFile.write("\t\t\tm->dest = message[2];\n")
-                outFile.write("\t\t\tm->src = message[3];\n")
 
             if message.ID[v].has_key('subId'):
                 outFile.write('''
-            if ((uint8_t) message[offset] != %d) {
+            if (check && (uint8_t) message[offset] != %d) {
                 return FREESPACE_ERROR_MALFORMED_MESSAGE;
             }
 '''%message.ID[v]['subId']['id'])
                 byteCounter += 1
-            for field in message.Fields[v]:
+            runs = bulkCopyRuns(message, v, fields)
+            runEnd = 0
+            for fieldIndex, field in enumerate(message.Fields[v]):
                 if field.has_key('synthesized'):
                     continue
                 elementSize = field['size']
                 if field['name'] == 'RESERVED':
                     byteCounter += elementSize
                     continue
-                if field.has_key('cType'):
-                    if field['typeDecode']['count'] == 1:
-                        outFile.write("\t\t\ts->%s = %s(&message[%d + offset]);\n" % (field['name'], IntConversionHelper(field['typeDecode']['type']), byteCounter))
-                        byteCounter += field['typeDecode']['width']
+                if fieldIndex in runs:
+                    run = message.Fields[v][fieldIndex:fieldIndex + runs[fieldIndex]]
+                    target, size = bulkCopyTarget(message, run)
+                    if field['typeDecode']['width'] == 1:
+                        outFile.write("\t\t\tmemcpy(%s, &message[%d + offset], %d);\n" % (target, byteCounter, size))
                     else:
-                        for i in range (field['typeDecode']['count']):
-                            outFile.write("\t\t\ts->%s[%d] = %s(&message[%d + offset]);\n" % (field['name'], i, IntConversionHelper(field['typeDecode']['type']), byteCounter))
-                            byteCounter += field['typeDecode']['width']
-                elif field.has_key('bits'):
-                    bitCounter = 0
-                    for bit in field['bits']:
-                        if bit['name'] != 'RESERVED':
-                            if bit.has_key('size'):
-                                outFile.write("\t\t\ts->%s = (uint8_t) ((message[%d + offset] >> %d) & 0x%02X);\n"%(bit['name'], byteCounter, bitCounter, 2**bit['size']-1))
-                                bitCounter += bit['size']-1
-                            else:
-                                outFile.write("\t\t\ts->%s = getBit(message[%d + offset], %d);\n"%(bit['name'], byteCounter, bitCounter))
-                        bitCounter += 1
-                    byteCounter += 1
-                elif field.has_key('nibbles'):
-
-                    nibbleCounter = 0
-                    for nibble in field['nibbles']:
-                        if nibble['name'] != 'RESERVED':
-                            outFile.write('    s->%s = getNibble(message[%d + offset], %d);\n'%(nibble['name'], byteCounter, nibbleCounter))
-                        nibbleCounter += 1
+                        outFile.write("#ifdef FREESPACE_LITTLE_ENDIAN\n")
+                        outFile.write("\t\t\tmemcpy(%s, &message[%d + offset], %d);\n" % (target, byteCounter, size))
+                        outFile.write("#else\n")
+                        counter = byteCounter
+                        for runField in run:
+                            counter = writeFieldDecode(runField, counter, outFile)
+                        outFile.write("#endif\n")
+                    byteCounter += size
+                    runEnd = fieldIndex + runs[fieldIndex]
+                    continue
+                if fieldIndex < runEnd:
+                    continue
+                if field.has_key('cType'):
+                    byteCounter = writeFieldDecode(field, byteCounter, outFile)
+                elif field.has_key('bits') or field.has_key('nibbles'):
+                    outFile.write("\t\t\tbyte = message[%d + offset];\n" % byteCounter)
+                    writeBitFieldDecode(field, fields, outFile)
+                    if field['name'] in packed:
+                        mask = 0
+                        for name, cType, shift, partMask in bitFieldParts(field):
+                            mask |= partMask << shift
+                        if mask == 0xff:
+                            outFile.write("\t\t\ts->%s = byte;\n" % field['name'])
+                        else:
+                            outFile.write("\t\t\ts->%s = (uint8_t) (byte & 0x%02X);\n" % (field['name'], mask))
                     byteCounter += 1
                 else:
                     print ("Unrecognized field type in %s\n" % message.name)
             for field in message.Fields[v]:
-                if field.has_key('synthesized'):
+                if field.has_key('synthesized') and synthesized != "lazy":
                     outFile.write(specialCaseCode(field['synthesized']))
             outFile.write("\t\t\treturn FREESPACE_SUCCESS;\n")
     # Default case
     outFile.write("\t\tdefault:\n")
     outFile.write("\t\t\treturn  FREESPACE_ERROR_INVALID_HID_PROTOCOL_VERSION;\n")
     outFile.write('\t}\n')
-    outFile.write('}\n')
-
-def printStrHelper(message, outFile):
+    outFile.write('}\n\n')
+    writeDecodeWrapper(message, outFile)
+
+PRINT_TYPES = {'uint8_t':'PRINT_UINT8',
+               'int8_t':'PRINT_INT8',
+               'uint16_t':'PRINT_UINT16',
+               'int16_t':'PRINT_INT16',
+               'uint32_t':'PRINT_UINT32',
+               'int32_t':'PRINT_INT32',
+               'int':'PRINT_INT'}
+
+# The widest value of each type, including any minus sign
+PRINT_WIDTHS = {'uint8_t':3,
+                'int8_t':4,
+                'uint16_t':5,
+                'int16_t':6,
+                'uint32_t':10,
+                'int32_t':11,
+                'int':11}
+
+# Longest output of any of the print formats for a message, with the
+# terminator.
+def printMaxLength(message):
     fields = extractFields(message)
-    first = True
-    for field in fields:
-        if not first:
-            outFile.write(' ')
-        else:
-            first = False
-        if field['count'] == 1:
-            outFile.write("%s=%%d"%field['name'])
-    outFile.write(')"')
+    name = len(message.name)
+    text = name + 2
+    json = 12 + name + 2
+    csv = name
+    header = 7
     for field in fields:
-        if field['count'] == 1:
-            outFile.write(', s->%s'%field['name'])
-    outFile.write(');')
+        count = field['count']
+        values = count * (PRINT_WIDTHS[field['type']] + 1)
+        text += len(field['name']) + 2 + values + (2 if count > 1 else 0)
+        json += len(field['name']) + 4 + values + (2 if count > 1 else 0)
+        csv += values
+        header += count * (len(field['name']) + 1 + (len(str(count)) if count > 1 else 0))
+    return max(text, json, csv, header) + 1
 
 def writePrintBody(message, outFile):
+    fields = extractFields(message)
+    if len(fields) > 0:
+        outFile.write('''
+static const struct printField print%sFields[] = {''' % message.name)
+        for field in fields:
+            outFile.write('''
+    {" %(field)s=", ",\\"%(field)s\\":", %(length)d, %(type)s, %(count)d, offsetof(struct freespace_%(name)s, %(field)s)},''' % {
+                'name':message.name,
+                'field':field['name'],
+                'length':len(field['name']),
+                'type':PRINT_TYPES[field['type']],
+                'count':field['count']})
+        outFile.write('''
+};
+''')
     outFile.write('''
+static const struct printMessage print%(name)s = {"%(name)s", %(length)d, %(numFields)d, %(maxLength)d, %(fields)s};
+
+LIBFREESPACE_API int freespace_format%(name)s(char* dest, int maxlen, const struct freespace_%(name)s* s, enum freespace_printFormat format) {
+    return formatStruct(dest, maxlen, &print%(name)s, s, format);
+}
+
 LIBFREESPACE_API int freespace_print%(name)sStr(char* dest, int maxlen, const struct freespace_%(name)s* s) {
-    int n;
+    return formatStruct(dest, maxlen, &print%(name)s, s, FREESPACE_PRINT_TEXT);
+}
+
+LIBFREESPACE_API int freespace_print%(name)s(FILE* fp, const struct freespace_%(name)s* s) {
+    char str[FREESPACE_PRINT_MAX_LENGTH];
+    int rc;
     if (s == NULL) {
         return FREESPACE_ERROR_UNEXPECTED;
     }
-#ifdef _WIN32
-    n = sprintf_s(dest, maxlen, "%(name)s('''%{'name':message.name})
-    printStrHelper(message, outFile)
+    rc = freespace_print%(name)sStr(str, sizeof(str), s);
+    if (rc < 0) {
+        return rc;
+    }
+    return fprintf(fp, "%%s\\n", str);
+}
+'''%{'name':message.name,
+       'length':len(message.name),
+       'numFields':len(fields),
+       'maxLength':printMaxLength(message),
+       'fields':('print%sFields' % message.name) if len(fields) > 0 else 'NULL'})
+        
+# --------------------------  View Accessors ------------------------------------
+
+# Expression that loads an integer of the given C type from the
+# little-endian report at byte offset o.
+def viewLoad(cType, o):
+    if cType == 'uint8_t':
+        return "report[%d]" % o
+    if cType == 'int8_t':
+        return "(int8_t) report[%d]" % o
+    if cType in ('uint16_t', 'int16_t'):
+        return "(%s) (report[%d] | (report[%d] << 8))" % (cType, o, o + 1)
+    return "(%s) ((uint32_t) report[%d] | ((uint32_t) report[%d] << 8) | ((uint32_t) report[%d] << 16) | ((uint32_t) report[%d] << 24))" % (cType, o, o + 1, o + 2, o + 3)
+
+def writeViews(message, outHeader):
+    if not message.decode:
+        return
+    extractFields(message)
+    for v in range(3):
+        if len(message.ID[v]) == 0:
+            continue
+        prefix = "freespace_view_%s_v%d" % (message.name, v)
+        offset = 4 if v == 2 else 1
+        outHeader.write('''
+/** @ingroup views
+ * Check that a raw report is a version %(ver)d %(name)s message.
+ *
+ * @param report the raw report
+ * @param length the length of the report
+ * @return non-zero if the report matches
+ */
+FREESPACE_VIEW_INLINE int %(prefix)s_matches(const uint8_t* report, int length) {
+    return length >= %(size)d && report[0] == %(id)d''' % {'ver':v, 'name':message.name, 'prefix':prefix,
+                                                     'size':message.getMessageSize(v),
+                                                     'id':message.ID[v]['constID']})
+        byteCounter = offset
+        if message.ID[v].has_key('subId'):
+            outHeader.write(" && report[%d] == %d" % (byteCounter, message.ID[v]['subId']['id']))
+            byteCounter += 1
+        outHeader.write(";\n}\n")
+
+        for field in message.Fields[v]:
+            if field.has_key('synthesized'):
+                continue
+            if field['name'] == 'RESERVED':
+                byteCounter += field['size']
+                continue
+            if field.has_key('cType'):
+                typeInfo = field['typeDecode']
+                if typeInfo['count'] == 1:
+                    outHeader.write('''
+FREESPACE_VIEW_INLINE %s %s_%s(const uint8_t* report) {
+    return %s;
+}
+''' % (typeInfo['type'], prefix, field['name'], viewLoad(typeInfo['type'], byteCounter)))
+                else:
+                    load = viewLoad(typeInfo['type'], 0).replace("report[", "r[")
+                    outHeader.write('''
+FREESPACE_VIEW_INLINE %s %s_%s(const uint8_t* report, int index) {
+    const uint8_t* r = report + %d + index * %d;
+    return %s;
+}
+''' % (typeInfo['type'], prefix, field['name'], byteCounter, typeInfo['width'], load))
+                byteCounter += typeInfo['width'] * typeInfo['count']
+            elif field.has_key('bits') or field.has_key('nibbles'):
+                shift = 0
+                if field.has_key('bits'):
+                    parts = [(bit, bit.get('size', 1)) for bit in field['bits']]
+                else:
+                    parts = [(nibble, 4) for nibble in field['nibbles']]
+                for part, sz in parts:
+                    if part['name'] != 'RESERVED':
+                        outHeader.write('''
+FREESPACE_VIEW_INLINE %s %s_%s(const uint8_t* report) {
+    return (report[%d] >> %d) & 0x%02X;
+}
+''' % (part['typeDecode']['type'], prefix, part['name'], byteCounter, shift, (1 << sz) - 1))
+                    shift += sz
+                byteCounter += 1
+
+# --------------------------  C++ Message API ------------------------------------
+#
+# freespace_messages.hpp is a header-only C++17 layer over the same
+# message definitions. Each message gets a plain struct, and each
+# version of it a Layout specialization whose field descriptors carry
+# the offsets as compile-time constants. Encoding and decoding are
+# generated per layout, so nothing is looked up at runtime.
+
+# Returns ('field', name, type, offset) / ('array', name, type, offset, count)
+# / ('bits', name, type, offset, shift, mask) entries for one version
+# of a message, with offsets from the start of the report.
+def cppLayoutFields(message, v):
+    entries = []
+    byteCounter = 4 if v == 2 else 1
+    if message.ID[v].has_key('subId'):
+        byteCounter += 1
+    for field in message.Fields[v]:
+        if field.has_key('synthesized'):
+            continue
+        if field['name'] == 'RESERVED':
+            byteCounter += field['size']
+            continue
+        if field.has_key('cType'):
+            typeInfo = field['typeDecode']
+            if typeInfo['count'] == 1:
+                entries.append(('field', field['name'], typeInfo['type'], byteCounter))
+            else:
+                entries.append(('array', field['name'], typeInfo['type'], byteCounter, typeInfo['count']))
+            byteCounter += typeInfo['width'] * typeInfo['count']
+        elif field.has_key('bits') or field.has_key('nibbles'):
+            shift = 0
+            if field.has_key('bits'):
+                parts = [(bit, bit.get('size', 1)) for bit in field['bits']]
+            else:
+                parts = [(nibble, 4) for nibble in field['nibbles']]
+            for part, sz in parts:
+                if part['name'] != 'RESERVED':
+                    entries.append(('bits', part['name'], part['typeDecode']['type'], byteCounter, shift, (1 << sz) - 1))
+                shift += sz
+            byteCounter += 1
+    return entries, byteCounter
+
+# The special cases for the C++ decoders: the same expressions as in C,
+# calling the same helpers in namespace detail. As in C, lazy synthesized
+# fields are left to the getters.
+def cppSynthesizedCode(message, v, synthesized):
+    code = ""
+    if synthesized == "lazy":
+        return code
+    for field in message.Fields[v]:
+        if field.has_key('synthesized'):
+            if SPECIAL_CASES.has_key(field['synthesized']):
+                member, expression = SPECIAL_CASES[field['synthesized']]
+                code += "        m.%s = detail::%s;\n" % (member, expression.replace("s->", "m."))
+            else:
+                print ("Unrecognized special case: %s" % field['synthesized'])
+    return code
+
+# The C++ counterparts of freespace_<Message>_<field>().
+def writeCppSynthesizedGetters(message, outFile, synthesized):
+    for name in synthesizedFields(message):
+        outFile.write('''
+/** @ingroup cpp
+ * Get %(field)s from a decoded %(name)s, like freespace_%(name)s_%(field)s().
+ * Versions of the message that don't carry it compute it from the other
+ * fields, either while decoding or, with lazy synthesized fields, only here.
+ */
+inline %(type)s %(name)s_%(field)s(const %(name)s& m, uint8_t ver) {
+''' % {'name':message.name, 'field':name, 'type':synthesizedType(message, name)})
+        if synthesized == "lazy":
+            for v in range(3):
+                for field in message.Fields[v]:
+                    if field['name'] == name and field.has_key('synthesized'):
+                        outFile.write("    if (ver == %d) {\n        return detail::%s;\n    }\n" %
+                                      (v, SPECIAL_CASES[field['synthesized']][1].replace("s->", "m.")))
+        else:
+            outFile.write("    (void) ver;\n")
+        outFile.write("    return m.%s;\n}\n" % name)
+
+def writeCppHeader(messages, outFile, synthesized):
+    writeCopyright(outFile)
     outFile.write('''
+#ifndef FREESPACE_MESSAGES_HPP_
+#define FREESPACE_MESSAGES_HPP_
+
+#include "freespace/freespace_common.h"
+
+#include <array>
+#include <cmath>
+#include <cstddef>
+#include <cstdint>
+#include <cstring>
+#include <optional>
+#include <type_traits>
+#include <utility>
+#include <variant>
+#if __cplusplus >= 202002L && defined(__has_include)
+#if __has_include(<span>)
+#include <span>
+#endif
+#endif
+
+/**
+ * @defgroup cpp C++ Message API
+ *
+ * A header-only C++17 interface to the Freespace messages. It doesn't
+ * need the C codecs.
+ *
+ *  - freespace::<Message> holds the decoded fields of a message.
+ *  - freespace::Layout<Message, Version> describes where each field of
+ *    one version of the message sits in a report, as types with
+ *    constexpr offset and size members.
+ *  - freespace::decode<Message, Version>() and freespace::encode<Message,
+ *    Version>() convert between the two with code generated for that
+ *    layout. decode<Message>(report, version) picks the layout at runtime.
+ *  - freespace::decode(report, version) decodes any received message into
+ *    the freespace::Message variant, for use with std::visit.
+ *  - freespace::View<Message, Version> reads fields straight out of a
+ *    report without copying it.
+ */
+
+namespace freespace {
+
+#if defined(__cpp_lib_span)
+using ConstBytes = std::span<const uint8_t>;
+using MutableBytes = std::span<uint8_t>;
 #else
-    n = snprintf(dest, maxlen, "%(name)s('''%{'name':message.name})
-    printStrHelper(message, outFile)
-    
-    outFile.write('''
+/** @ingroup cpp
+ * A minimal stand-in for std::span, for C++17.
+ */
+template <typename T>
+class Span {
+public:
+    constexpr Span() : data_(nullptr), size_(0) {}
+    constexpr Span(T* data, std::size_t size) : data_(data), size_(size) {}
+    template <std::size_t N>
+    constexpr Span(T (&array)[N]) : data_(array), size_(N) {}
+    template <typename Container,
+              typename = decltype(std::declval<Container&>().data() + std::declval<Container&>().size())>
+    constexpr Span(Container& c) : data_(c.data()), size_(c.size()) {}
+    constexpr T* data() const { return data_; }
+    constexpr std::size_t size() const { return size_; }
+    constexpr T& operator[](std::size_t i) const { return data_[i]; }
+
+private:
+    T* data_;
+    std::size_t size_;
+};
+
+using ConstBytes = Span<const uint8_t>;
+using MutableBytes = Span<uint8_t>;
 #endif
-    if (n < 0) {
+
+namespace detail {
+
+template <typename T>
+constexpr T load(const uint8_t* p) {
+    using U = std::make_unsigned_t<T>;
+    U v = 0;
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+        v = static_cast<U>(v | (static_cast<U>(p[i]) << (8 * i)));
+    }
+    return static_cast<T>(v);
+}
+
+template <typename T>
+constexpr void store(uint8_t* p, T value) {
+    using U = std::make_unsigned_t<T>;
+    U v = static_cast<U>(value);
+    for (std::size_t i = 0; i < sizeof(T); i++) {
+        p[i] = static_cast<uint8_t>(v >> (8 * i));
+    }
+}
+
+''')
+    writeSynthesizedHelpers(outFile, synthesized, True)
+    outFile.write('''} // namespace detail
+
+/** @ingroup cpp
+ * A little-endian integer field at a fixed offset in a report.
+ */
+template <typename T, std::size_t Offset>
+struct Field {
+    using type = T;
+    static constexpr std::size_t offset = Offset;
+    static constexpr std::size_t size = sizeof(T);
+    static constexpr T load(const uint8_t* report) { return detail::load<T>(report + Offset); }
+    static constexpr void store(uint8_t* report, T value) { detail::store<T>(report + Offset, value); }
+};
+
+/** @ingroup cpp
+ * An array of little-endian integers at a fixed offset in a report.
+ */
+template <typename T, std::size_t Offset, std::size_t Count>
+struct ArrayField {
+    using type = T;
+    static constexpr std::size_t offset = Offset;
+    static constexpr std::size_t count = Count;
+    static constexpr std::size_t size = sizeof(T) * Count;
+    static constexpr T load(const uint8_t* report, std::size_t i) { return detail::load<T>(report + Offset + i * sizeof(T)); }
+    static constexpr void store(uint8_t* report, std::size_t i, T value) { detail::store<T>(report + Offset + i * sizeof(T), value); }
+};
+
+/** @ingroup cpp
+ * A group of bits within one byte of a report.
+ */
+template <typename T, std::size_t Offset, unsigned Shift, unsigned Mask>
+struct BitField {
+    using type = T;
+    static constexpr std::size_t offset = Offset;
+    static constexpr unsigned shift = Shift;
+    static constexpr unsigned mask = Mask;
+    static constexpr T load(const uint8_t* report) { return static_cast<T>((report[Offset] >> Shift) & Mask); }
+    static constexpr void store(uint8_t* report, T value) {
+        report[Offset] = static_cast<uint8_t>(report[Offset] | ((static_cast<unsigned>(value) & Mask) << Shift));
+    }
+};
+
+/** @ingroup cpp
+ * The layout of one HID protocol version of a message. Specializations
+ * exist for every version a message has, with exists set to true, the
+ * report ID, sub ID (or -1), report size, and one member type per field.
+ */
+template <typename Msg, int Ver>
+struct Layout {
+    static constexpr bool exists = false;
+};
+
+/** @ingroup cpp
+ * Zero-copy access to the fields of a report. Specialized for every
+ * layout of every received message.
+ */
+template <typename Msg, int Ver>
+class View;
+
+/** @ingroup cpp
+ * Helper for building a std::visit visitor out of lambdas.
+ */
+template <typename... Ts>
+struct overloaded : Ts... {
+    using Ts::operator()...;
+};
+template <typename... Ts>
+overloaded(Ts...) -> overloaded<Ts...>;
+''')
+
+    for message in messages:
+        fields = extractFields(message)
+        outFile.write("\n")
+        if message.Documentation:
+            outFile.write("/** @ingroup cpp\n * " + message.Documentation + "\n */\n")
+        outFile.write("struct %s {\n" % message.name)
+        for field in fields:
+            if field['count'] == 1:
+                outFile.write("    %s %s{};\n" % (field['type'], field['name']))
+            else:
+                outFile.write("    std::array<%s, %d> %s{};\n" % (field['type'], field['count'], field['name']))
+        outFile.write("};\n")
+        writeCppSynthesizedGetters(message, outFile, synthesized)
+
+    for message in messages:
+        if not (message.encode or message.decode):
+            continue
+        for v in range(3):
+            if len(message.ID[v]) == 0:
+                continue
+            entries, length = cppLayoutFields(message, v)
+            subId = -1
+            if message.ID[v].has_key('subId'):
+                subId = message.ID[v]['subId']['id']
+            d = {'name':message.name, 'ver':v, 'id':message.ID[v]['constID'], 'subId':subId,
+                 'subIdOffset':4 if v == 2 else 1, 'size':message.getMessageSize(v)}
+            outFile.write('''
+template <>
+struct Layout<%(name)s, %(ver)d> {
+    static constexpr bool exists = true;
+    static constexpr uint8_t id = %(id)d;
+    static constexpr int subId = %(subId)d;
+    static constexpr std::size_t size = %(size)d;
+''' % d)
+            for e in entries:
+                if e[0] == 'field':
+                    outFile.write("    using %s = Field<%s, %d>;\n" % (e[1], e[2], e[3]))
+                elif e[0] == 'array':
+                    outFile.write("    using %s = ArrayField<%s, %d, %d>;\n" % (e[1], e[2], e[3], e[4]))
+                else:
+                    outFile.write("    using %s = BitField<%s, %d, %d, 0x%x>;\n" % (e[1], e[2], e[3], e[4], e[5]))
+            outFile.write('''
+    static bool matches(ConstBytes report) {
+        return report.size() >= size && report[0] == id''')
+            if subId >= 0:
+                outFile.write(" && report[%(subIdOffset)d] == %(subId)d" % d)
+            outFile.write(''';
+    }
+''')
+            if message.decode:
+                outFile.write('''
+    static void decode(const uint8_t* report, %(name)s& m) {
+''' % d)
+                if len(entries) == 0:
+                    outFile.write("        (void) report;\n        (void) m;\n")
+                for e in entries:
+                    if e[0] == 'array':
+                        outFile.write('''        for (std::size_t i = 0; i < %(count)d; i++) {
+            m.%(f)s[i] = %(f)s::load(report, i);
+        }
+''' % {'f':e[1], 'count':e[4]})
+                    else:
+                        outFile.write("        m.%(f)s = %(f)s::load(report);\n" % {'f':e[1]})
+                outFile.write(cppSynthesizedCode(message, v, synthesized))
+                outFile.write("    }\n")
+            if message.encode:
+                outFile.write('''
+    static constexpr void encode(const %(name)s& m, uint8_t* report, uint8_t dest) {
+        for (std::size_t i = 0; i < size; i++) {
+            report[i] = 0;
+        }
+        report[0] = id;
+''' % d)
+                if v == 2:
+                    outFile.write('''        report[1] = static_cast<uint8_t>(size);
+        report[2] = dest;
+        report[3] = 0;
+''')
+                else:
+                    outFile.write("        (void) dest;\n")
+                if subId >= 0:
+                    outFile.write("        report[%(subIdOffset)d] = %(subId)d;\n" % d)
+                if len(entries) == 0:
+                    outFile.write("        (void) m;\n")
+                for e in entries:
+                    if e[0] == 'array':
+                        outFile.write('''        for (std::size_t i = 0; i < %(count)d; i++) {
+            %(f)s::store(report, i, m.%(f)s[i]);
+        }
+''' % {'f':e[1], 'count':e[4]})
+                    else:
+                        outFile.write("        %(f)s::store(report, m.%(f)s);\n" % {'f':e[1]})
+                outFile.write("    }\n")
+            outFile.write("};\n")
+
+            if message.decode:
+                outFile.write('''
+template <>
+class View<%(name)s, %(ver)d> {
+public:
+    using layout = Layout<%(name)s, %(ver)d>;
+
+    /** Returns a view of report, if it is this type of message. */
+    static std::optional<View> from(ConstBytes report) {
+        if (!layout::matches(report)) {
+            return std::nullopt;
+        }
+        return View(report.data());
+    }
+
+    ConstBytes bytes() const { return ConstBytes(report_, layout::size); }
+''' % d)
+                for e in entries:
+                    if e[0] == 'array':
+                        outFile.write("    %(t)s %(f)s(std::size_t i) const { return layout::%(f)s::load(report_, i); }\n" % {'t':e[2], 'f':e[1]})
+                    else:
+                        outFile.write("    %(t)s %(f)s() const { return layout::%(f)s::load(report_); }\n" % {'t':e[2], 'f':e[1]})
+                outFile.write('''
+private:
+    explicit View(const uint8_t* report) : report_(report) {}
+    const uint8_t* report_;
+};
+''')
+
+    decodeMessages = [m for m in messages if m.decode]
+    outFile.write('''
+/** @ingroup cpp
+ * Decode a report as one particular version of a message.
+ *
+ * @return the message, or nothing if the report is a different message
+ */
+template <typename Msg, int Ver>
+inline std::optional<Msg> decode(ConstBytes report) {
+    using L = Layout<Msg, Ver>;
+    static_assert(L::exists, "The message has no such version");
+    if (!L::matches(report)) {
+        return std::nullopt;
+    }
+    Msg m;
+    L::decode(report.data(), m);
+    return m;
+}
+
+/** @ingroup cpp
+ * Decode a report as a message, choosing the layout from the HID
+ * protocol version at runtime.
+ *
+ * @return the message, or nothing if the report is a different message
+ */
+template <typename Msg>
+inline std::optional<Msg> decode(ConstBytes report, int ver) {
+    switch (ver) {
+    case 0:
+        if constexpr (Layout<Msg, 0>::exists) {
+            return decode<Msg, 0>(report);
+        }
+        break;
+    case 1:
+        if constexpr (Layout<Msg, 1>::exists) {
+            return decode<Msg, 1>(report);
+        }
+        break;
+    case 2:
+        if constexpr (Layout<Msg, 2>::exists) {
+            return decode<Msg, 2>(report);
+        }
+        break;
+    }
+    return std::nullopt;
+}
+
+/** @ingroup cpp
+ * Encode one version of a message.
+ *
+ * @param m the message
+ * @param out where to write the report
+ * @param dest the version 2 destination address
+ * @return the length of the report, or FREESPACE_ERROR_BUFFER_TOO_SMALL
+ */
+template <typename Msg, int Ver>
+inline int encode(const Msg& m, MutableBytes out, uint8_t dest = 0) {
+    using L = Layout<Msg, Ver>;
+    static_assert(L::exists, "The message has no such version");
+    if (out.size() < L::size) {
         return FREESPACE_ERROR_BUFFER_TOO_SMALL;
     }
-    return n;
+    L::encode(m, out.data(), dest);
+    return static_cast<int>(L::size);
 }
+
+/** @ingroup cpp
+ * Encode one version of a message at compile time, for requests that
+ * are always sent with the same contents:
+ *
+ *     constexpr auto request = freespace::encoded<freespace::ProductIDRequest, 2>({}, FREESPACE_RESERVED_ADDRESS);
+ *
+ * @param m the message
+ * @param dest the version 2 destination address
+ * @return the encoded report
+ */
+template <typename Msg, int Ver>
+constexpr std::array<uint8_t, Layout<Msg, Ver>::size> encoded(const Msg& m, uint8_t dest = 0) {
+    std::array<uint8_t, Layout<Msg, Ver>::size> report{};
+    Layout<Msg, Ver>::encode(m, report.data(), dest);
+    return report;
+}
+
+/** @ingroup cpp
+ * Any received message. std::monostate means the report couldn't be
+ * decoded.
+ */
+using Message = std::variant<std::monostate''')
+    for message in decodeMessages:
+        outFile.write(",\n                             %s" % message.name)
+    outFile.write('''>;
+
+/** @ingroup cpp
+ * Decode any received message.
+ *
+ * @param report the report received from the Freespace device
+ * @param ver the HID protocol version of the report
+ * @return the message, or std::monostate if the report couldn't be decoded
+ */
+inline Message decode(ConstBytes report, int ver) {
+    if (report.size() == 0) {
+        return std::monostate();
+    }
+    switch (ver) {
 ''')
-    
-    
+    for v in range(3):
+        outFile.write("    case %d:\n        switch (report[0]) {\n" % v)
+        byId = {}
+        for message in decodeMessages:
+            if len(message.ID[v]) == 0:
+                continue
+            byId.setdefault(message.ID[v]['constID'], []).append(message)
+        for reportId in sorted(byId.keys()):
+            outFile.write("        case %d:\n" % reportId)
+            for message in byId[reportId]:
+                outFile.write('''            if (auto m = decode<%(name)s, %(ver)d>(report)) {
+                return *m;
+            }
+''' % {'name':message.name, 'ver':v})
+            outFile.write("            break;\n")
+        outFile.write("        }\n        break;\n")
+    outFile.write('''    }
+    return std::monostate();
+}
+
+} // namespace freespace
+
+#endif /* FREESPACE_MESSAGES_HPP_ */
+''')
+
+# --------------------------  Constant Encoding ------------------------------------
+#
+# freespace_encoded.h lets requests that never change be encoded at
+# compile time. FREESPACE_ENCODE_<MESSAGE>_V<version>() expands to a
+# byte array initializer, and the FREESPACE_FIELD_ handles locate each
+# field for patching a freespace_messageTemplate.
+
+def encodedMacroName(message, v):
+    return "FREESPACE_ENCODE_%s_V%d" % (message.name.upper(), v)
+
+def writeEncodedHeader(messages, outFile):
+    outFile.write('''#include "freespace/freespace_template.h"
+
+/**
+ * @defgroup encoded Constant Messages
+ *
+ * FREESPACE_ENCODE_<MESSAGE>_V<version>(...) builds an encoded message
+ * as an array initializer, so a request whose fields are constants costs
+ * nothing to encode:
+ *
+ *     static const uint8_t request[] = FREESPACE_ENCODE_PRODUCTIDREQUEST_V2(FREESPACE_RESERVED_ADDRESS);
+ *
+ * The arguments are the version 2 destination, where there is one,
+ * then the fields in report order, with one argument per array element.
+ * FREESPACE_ENCODE_<MESSAGE>_V<version>_LENGTH is the encoded length.
+ *
+ * FREESPACE_FIELD_<MESSAGE>_V<version>_<FIELD> is the handle of a field
+ * for freespace_template_set(). Array fields take the element index.
+ */
+''')
+    for message in messages:
+        if not message.encode:
+            continue
+        extractFields(message)
+        for v in range(3):
+            if len(message.ID[v]) == 0:
+                continue
+            entries, length = cppLayoutFields(message, v)
+            macro = encodedMacroName(message, v)
+            params = []
+            byteExprs = [[] for i in range(length)]
+            byteExprs[0].append("%d" % message.ID[v]['constID'])
+            if v == 2:
+                params.append("dest")
+                byteExprs[1].append("%d" % length)
+                byteExprs[2].append("(dest)")
+            if message.ID[v].has_key('subId'):
+                byteExprs[4 if v == 2 else 1].append("%d" % message.ID[v]['subId']['id'])
+            handles = []
+            upper = "FREESPACE_FIELD_%s_V%d_" % (message.name.upper(), v)
+            for e in entries:
+                if e[0] == 'field':
+                    width = typeWidth(e[2])
+                    params.append(e[1])
+                    for j in range(width):
+                        byteExprs[e[3] + j].append(encodedByte(e[1], j))
+                    handles.append("#define %s%s FREESPACE_FIELD(%d, %d, 0, 0)\n" % (upper, e[1].upper(), e[3], width))
+                elif e[0] == 'array':
+                    width = typeWidth(e[2])
+                    for i in range(e[4]):
+                        params.append("%s%d" % (e[1], i))
+                        for j in range(width):
+                            byteExprs[e[3] + i * width + j].append(encodedByte("%s%d" % (e[1], i), j))
+                    handles.append("#define %s%s(i) FREESPACE_FIELD(%d + %d * (i), %d, 0, 0)\n" % (upper, e[1].upper(), e[3], width, width))
+                else:
+                    params.append(e[1])
+                    byteExprs[e[3]].append("(((%s) & 0x%x) << %d)" % (e[1], e[5], e[4]))
+                    handles.append("#define %s%s FREESPACE_FIELD(%d, 0, %d, 0x%x)\n" % (upper, e[1].upper(), e[3], e[4], e[5]))
+
+            outFile.write("\n/** @ingroup encoded\n * Encode a version %d %s message.\n */\n" % (v, message.name))
+            outFile.write("#define %s_LENGTH %d\n" % (macro, length))
+            outFile.write("#define %s(%s) { \\\n" % (macro, ", ".join(params)))
+            for i in range(length):
+                if len(byteExprs[i]) == 0:
+                    expr = "0"
+                elif len(byteExprs[i]) == 1 and byteExprs[i][0].isdigit():
+                    expr = byteExprs[i][0]
+                elif len(byteExprs[i]) == 1:
+                    expr = "(uint8_t) %s" % byteExprs[i][0]
+                else:
+                    expr = "(uint8_t) (%s)" % " | ".join(byteExprs[i])
+                outFile.write("    %s%s \\\n" % (expr, "," if i < length - 1 else ""))
+            outFile.write("}\n")
+            for h in handles:
+                outFile.write(h)
+
+def encodedByte(name, j):
+    if j == 0:
+        return "(%s)" % name
+    return "((uint32_t) (%s) >> %d)" % (name, 8 * j)
+
+def typeWidth(cType):
+    return {'uint8_t':1, 'int8_t':1, 'uint16_t':2, 'int16_t':2, 'uint32_t':4, 'int32_t':4}[cType]
+
+# --------------------------  Batch Decoding ------------------------------------
+#
+# freespace_decode_batch() decodes a run of reports into one set of
+# columns per received message type, with one array per field, so that
+# analysis code can loop over a field across many messages. The columns
+# belong to a freespace_batch and are only reallocated when a batch
+# holds more messages of a type than any batch before it.
+
+def batchColumnDecl(field):
+    if field['count'] == 1:
+        return "%s* %s" % (field['type'], field['name'])
+    return "%s (*%s)[%d]" % (field['type'], field['name'], field['count'])
+
+# Column names used for bookkeeping in every columns struct.
+BATCH_RESERVED_NAMES = ('numMessages', 'capacity', 'index')
+
+def writeBatchHeader(messages, outHeader):
+    outHeader.write('''#include "freespace/freespace_codecs.h"
+
+/**
+ * @defgroup batch Batch Decoding
+ *
+ * Decoding of many received messages at once into one array per field.
+ * The messages of each type go in a freespace_<message>Columns struct
+ * inside a freespace_batch. Entry i of every array in a columns struct
+ * belongs to the same message, and index[i] gives that message's
+ * position in the reports passed to freespace_decode_batch().
+ *
+ * A batch keeps its arrays between calls to freespace_decode_batch(),
+ * so decoding batches of a similar mix of messages into the same
+ * freespace_batch only allocates memory for the first one.
+ */
+''')
+    for message in messages:
+        if not message.decode:
+            continue
+        fields = extractFields(message)
+        for field in fields:
+            if field['name'] in BATCH_RESERVED_NAMES:
+                raise Exception("Field %s of message %s clashes with a batch column name" % (field['name'], message.name))
+        outHeader.write('''
+/** @ingroup batch
+ * The decoded %(name)s messages in a batch.
+ */
+struct freespace_%(name)sColumns {
+    int numMessages; /**< The number of messages */
+    int capacity;    /**< The number of messages the arrays can hold */
+    int* index;      /**< The position of each message in the batch */
+''' % {'name':message.name})
+        for field in fields:
+            outHeader.write("    %s;\n" % batchColumnDecl(field))
+        outHeader.write("};\n")
+
+    outHeader.write('''
+/** @ingroup batch
+ * The columns for each received message type. Initialize with
+ * freespace_batch_init() and release with freespace_batch_free().
+ */
+struct freespace_batch {
+    int count;  /**< The number of reports decoded */
+    int errors; /**< The number of reports that could not be decoded */
+''')
+    for message in messages:
+        if message.decode:
+            outHeader.write("    struct freespace_%sColumns %s;\n" % (message.name, message.structName))
+    outHeader.write('''};
+
+/** @ingroup batch
+ * Initialize an empty batch. No memory is allocated until messages are
+ * decoded into it.
+ *
+ * @param batch the batch to initialize
+ */
+LIBFREESPACE_API void freespace_batch_init(struct freespace_batch* batch);
+
+/** @ingroup batch
+ * Free the arrays owned by a batch and leave it empty.
+ *
+ * @param batch the batch to free
+ */
+LIBFREESPACE_API void freespace_batch_free(struct freespace_batch* batch);
+
+/** @ingroup batch
+ * Make room for messages of one type ahead of time, so that decoding
+ * up to that many messages of the type doesn't allocate.
+ *
+ * @param batch the batch
+ * @param messageType the message type, from enum MessageTypes
+ * @param capacity the number of messages to make room for
+ * @return FREESPACE_SUCCESS or an error code
+ */
+LIBFREESPACE_API int freespace_batch_reserve(struct freespace_batch* batch, int messageType, int capacity);
+
+/** @ingroup batch
+ * Decode a run of received reports into a batch. Any messages already
+ * in the batch are discarded first, but its arrays are reused. Reports
+ * that can't be decoded are counted in batch->errors and skipped.
+ *
+ * @param batch the batch to decode into
+ * @param reports the reports, stored one after another
+ * @param lengths the length of each report
+ * @param count the number of reports
+ * @param ver the HID protocol version to use to decode the reports
+ * @return the number of reports decoded, or an error code
+ */
+LIBFREESPACE_API int freespace_decode_batch(struct freespace_batch* batch,
+                                            const uint8_t* reports,
+                                            const int* lengths,
+                                            int count,
+                                            uint8_t ver);
+
+''')
+
+def writeBatchBody(messages, outFile):
+    outFile.write('''#include <stdlib.h>
+
+#define BATCH_MIN_CAPACITY 16
+
+// Grow one column to hold capacity entries of the given size.
+static int growColumn(void** column, int capacity, size_t size) {
+    void* p = realloc(*column, (size_t) capacity * size);
+    if (p == NULL) {
+        return FREESPACE_ERROR_OUT_OF_MEMORY;
+    }
+    *column = p;
+    return FREESPACE_SUCCESS;
+}
+
+#define GROW_COLUMN(c, name, capacity) \\
+    do { \\
+        if (growColumn((void**) &(c)->name, capacity, sizeof(*(c)->name)) != FREESPACE_SUCCESS) { \\
+            return FREESPACE_ERROR_OUT_OF_MEMORY; \\
+        } \\
+    } while (0)
+''')
+    for message in messages:
+        if not message.decode:
+            continue
+        fields = extractFields(message)
+        d = {'name':message.name, 'structName':message.structName, 'ver':''}
+        # Synthesized fields go through their getter, which needs the version.
+        synthesized = synthesizedFields(message)
+        if len(synthesized) > 0:
+            d['ver'] = ', uint8_t ver'
+        outFile.write('''
+static int reserve_%(name)s(struct freespace_%(name)sColumns* c, int capacity) {
+    if (capacity <= c->capacity) {
+        return FREESPACE_SUCCESS;
+    }
+    GROW_COLUMN(c, index, capacity);
+''' % d)
+        for field in fields:
+            outFile.write("    GROW_COLUMN(c, %s, capacity);\n" % field['name'])
+        outFile.write('''    c->capacity = capacity;
+    return FREESPACE_SUCCESS;
+}
+
+static void free_%(name)s(struct freespace_%(name)sColumns* c) {
+    free(c->index);
+''' % d)
+        for field in fields:
+            outFile.write("    free(c->%s);\n" % field['name'])
+        outFile.write('''}
+
+static int append_%(name)s(struct freespace_%(name)sColumns* c, const struct freespace_%(name)s* m, int index%(ver)s) {
+    int i = c->numMessages;
+
+    if (i == c->capacity) {
+        int rc = reserve_%(name)s(c, i < BATCH_MIN_CAPACITY ? BATCH_MIN_CAPACITY : 2 * i);
+        if (rc != FREESPACE_SUCCESS) {
+            return rc;
+        }
+    }
+    c->index[i] = index;
+''' % d)
+        if len(fields) == 0:
+            outFile.write("    (void) m;\n")
+        for field in fields:
+            if field['name'] in synthesized:
+                outFile.write("    c->%(f)s[i] = freespace_%(name)s_%(f)s(m, ver);\n" % {'f':field['name'], 'name':message.name})
+            elif field['count'] == 1:
+                outFile.write("    c->%(f)s[i] = m->%(f)s;\n" % {'f':field['name']})
+            else:
+                outFile.write("    memcpy(c->%(f)s[i], m->%(f)s, sizeof(m->%(f)s));\n" % {'f':field['name']})
+        outFile.write('''    c->numMessages = i + 1;
+    return FREESPACE_SUCCESS;
+}
+''')
+
     outFile.write('''
-LIBFREESPACE_API int freespace_print%(name)s(FILE* fp, const struct freespace_%(name)s* s) {
-    char str[1024];
-    int rc;
-    if (s == NULL) {
+LIBFREESPACE_API void freespace_batch_init(struct freespace_batch* batch) {
+    memset(batch, 0, sizeof(*batch));
+}
+
+LIBFREESPACE_API void freespace_batch_free(struct freespace_batch* batch) {
+''')
+    for message in messages:
+        if message.decode:
+            outFile.write("    free_%s(&batch->%s);\n" % (message.name, message.structName))
+    outFile.write('''    memset(batch, 0, sizeof(*batch));
+}
+
+LIBFREESPACE_API int freespace_batch_reserve(struct freespace_batch* batch, int messageType, int capacity) {
+    switch (messageType) {
+''')
+    for message in messages:
+        if message.decode:
+            outFile.write('''    case %(enumName)s:
+        return reserve_%(name)s(&batch->%(structName)s, capacity);
+''' % {'enumName':message.enumName, 'name':message.name, 'structName':message.structName})
+    outFile.write('''    default:
         return FREESPACE_ERROR_UNEXPECTED;
     }
-    rc = freespace_print%(name)sStr(str, sizeof(str), s);
-    if (rc < 0) {
-        return rc;
+}
+
+LIBFREESPACE_API int freespace_decode_batch(struct freespace_batch* batch,
+                                            const uint8_t* reports,
+                                            const int* lengths,
+                                            int count,
+                                            uint8_t ver) {
+    struct freespace_message m;
+    int rc;
+    int i;
+
+    batch->count = 0;
+    batch->errors = 0;
+''')
+    for message in messages:
+        if message.decode:
+            outFile.write("    batch->%s.numMessages = 0;\n" % message.structName)
+    outFile.write('''
+    for (i = 0; i < count; i++) {
+        const uint8_t* report = reports;
+
+        reports += lengths[i];
+        if (freespace_decode_message(report, lengths[i], &m, ver) != FREESPACE_SUCCESS) {
+            batch->errors++;
+            continue;
+        }
+        switch (m.messageType) {
+''')
+    for message in messages:
+        if message.decode:
+            ver = ''
+            if len(synthesizedFields(message)) > 0:
+                ver = ', ver'
+            outFile.write('''        case %(enumName)s:
+            rc = append_%(name)s(&batch->%(structName)s, &m.%(structName)s, i%(ver)s);
+            break;
+''' % {'enumName':message.enumName, 'name':message.name, 'structName':message.structName, 'ver':ver})
+    outFile.write('''        default:
+            batch->errors++;
+            continue;
+        }
+        if (rc != FREESPACE_SUCCESS) {
+            return rc;
+        }
+        batch->count++;
     }
-    return fprintf(fp, "%%s\\n", str);
+    return batch->count;
 }
-'''%{'name':message.name})
-        
+''')
+
+# --------------------------  Table Driven Codecs ------------------------------------
+#
+# In table mode each message version is described by a run of constant
+# field descriptors, and one pair of loops in the generated C file
+# encodes and decodes every message from them. The per-message entry
+# points are kept, so callers see the same API as the unrolled mode.
+
+# Field descriptor operations. These must match the CODEC_OP_* values
+# written by writeCodecTables.
+TABLE_OPS = {'uint8_t':'CODEC_OP_U8',
+             'int8_t':'CODEC_OP_S8',
+             'uint16_t':'CODEC_OP_U16',
+             'int16_t':'CODEC_OP_S16',
+             'uint32_t':'CODEC_OP_U32',
+             'int32_t':'CODEC_OP_S32'}
+
+def tableFieldDescriptors(message, v, packed=[]):
+    # Returns a list of (op, byte, shift, mask, member) tuples for one
+    # version of a message, in the order the unrolled codecs touch them,
+    # followed by the descriptors that only the encoder needs, which clear
+    # the bytes that are entirely reserved. packed lists the bit fields that
+    # get a CODEC_OP_FLAGS descriptor.
+    descriptors = []
+    encodeOnly = []
+    byteCounter = 0
+    if message.ID[v].has_key('subId'):
+        byteCounter += 1
+    for field in message.Fields[v]:
+        if field.has_key('synthesized'):
+            continue
+        if field['name'] == 'RESERVED':
+            byteCounter += field['size']
+            continue
+        if field.has_key('cType'):
+            typeInfo = field['typeDecode']
+            if typeInfo['width'] == 1 and typeInfo['count'] != 1:
+                # Byte arrays are copied in one go.
+                descriptors.append(('CODEC_OP_BYTES', byteCounter, 0, typeInfo['count'],
+                                    "%s.%s" % (message.structName, field['name'])))
+                byteCounter += typeInfo['count']
+                continue
+            for i in range(typeInfo['count']):
+                member = "%s.%s" % (message.structName, field['name'])
+                if typeInfo['count'] != 1:
+                    member += "[%d]" % i
+                descriptors.append((TABLE_OPS[typeInfo['type']], byteCounter, 0, 0, member))
+                byteCounter += typeInfo['width']
+        elif field.has_key('bits') or field.has_key('nibbles'):
+            first = 'CODEC_OP_FIRST | '
+            shift = 0
+            if field.has_key('bits'):
+                parts = [(bit, bit.get('size', 1)) for bit in field['bits']]
+            else:
+                parts = [(nibble, 4) for nibble in field['nibbles']]
+            for part, sz in parts:
+                if part['name'] != 'RESERVED':
+                    if part['typeDecode']['type'] == 'uint8_t':
+                        op = 'CODEC_OP_BITS'
+                    else:
+                        op = 'CODEC_OP_BITS_INT'
+                    descriptors.append((first + op, byteCounter, shift, (1 << sz) - 1,
+                                        "%s.%s" % (message.structName, part['name'])))
+                    first = ''
+                shift += sz
+            if first != '':
+                # Everything in the byte is reserved, so the encoder just clears it.
+                encodeOnly.append(('CODEC_OP_FIRST | CODEC_OP_BITS', byteCounter, 0, 0, None))
+            if field['name'] in packed:
+                mask = 0
+                for name, cType, partShift, partMask in bitFieldParts(field):
+                    mask |= partMask << partShift
+                descriptors.append(('CODEC_OP_FLAGS', byteCounter, 0, mask,
+                                    "%s.%s" % (message.structName, field['name'])))
+            byteCounter += 1
+        else:
+            print ("Unrecognized field type in %s\n" % message.name)
+    return descriptors, encodeOnly, byteCounter
+
+def writeCodecTables(messages, outFile, packedFlags=False):
+    outFile.write('''
+#define CODEC_OP_U8        0
+#define CODEC_OP_S8        1
+#define CODEC_OP_U16       2
+#define CODEC_OP_S16       3
+#define CODEC_OP_U32       4
+#define CODEC_OP_S32       5
+#define CODEC_OP_BITS      6 // (byte >> shift) & mask into a uint8_t
+#define CODEC_OP_BITS_INT  7 // (byte >> shift) & mask into an int
+#define CODEC_OP_FLAGS     8 // byte & mask into a uint8_t, skipped by the encoder
+#define CODEC_OP_BYTES     9 // mask bytes copied as they are, for uint8_t and int8_t arrays
+#define CODEC_OP_MASK   0x7f
+#define CODEC_OP_FIRST  0x80 // First bit field in its byte, so the encoder assigns instead of ORs
+
+#define CODEC_NO_MEMBER 0xffff
+
+// Where the message structs start within struct freespace_message.
+#define CODEC_BODY_OFFSET offsetof(struct freespace_message, %s)
+
+struct CodecField {
+    uint8_t op;
+    uint8_t byte;    // Offset of the field from the start of the payload
+    uint8_t shift;   // Bit fields only
+    uint8_t mask;    // Bit fields, or the length of a CODEC_OP_BYTES array
+    uint16_t member; // Offset of the value in the message struct
+};
+
+struct CodecVersion {
+    uint8_t size;     // Encoded size returned by the encoder, or 0 if the message has no such version
+    uint8_t id;
+    int16_t subId;    // -1 if the message has no sub ID
+    uint16_t first;   // Index of the first descriptor in codecFields
+    uint8_t count;    // Descriptors used by the decoder
+    uint8_t encodeCount; // Also counts the ones that clear reserved bytes
+};
+
+static const struct CodecField codecFields[] = {
+''' % messages[0].structName)
+    versions = []
+    index = 0
+    for message in messages:
+        fields = extractFields(message) # Attaches the type information to each field
+        packed = []
+        if packedFlags:
+            packed = packedFlagFields(message, fields)
+        entry = []
+        for v in range(3):
+            if len(message.ID[v]) == 0 or not (message.encode or message.decode):
+                entry.append(None)
+                continue
+            descriptors, encodeOnly, _ = tableFieldDescriptors(message, v, packed)
+            for op, byte, shift, mask, member in descriptors + encodeOnly:
+                if member is None:
+                    memberExpr = 'CODEC_NO_MEMBER'
+                else:
+                    memberExpr = 'offsetof(struct freespace_%s, %s)' % (message.name, member[len(message.structName) + 1:])
+                outFile.write('    {%s, %d, %d, 0x%02x, %s},\n' % (op, byte, shift, mask, memberExpr))
+            subId = -1
+            if message.ID[v].has_key('subId'):
+                subId = message.ID[v]['subId']['id']
+            entry.append((message.getMessageSize(v), message.ID[v]['constID'], subId,
+                          index, len(descriptors), len(descriptors) + len(encodeOnly)))
+            index += len(descriptors) + len(encodeOnly)
+        versions.append(entry)
+    if index == 0:
+        outFile.write('    {0, 0, 0, 0, CODEC_NO_MEMBER},\n')
+    outFile.write('''};
+
+// Indexed by message type and then by HID protocol version.
+static const struct CodecVersion codecVersions[][3] = {
+''')
+    for message, entry in zip(messages, versions):
+        outFile.write('    /* %s */ {' % message.enumName)
+        items = []
+        for item in entry:
+            if item is None:
+                items.append('{0, 0, -1, 0, 0, 0}')
+            else:
+                items.append('{%d, %d, %d, %d, %d, %d}' % item)
+        outFile.write(', '.join(items))
+        outFile.write('},\n')
+    outFile.write('''};
+
+// Copies a CODEC_OP_BYTES array, which has at least two bytes, in fixed
+// size pieces whose last one may overlap the one before. A memcpy whose
+// length is only known at run time is inlined as a string instruction,
+// which costs more than the whole of a short array.
+static void copyBytes(uint8_t* d, const uint8_t* b, int n) {
+    int i;
+
+    if (n < 4) {
+        d[0] = b[0];
+        d[n / 2] = b[n / 2];
+        d[n - 1] = b[n - 1];
+        return;
+    }
+    if (n < 8) {
+        memcpy(d, b, 4);
+        memcpy(d + n - 4, b + n - 4, 4);
+        return;
+    }
+    for (i = 0; i < n - 8; i += 8) {
+        memcpy(d + i, b + i, 8);
+    }
+    memcpy(d + n - 8, b + n - 8, 8);
+}
+
+static int decodeTable(const uint8_t* message, int length, void* body, uint8_t ver, int type, int check) {
+    const struct CodecVersion* cv;
+    const struct CodecField* f;
+    const struct CodecField* end;
+    uint8_t* s = (uint8_t*) body;
+    int offset = 1;
+
+    if (ver == 2) {
+        offset = 4;
+    }
+    if (check) {
+        if (ver > 2 || codecVersions[type][ver].size == 0) {
+            return FREESPACE_ERROR_INVALID_HID_PROTOCOL_VERSION;
+        }
+        cv = &codecVersions[type][ver];
+        if (length < cv->size) {
+            CODECS_PRINTF("Length mismatch for message type %d.  Expected %d.  Got %d.\\n", type, cv->size, length);
+            return FREESPACE_ERROR_BUFFER_TOO_SMALL;
+        }
+        if (message[0] != cv->id) {
+            return FREESPACE_ERROR_MALFORMED_MESSAGE;
+        }
+        if (cv->subId >= 0 && message[offset] != cv->subId) {
+            return FREESPACE_ERROR_MALFORMED_MESSAGE;
+        }
+    }
+    cv = &codecVersions[type][ver];
+
+    message += offset;
+    for (f = &codecFields[cv->first], end = f + cv->count; f < end; f++) {
+        const uint8_t* b = message + f->byte;
+        uint8_t* d = s + f->member;
+
+        switch (f->op & CODEC_OP_MASK) {
+            case CODEC_OP_U8:       *d = toUint8(b); break;
+            case CODEC_OP_S8:       *(int8_t*) d = toInt8(b); break;
+            case CODEC_OP_U16:      *(uint16_t*) d = toUint16(b); break;
+            case CODEC_OP_S16:      *(int16_t*) d = toInt16(b); break;
+            case CODEC_OP_U32:      *(uint32_t*) d = toUint32(b); break;
+            case CODEC_OP_S32:      *(int32_t*) d = toInt32(b); break;
+            case CODEC_OP_BITS:     *d = (uint8_t) ((*b >> f->shift) & f->mask); break;
+            case CODEC_OP_BITS_INT: *(int*) d = (*b >> f->shift) & f->mask; break;
+            case CODEC_OP_FLAGS:    *d = (uint8_t) (*b & f->mask); break;
+            case CODEC_OP_BYTES:    copyBytes(d, b, f->mask); break;
+        }
+    }
+    return FREESPACE_SUCCESS;
+}
+
+static int encodeTable(const struct freespace_message* m, uint8_t* message, int maxlength, int type) {
+    const struct CodecVersion* cv;
+    const struct CodecField* f;
+    const struct CodecField* end;
+    const uint8_t* s = (const uint8_t*) m + CODEC_BODY_OFFSET;
+    uint8_t* payload;
+    int offset = 1;
+
+    if (m->ver > 2 || codecVersions[type][m->ver].size == 0) {
+        return FREESPACE_ERROR_INVALID_HID_PROTOCOL_VERSION;
+    }
+    cv = &codecVersions[type][m->ver];
+    if (maxlength < cv->size) {
+        CODECS_PRINTF("message type %d encode(<INVALID LENGTH>)\\n", type);
+        return FREESPACE_ERROR_BUFFER_TOO_SMALL;
+    }
+    message[0] = cv->id;
+    if (m->ver == 2) {
+        message[1] = cv->size;
+        message[2] = m->dest;
+        message[3] = m->src;
+        offset = 4;
+    }
+    if (cv->subId >= 0) {
+        message[offset] = (uint8_t) cv->subId;
+    }
+
+    payload = message + offset;
+    for (f = &codecFields[cv->first], end = f + cv->encodeCount; f < end; f++) {
+        uint8_t* b = payload + f->byte;
+        const uint8_t* d = s + f->member;
+        uint32_t v;
+
+        switch (f->op & CODEC_OP_MASK) {
+            case CODEC_OP_U8:
+            case CODEC_OP_S8:
+                b[0] = *d;
+                break;
+            case CODEC_OP_U16:
+            case CODEC_OP_S16:
+                fromUint16(b, *(const uint16_t*) d);
+                break;
+            case CODEC_OP_U32:
+            case CODEC_OP_S32:
+                fromUint32(b, *(const uint32_t*) d);
+                break;
+            case CODEC_OP_BITS:
+                v = f->member == CODEC_NO_MEMBER ? 0 : (uint32_t) ((*d & f->mask) << f->shift);
+                b[0] = (uint8_t) ((f->op & CODEC_OP_FIRST) ? v : (b[0] | v));
+                break;
+            case CODEC_OP_BITS_INT:
+                v = (uint32_t) ((*(const int*) d & f->mask) << f->shift);
+                b[0] = (uint8_t) ((f->op & CODEC_OP_FIRST) ? v : (b[0] | v));
+                break;
+            case CODEC_OP_BYTES:
+                copyBytes(b, d, f->mask);
+                break;
+        }
+    }
+    return cv->size;
+}
+
+''')
+
+def writeTableCodecCFile(message, fields, outFile, synthesized="exact"):
+    if message.decode:
+        outFile.write('''static int decode%(name)sBody(const uint8_t* message, int length, struct freespace_%(name)s* s, uint8_t ver, int check) {
+    int rc = decodeTable(message, length, s, ver, %(enumName)s, check);
+''' % {'name':message.name, 'enumName':message.enumName})
+        for v in range(3):
+            if synthesized == "lazy":
+                break
+            synthesizedFields = [f for f in message.Fields[v] if f.has_key('synthesized')]
+            if len(synthesizedFields) == 0:
+                continue
+            outFile.write('''    if (rc == FREESPACE_SUCCESS && ver == %d) {
+''' % v)
+            for field in synthesizedFields:
+                outFile.write(specialCaseCode(field['synthesized']).replace("\t\t\t", "        "))
+            outFile.write("    }\n")
+        outFile.write("    return rc;\n}\n\n")
+        writeDecodeWrapper(message, outFile)
+
+    if message.encode:
+        outFile.write('''LIBFREESPACE_API int freespace_encode%(name)s(const struct freespace_message* m, uint8_t* message, int maxlength) {
+    return encodeTable(m, message, maxlength, %(enumName)s);
+}
+
+''' % {'name':message.name, 'enumName':message.enumName})
+
 # --------------------------  Syntax Helpers ------------------------------------
 
 def fieldToPrintFormat(field):
@@ -897,16 +3603,93 @@ def writeCloseExternC(outHeader):
     outHeader.write('#endif\n')
 
 #----------------------- Special Case Code ----------------------------
+# The member each special case fills in and the expression that computes
+# it from the rest of the struct s.
+SPECIAL_CASES = {
+    # Calculate the A value of the quaternion
+    # A = sqrt(16384**2 - (B**2 + C**2 + D**2))
+    'case_A': ('angularPosA', 'quaternionA(s->angularPosB, s->angularPosC, s->angularPosD)'),
+}
+
 def specialCaseCode(case):
-    if case == 'case_A':
-        # Calculate the A value of the quaternion
-        # A = sqrt(16384**2 - (B**2 + C**2 + D**2))
-        specialCode = "\t\t\ts->angularPosA = (int16_t) sqrt(268435456 - ((s->angularPosB * s->angularPosB) + (s->angularPosC * s->angularPosC) + (s->angularPosD * s->angularPosD)));\n"
+    if SPECIAL_CASES.has_key(case):
+        specialCode = "\t\t\ts->%s = %s;\n" % SPECIAL_CASES[case]
     else:
         print ("Unrecognized special case: %s" % case)
         specialCode =  "Unknown code goes here."
         
     return specialCode
+
+# Helpers for the special cases. With "exact" and "lazy" the quaternion A
+# is the truncated double precision square root, as it always has been.
+# With "float" it comes from sqrtf, which is cheaper where double
+# precision is done in software and is at most 1 above the exact value.
+# The C codecs and the C++ header get the same code, so that they always
+# agree.
+def writeSynthesizedHelpers(outFile, synthesized, cpp=False):
+    d = {'storage': 'static', 'sqrt': 'sqrt', 'sqrtf': 'sqrtf'}
+    if cpp:
+        d = {'storage': 'inline', 'sqrt': 'std::sqrt', 'sqrtf': 'std::sqrt'}
+    outFile.write('''// The real part of a unit quaternion whose parts are scaled by 16384,
+// from the three imaginary parts. Rounding in the device can leave
+// B^2 + C^2 + D^2 slightly above 16384^2, which gives 0.
+%(storage)s int16_t quaternionA(int16_t b, int16_t c, int16_t d) {
+    int64_t n = 268435456 - ((int64_t) b * b + (int64_t) c * c + (int64_t) d * d);
+
+    if (n <= 0) {
+        return 0;
+    }
+''' % d)
+    if synthesized == "float":
+        outFile.write("    return (int16_t) %(sqrtf)s((float) n);\n" % d)
+    else:
+        outFile.write("    return (int16_t) %(sqrt)s((double) n);\n" % d)
+    outFile.write("}\n\n")
+
+# The fields of a message that some version computes instead of reading
+# from the report, in the order they first appear.
+def synthesizedFields(message):
+    names = []
+    for version in message.Fields:
+        for field in version:
+            if field.has_key('synthesized') and field['name'] not in names:
+                names.append(field['name'])
+    return names
+
+def writeSynthesizedGetterDecls(message, outHeader):
+    for name in synthesizedFields(message):
+        outHeader.write('''
+/** @ingroup messages
+ * Get %(field)s from a decoded %(name)s message. Versions of the message
+ * that don't carry it compute it from the other fields, either while
+ * decoding or, when the codecs are generated with lazy synthesized fields,
+ * only here.
+ *
+ * @param s the decoded message
+ * @param ver the protocol version the message was decoded with
+ * @return the value of %(field)s
+ */
+LIBFREESPACE_API %(type)s freespace_%(name)s_%(field)s(const struct freespace_%(name)s* s, uint8_t ver);
+''' % {'name':message.name, 'field':name, 'type':synthesizedType(message, name)})
+
+def synthesizedType(message, name):
+    for version in message.Fields:
+        for field in version:
+            if field['name'] == name:
+                return field['cType']
+
+def writeSynthesizedGetters(message, outFile, synthesized):
+    for name in synthesizedFields(message):
+        outFile.write("LIBFREESPACE_API %s freespace_%s_%s(const struct freespace_%s* s, uint8_t ver) {\n" %
+                      (synthesizedType(message, name), message.name, name, message.name))
+        if synthesized == "lazy":
+            for v in range(3):
+                for field in message.Fields[v]:
+                    if field['name'] == name and field.has_key('synthesized'):
+                        outFile.write("    if (ver == %d) {\n        return %s;\n    }\n" % (v, SPECIAL_CASES[field['synthesized']][1]))
+        else:
+            outFile.write("    (void) ver;\n")
+        outFile.write("    return s->%s;\n}\n\n" % name)
 # ---------------------- Main function --------------------------------
 # Courtesy of Guido: http://www.artima.com/weblogs/viewpost.jsp?thread=4829
 class Usage(Exception):
@@ -926,6 +3709,16 @@ def main(argv=None):
                             default=False, 
                             help="Use test mode to build BOTH encoders and decoders for ALL message types. " +
                                  "By default encoders are built for outgoing msgs and decoders for incoming msgs")
+        parser.add_argument("-m", "--mode", default="unrolled", choices=["unrolled", "table"],
+                            help="Generate unrolled per-message codecs, or compact descriptor tables " +
+                                 "interpreted by a shared encode/decode loop")
+        parser.add_argument("-p", "--packed-flags", default="0", choices=["0", "1"],
+                            help="Also decode each byte of bit flags into one packed uint8_t member, " +
+                                 "next to the per-flag members")
+        parser.add_argument("-y", "--synthesized", default="exact", choices=["exact", "float", "lazy"],
+                            help="How decoders fill in fields computed from other fields, such as the " +
+                                 "quaternion A of UserFrame: double precision, single precision, or " +
+                                 "only when read through freespace_<message>_<field>()")
         parser.add_argument("-I", "--include", default="include", 
                             help="Include directory to write generated freespace headers to")
         parser.add_argument("-s", "--src", default="src",
@@ -951,7 +3744,11 @@ def main(argv=None):
 
         mcg = MessageCodeGenerator(
             includeDir,
-            srcDir
+            srcDir,
+            args.mode,
+            args.packed_flags == "1",
+            args.synthesized,
+            bool(args.test)
         )
         mcg.writeMessages(messages)
     except Usage, err:
@@ -109,6 +109,17 @@ typedef void (*freespace_hotplugCallback)(enum freespace_hotplugEvent event,
                                           FreespaceDeviceId id,
                                           void* cookie);
 
+/** @ingroup async
+ * Where receive callbacks run when libfreespace handles events on its
+ * own thread. See freespace_startEventThread().
+ */
+enum freespace_eventThreadDispatch {
+    /** Queue received messages and call back from freespace_perform(). */
+    FREESPACE_DISPATCH_PERFORM,
+    /** Call back directly from the event thread. */
+    FREESPACE_DISPATCH_EVENT_THREAD
+};
+
 /** @ingroup async
  * Callback for getting notified when a USB packet has been sent.
  *
@@ -118,6 +129,16 @@ typedef void (*freespace_hotplugCallback)(enum freespace_hotplugEvent event,
  */
 typedef void (*freespace_sendCallback)(FreespaceDeviceId id, void* cookie, int result);
 
+/** @ingroup device
+ * Callback for getting notified when an asynchronous close has completed.
+ *
+ * @param id the device that was closed
+ * @param cookie the data passed to freespace_closeDeviceAsync().
+ * @param result FREESPACE_SUCCESS, or FREESPACE_ERROR_TIMEOUT if the
+ *               device's transfers didn't cancel in time
+ */
+typedef void (*freespace_closeCallback)(FreespaceDeviceId id, void* cookie, int result);
+
 /** @ingroup async
  * Callback for received Freespace events in byte stream form.
  * Deprecated for external use.  For use with other language bindings, such as
@@ -212,7 +233,9 @@ LIBFREESPACE_API int freespace_setDeviceHotplugCallback(freespace_hotplugCallbac
 
 /** @ingroup discovery
  *
- * Get the list of attached devices.
+ * Get the list of attached devices. This only looks for inserted and
+ * removed devices. It never handles libusb events, so no receive or send
+ * callbacks run during it.
  *
  * @param list where to store the list of inserted devices
  * @param listSize the max number of ids that the list can hold
@@ -255,7 +278,8 @@ LIBFREESPACE_API int freespace_openDevice(FreespaceDeviceId id);
  * @param id the FreespaceDeviceId of the device to send message to
  * @param message the message to send
  * @param length the length of the message
- * @return FREESPACE_SUCCESS or an error
+ * @return FREESPACE_SUCCESS or an error. FREESPACE_ERROR_TIMEOUT if
+ *         the device doesn't take the message within a second.
  */
 LIBFREESPACE_API int freespace_private_send(FreespaceDeviceId id,
                                             const uint8_t* message,
@@ -267,7 +291,8 @@ LIBFREESPACE_API int freespace_private_send(FreespaceDeviceId id,
  *
  * @param id the FreespaceDeviceId of the device to send message to
  * @param message the message to send
- * @return FREESPACE_SUCCESS or an error
+ * @return FREESPACE_SUCCESS or an error. FREESPACE_ERROR_TIMEOUT if
+ *         the device doesn't take the message within a second.
  */
 LIBFREESPACE_API int freespace_sendMessage(FreespaceDeviceId id,
                                            struct freespace_message* message);
@@ -306,6 +331,29 @@ LIBFREESPACE_API int freespace_readMessage(FreespaceDeviceId id,
                                            struct freespace_message* message,
                                            unsigned int timeoutMs);
 
+/** @ingroup synchronous
+ *
+ * Read all of the message structs that have been queued for the
+ * specified device.  This function blocks until at least one message
+ * is received, there's a timeout or an error, and then returns every
+ * message already received up to maxMessages without waiting again.
+ * A report that fails to arrive intact or to decode doesn't hide the
+ * good reports queued behind it: they are returned first, and the
+ * error is returned by the next call.
+ *
+ * @param id the FreespaceDeviceId of the device to read from
+ * @param messages where to put the received messages
+ * @param maxMessages the number of messages that fit in messages
+ * @param timeoutMs the timeout in milliseconds for the first message
+ * @param numMessages the number of messages returned
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_readMessages(FreespaceDeviceId id,
+                                            struct freespace_message* messages,
+                                            int maxMessages,
+                                            unsigned int timeoutMs,
+                                            int* numMessages);
+
 /** @ingroup synchronous
  *
  * Flush all of the messages out of any receive queues.  libfreespace
@@ -360,7 +408,9 @@ LIBFREESPACE_API int freespace_setReceiveMessageCallback(FreespaceDeviceId id,
  * @param timeoutMs the number of milliseconds to wait before timing out
  * @param callback the function to call when the send completes
  * @param cookie data passed to the callback function
- * @return FREESPACE_SUCCESS or an error
+ * @return FREESPACE_SUCCESS or an error. These sends aren't limited
+ *         by the pipeline depth. Sends beyond the queue of 16 get
+ *         transfers of their own.
  */
 LIBFREESPACE_API int freespace_private_sendAsync(FreespaceDeviceId id,
                                                  const uint8_t* message,
@@ -378,7 +428,9 @@ LIBFREESPACE_API int freespace_private_sendAsync(FreespaceDeviceId id,
  * @param timeoutMs the number of milliseconds to wait before timing out
  * @param callback the function to call when the send completes
  * @param cookie data passed to the callback function
- * @return FREESPACE_SUCCESS or an error
+ * @return FREESPACE_SUCCESS or an error. These sends aren't limited
+ *         by the pipeline depth. Sends beyond the queue of 16 get
+ *         transfers of their own.
  */
 LIBFREESPACE_API int freespace_sendMessageAsync(FreespaceDeviceId id,
                                                 struct freespace_message* message,
@@ -386,6 +438,77 @@ LIBFREESPACE_API int freespace_sendMessageAsync(FreespaceDeviceId id,
                                                 freespace_sendCallback callback,
                                                 void* cookie);
 
+/** @ingroup async
+ *
+ * Send a message to the specified Freespace device without waiting for
+ * earlier sends to complete. Up to the pipeline depth of sends may be
+ * in flight at once. When the pipeline is full, libfreespace handles
+ * USB events until a slot frees up or timeoutMs expires. The message
+ * is copied, so the buffer may be reused as soon as this returns.
+ * Deprecated for external use.  For use with other language bindings, such as
+ * Python and Java, only.
+ *
+ * @param id the FreespaceDeviceId of the device to send message to
+ * @param message the HID message to send
+ * @param length the length of the message
+ * @param timeoutMs the number of milliseconds to wait for a free slot
+ *                  and for the send itself (0 waits forever)
+ * @param callback the function to call when the send completes
+ * @param cookie data passed to the callback function
+ * @return FREESPACE_SUCCESS, FREESPACE_ERROR_TIMEOUT if the pipeline
+ *         stayed full, or an error
+ */
+LIBFREESPACE_API int freespace_private_sendPipelined(FreespaceDeviceId id,
+                                                     const uint8_t* message,
+                                                     int length,
+                                                     unsigned int timeoutMs,
+                                                     freespace_sendCallback callback,
+                                                     void* cookie);
+
+/** @ingroup async
+ *
+ * Send a message struct to the specified Freespace device without
+ * waiting for earlier sends to complete. See freespace_private_sendPipelined.
+ *
+ * @param id the FreespaceDeviceId of the device to send message to
+ * @param message the HID message struct to send
+ * @param timeoutMs the number of milliseconds to wait for a free slot
+ *                  and for the send itself (0 waits forever)
+ * @param callback the function to call when the send completes
+ * @param cookie data passed to the callback function
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_sendMessagePipelined(FreespaceDeviceId id,
+                                                    struct freespace_message* message,
+                                                    unsigned int timeoutMs,
+                                                    freespace_sendCallback callback,
+                                                    void* cookie);
+
+/** @ingroup async
+ *
+ * Set how many asynchronous sends may be in flight at once for a
+ * device with freespace_sendMessagePipelined. Once the limit is reached,
+ * it waits for a send to complete. freespace_sendMessageAsync isn't
+ * limited. Use a depth of 1 for devices that can't keep up with
+ * back-to-back messages.
+ *
+ * @param id the FreespaceDeviceId of the device
+ * @param depth the number of sends, from 1 to 16 (the default)
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_setSendPipelineDepth(FreespaceDeviceId id, int depth);
+
+/** @ingroup async
+ *
+ * Handle USB events until all asynchronous sends to a device have
+ * completed.
+ *
+ * @param id the FreespaceDeviceId of the device
+ * @param timeoutMs the number of milliseconds to wait (0 waits forever)
+ * @return FREESPACE_SUCCESS, FREESPACE_ERROR_TIMEOUT or an error
+ */
+LIBFREESPACE_API int freespace_waitForSends(FreespaceDeviceId id, unsigned int timeoutMs);
+
 /** @ingroup async
  *
  * Get the next timeout for a call to select or poll.
@@ -426,14 +549,71 @@ LIBFREESPACE_API void freespace_setFileDescriptorCallbacks(freespace_pollfdAdded
  */
 LIBFREESPACE_API int freespace_syncFileDescriptors();
 
+/** @ingroup async
+ *
+ * Start handling USB events on a thread inside libfreespace, so that
+ * receives keep flowing no matter how often the application calls
+ * freespace_perform(). With FREESPACE_DISPATCH_PERFORM, received
+ * messages are queued and the receive callbacks are called from
+ * freespace_perform(). The only file descriptor reported to the
+ * application is then a wakeup descriptor that becomes readable when
+ * messages are waiting. With FREESPACE_DISPATCH_EVENT_THREAD, the
+ * receive callbacks are called directly on the event thread.
+ *
+ * With FREESPACE_DISPATCH_PERFORM, each device queues up to 64 reports
+ * between calls to freespace_perform(). Reports that arrive while the
+ * queue is full are dropped, and after delivering the queued reports
+ * freespace_perform() calls the receive callbacks once with no message
+ * and FREESPACE_ERROR_BUFFER_TOO_SMALL to say that some were lost.
+ *
+ * Set the receive callbacks before starting the thread. The libusb
+ * backend is the only one that supports this mode.
+ *
+ * @param dispatch where receive callbacks are called
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_startEventThread(enum freespace_eventThreadDispatch dispatch);
+
+/** @ingroup async
+ *
+ * Stop the thread started by freespace_startEventThread() and hand
+ * USB event handling back to freespace_perform(). Messages still
+ * queued are delivered before this returns.
+ */
+LIBFREESPACE_API void freespace_stopEventThread();
+
 /** @ingroup device
  *
- * Close a Freespace device.
+ * Close a Freespace device. This waits at most a second for the
+ * device's transfers to cancel. Transfers that take longer are released
+ * by a later freespace_perform() or freespace_exit(), and until then
+ * the device can't be reopened.
  *
  * @param id the Freespace device id to close
  */
 LIBFREESPACE_API void freespace_closeDevice(FreespaceDeviceId id);
 
+/** @ingroup device
+ *
+ * Start closing a Freespace device without waiting for its transfers
+ * to cancel. The close completes from freespace_perform(), and
+ * freespace_getNextTimeout() accounts for it. The device can't be used
+ * or reopened until the callback has been called. If the transfers
+ * haven't cancelled within a second, the callback gets
+ * FREESPACE_ERROR_TIMEOUT and they are released later, as for
+ * freespace_closeDevice(). Backends that close synchronously call the
+ * callback before this returns.
+ *
+ * @param id the Freespace device id to close
+ * @param callback the function to call when the close completes, or NULL
+ * @param cookie data passed to the callback function
+ * @return FREESPACE_SUCCESS, FREESPACE_ERROR_BUSY if a close is
+ *         already in progress, or an error
+ */
+LIBFREESPACE_API int freespace_closeDeviceAsync(FreespaceDeviceId id,
+                                                freespace_closeCallback callback,
+                                                void* cookie);
+
 #ifdef __cplusplus
 }
 #endif
@@ -0,0 +1,113 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREESPACE_DCEOUT_H_
+#define FREESPACE_DCEOUT_H_
+
+#include "freespace/freespace_common.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup dceout DceOut Batch Decoding API
+ *
+ * This page describes functions for decoding many raw DceOut sensor
+ * reports at once into separate arrays per field.
+ */
+
+/** @ingroup dceout
+ * The DceOut report layouts.
+ */
+enum freespace_dceOutType {
+    FREESPACE_DCEOUT_V2,   /**< DceOutV2: 9-axis, 31 byte reports */
+    FREESPACE_DCEOUT_V3,   /**< DceOutV3: 6-axis, 20 byte reports */
+    FREESPACE_DCEOUT_V4T0, /**< DceOutV4T0: accelerometer and gyro, 20 byte reports */
+    FREESPACE_DCEOUT_V4T1  /**< DceOutV4T1: magnetometer and buttons, 15 byte reports */
+};
+
+/** @ingroup dceout
+ * Instruction sets for freespace_setDceOutSimd().
+ */
+enum freespace_dceOutSimd {
+    FREESPACE_DCEOUT_SCALAR,
+    FREESPACE_DCEOUT_SSE2,
+    FREESPACE_DCEOUT_AVX2
+};
+
+/** @ingroup dceout
+ * Destination arrays for freespace_decodeDceOutBatch(). Each array
+ * receives one entry per report. Set the arrays that aren't wanted,
+ * or that the report type doesn't carry, to NULL.
+ *
+ * The flags and buttons arrays receive the raw flag and button bytes
+ * of the reports, with bit 0 holding flag1 or button1.
+ */
+struct freespace_dceOutBatch {
+    uint32_t* sampleBase;
+    int16_t* ax;
+    int16_t* ay;
+    int16_t* az;
+    int16_t* rx;
+    int16_t* ry;
+    int16_t* rz;
+    int16_t* mx;
+    int16_t* my;
+    int16_t* mz;
+    int16_t* temperature;
+    uint8_t* flags;
+    uint8_t* buttons;
+    int8_t* deltaWheel;
+};
+
+/** @ingroup dceout
+ *
+ * Decode raw HID protocol version 2 DceOut reports of one type. The
+ * report ID and sub ID of each report are checked, and decoding stops
+ * at the first report that doesn't match.
+ *
+ * @param type the type of all of the reports
+ * @param reports the first report
+ * @param stride the distance in bytes between the starts of consecutive
+ *               reports. At least the size of the report type.
+ * @param count the number of reports
+ * @param out where to store the decoded fields
+ * @return the number of reports decoded, or an error
+ */
+LIBFREESPACE_API int freespace_decodeDceOutBatch(enum freespace_dceOutType type,
+                                                 const uint8_t* reports,
+                                                 int stride,
+                                                 int count,
+                                                 const struct freespace_dceOutBatch* out);
+
+/** @ingroup dceout
+ *
+ * Limit the instruction set used by freespace_decodeDceOutBatch(). By
+ * default the best one that the CPU supports is picked at runtime.
+ * Mostly useful for testing and benchmarking.
+ *
+ * @param simd the most capable instruction set to use
+ * @return the instruction set that will actually be used
+ */
+LIBFREESPACE_API enum freespace_dceOutSimd freespace_setDceOutSimd(enum freespace_dceOutSimd simd);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREESPACE_DCEOUT_H_ */
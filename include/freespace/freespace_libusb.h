@@ -0,0 +1,78 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2009-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREESPACE_LIBUSB_H_
+#define FREESPACE_LIBUSB_H_
+
+#include "freespace/freespace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/*
+ * Integration with applications that use libusb themselves. Only the
+ * libusb backend implements these calls. The others return
+ * FREESPACE_ERROR_UINIMPLEMENTED.
+ */
+
+struct libusb_context;
+
+/**
+ * The application runs libusb's event loop for the context passed to
+ * freespace_initWithLibusbContext.
+ */
+#define FREESPACE_LIBUSB_APP_HANDLES_EVENTS 0x01
+
+/** @ingroup initialization
+ *
+ * Initialize libfreespace on a libusb context that belongs to the
+ * application, rather than on a private one. Use this instead of
+ * freespace_init(). libfreespace does not call libusb_exit() on the
+ * context, so it must stay valid until after freespace_exit().
+ *
+ * Without FREESPACE_LIBUSB_APP_HANDLES_EVENTS, libfreespace handles
+ * events on the context as it would on its own, and takes over the
+ * context's pollfd notifiers once freespace_setFileDescriptorCallbacks
+ * is called.
+ *
+ * With FREESPACE_LIBUSB_APP_HANDLES_EVENTS, libfreespace only submits
+ * its transfers. freespace_perform() no longer handles libusb events,
+ * libusb's file descriptors and timeouts are not reported through
+ * freespace_syncFileDescriptors() and freespace_getNextTimeout(), and
+ * the pollfd notifiers are left alone. Receive and send callbacks are
+ * called from whichever thread handles libusb events. The application
+ * still calls freespace_perform() for hotplug processing.
+ *
+ * libfreespace never handles events on the context in this mode. Calls
+ * that wait for transfers, such as freespace_readMessages(),
+ * freespace_sendMessagePipelined(), freespace_waitForSends() and
+ * freespace_closeDevice(), block until the application's event loop
+ * completes them. That loop must be running on another thread.
+ * freespace_startEventThread() is not available in this mode.
+ *
+ * @param context the application's libusb context
+ * @param flags 0 or FREESPACE_LIBUSB_APP_HANDLES_EVENTS
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_initWithLibusbContext(struct libusb_context* context, int flags);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREESPACE_LIBUSB_H_ */
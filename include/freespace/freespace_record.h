@@ -0,0 +1,198 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREESPACE_RECORD_H_
+#define FREESPACE_RECORD_H_
+
+#include "freespace/freespace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup record Session Recording
+ *
+ * This page describes functions for recording raw reports to a binary
+ * file and reading them back.
+ *
+ * A recording is a file header followed by records appended in the
+ * order they were written. Each record holds one raw report with the
+ * host timestamp, device ID and HID protocol version it was received
+ * with. Every so often the recorder appends an index block that maps
+ * timestamps to file offsets. Closing the recorder appends a directory
+ * of the index blocks and a footer. The reader maps the whole file into
+ * memory and uses the index blocks to seek by time without reading the
+ * records in between.
+ *
+ * A recording that was not closed, for example because the program
+ * crashed, has no footer. It can still be read, but opening it scans
+ * the record headers to find the index blocks.
+ *
+ * Seeking by time needs the timestamps to never decrease, so use a
+ * monotonic clock such as freespace_recorder_timestamp().
+ *
+ * Recorders and recordings are not thread safe.
+ */
+
+/** @ingroup record
+ * A recording being written.
+ */
+struct freespace_recorder;
+
+/** @ingroup record
+ * A recording opened for reading.
+ */
+struct freespace_recording;
+
+/** @ingroup record
+ * One report read from a recording.
+ */
+struct freespace_recordedReport {
+    uint64_t timestampUs;   /**< The host timestamp, in microseconds */
+    FreespaceDeviceId id;   /**< The device the report came from */
+    uint8_t hVer;           /**< The HID protocol version of the device */
+    int length;             /**< The length of the report */
+    const uint8_t* report;  /**< The report, which stays valid until the recording is closed */
+};
+
+/** @ingroup record
+ * Information about a recording from freespace_recording_getInfo().
+ */
+struct freespace_recordingInfo {
+    uint64_t reportCount;      /**< The number of reports */
+    uint64_t firstTimestampUs; /**< The timestamp of the first report */
+    uint64_t lastTimestampUs;  /**< The timestamp of the last report */
+    int complete;              /**< 1 if the recorder was closed, 0 if the recording was cut short */
+};
+
+/** @ingroup record
+ *
+ * Get a host timestamp for freespace_recorder_write() from a monotonic
+ * clock.
+ *
+ * @return the time in microseconds since an arbitrary starting point
+ */
+LIBFREESPACE_API uint64_t freespace_recorder_timestamp(void);
+
+/** @ingroup record
+ *
+ * Create a recording, replacing the file if it exists.
+ *
+ * @param recorder where to store the new recorder
+ * @param path the file to write
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_recorder_open(struct freespace_recorder** recorder,
+                                             const char* path);
+
+/** @ingroup record
+ *
+ * Append a report to a recording. Writes are buffered, so the report
+ * may not reach the file until later writes or freespace_recorder_close().
+ *
+ * @param recorder the recorder
+ * @param timestampUs the host timestamp of the report, in microseconds
+ * @param id the device the report came from
+ * @param hVer the HID protocol version of the device
+ * @param report the raw report
+ * @param length the length of the report
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_recorder_write(struct freespace_recorder* recorder,
+                                              uint64_t timestampUs,
+                                              FreespaceDeviceId id,
+                                              uint8_t hVer,
+                                              const uint8_t* report,
+                                              int length);
+
+/** @ingroup record
+ *
+ * Finish a recording and free the recorder. The recorder is freed even
+ * if finishing the file fails.
+ *
+ * @param recorder the recorder
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_recorder_close(struct freespace_recorder* recorder);
+
+/** @ingroup record
+ *
+ * Open a recording for reading.
+ *
+ * @param recording where to store the opened recording
+ * @param path the file to read
+ * @return FREESPACE_SUCCESS, or FREESPACE_ERROR_MALFORMED_MESSAGE if the
+ *         file isn't a recording, or another error
+ */
+LIBFREESPACE_API int freespace_recording_open(struct freespace_recording** recording,
+                                              const char* path);
+
+/** @ingroup record
+ *
+ * Close a recording. The reports read from it are no longer valid.
+ *
+ * @param recording the recording
+ */
+LIBFREESPACE_API void freespace_recording_close(struct freespace_recording* recording);
+
+/** @ingroup record
+ *
+ * Get the number of reports and the time span of a recording.
+ *
+ * @param recording the recording
+ * @param info where to store the information
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_recording_getInfo(struct freespace_recording* recording,
+                                                 struct freespace_recordingInfo* info);
+
+/** @ingroup record
+ *
+ * Find the first report at or after a time. Seeking to time 0 gives
+ * the start of the recording.
+ *
+ * @param recording the recording
+ * @param timestampUs the time to seek to
+ * @param cursor where to store the position of the report, for
+ *               freespace_recording_next()
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_recording_seek(struct freespace_recording* recording,
+                                              uint64_t timestampUs,
+                                              uint64_t* cursor);
+
+/** @ingroup record
+ *
+ * Read the report at a position and move the position to the next
+ * report.
+ *
+ * @param recording the recording
+ * @param cursor the position, from freespace_recording_seek()
+ * @param report where to store the report
+ * @return FREESPACE_SUCCESS, or FREESPACE_ERROR_NO_DATA at the end of the
+ *         recording
+ */
+LIBFREESPACE_API int freespace_recording_next(struct freespace_recording* recording,
+                                              uint64_t* cursor,
+                                              struct freespace_recordedReport* report);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREESPACE_RECORD_H_ */
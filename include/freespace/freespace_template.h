@@ -0,0 +1,135 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2009-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+#ifndef FREESPACE_TEMPLATE_H_
+#define FREESPACE_TEMPLATE_H_
+
+#include "freespace/freespace.h"
+
+#ifdef __cplusplus
+extern "C" {
+#endif
+
+/**
+ * @defgroup template Message Templates
+ *
+ * Messages that are sent over and over with the same or nearly the
+ * same contents can be encoded once into a freespace_messageTemplate.
+ * Later sends only patch the fields that changed and send the stored
+ * bytes.
+ *
+ * Fields are named by the FREESPACE_FIELD_<MESSAGE>_V<version>_<FIELD>
+ * handles in freespace_encoded.h. That header also has
+ * FREESPACE_ENCODE_<MESSAGE>_V<version>() macros, which build an
+ * encoded message as a constant byte array initializer.
+ */
+
+/** @ingroup template
+ * Pack the location of a field into a field handle. width is the size
+ * in bytes of an integer field, or 0 for a bit field, which is
+ * (byte >> shift) & mask.
+ */
+#define FREESPACE_FIELD(offset, width, shift, mask) \
+    ((uint32_t) (offset) | ((uint32_t) (width) << 8) | ((uint32_t) (shift) << 16) | ((uint32_t) (mask) << 24))
+
+/** @ingroup template
+ * An encoded message ready to send.
+ */
+struct freespace_messageTemplate {
+    uint8_t message[FREESPACE_MAX_OUTPUT_MESSAGE_SIZE]; /**< The encoded message */
+    int length;                                         /**< The length of the encoded message */
+};
+
+/** @ingroup template
+ *
+ * Encode a message into a template for a device, the same way
+ * freespace_sendMessage() would. The message is encoded for the HID
+ * protocol version of the device, and a destination of 0 is replaced
+ * by FREESPACE_RESERVED_ADDRESS.
+ *
+ * @param t the template to fill in
+ * @param id the FreespaceDeviceId of the device the message is for
+ * @param message the message to encode
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_template_init(struct freespace_messageTemplate* t,
+                                             FreespaceDeviceId id,
+                                             struct freespace_message* message);
+
+/** @ingroup template
+ *
+ * Fill in a template with an already encoded message, such as one
+ * built with the FREESPACE_ENCODE_ macros.
+ *
+ * @param t the template to fill in
+ * @param message the encoded message
+ * @param length the length of the encoded message
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_template_initEncoded(struct freespace_messageTemplate* t,
+                                                    const uint8_t* message,
+                                                    int length);
+
+/** @ingroup template
+ *
+ * Change one field of the encoded message.
+ *
+ * @param t the template
+ * @param field the field handle, for the HID protocol version the
+ *              template was encoded with
+ * @param value the new value. Integer fields take the low bytes, and
+ *              bit fields the bits under the field's mask.
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_template_set(struct freespace_messageTemplate* t,
+                                            uint32_t field,
+                                            uint32_t value);
+
+/** @ingroup template
+ *
+ * Send a template synchronously.
+ *
+ * @param id the FreespaceDeviceId of the device to send the message to
+ * @param t the template to send
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_template_send(FreespaceDeviceId id,
+                                             const struct freespace_messageTemplate* t);
+
+/** @ingroup template
+ *
+ * Send a template, but do not block. The template may be changed or
+ * freed as soon as this returns.
+ *
+ * @param id the FreespaceDeviceId of the device to send the message to
+ * @param t the template to send
+ * @param timeoutMs the number of milliseconds to wait before timing out
+ * @param callback the function to call when the send completes
+ * @param cookie data passed to the callback function
+ * @return FREESPACE_SUCCESS or an error
+ */
+LIBFREESPACE_API int freespace_template_sendAsync(FreespaceDeviceId id,
+                                                  const struct freespace_messageTemplate* t,
+                                                  unsigned int timeoutMs,
+                                                  freespace_sendCallback callback,
+                                                  void* cookie);
+
+#ifdef __cplusplus
+}
+#endif
+
+#endif /* FREESPACE_TEMPLATE_H_ */
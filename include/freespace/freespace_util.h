@@ -48,6 +48,89 @@ struct MultiAxisSensor {
     float z;
 };
 
+/** Presence bits for the sections of struct MotionEngineOutputSensors. */
+enum MotionEngineOutputSection {
+    FREESPACE_ME_ACCELERATION     = 0x0001,
+    FREESPACE_ME_ACC_NO_GRAVITY   = 0x0002,
+    FREESPACE_ME_ANGULAR_VELOCITY = 0x0004,
+    FREESPACE_ME_MAGNETOMETER     = 0x0008,
+    FREESPACE_ME_TEMPERATURE      = 0x0010,
+    FREESPACE_ME_INCLINATION      = 0x0020,
+    FREESPACE_ME_COMPASS_HEADING  = 0x0040,
+    FREESPACE_ME_ANG_POS          = 0x0080,
+    FREESPACE_ME_ACT_CLASS        = 0x0100
+};
+
+/** This struct holds every section extracted from a MEOut packet.
+ * Each member uses the same coordinates and units as the matching
+ * freespace_util_get* function. Members whose bit is not set in
+ * present are left untouched.
+ */
+struct MotionEngineOutputSensors {
+    /** Bitwise OR of the FREESPACE_ME_* values of the extracted sections */
+    uint16_t present;
+    /** See freespace_util_getAcceleration */
+    struct MultiAxisSensor acceleration;
+    /** See freespace_util_getAccNoGravity */
+    struct MultiAxisSensor accNoGravity;
+    /** See freespace_util_getAngularVelocity */
+    struct MultiAxisSensor angularVelocity;
+    /** See freespace_util_getMagnetometer */
+    struct MultiAxisSensor magnetometer;
+    /** See freespace_util_getTemperature */
+    struct MultiAxisSensor temperature;
+    /** See freespace_util_getInclination */
+    struct MultiAxisSensor inclination;
+    /** See freespace_util_getCompassHeading */
+    struct MultiAxisSensor compassHeading;
+    /** See freespace_util_getAngPos */
+    struct MultiAxisSensor angPos;
+    /** See freespace_util_getActClass */
+    struct MultiAxisSensor actClass;
+};
+
+/** This struct points to the arrays that receive one coordinate of a
+ * section for a batch of MEOut packets. An array must hold one value
+ * per packet. Coordinates left NULL are not converted.
+ */
+struct MultiAxisSensorArrays {
+    /** W-coordinates */
+    float* w;
+    /** X-coordinates */
+    float* x;
+    /** Y-coordinates */
+    float* y;
+    /** Z-coordinates */
+    float* z;
+};
+
+/** This struct holds the arrays that receive every section converted
+ * from a batch of MEOut packets. Each member uses the same coordinates
+ * and units as the matching freespace_util_get* function.
+ */
+struct MotionEngineOutputArrays {
+    /** Bitwise OR of the FREESPACE_ME_* values of the converted sections */
+    uint16_t present;
+    /** See freespace_util_getAcceleration */
+    struct MultiAxisSensorArrays acceleration;
+    /** See freespace_util_getAccNoGravity */
+    struct MultiAxisSensorArrays accNoGravity;
+    /** See freespace_util_getAngularVelocity */
+    struct MultiAxisSensorArrays angularVelocity;
+    /** See freespace_util_getMagnetometer */
+    struct MultiAxisSensorArrays magnetometer;
+    /** See freespace_util_getTemperature */
+    struct MultiAxisSensorArrays temperature;
+    /** See freespace_util_getInclination */
+    struct MultiAxisSensorArrays inclination;
+    /** See freespace_util_getCompassHeading */
+    struct MultiAxisSensorArrays compassHeading;
+    /** See freespace_util_getAngPos */
+    struct MultiAxisSensorArrays angPos;
+    /** See freespace_util_getActClass */
+    struct MultiAxisSensorArrays actClass;
+};
+
 /** @ingroup util
  *
  * Get the acceleration values from a MEOut packet.
@@ -195,6 +278,46 @@ LIBFREESPACE_API int freespace_util_getAngPos(struct freespace_MotionEngineOutpu
 LIBFREESPACE_API int freespace_util_getActClass(struct freespace_MotionEngineOutput const * meOutPkt,
                                                 struct MultiAxisSensor * sensor);
 
+/** @ingroup util
+ *
+ * Extract every section present in a MEOut packet in a single pass.
+ *
+ * The section offsets come from a table precomputed for all format flag
+ * combinations, and the values are bit-identical to those returned by the
+ * individual freespace_util_get* functions. Prefer this over calling several
+ * getters on the same packet.
+ *
+ * @param meOutPkt A pointer to the MEOut packet to extract the sections from.
+ * @param sensors A pointer to where to store the extracted values. The present
+ * member tells which sections were extracted.
+ * @return 0 if successful, even if no section was present.
+ *         -3 if the format select number is unrecognized.
+ */
+LIBFREESPACE_API int freespace_util_parseMotionEngineOutput(struct freespace_MotionEngineOutput const * meOutPkt,
+                                                            struct MotionEngineOutputSensors * sensors);
+
+/** @ingroup util
+ *
+ * Convert every section of a batch of MEOut packets into arrays.
+ *
+ * All packets must use the same format select number and format flags,
+ * as a recorded session from one device does. The conversion uses SIMD
+ * instructions where available, and the values are bit-identical to
+ * those returned by the individual freespace_util_get* functions.
+ *
+ * @param meOutPkts The MEOut packets to convert.
+ * @param count The number of packets.
+ * @param arrays The arrays to store the converted values in. Value i of
+ * each array comes from packet i. The present member tells which
+ * sections were converted.
+ * @return 0 if successful, even if no section was present.
+ *         -3 if the format select number is unrecognized.
+ *         -4 if the packets do not all use the same format and flags.
+ */
+LIBFREESPACE_API int freespace_util_convertMotionEngineOutputs(struct freespace_MotionEngineOutput const * meOutPkts,
+                                                               int count,
+                                                               struct MotionEngineOutputArrays * arrays);
+
 #ifdef __cplusplus
 }
 #endif
@@ -149,9 +149,6 @@ int freespace_hotplug_init() {
         return FREESPACE_ERROR_UNEXPECTED;
     }
 
-    // Write something to the readFD to get the initial scan rolling
-    write(writeFd_, "1", 1);
-
     // Start the notification thread
     pthread_create (&freespace_darwin_et, NULL, event_thread_main, NULL);
 
@@ -193,12 +190,12 @@ int freespace_hotplug_getFD() {
 int freespace_hotplug_perform(int* recheck) {
     char buf[16];
     int rc;
-    *recheck = 0;
+    *recheck = FREESPACE_HOTPLUG_RESCAN_NONE;
 
     rc = read(readFd_, buf, sizeof(buf));
     if (rc > 0) {
         // If any data was read, we received an event - rescan the devices
-        *recheck = 1;
+        *recheck = FREESPACE_HOTPLUG_RESCAN_ALL;
         return FREESPACE_SUCCESS;
     }
 
@@ -209,3 +206,9 @@ int freespace_hotplug_perform(int* recheck) {
         return FREESPACE_ERROR_IO;
     }
 }
+
+int freespace_hotplug_nextDevice(struct freespace_hotplugDevice* device) {
+    // IOKit notifications aren't tracked per device, so events always
+    // request a full rescan.
+    return 0;
+}
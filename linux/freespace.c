@@ -16,6 +16,7 @@
  */
 
 #include "freespace/freespace.h"
+#include "freespace/freespace_libusb.h"
 #include "freespace/freespace_deviceTable.h"
 #include "hotplug.h"
 #include "freespace_config.h"
@@ -25,9 +26,28 @@
 #include <stdio.h>
 #include <poll.h>
 #include <string.h>
+#include <sys/time.h>
+#include <pthread.h>
+#include <fcntl.h>
+#include <unistd.h>
+#ifdef __linux__
+#include <sys/eventfd.h>
+#endif
 
 #define FREESPACE_RECEIVE_QUEUE_SIZE 8 // Could be tuned better. 3-4 might be good enough
 
+// libusb 1.0.16 and later can report hotplug events itself.
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000102)
+#define FREESPACE_LIBUSB_HOTPLUG
+#define FREESPACE_HOTPLUG_MAX_VENDORS 8
+#define FREESPACE_HOTPLUG_EVENT_QUEUE_SIZE 32
+#endif
+
+#define FREESPACE_SEND_QUEUE_SIZE 16 // Maximum sends in flight per device
+#define FREESPACE_CLOSE_TIMEOUT_MS 1000 // Time allowed for transfers to cancel on close
+#define FREESPACE_SEND_TIMEOUT_MS 1000 // Time allowed for a synchronous send
+#define FREESPACE_EVENT_QUEUE_SIZE 64 // Reports held per device for freespace_perform() in event thread mode
+
 /**
  * The device state is primarily used to keep track of FreespaceDevice allocations.
  * The state machine looks like the following:
@@ -63,8 +83,39 @@ struct FreespaceReceiveTransfer {
     uint8_t buffer_[FREESPACE_MAX_INPUT_MESSAGE_SIZE];
 
     // Synchronous interface usage for the state of the
-    // queue.
+    // queue. Cleared by receiveCallback(), which may run on the event
+    // thread, so it is accessed atomically.
+    int submitted_;
+};
+
+/**
+ * An asynchronous send. Up to sendDepth_ of these can be in flight
+ * per device, and libusb completes them in the order submitted.
+ */
+struct FreespaceSendTransfer {
+    struct FreespaceDevice* device_;
+    struct libusb_transfer* transfer_;
+    uint8_t buffer_[FREESPACE_MAX_OUTPUT_MESSAGE_SIZE];
+    freespace_sendCallback callback_;
+    void* cookie_;
     int submitted_;
+
+    // Set for a freespace_sendMessageAsync() send that didn't fit in
+    // the queue. It is allocated for the one send, kept on the device's
+    // overflow list and freed by sendCallback().
+    int overflow_;
+    struct FreespaceSendTransfer* prev_;
+    struct FreespaceSendTransfer* next_;
+};
+
+/**
+ * A report received on the event thread, waiting to be passed to the
+ * receive callbacks by freespace_perform().
+ */
+struct FreespaceQueuedReport {
+    int status_;
+    int length_;
+    uint8_t buffer_[FREESPACE_MAX_INPUT_MESSAGE_SIZE];
 };
 
 struct FreespaceDevice {
@@ -93,6 +144,38 @@ struct FreespaceDevice {
 
     int receiveQueueHead_;
     struct FreespaceReceiveTransfer receiveQueue_[FREESPACE_RECEIVE_QUEUE_SIZE];
+
+    // An error from a bad report that freespace_readMessages() skipped
+    // over. It is returned by the next call.
+    int pendingReadError_;
+
+    // Sends may complete on the event thread, so sendsInFlight_ and
+    // submitted_ are accessed atomically.
+    int sendDepth_;
+    int sendsInFlight_;
+    struct FreespaceSendTransfer sendQueue_[FREESPACE_SEND_QUEUE_SIZE];
+    // Guarded by overflowLock. Counted in sendsInFlight_.
+    struct FreespaceSendTransfer* overflow_;
+
+    // Reports from the event thread. The event thread only writes
+    // eventQueueHead_ and eventQueueDropped_, and freespace_perform()
+    // only writes eventQueueTail_ and eventQueueDroppedSeen_, so no lock
+    // is needed.
+    unsigned int eventQueueHead_;
+    unsigned int eventQueueTail_;
+    unsigned int eventQueueDropped_;
+    unsigned int eventQueueDroppedSeen_;
+    struct FreespaceQueuedReport eventQueue_[FREESPACE_EVENT_QUEUE_SIZE];
+
+    // Set while the device's transfers are being cancelled. See
+    // freespace_closeDeviceAsync().
+    int closing_;
+    struct timeval closeDeadline_;
+    freespace_closeCallback closeCallback_;
+    void* closeCookie_;
+
+    // Next on the zombie list. See buryDevice().
+    struct FreespaceDevice* nextZombie_;
 };
 
 static struct FreespaceDevice* devices[FREESPACE_MAXIMUM_DEVICE_COUNT];
@@ -100,12 +183,69 @@ static int numDevices = 0;
 static FreespaceDeviceId nextFreeIndex = 0;
 static uint32_t ts = 0;
 
+// Closed devices whose transfers libusb still owns. They are out of the
+// device table, and are freed by reapZombies() once libusb is done.
+static struct FreespaceDevice* zombies = NULL;
+
 static struct libusb_context* freespace_libusb_context = NULL;
+static int ownsLibusbContext = 0;
+static int appHandlesEvents = 0;
 static freespace_pollfdAddedCallback userAddedCallback = NULL;
 static freespace_pollfdRemovedCallback userRemovedCallback = NULL;
 static freespace_hotplugCallback hotplugCallback = NULL;
 static void* hotplugCookie;
 
+// Set when the devices found by freespace_init still need to be
+// reported to the hotplug callback.
+static int announceDevices = 0;
+
+// Event thread mode. See freespace_startEventThread().
+// eventThreadRunning and eventThreadStop are read by the event thread,
+// so they are accessed atomically.
+static pthread_t eventThread;
+static int eventThreadRunning = 0;
+static int eventThreadStop = 0;
+static enum freespace_eventThreadDispatch eventThreadDispatch;
+static int wakeReadFd = -1;
+static int wakeWriteFd = -1;
+
+// With FREESPACE_LIBUSB_APP_HANDLES_EVENTS, the transfer callbacks count
+// completions here so that blocking calls can wait for the application's
+// event loop instead of running libusb's. See handleEvents().
+static pthread_mutex_t completionLock = PTHREAD_MUTEX_INITIALIZER;
+static pthread_cond_t completionCond = PTHREAD_COND_INITIALIZER;
+static unsigned int completions = 0;
+static __thread unsigned int completionsSeen = 0;
+
+// Guards the overflow send lists, which sendCallback() changes on the
+// event thread.
+static pthread_mutex_t overflowLock = PTHREAD_MUTEX_INITIALIZER;
+
+#ifdef FREESPACE_LIBUSB_HOTPLUG
+// Hotplug notifications from libusb are queued by the libusb callback
+// and applied to the device list by scanDevices().
+struct FreespaceHotplugEvent {
+    struct libusb_device* dev_;
+    libusb_hotplug_event event_;
+};
+
+static int useLibusbHotplug = 0;
+static pthread_mutex_t hotplugEventsLock = PTHREAD_MUTEX_INITIALIZER;
+static libusb_hotplug_callback_handle hotplugHandles[FREESPACE_HOTPLUG_MAX_VENDORS];
+static int numHotplugHandles = 0;
+static struct FreespaceHotplugEvent hotplugEvents[FREESPACE_HOTPLUG_EVENT_QUEUE_SIZE];
+static int numHotplugEvents = 0;
+static int hotplugEventsDropped = 0;
+
+static int registerLibusbHotplug();
+static void deregisterLibusbHotplug();
+static int applyHotplugEvents();
+#endif
+static int rescanAllDevices();
+static void wakeApplication();
+static void closeDevices(struct FreespaceDevice** closing, int count);
+static void reapZombies();
+
 static int libusb_to_freespace_error(int libusberror) {
     // libusb returns values greater than 0 for success for some functions.
     if (libusberror >= 0) {
@@ -143,25 +283,178 @@ static int libusb_transfer_status_to_freespace_error(enum libusb_transfer_status
     }
 }
 
+static void makeDeadline(struct timeval* deadline, unsigned int timeoutMs) {
+    gettimeofday(deadline, NULL);
+    deadline->tv_sec += timeoutMs / 1000;
+    deadline->tv_usec += (timeoutMs % 1000) * 1000;
+    if (deadline->tv_usec >= 1000000) {
+        deadline->tv_sec++;
+        deadline->tv_usec -= 1000000;
+    }
+}
+
+// Compute the time remaining until the deadline. Returns 0 if the
+// deadline has passed.
+static int timeLeft(const struct timeval* deadline, struct timeval* tv) {
+    struct timeval now;
+
+    gettimeofday(&now, NULL);
+    tv->tv_sec = deadline->tv_sec - now.tv_sec;
+    tv->tv_usec = deadline->tv_usec - now.tv_usec;
+    if (tv->tv_usec < 0) {
+        tv->tv_sec--;
+        tv->tv_usec += 1000000;
+    }
+    return tv->tv_sec > 0 || (tv->tv_sec == 0 && tv->tv_usec > 0);
+}
+
+// Called from the transfer callbacks to wake up handleEvents().
+static void signalCompletion() {
+    if (!appHandlesEvents) {
+        return;
+    }
+    pthread_mutex_lock(&completionLock);
+    completions++;
+    pthread_cond_broadcast(&completionCond);
+    pthread_mutex_unlock(&completionLock);
+}
+
+// Let libusb make progress for up to tv. When the application handles
+// libusb events, only wait for it to complete a transfer. A completion
+// since this thread's last call returns right away, so one that lands
+// between the caller's check and the wait isn't missed.
+static int handleEvents(struct timeval* tv) {
+    struct timeval deadline;
+    struct timespec abstime;
+    int rc = 0;
+
+    if (!appHandlesEvents) {
+        return libusb_handle_events_timeout(freespace_libusb_context, tv);
+    }
+
+    gettimeofday(&deadline, NULL);
+    deadline.tv_sec += tv->tv_sec;
+    deadline.tv_usec += tv->tv_usec;
+    if (deadline.tv_usec >= 1000000) {
+        deadline.tv_sec++;
+        deadline.tv_usec -= 1000000;
+    }
+    abstime.tv_sec = deadline.tv_sec;
+    abstime.tv_nsec = deadline.tv_usec * 1000;
+
+    pthread_mutex_lock(&completionLock);
+    while (completions == completionsSeen && rc == 0) {
+        rc = pthread_cond_timedwait(&completionCond, &completionLock, &abstime);
+    }
+    completionsSeen = completions;
+    pthread_mutex_unlock(&completionLock);
+    return LIBUSB_SUCCESS;
+}
+
 const char* freespace_version() {
     return LIBFREESPACE_VERSION;
 }
 
-int freespace_init() {
+static void releaseLibusbContext() {
+    // An application's context stays with the application.
+    if (ownsLibusbContext) {
+        libusb_exit(freespace_libusb_context);
+    }
+    freespace_libusb_context = NULL;
+    ownsLibusbContext = 0;
+    appHandlesEvents = 0;
+}
+
+static int initDevices() {
+    freespace_hotplugCallback callback;
     int rc;
 
-    rc = freespace_hotplug_init();
-    if (rc != FREESPACE_SUCCESS) {
-        return rc;
+    // Enumerate the attached devices now so that the first call to
+    // freespace_getDeviceList() doesn't have to wait. The hotplug
+    // callback hears about them on the first scan instead.
+    callback = hotplugCallback;
+    hotplugCallback = NULL;
+
+#ifdef FREESPACE_LIBUSB_HOTPLUG
+    // Prefer libusb's own hotplug notifications, and fall back to
+    // rescanning the bus on uevents when they aren't available.
+    if (registerLibusbHotplug() == FREESPACE_SUCCESS) {
+        rc = applyHotplugEvents();
+    } else
+#endif
+    {
+        rc = freespace_hotplug_init();
+        if (rc != FREESPACE_SUCCESS) {
+            hotplugCallback = callback;
+            releaseLibusbContext();
+            return rc;
+        }
+        rc = rescanAllDevices();
     }
 
+    hotplugCallback = callback;
+    announceDevices = 1;
+    return rc;
+}
+
+int freespace_init() {
+    int rc;
+
     rc = libusb_init(&freespace_libusb_context);
-    return libusb_to_freespace_error(rc);
+    if (rc != LIBUSB_SUCCESS) {
+        return libusb_to_freespace_error(rc);
+    }
+    ownsLibusbContext = 1;
+    appHandlesEvents = 0;
+
+    return initDevices();
+}
+
+int freespace_initWithLibusbContext(struct libusb_context* context, int flags) {
+    if (context == NULL) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+
+    freespace_libusb_context = context;
+    ownsLibusbContext = 0;
+    appHandlesEvents = (flags & FREESPACE_LIBUSB_APP_HANDLES_EVENTS) != 0;
+
+    return initDevices();
 }
 
 void freespace_exit() {
     struct FreespaceDevice* device;
+    struct FreespaceDevice* opened[FREESPACE_MAXIMUM_DEVICE_COUNT];
+    int numOpened = 0;
     int i;
+
+    freespace_stopEventThread();
+
+    // Close whatever the application left open, all at once.
+    for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
+        if (devices[i] != NULL && devices[i]->handle_ != NULL) {
+            opened[numOpened++] = devices[i];
+        }
+    }
+    if (numOpened > 0) {
+        closeDevices(opened, numOpened);
+    }
+
+    // Free the zombies that libusb has finished with, including those of
+    // earlier closes. libusb could still complete the transfers of any
+    // that are left, so those are never freed.
+    if (zombies != NULL) {
+        struct timeval tv = {0, 0};
+        handleEvents(&tv);
+        reapZombies();
+        zombies = NULL;
+    }
+
+#ifdef FREESPACE_LIBUSB_HOTPLUG
+    deregisterLibusbHotplug();
+#endif
+    announceDevices = 0;
+
     for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
         if (devices[i] != NULL) {
             device = devices[i];
@@ -174,8 +467,16 @@ void freespace_exit() {
             numDevices--;
         }
     }
-    libusb_exit(freespace_libusb_context);
-    freespace_hotplug_exit();
+    releaseLibusbContext();
+
+#ifdef FREESPACE_LIBUSB_HOTPLUG
+    if (useLibusbHotplug) {
+        useLibusbHotplug = 0;
+    } else
+#endif
+    {
+        freespace_hotplug_exit();
+    }
 }
 
 static struct FreespaceDeviceAPI const * lookupDevice(struct libusb_device_descriptor* desc) {
@@ -242,18 +543,55 @@ static void removeFreespaceDevice(struct FreespaceDevice* device) {
     }
 }
 
-static int scanDevices() {
+static int insertDevice(struct libusb_device* dev,
+                        struct libusb_device_descriptor const * desc,
+                        struct FreespaceDeviceAPI const * api) {
+    struct FreespaceDevice* device;
+
+    device = (struct FreespaceDevice*) malloc(sizeof(struct FreespaceDevice));
+    if (device == NULL) {
+        // Out of memory.
+        return FREESPACE_ERROR_OUT_OF_MEMORY;
+    }
+    memset(device, 0, sizeof(struct FreespaceDevice));
+
+    libusb_ref_device(dev);
+    device->dev_ = dev;
+    device->idProduct_ = desc->idProduct;
+    device->idVendor_ = desc->idVendor;
+    device->api_ = api;
+    device->id_ = libusb_get_device_address(dev);
+    device->state_ = FREESPACE_CONNECTED;
+    device->ts_ = ts;
+    device->sendDepth_ = FREESPACE_SEND_QUEUE_SIZE;
+    if (addFreespaceDevice(device) != FREESPACE_SUCCESS) {
+        // No room in the device table.
+        libusb_unref_device(dev);
+        free(device);
+        return FREESPACE_ERROR_INVALID_DEVICE;
+    }
+    if (hotplugCallback) {
+        hotplugCallback(FREESPACE_HOTPLUG_INSERTION, device->id_, hotplugCookie);
+    }
+    return FREESPACE_SUCCESS;
+}
+
+static void deviceRemoved(struct FreespaceDevice* d) {
+    if (hotplugCallback) {
+        hotplugCallback(FREESPACE_HOTPLUG_REMOVAL, d->id_, hotplugCookie);
+    }
+    if (d->state_ == FREESPACE_OPENED) {
+        d->state_ = FREESPACE_DISCONNECTED;
+    } else {
+        removeFreespaceDevice(d);
+    }
+}
+
+static int rescanAllDevices() {
     struct libusb_device** devs;
     ssize_t count;
     ssize_t i;
     int rc;
-    int needToRescan;
-
-    // Check if the devices need to be rescanned.
-    rc = freespace_hotplug_perform(&needToRescan);
-    if (rc != FREESPACE_SUCCESS || !needToRescan) {
-        return rc;
-    }
 
     count = libusb_get_device_list(freespace_libusb_context, &devs);
     if (count < 0) {
@@ -279,49 +617,257 @@ static int scanDevices() {
             struct FreespaceDevice* device;
             device = findDeviceById(deviceAddress);
             if (device == NULL) {
-                device = (struct FreespaceDevice*) malloc(sizeof(struct FreespaceDevice));
-                if (device == NULL) {
-                    // Out of memory.
+                rc = insertDevice(dev, &desc, api);
+                if (rc == FREESPACE_ERROR_OUT_OF_MEMORY) {
                     libusb_free_device_list(devs, 1);
-                    return FREESPACE_ERROR_OUT_OF_MEMORY;
+                    return rc;
                 }
-                memset(device, 0, sizeof(struct FreespaceDevice));
-
-                libusb_ref_device(dev);
-                device->dev_ = dev;
-                device->idProduct_ = desc.idProduct;
-                device->idVendor_ = desc.idVendor;
-                device->api_ = api;
-                device->id_ = libusb_get_device_address(dev);
-                device->state_ = FREESPACE_CONNECTED;
+            } else {
                 device->ts_ = ts;
-                addFreespaceDevice(device);
-                if (hotplugCallback) {
-                    hotplugCallback(FREESPACE_HOTPLUG_INSERTION, device->id_, hotplugCookie);
-                }
             }
-            device->ts_ = ts;
         }
     }
 
     for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
         struct FreespaceDevice* d = devices[i];
         if (d != NULL && d->ts_ != ts) {
-            if (hotplugCallback) {
-                hotplugCallback(FREESPACE_HOTPLUG_REMOVAL, d->id_, hotplugCookie);
+            deviceRemoved(d);
+        }
+    }
+
+    libusb_free_device_list(devs, 1);
+    return FREESPACE_SUCCESS;
+}
+
+// Recheck only the devices named by the hotplug code.
+static int rescanHotplugDevices() {
+    struct freespace_hotplugDevice hd;
+    struct libusb_device** devs = NULL;
+    ssize_t count = 0;
+    ssize_t i;
+    int rc = FREESPACE_SUCCESS;
+
+    while (freespace_hotplug_nextDevice(&hd)) {
+        if (!hd.added) {
+            for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
+                struct FreespaceDevice* d = devices[i];
+                if (d != NULL && d->state_ != FREESPACE_DISCONNECTED &&
+                    libusb_get_bus_number(d->dev_) == hd.busNumber &&
+                    libusb_get_device_address(d->dev_) == hd.deviceAddress) {
+                    deviceRemoved(d);
+                    break;
+                }
             }
-            if (d->state_ == FREESPACE_OPENED) {
-                d->state_ = FREESPACE_DISCONNECTED;
-            } else {
-                removeFreespaceDevice(d);
+            continue;
+        }
+
+        // libusb can only look up a device through the device list.
+        if (devs == NULL) {
+            count = libusb_get_device_list(freespace_libusb_context, &devs);
+            if (count < 0) {
+                // Drain the rest of the queue and rescan everything.
+                while (freespace_hotplug_nextDevice(&hd)) {
+                }
+                return rescanAllDevices();
             }
         }
+        for (i = 0; i < count; i++) {
+            struct libusb_device_descriptor desc;
+            struct libusb_device* dev = devs[i];
+            struct FreespaceDeviceAPI const * api;
+
+            if (libusb_get_bus_number(dev) != hd.busNumber ||
+                libusb_get_device_address(dev) != hd.deviceAddress) {
+                continue;
+            }
+            if (libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS) {
+                api = lookupDevice(&desc);
+                if (api != NULL && findDeviceById(hd.deviceAddress) == NULL) {
+                    rc = insertDevice(dev, &desc, api);
+                }
+            }
+            break;
+        }
     }
 
-    libusb_free_device_list(devs, 1);
+    if (devs != NULL) {
+        libusb_free_device_list(devs, 1);
+    }
+    return rc;
+}
+
+#ifdef FREESPACE_LIBUSB_HOTPLUG
+static int LIBUSB_CALL libusbHotplugCallback(struct libusb_context* ctx,
+                                             struct libusb_device* dev,
+                                             libusb_hotplug_event event,
+                                             void* user_data) {
+    // libusb doesn't allow most calls from inside its hotplug callback,
+    // so just remember the event until the next scanDevices().
+    pthread_mutex_lock(&hotplugEventsLock);
+    if (numHotplugEvents == FREESPACE_HOTPLUG_EVENT_QUEUE_SIZE) {
+        hotplugEventsDropped = 1;
+    } else {
+        libusb_ref_device(dev);
+        hotplugEvents[numHotplugEvents].dev_ = dev;
+        hotplugEvents[numHotplugEvents].event_ = event;
+        numHotplugEvents++;
+    }
+    pthread_mutex_unlock(&hotplugEventsLock);
+
+    if (__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE)) {
+        wakeApplication();
+    }
+
+    // Keep the callback registered.
+    return 0;
+}
+
+static int registerLibusbHotplug() {
+    uint16_t vendors[FREESPACE_HOTPLUG_MAX_VENDORS];
+    int numVendors = 0;
+    int i;
+    int j;
+    int rc;
+
+    if (!libusb_has_capability(LIBUSB_CAP_HAS_HOTPLUG)) {
+        return FREESPACE_ERROR_UINIMPLEMENTED;
+    }
+
+    // Only listen for the vendors that appear in the device table.
+    for (i = 0; i < freespace_deviceAPITableNum; i++) {
+        uint16_t idVendor = freespace_deviceAPITable[i].idVendor_;
+        for (j = 0; j < numVendors && vendors[j] != idVendor; j++) {
+        }
+        if (j == numVendors) {
+            if (numVendors == FREESPACE_HOTPLUG_MAX_VENDORS) {
+                return FREESPACE_ERROR_UNEXPECTED;
+            }
+            vendors[numVendors++] = idVendor;
+        }
+    }
+
+    // LIBUSB_HOTPLUG_ENUMERATE queues arrivals for devices that are
+    // already attached, so the first scan finds them too.
+    for (i = 0; i < numVendors; i++) {
+        rc = libusb_hotplug_register_callback(freespace_libusb_context,
+                                              LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED | LIBUSB_HOTPLUG_EVENT_DEVICE_LEFT,
+                                              LIBUSB_HOTPLUG_ENUMERATE,
+                                              vendors[i],
+                                              LIBUSB_HOTPLUG_MATCH_ANY,
+                                              LIBUSB_HOTPLUG_MATCH_ANY,
+                                              libusbHotplugCallback,
+                                              NULL,
+                                              &hotplugHandles[numHotplugHandles]);
+        if (rc != LIBUSB_SUCCESS) {
+            deregisterLibusbHotplug();
+            return libusb_to_freespace_error(rc);
+        }
+        numHotplugHandles++;
+    }
+
+    useLibusbHotplug = 1;
     return FREESPACE_SUCCESS;
 }
 
+static void deregisterLibusbHotplug() {
+    int i;
+
+    for (i = 0; i < numHotplugHandles; i++) {
+        libusb_hotplug_deregister_callback(freespace_libusb_context, hotplugHandles[i]);
+    }
+    numHotplugHandles = 0;
+
+    for (i = 0; i < numHotplugEvents; i++) {
+        libusb_unref_device(hotplugEvents[i].dev_);
+    }
+    numHotplugEvents = 0;
+    hotplugEventsDropped = 0;
+}
+
+static int applyHotplugEvents() {
+    struct FreespaceHotplugEvent events[FREESPACE_HOTPLUG_EVENT_QUEUE_SIZE];
+    int count;
+    int dropped;
+    int i;
+    int j;
+    int rc = FREESPACE_SUCCESS;
+
+    // The event thread may be adding more events.
+    pthread_mutex_lock(&hotplugEventsLock);
+    count = numHotplugEvents;
+    dropped = hotplugEventsDropped;
+    memcpy(events, hotplugEvents, count * sizeof(events[0]));
+    numHotplugEvents = 0;
+    hotplugEventsDropped = 0;
+    pthread_mutex_unlock(&hotplugEventsLock);
+
+    for (i = 0; i < count; i++) {
+        struct libusb_device* dev = events[i].dev_;
+
+        if (events[i].event_ == LIBUSB_HOTPLUG_EVENT_DEVICE_ARRIVED) {
+            struct libusb_device_descriptor desc;
+            struct FreespaceDeviceAPI const * api;
+
+            if (libusb_get_device_descriptor(dev, &desc) == LIBUSB_SUCCESS) {
+                api = lookupDevice(&desc);
+                if (api != NULL && findDeviceById(libusb_get_device_address(dev)) == NULL) {
+                    rc = insertDevice(dev, &desc, api);
+                }
+            }
+        } else {
+            for (j = 0; j < FREESPACE_MAXIMUM_DEVICE_COUNT; j++) {
+                struct FreespaceDevice* d = devices[j];
+                if (d != NULL && d->dev_ == dev && d->state_ != FREESPACE_DISCONNECTED) {
+                    deviceRemoved(d);
+                    break;
+                }
+            }
+        }
+        libusb_unref_device(dev);
+    }
+
+    // Resynchronize with a full scan if libusb reported more events than
+    // could be queued.
+    if (dropped) {
+        return rescanAllDevices();
+    }
+    return rc;
+}
+#endif
+
+static int scanDevices() {
+    int rc;
+    int needToRescan;
+    int i;
+
+    // Report the devices found by freespace_init().
+    if (announceDevices) {
+        announceDevices = 0;
+        for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
+            if (hotplugCallback && devices[i] != NULL) {
+                hotplugCallback(FREESPACE_HOTPLUG_INSERTION, devices[i]->id_, hotplugCookie);
+            }
+        }
+    }
+
+#ifdef FREESPACE_LIBUSB_HOTPLUG
+    if (useLibusbHotplug) {
+        return applyHotplugEvents();
+    }
+#endif
+
+    // Check if the devices need to be rescanned.
+    rc = freespace_hotplug_perform(&needToRescan);
+    if (rc != FREESPACE_SUCCESS || needToRescan == FREESPACE_HOTPLUG_RESCAN_NONE) {
+        return rc;
+    }
+
+    if (needToRescan == FREESPACE_HOTPLUG_RESCAN_DEVICES) {
+        return rescanHotplugDevices();
+    }
+    return rescanAllDevices();
+}
+
 int freespace_setDeviceHotplugCallback(freespace_hotplugCallback callback,
                                        void* cookie) {
     hotplugCallback = callback;
@@ -337,6 +883,17 @@ int freespace_getDeviceList(FreespaceDeviceId* idList,
     *numIds = 0;
 
     rc = scanDevices();
+#ifdef FREESPACE_LIBUSB_HOTPLUG
+    if (rc == FREESPACE_SUCCESS && useLibusbHotplug &&
+        !__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE) && !appHandlesEvents) {
+        // libusb only delivers hotplug notifications while its events are
+        // handled, and handling them here would also run transfer
+        // callbacks. Its device list is kept current without that, so
+        // compare against the list instead. Notifications that arrive
+        // later find their devices already added or removed.
+        rc = rescanAllDevices();
+    }
+#endif
     if (rc != FREESPACE_SUCCESS) {
         return rc;
     }
@@ -366,31 +923,95 @@ int freespace_getDeviceInfo(FreespaceDeviceId id,
     }
 }
 
+static void callReceiveCallbacks(struct FreespaceDevice* device,
+                                 const uint8_t* buffer,
+                                 int length,
+                                 int rc) {
+    if (device->receiveCallback_ != NULL) {
+        device->receiveCallback_(device->id_, buffer, length, device->receiveCookie_, rc);
+    }
+    if (device->receiveMessageCallback_ != NULL) {
+        struct freespace_message m;
+
+        rc = freespace_decode_message(buffer, length, &m, device->api_->hVer_);
+        if (rc == FREESPACE_SUCCESS) {
+            device->receiveMessageCallback_(device->id_, &m, device->receiveMessageCookie_, FREESPACE_SUCCESS);
+        } else {
+            device->receiveMessageCallback_(device->id_, NULL, device->receiveMessageCookie_, rc);
+        }
+    }
+}
+
+// Called on the event thread. Drops the report if the application
+// has fallen FREESPACE_EVENT_QUEUE_SIZE reports behind, and counts it so
+// that dispatchQueuedReports() can tell the application.
+static void queueReport(struct FreespaceDevice* device, struct libusb_transfer* transfer) {
+    unsigned int head = device->eventQueueHead_;
+    unsigned int tail = __atomic_load_n(&device->eventQueueTail_, __ATOMIC_ACQUIRE);
+    struct FreespaceQueuedReport* report;
+
+    if (head - tail >= FREESPACE_EVENT_QUEUE_SIZE) {
+        __atomic_add_fetch(&device->eventQueueDropped_, 1, __ATOMIC_RELEASE);
+        return;
+    }
+    report = &device->eventQueue_[head % FREESPACE_EVENT_QUEUE_SIZE];
+    report->status_ = libusb_transfer_status_to_freespace_error(transfer->status);
+    report->length_ = transfer->actual_length;
+    memcpy(report->buffer_, transfer->buffer, transfer->actual_length);
+    __atomic_store_n(&device->eventQueueHead_, head + 1, __ATOMIC_RELEASE);
+}
+
+// Called from the application's thread to deliver the reports queued
+// by queueReport().
+static void dispatchQueuedReports(struct FreespaceDevice* device) {
+    unsigned int tail = device->eventQueueTail_;
+    unsigned int head = __atomic_load_n(&device->eventQueueHead_, __ATOMIC_ACQUIRE);
+    unsigned int dropped = __atomic_load_n(&device->eventQueueDropped_, __ATOMIC_ACQUIRE);
+
+    while (tail != head) {
+        struct FreespaceQueuedReport* report = &device->eventQueue_[tail % FREESPACE_EVENT_QUEUE_SIZE];
+        callReceiveCallbacks(device, report->buffer_, report->length_, report->status_);
+        tail++;
+        __atomic_store_n(&device->eventQueueTail_, tail, __ATOMIC_RELEASE);
+    }
+
+    // Reports were lost after the ones just delivered.
+    if (dropped != device->eventQueueDroppedSeen_) {
+        device->eventQueueDroppedSeen_ = dropped;
+        if (device->receiveCallback_ != NULL) {
+            device->receiveCallback_(device->id_, NULL, 0, device->receiveCookie_, FREESPACE_ERROR_BUFFER_TOO_SMALL);
+        }
+        if (device->receiveMessageCallback_ != NULL) {
+            device->receiveMessageCallback_(device->id_, NULL, device->receiveMessageCookie_, FREESPACE_ERROR_BUFFER_TOO_SMALL);
+        }
+    }
+}
+
 static void receiveCallback(struct libusb_transfer* transfer) {
     struct FreespaceReceiveTransfer* rt = (struct FreespaceReceiveTransfer*) transfer->user_data;
     struct FreespaceDevice* device = rt->device_;
 
-    if (transfer->status == LIBUSB_TRANSFER_CANCELLED) {
+    if (transfer->status == LIBUSB_TRANSFER_CANCELLED || device->closing_) {
         // Canceled. This only happens on cleanup. Don't report errors or resubmit.
-        rt->submitted_ = 0;
+        __atomic_store_n(&rt->submitted_, 0, __ATOMIC_RELEASE);
+        signalCompletion();
+        if (__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE)) {
+            wakeApplication();
+        }
         return;
     }
 
     if (device->receiveCallback_ != NULL || device->receiveMessageCallback_ != NULL) {
-        // Using async interface, so call user back immediately.
-        int rc = libusb_transfer_status_to_freespace_error(transfer->status);
-        if (device->receiveCallback_ != NULL) {
-            device->receiveCallback_(device->id_, (const uint8_t*) transfer->buffer, transfer->actual_length, device->receiveCookie_, rc);
-        }
-        if (device->receiveMessageCallback_ != NULL) {
-            struct freespace_message m;
-            
-            rc = freespace_decode_message((const uint8_t*) transfer->buffer, transfer->actual_length, &m, device->api_->hVer_);
-            if (rc == FREESPACE_SUCCESS) {
-                device->receiveMessageCallback_(device->id_, &m, device->receiveMessageCookie_, FREESPACE_SUCCESS);
-            } else {
-                device->receiveMessageCallback_(device->id_, NULL, device->receiveMessageCookie_, rc);
-            }
+        if (__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE) && eventThreadDispatch == FREESPACE_DISPATCH_PERFORM) {
+            // On the event thread, so leave the report for freespace_perform().
+            queueReport(device, transfer);
+            wakeApplication();
+        } else {
+            // Using async interface, so call user back immediately.
+            callReceiveCallbacks(device,
+                                 (const uint8_t*) transfer->buffer,
+                                 transfer->actual_length,
+                                 libusb_transfer_status_to_freespace_error(transfer->status));
         }
 
         // Re-submit the transfer for the to get the next receive going.
@@ -398,69 +1019,54 @@ static void receiveCallback(struct libusb_transfer* transfer) {
         libusb_submit_transfer(transfer);
     } else {
         // Using sync interface, so queue.
-        rt->submitted_ = 0;
+        __atomic_store_n(&rt->submitted_, 0, __ATOMIC_RELEASE);
+        signalCompletion();
     }
 }
 
-int freespace_terminateReceiveTransfers(struct FreespaceDevice* device) {
-    int rc = LIBUSB_SUCCESS;
+// Cancel every receive that libusb owns. The cancellations complete
+// asynchronously through receiveCallback().
+static void cancelReceiveTransfers(struct FreespaceDevice* device) {
     int i;
-    int canceledCount = 0;
-    int retries;
 
-    // Cancel all submitted transfers.
     for (i = 0; i < FREESPACE_RECEIVE_QUEUE_SIZE; i++) {
         struct FreespaceReceiveTransfer* rt = &device->receiveQueue_[i];
-        if (rt->transfer_ != NULL) {
-            if (rt->submitted_) {
-                rc = libusb_cancel_transfer(rt->transfer_);
-
-                // Do not free the transfer here. Transfer cancels are
-                // asynchronous. The callback will know what to do.
-
-                if (rc == LIBUSB_SUCCESS) {
-                    canceledCount++;
-                } else {
-                    // Force free on error.
-                    libusb_free_transfer(rt->transfer_);
-                    rt->transfer_ = NULL;
-                    rt->submitted_ = 0;
-                }
-            } else {
-                // Not submitted to libusb, so this can be freed immediatedly.
-                libusb_free_transfer(rt->transfer_);
-                rt->transfer_ = NULL;
-            }
+        if (rt->transfer_ == NULL) {
+            continue;
+        }
+        if (!__atomic_load_n(&rt->submitted_, __ATOMIC_ACQUIRE)) {
+            // Not submitted to libusb, so this can be freed immediatedly.
+            libusb_free_transfer(rt->transfer_);
+            rt->transfer_ = NULL;
+        } else if (libusb_cancel_transfer(rt->transfer_) != LIBUSB_SUCCESS) {
+            // Don't wait for a cancel that isn't coming.
+            __atomic_store_n(&rt->submitted_, 0, __ATOMIC_RELEASE);
         }
     }
+}
 
-    // Wait for the cancellation to finish up. libusb seems to cancel
-    // one transfer per call to libusb_handle_events_timeout, so make the
-    // retries take that into account and add slack.
-    retries = canceledCount * 3;
-    while (canceledCount > 0 && retries > 0) {
-        struct timeval tv;
-
-        tv.tv_sec = 0;
-        tv.tv_usec = 100000;
-
-        rc = libusb_handle_events_timeout(freespace_libusb_context, &tv);
-        if (rc != LIBUSB_SUCCESS) {
-            break;
-        }
+// Cancel every send in flight. The send callbacks get
+// FREESPACE_ERROR_INTERRUPTED.
+static void cancelSendTransfers(struct FreespaceDevice* device) {
+    struct FreespaceSendTransfer* st;
+    int i;
 
-        for (i = 0; i < FREESPACE_RECEIVE_QUEUE_SIZE; i++) {
-            struct FreespaceReceiveTransfer* rt = &device->receiveQueue_[i];
-            if (rt->transfer_ != NULL && rt->submitted_ == 0) {
-                // Cancel completed.
-                libusb_free_transfer(rt->transfer_);
-                rt->transfer_ = NULL;
-                canceledCount--;
-            }
+    for (i = 0; i < FREESPACE_SEND_QUEUE_SIZE; i++) {
+        st = &device->sendQueue_[i];
+        if (st->transfer_ != NULL && __atomic_load_n(&st->submitted_, __ATOMIC_ACQUIRE)) {
+            libusb_cancel_transfer(st->transfer_);
         }
+    }
 
-        retries--;
+    pthread_mutex_lock(&overflowLock);
+    for (st = device->overflow_; st != NULL; st = st->next_) {
+        libusb_cancel_transfer(st->transfer_);
     }
+    pthread_mutex_unlock(&overflowLock);
+}
+
+static void freeReceiveTransfers(struct FreespaceDevice* device) {
+    int i;
 
     // Force clean any left.
     for (i = 0; i < FREESPACE_RECEIVE_QUEUE_SIZE; i++) {
@@ -469,9 +1075,261 @@ int freespace_terminateReceiveTransfers(struct FreespaceDevice* device) {
             libusb_free_transfer(rt->transfer_);
             rt->transfer_ = NULL;
         }
+        __atomic_store_n(&rt->submitted_, 0, __ATOMIC_RELEASE);
     }
+}
 
-    return libusb_to_freespace_error(rc);
+// Only call once libusb is done with the sends. See finishClose().
+static void freeSendTransfers(struct FreespaceDevice* device) {
+    int i;
+
+    for (i = 0; i < FREESPACE_SEND_QUEUE_SIZE; i++) {
+        struct FreespaceSendTransfer* st = &device->sendQueue_[i];
+        if (st->transfer_ != NULL) {
+            libusb_free_transfer(st->transfer_);
+            st->transfer_ = NULL;
+        }
+        __atomic_store_n(&st->submitted_, 0, __ATOMIC_RELEASE);
+    }
+}
+
+// Returns non-zero while libusb still owns any of the device's transfers.
+static int transfersPending(struct FreespaceDevice* device) {
+    int i;
+
+    if (__atomic_load_n(&device->sendsInFlight_, __ATOMIC_ACQUIRE) > 0) {
+        return 1;
+    }
+    for (i = 0; i < FREESPACE_RECEIVE_QUEUE_SIZE; i++) {
+        struct FreespaceReceiveTransfer* rt = &device->receiveQueue_[i];
+        if (rt->transfer_ != NULL && __atomic_load_n(&rt->submitted_, __ATOMIC_ACQUIRE)) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Handle libusb events until the cancellations on all of the devices
+// have completed or the deadline passes. All devices share the one
+// deadline, so closing many devices costs no more than closing one.
+static int waitForCancels(struct FreespaceDevice** closing,
+                          int count,
+                          const struct timeval* deadline) {
+    struct timeval tv;
+    int i;
+    int rc;
+
+    for (;;) {
+        for (i = 0; i < count && !transfersPending(closing[i]); i++) {
+        }
+        if (i == count) {
+            return FREESPACE_SUCCESS;
+        }
+        if (!timeLeft(deadline, &tv)) {
+            return FREESPACE_ERROR_TIMEOUT;
+        }
+
+        // libusb may complete only one cancellation per call, so
+        // loop until everything is done.
+        rc = handleEvents(&tv);
+        if (rc != LIBUSB_SUCCESS) {
+            return libusb_to_freespace_error(rc);
+        }
+    }
+}
+
+int freespace_terminateReceiveTransfers(struct FreespaceDevice* device) {
+    struct timeval deadline;
+    int rc;
+
+    cancelReceiveTransfers(device);
+    makeDeadline(&deadline, FREESPACE_CLOSE_TIMEOUT_MS);
+    rc = waitForCancels(&device, 1, &deadline);
+    freeReceiveTransfers(device);
+    return rc;
+}
+
+// Free the transfers and give up the device handle. Only call once
+// libusb is done with the transfers.
+static void releaseHandle(struct FreespaceDevice* device) {
+    freeSendTransfers(device);
+    freeReceiveTransfers(device);
+
+    // Release our lock on the interface.
+    libusb_release_interface(device->handle_, device->api_->controlInterfaceNumber_);
+
+    // Re-attach the kernel driver if we detached it before.
+    if (device->kernelDriverDetached_) {
+        // This currently fails, and there doesn't seem to be anything that we
+        // can do.
+        libusb_attach_kernel_driver(device->handle_, device->api_->controlInterfaceNumber_);
+    }
+    libusb_close(device->handle_);
+    device->handle_ = NULL;
+}
+
+// Move a device whose cancellations missed the close deadline to the
+// zombie list. Its transfers point back at it, so it stays allocated,
+// still marked as closing, until libusb completes them. A fresh entry
+// takes its place in the device table while the device is attached,
+// so its id stays valid. Opening it fails until the zombie is reaped.
+static void buryDevice(struct FreespaceDevice* device) {
+    struct FreespaceDevice* fresh = NULL;
+    int i;
+
+    if (device->state_ != FREESPACE_DISCONNECTED) {
+        fresh = (struct FreespaceDevice*) malloc(sizeof(struct FreespaceDevice));
+        if (fresh != NULL) {
+            memset(fresh, 0, sizeof(struct FreespaceDevice));
+            libusb_ref_device(device->dev_);
+            fresh->dev_ = device->dev_;
+            fresh->idProduct_ = device->idProduct_;
+            fresh->idVendor_ = device->idVendor_;
+            fresh->api_ = device->api_;
+            fresh->id_ = device->id_;
+            fresh->state_ = FREESPACE_CONNECTED;
+            fresh->ts_ = device->ts_;
+            fresh->sendDepth_ = FREESPACE_SEND_QUEUE_SIZE;
+        }
+    }
+
+    for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
+        if (devices[i] == device) {
+            devices[i] = fresh;
+            if (fresh == NULL) {
+                if (nextFreeIndex == -1) {
+                    nextFreeIndex = i;
+                }
+                numDevices--;
+            }
+            break;
+        }
+    }
+
+    device->closeCallback_ = NULL;
+    device->closeCookie_ = NULL;
+    device->nextZombie_ = zombies;
+    zombies = device;
+}
+
+// Free the zombies whose transfers libusb has completed.
+static void reapZombies() {
+    struct FreespaceDevice** link = &zombies;
+
+    while (*link != NULL) {
+        struct FreespaceDevice* device = *link;
+        if (transfersPending(device)) {
+            link = &device->nextZombie_;
+            continue;
+        }
+        *link = device->nextZombie_;
+        releaseHandle(device);
+        libusb_unref_device(device->dev_);
+        free(device);
+    }
+}
+
+// Release the device and tell the application if it asked to hear
+// about it. This never waits: a device whose transfers libusb still
+// owns becomes a zombie, and is freed by a later freespace_perform()
+// or freespace_exit().
+static void finishClose(struct FreespaceDevice* device, int result) {
+    FreespaceDeviceId id = device->id_;
+    freespace_closeCallback callback = device->closeCallback_;
+    void* cookie = device->closeCookie_;
+
+    if (transfersPending(device)) {
+        buryDevice(device);
+    } else {
+        releaseHandle(device);
+        device->closing_ = 0;
+        device->closeCallback_ = NULL;
+        device->closeCookie_ = NULL;
+
+        if (device->state_ == FREESPACE_DISCONNECTED) {
+            removeFreespaceDevice(device);
+        } else {
+            device->state_ = FREESPACE_CONNECTED;
+        }
+    }
+
+    if (callback != NULL) {
+        callback(id, cookie, result);
+    }
+}
+
+static void startClose(struct FreespaceDevice* device) {
+    device->closing_ = 1;
+    makeDeadline(&device->closeDeadline_, FREESPACE_CLOSE_TIMEOUT_MS);
+
+    // Stop sends and receives.
+    cancelSendTransfers(device);
+    cancelReceiveTransfers(device);
+}
+
+// Close several devices at once. All of the transfers are cancelled
+// up front and then waited for together.
+static void closeDevices(struct FreespaceDevice** closing, int count) {
+    struct timeval deadline;
+    int rc;
+    int i;
+
+    for (i = 0; i < count; i++) {
+        if (!closing[i]->closing_) {
+            startClose(closing[i]);
+        }
+    }
+
+    makeDeadline(&deadline, FREESPACE_CLOSE_TIMEOUT_MS);
+    rc = waitForCancels(closing, count, &deadline);
+
+    for (i = 0; i < count; i++) {
+        finishClose(closing[i], rc);
+    }
+}
+
+// Complete the asynchronous closes whose transfers are done or whose
+// time is up.
+static void finishPendingCloses() {
+    struct timeval tv;
+    int i;
+
+    for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
+        struct FreespaceDevice* device = devices[i];
+        if (device == NULL || !device->closing_) {
+            continue;
+        }
+        if (!transfersPending(device)) {
+            finishClose(device, FREESPACE_SUCCESS);
+        } else if (!timeLeft(&device->closeDeadline_, &tv)) {
+            finishClose(device, FREESPACE_ERROR_TIMEOUT);
+        }
+    }
+}
+
+// The time until an asynchronous close needs attention, or -1 if
+// there are none.
+static int nextCloseTimeout() {
+    struct timeval tv;
+    int timeoutMs = -1;
+    int i;
+
+    for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
+        struct FreespaceDevice* device = devices[i];
+        int ms;
+
+        if (device == NULL || !device->closing_) {
+            continue;
+        }
+        if (!transfersPending(device) || !timeLeft(&device->closeDeadline_, &tv)) {
+            return 0;
+        }
+        ms = tv.tv_sec * 1000 + (tv.tv_usec + 999) / 1000;
+        if (timeoutMs < 0 || ms < timeoutMs) {
+            timeoutMs = ms;
+        }
+    }
+    return timeoutMs;
 }
 
 int freespace_initiateReceiveTransfers(struct FreespaceDevice* device) {
@@ -491,18 +1349,75 @@ int freespace_initiateReceiveTransfers(struct FreespaceDevice* device) {
                                        receiveCallback,
                                        rt,
                                        0);
+        // Mark the transfer before submitting it so that a completion
+        // on the event thread can't be overwritten.
+        __atomic_store_n(&rt->submitted_, 1, __ATOMIC_RELEASE);
         rc = libusb_submit_transfer(rt->transfer_);
         if (rc != LIBUSB_SUCCESS) {
+            __atomic_store_n(&rt->submitted_, 0, __ATOMIC_RELEASE);
             freespace_terminateReceiveTransfers(device);
             break;
         }
-
-        rt->submitted_ = 1;
     }
 
     return libusb_to_freespace_error(rc);
 }
 
+static void sendCallback(struct libusb_transfer* transfer) {
+    struct FreespaceSendTransfer* st = (struct FreespaceSendTransfer*) transfer->user_data;
+    struct FreespaceDevice* device = st->device_;
+    FreespaceDeviceId id = device->id_;
+    int closing = device->closing_;
+    freespace_sendCallback callback = st->callback_;
+    void* cookie = st->cookie_;
+    int rc = libusb_transfer_status_to_freespace_error(transfer->status);
+
+    // Free the slot first so that the callback can send the next message.
+    // Once the send stops being counted, another thread can finish closing
+    // the device and free it, so only the copies above are used after.
+    if (st->overflow_) {
+        pthread_mutex_lock(&overflowLock);
+        if (st->prev_ != NULL) {
+            st->prev_->next_ = st->next_;
+        } else {
+            device->overflow_ = st->next_;
+        }
+        if (st->next_ != NULL) {
+            st->next_->prev_ = st->prev_;
+        }
+        pthread_mutex_unlock(&overflowLock);
+        libusb_free_transfer(transfer);
+        free(st);
+    } else {
+        __atomic_store_n(&st->submitted_, 0, __ATOMIC_RELEASE);
+    }
+    __atomic_sub_fetch(&device->sendsInFlight_, 1, __ATOMIC_RELEASE);
+    signalCompletion();
+
+    if (callback != NULL) {
+        callback(id, cookie, rc);
+    }
+    if (closing && __atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE)) {
+        wakeApplication();
+    }
+}
+
+static int initiateSendTransfers(struct FreespaceDevice* device) {
+    int i;
+
+    device->sendsInFlight_ = 0;
+    for (i = 0; i < FREESPACE_SEND_QUEUE_SIZE; i++) {
+        struct FreespaceSendTransfer* st = &device->sendQueue_[i];
+        st->device_ = device;
+        __atomic_store_n(&st->submitted_, 0, __ATOMIC_RELEASE);
+        st->transfer_ = libusb_alloc_transfer(0);
+        if (st->transfer_ == NULL) {
+            return FREESPACE_ERROR_OUT_OF_MEMORY;
+        }
+    }
+    return FREESPACE_SUCCESS;
+}
+
 int freespace_openDevice(FreespaceDeviceId id) {
     struct FreespaceDevice* device = findDeviceById(id);
     struct libusb_config_descriptor *config;
@@ -514,6 +1429,9 @@ int freespace_openDevice(FreespaceDeviceId id) {
     if (device == NULL) {
         return FREESPACE_ERROR_NOT_FOUND;
     }
+    if (device->closing_) {
+        return FREESPACE_ERROR_BUSY;
+    }
 
     rc = libusb_open(device->dev_, &device->handle_);
     if (rc != LIBUSB_SUCCESS) {
@@ -559,6 +1477,17 @@ int freespace_openDevice(FreespaceDeviceId id) {
     }
 
     device->state_ = FREESPACE_OPENED;
+    device->pendingReadError_ = FREESPACE_SUCCESS;
+    device->eventQueueHead_ = 0;
+    device->eventQueueTail_ = 0;
+    device->eventQueueDropped_ = 0;
+    device->eventQueueDroppedSeen_ = 0;
+
+    rc = initiateSendTransfers(device);
+    if (rc != FREESPACE_SUCCESS) {
+        freeSendTransfers(device);
+        return rc;
+    }
 
     // Start the receive queue working.
     rc = freespace_initiateReceiveTransfers(device);
@@ -569,29 +1498,28 @@ void freespace_closeDevice(FreespaceDeviceId id) {
     struct FreespaceDevice* device;
     device = findDeviceById(id);
     if (device != NULL && device->handle_ != NULL) {
-        // Stop receives.
-        freespace_terminateReceiveTransfers(device);
-
-        // Should we wait until everything terminates cleanly?
+        closeDevices(&device, 1);
+    }
+}
 
-        // Release our lock on the interface.
-        libusb_release_interface(device->handle_, device->api_->controlInterfaceNumber_);
+int freespace_closeDeviceAsync(FreespaceDeviceId id,
+                               freespace_closeCallback callback,
+                               void* cookie) {
+    struct FreespaceDevice* device;
+    device = findDeviceById(id);
+    if (device == NULL || device->handle_ == NULL) {
+        return FREESPACE_ERROR_NOT_FOUND;
+    }
+    if (device->closing_) {
+        return FREESPACE_ERROR_BUSY;
+    }
 
-        // Re-attach the kernel driver if we detached it before.
-        if (device->kernelDriverDetached_) {
-            // This currently fails, and there doesn't seem to be anything that we
-            // can do.
-            libusb_attach_kernel_driver(device->handle_, device->api_->controlInterfaceNumber_);
-        }
-        libusb_close(device->handle_);
-        device->handle_ = NULL;
+    device->closeCallback_ = callback;
+    device->closeCookie_ = cookie;
+    startClose(device);
 
-        if (device->state_ == FREESPACE_DISCONNECTED) {
-            removeFreespaceDevice(device);
-        } else {
-            device->state_ = FREESPACE_CONNECTED;
-        }
-    }
+    // freespace_perform() finishes the close.
+    return FREESPACE_SUCCESS;
 }
 
 int freespace_private_send(FreespaceDeviceId id,
@@ -602,7 +1530,7 @@ int freespace_private_send(FreespaceDeviceId id,
     struct FreespaceDevice* device;
     device = findDeviceById(id);
 
-    if (device == NULL || device->state_ != FREESPACE_OPENED) {
+    if (device == NULL || device->state_ != FREESPACE_OPENED || device->closing_) {
         return FREESPACE_ERROR_NOT_FOUND;
     }
 
@@ -611,7 +1539,7 @@ int freespace_private_send(FreespaceDeviceId id,
         return FREESPACE_ERROR_SEND_TOO_LARGE;
     }
 
-    rc = libusb_interrupt_transfer(device->handle_, device->writeEndpointAddress_, (unsigned char*) message, length, &count, 0);
+    rc = libusb_interrupt_transfer(device->handle_, device->writeEndpointAddress_, (unsigned char*) message, length, &count, FREESPACE_SEND_TIMEOUT_MS);
     if (rc != LIBUSB_SUCCESS) {
         return libusb_to_freespace_error(rc);
     }
@@ -648,19 +1576,18 @@ int freespace_sendMessage(FreespaceDeviceId id,
     return freespace_private_send(id, msgBuf, rc);
 }
 
-int freespace_private_read(FreespaceDeviceId id,
-                           uint8_t* message,
-                           int maxLength,
-                           unsigned int timeoutMs,
-                           int* actualLength) {
-    struct FreespaceDevice* device = findDeviceById(id);
+// Wait for the next report and take it off the receive queue. Returns
+// an error if no report could be taken. Otherwise, the report's own
+// status is stored in status.
+static int readReport(struct FreespaceDevice* device,
+                      uint8_t* message,
+                      int maxLength,
+                      unsigned int timeoutMs,
+                      int* actualLength,
+                      int* status) {
     struct FreespaceReceiveTransfer* rt;
     int rc;
 
-    if (device == NULL || device->state_ != FREESPACE_OPENED) {
-        return FREESPACE_ERROR_NOT_FOUND;
-    }
-
     if (maxLength < device->maxReadSize_) {
         // Don't risk causing an overflow due to too small
         // a receive buffer.
@@ -670,48 +1597,68 @@ int freespace_private_read(FreespaceDeviceId id,
     rt = &device->receiveQueue_[device->receiveQueueHead_];
 
     // Check if we need to wait.
-    if (rt->submitted_ != 0) {
+    if (__atomic_load_n(&rt->submitted_, __ATOMIC_ACQUIRE) != 0) {
+        struct timeval deadline;
         struct timeval tv;
 
+        makeDeadline(&deadline, timeoutMs);
         tv.tv_sec = timeoutMs / 1000;
         tv.tv_usec = (timeoutMs % 1000) * 1000;
 
         // Wait.
         do {
-            rc = libusb_handle_events_timeout(freespace_libusb_context, &tv);
+            rc = handleEvents(&tv);
             if (rc != LIBUSB_SUCCESS) {
                 return libusb_to_freespace_error(rc);
             }
 
             // Keep trying until something has been received.
-            // Note that libusb_handle_events_timeout could return
+            // Note that handleEvents could return
             // without a receive if it ends up doing some other
             // processing such as an async send completion or
-            // something on another device.
-
-            // TODO: update tv with time left.
-            timeoutMs = 0;
-        } while (rt->submitted_ != 0 && timeoutMs > 0);
+            // something on another device, so wait again for
+            // whatever is left of the timeout.
+        } while (__atomic_load_n(&rt->submitted_, __ATOMIC_ACQUIRE) != 0 && timeLeft(&deadline, &tv));
 
-        if (rt->submitted_ != 0) {
-            return LIBUSB_ERROR_TIMEOUT;
+        if (__atomic_load_n(&rt->submitted_, __ATOMIC_ACQUIRE) != 0) {
+            return FREESPACE_ERROR_TIMEOUT;
         }
     }
 
     // Copy the message out.
     *actualLength = rt->transfer_->actual_length;
     memcpy(message, rt->buffer_, *actualLength);
-    rc = libusb_transfer_status_to_freespace_error(rt->transfer_->status);
+    *status = libusb_transfer_status_to_freespace_error(rt->transfer_->status);
 
     // Resubmit the transfer
-    rt->submitted_ = 1;
+    __atomic_store_n(&rt->submitted_, 1, __ATOMIC_RELEASE);
     libusb_submit_transfer(rt->transfer_);
     device->receiveQueueHead_++;
     if (device->receiveQueueHead_ >= FREESPACE_RECEIVE_QUEUE_SIZE) {
         device->receiveQueueHead_ = 0;
     }
 
-    return rc;
+    return FREESPACE_SUCCESS;
+}
+
+int freespace_private_read(FreespaceDeviceId id,
+                           uint8_t* message,
+                           int maxLength,
+                           unsigned int timeoutMs,
+                           int* actualLength) {
+    struct FreespaceDevice* device = findDeviceById(id);
+    int status;
+    int rc;
+
+    if (device == NULL || device->state_ != FREESPACE_OPENED || device->closing_) {
+        return FREESPACE_ERROR_NOT_FOUND;
+    }
+
+    rc = readReport(device, message, maxLength, timeoutMs, actualLength, &status);
+    if (rc != FREESPACE_SUCCESS) {
+        return rc;
+    }
+    return status;
 }
 
 int freespace_readMessage(FreespaceDeviceId id,
@@ -736,6 +1683,66 @@ int freespace_readMessage(FreespaceDeviceId id,
     }
 }
 
+int freespace_readMessages(FreespaceDeviceId id,
+                           struct freespace_message* messages,
+                           int maxMessages,
+                           unsigned int timeoutMs,
+                           int* numMessages) {
+    struct FreespaceDevice* device = findDeviceById(id);
+    uint8_t buffer[FREESPACE_MAX_INPUT_MESSAGE_SIZE];
+    int actLen;
+    int status;
+    int rc;
+
+    *numMessages = 0;
+    if (device == NULL || device->state_ != FREESPACE_OPENED || device->closing_) {
+        return FREESPACE_ERROR_NOT_FOUND;
+    }
+    if (maxMessages <= 0) {
+        return FREESPACE_SUCCESS;
+    }
+
+    // Report a bad report skipped by the previous call before reading on.
+    if (device->pendingReadError_ != FREESPACE_SUCCESS) {
+        rc = device->pendingReadError_;
+        device->pendingReadError_ = FREESPACE_SUCCESS;
+        return rc;
+    }
+
+    // Wait for the first report, then only take what has already
+    // been received.
+    rc = readReport(device, buffer, sizeof(buffer), timeoutMs, &actLen, &status);
+    while (rc == FREESPACE_SUCCESS) {
+        if (status == FREESPACE_SUCCESS) {
+            status = freespace_decode_message(buffer, actLen, &messages[*numMessages], device->api_->hVer_);
+        }
+        if (status == FREESPACE_SUCCESS) {
+            *numMessages = *numMessages + 1;
+            if (*numMessages == maxMessages) {
+                break;
+            }
+        } else if (device->pendingReadError_ == FREESPACE_SUCCESS) {
+            // Keep the first error for later so that the good reports
+            // queued behind a bad one are still returned.
+            device->pendingReadError_ = status;
+        }
+        rc = readReport(device, buffer, sizeof(buffer), 0, &actLen, &status);
+    }
+
+    // Once something has been returned, running out of queued reports
+    // or a failed read just ends the batch.
+    if (*numMessages > 0) {
+        return FREESPACE_SUCCESS;
+    }
+
+    // Nothing good was queued, so report the bad report now.
+    if (device->pendingReadError_ != FREESPACE_SUCCESS) {
+        rc = device->pendingReadError_;
+        device->pendingReadError_ = FREESPACE_SUCCESS;
+    }
+    return rc;
+}
+
 int freespace_flush(FreespaceDeviceId id) {
     struct FreespaceDevice* device = findDeviceById(id);
     struct FreespaceReceiveTransfer* rt;
@@ -743,7 +1750,7 @@ int freespace_flush(FreespaceDeviceId id) {
     int repeat;
     int maxRepeats = FREESPACE_RECEIVE_QUEUE_SIZE * 2;
 
-    if (device == NULL || device->state_ != FREESPACE_OPENED) {
+    if (device == NULL || device->state_ != FREESPACE_OPENED || device->closing_) {
         return FREESPACE_ERROR_NOT_FOUND;
     }
 
@@ -754,14 +1761,14 @@ int freespace_flush(FreespaceDeviceId id) {
         // events as possible.
         tv.tv_sec = 0;
         tv.tv_usec = 0;
-        libusb_handle_events_timeout(freespace_libusb_context, &tv);
+        handleEvents(&tv);
 
         repeat = 0;
 
         // Clear out our queue.
         rt = &device->receiveQueue_[device->receiveQueueHead_];
-        while (rt->submitted_ == 0) {
-            rt->submitted_ = 1;
+        while (__atomic_load_n(&rt->submitted_, __ATOMIC_ACQUIRE) == 0) {
+            __atomic_store_n(&rt->submitted_, 1, __ATOMIC_RELEASE);
             libusb_submit_transfer(rt->transfer_);
             device->receiveQueueHead_++;
             if (device->receiveQueueHead_ >= FREESPACE_RECEIVE_QUEUE_SIZE) {
@@ -778,19 +1785,107 @@ int freespace_flush(FreespaceDeviceId id) {
     return FREESPACE_SUCCESS;
 }
 
-struct SendTransferInfo {
-    FreespaceDeviceId id;
-    freespace_sendCallback callback;
-    void* cookie;
-};
+#ifndef __APPLE__
+// Start an asynchronous send. Pipelined sends are limited to the
+// device's pipeline depth and return FREESPACE_ERROR_BUSY beyond it.
+// The others have never been limited, so one that doesn't fit in the
+// queue gets a transfer of its own.
+static int submitSend(FreespaceDeviceId id,
+                      const uint8_t* message,
+                      int length,
+                      unsigned int timeoutMs,
+                      freespace_sendCallback callback,
+                      void* cookie,
+                      int pipelined) {
+    struct FreespaceDevice* device;
+    struct FreespaceSendTransfer* st = NULL;
+    int i;
+    int rc;
 
-static void sendCallback(struct libusb_transfer* transfer) {
-    struct SendTransferInfo* info = (struct SendTransferInfo*) transfer->user_data;
-    int rc = libusb_transfer_status_to_freespace_error(transfer->status);
-    info->callback(info->id, info->cookie, rc);
+    device = findDeviceById(id);
+    if (device == NULL || device->state_ != FREESPACE_OPENED || device->closing_) {
+        return FREESPACE_ERROR_NOT_FOUND;
+    }
+
+    if (length > device->maxWriteSize_) {
+        return FREESPACE_ERROR_SEND_TOO_LARGE;
+    }
+
+    // Apply backpressure once the pipeline is full.
+    if (pipelined && __atomic_load_n(&device->sendsInFlight_, __ATOMIC_ACQUIRE) >= device->sendDepth_) {
+        return FREESPACE_ERROR_BUSY;
+    }
+    for (i = 0; i < FREESPACE_SEND_QUEUE_SIZE; i++) {
+        if (!__atomic_load_n(&device->sendQueue_[i].submitted_, __ATOMIC_ACQUIRE)) {
+            st = &device->sendQueue_[i];
+            break;
+        }
+    }
+    if (st == NULL) {
+        if (pipelined) {
+            return FREESPACE_ERROR_BUSY;
+        }
+        st = (struct FreespaceSendTransfer*) calloc(1, sizeof(struct FreespaceSendTransfer));
+        if (st == NULL) {
+            return FREESPACE_ERROR_OUT_OF_MEMORY;
+        }
+        st->transfer_ = libusb_alloc_transfer(0);
+        if (st->transfer_ == NULL) {
+            free(st);
+            return FREESPACE_ERROR_OUT_OF_MEMORY;
+        }
+        st->device_ = device;
+        st->overflow_ = 1;
+    }
 
-    free(info);
+    // Copy the message since the caller's buffer may go away before
+    // the send completes.
+    memcpy(st->buffer_, message, length);
+    st->callback_ = callback;
+    st->cookie_ = cookie;
+    libusb_fill_interrupt_transfer(st->transfer_,
+                                   device->handle_,
+                                   device->writeEndpointAddress_,
+                                   st->buffer_,
+                                   length,
+                                   sendCallback,
+                                   st,
+                                   timeoutMs);
+
+    // List the overflow send before submitting it, so that a close can
+    // find it to cancel.
+    if (st->overflow_) {
+        pthread_mutex_lock(&overflowLock);
+        st->next_ = device->overflow_;
+        if (st->next_ != NULL) {
+            st->next_->prev_ = st;
+        }
+        device->overflow_ = st;
+        pthread_mutex_unlock(&overflowLock);
+    } else {
+        __atomic_store_n(&st->submitted_, 1, __ATOMIC_RELEASE);
+    }
+    __atomic_add_fetch(&device->sendsInFlight_, 1, __ATOMIC_RELEASE);
+    rc = libusb_submit_transfer(st->transfer_);
+    if (rc != LIBUSB_SUCCESS) {
+        if (st->overflow_) {
+            pthread_mutex_lock(&overflowLock);
+            device->overflow_ = st->next_;
+            if (st->next_ != NULL) {
+                st->next_->prev_ = NULL;
+            }
+            pthread_mutex_unlock(&overflowLock);
+            libusb_free_transfer(st->transfer_);
+            free(st);
+        } else {
+            __atomic_store_n(&st->submitted_, 0, __ATOMIC_RELEASE);
+        }
+        __atomic_sub_fetch(&device->sendsInFlight_, 1, __ATOMIC_RELEASE);
+    }
+
+    return libusb_to_freespace_error(rc);
 }
+#endif
 
 int freespace_private_sendAsync(FreespaceDeviceId id,
                                 const uint8_t* message,
@@ -809,52 +1904,132 @@ int freespace_private_sendAsync(FreespaceDeviceId id,
 
     return libusb_to_freespace_error(rc);
 #else
-    struct FreespaceDevice* device;
-    device = findDeviceById(id);
-    struct libusb_transfer* transfer;
+    return submitSend(id, message, length, timeoutMs, callback, cookie, 0);
+#endif
+}
+
+// One try at a pipelined send, which returns FREESPACE_ERROR_BUSY while
+// the pipeline is full.
+static int trySendPipelined(FreespaceDeviceId id,
+                            const uint8_t* message,
+                            int length,
+                            unsigned int timeoutMs,
+                            freespace_sendCallback callback,
+                            void* cookie) {
+#ifdef __APPLE__
+    return freespace_private_sendAsync(id, message, length, timeoutMs, callback, cookie);
+#else
+    return submitSend(id, message, length, timeoutMs, callback, cookie, 1);
+#endif
+}
+
+int freespace_private_sendPipelined(FreespaceDeviceId id,
+                                    const uint8_t* message,
+                                    int length,
+                                    unsigned int timeoutMs,
+                                    freespace_sendCallback callback,
+                                    void* cookie) {
+    struct timeval deadline;
+    struct timeval tv;
     int rc;
 
-    if (device == NULL || device->state_ != FREESPACE_OPENED) {
-        return FREESPACE_ERROR_NOT_FOUND;
+    rc = trySendPipelined(id, message, length, timeoutMs, callback, cookie);
+    if (rc != FREESPACE_ERROR_BUSY) {
+        return rc;
     }
 
-    if (length > device->maxWriteSize_) {
-        return FREESPACE_ERROR_SEND_TOO_LARGE;
+    // The pipeline is full, so handle events until a send completes.
+    makeDeadline(&deadline, timeoutMs);
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    do {
+        if (timeoutMs == 0) {
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+        }
+        rc = handleEvents(&tv);
+        if (rc != LIBUSB_SUCCESS) {
+            return libusb_to_freespace_error(rc);
+        }
+
+        rc = trySendPipelined(id, message, length, timeoutMs, callback, cookie);
+        if (rc != FREESPACE_ERROR_BUSY) {
+            return rc;
+        }
+    } while (timeoutMs == 0 || timeLeft(&deadline, &tv));
+
+    return FREESPACE_ERROR_TIMEOUT;
+}
+
+int freespace_sendMessagePipelined(FreespaceDeviceId id,
+                                   struct freespace_message* message,
+                                   unsigned int timeoutMs,
+                                   freespace_sendCallback callback,
+                                   void* cookie) {
+    int rc;
+    uint8_t msgBuf[FREESPACE_MAX_OUTPUT_MESSAGE_SIZE];
+    struct FreespaceDeviceInfo info;
+
+    // Address is reserved for now and must be set to 0 by the caller.
+    if (message->dest == 0) {
+        message->dest = FREESPACE_RESERVED_ADDRESS;
     }
 
-    transfer = libusb_alloc_transfer(0);
-    if (transfer == NULL) {
-        return FREESPACE_ERROR_OUT_OF_MEMORY;
+    rc = freespace_getDeviceInfo(id, &info);
+    if (rc != FREESPACE_SUCCESS) {
+        return rc;
     }
 
-    transfer->dev_handle = device->handle_;
-    transfer->endpoint = device->writeEndpointAddress_;
-    transfer->type = LIBUSB_TRANSFER_TYPE_INTERRUPT;
-    transfer->timeout = timeoutMs;
-    transfer->buffer = (unsigned char*) message;
-    transfer->length = length;
-    transfer->flags = LIBUSB_TRANSFER_FREE_TRANSFER;
+    message->ver = info.hVer;
+    rc = freespace_encode_message(message, msgBuf, FREESPACE_MAX_OUTPUT_MESSAGE_SIZE);
+    if (rc <= FREESPACE_SUCCESS) {
+        return rc;
+    }
 
-    if (callback != NULL) {
-        struct SendTransferInfo* info = (struct SendTransferInfo*) malloc(sizeof(struct SendTransferInfo));
-    	if (info == NULL) {
-    	    libusb_free_transfer(transfer);
-            return FREESPACE_ERROR_OUT_OF_MEMORY;
-    	}
-    	info->id = id;
-        info->callback = callback;
-        info->cookie = cookie;
-    	transfer->callback = sendCallback;
-    	transfer->user_data = info;
-    } else {
-    	transfer->callback = NULL;
-    	transfer->user_data = NULL;
+    return freespace_private_sendPipelined(id, msgBuf, rc, timeoutMs, callback, cookie);
+}
+
+int freespace_setSendPipelineDepth(FreespaceDeviceId id, int depth) {
+    struct FreespaceDevice* device = findDeviceById(id);
+
+    if (device == NULL) {
+        return FREESPACE_ERROR_NOT_FOUND;
+    }
+    if (depth < 1 || depth > FREESPACE_SEND_QUEUE_SIZE) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+
+    device->sendDepth_ = depth;
+    return FREESPACE_SUCCESS;
+}
+
+int freespace_waitForSends(FreespaceDeviceId id, unsigned int timeoutMs) {
+    struct FreespaceDevice* device = findDeviceById(id);
+    struct timeval deadline;
+    struct timeval tv;
+    int rc;
+
+    if (device == NULL || device->state_ != FREESPACE_OPENED || device->closing_) {
+        return FREESPACE_ERROR_NOT_FOUND;
     }
 
-    rc = libusb_submit_transfer(transfer);
+    makeDeadline(&deadline, timeoutMs);
+    tv.tv_sec = timeoutMs / 1000;
+    tv.tv_usec = (timeoutMs % 1000) * 1000;
+    while (__atomic_load_n(&device->sendsInFlight_, __ATOMIC_ACQUIRE) > 0) {
+        if (timeoutMs == 0) {
+            tv.tv_sec = 1;
+            tv.tv_usec = 0;
+        } else if (!timeLeft(&deadline, &tv)) {
+            return FREESPACE_ERROR_TIMEOUT;
+        }
+        rc = handleEvents(&tv);
+        if (rc != LIBUSB_SUCCESS) {
+            return libusb_to_freespace_error(rc);
+        }
+    }
 
-    return libusb_to_freespace_error(rc);
-#endif
+    return FREESPACE_SUCCESS;
 }
 
 int freespace_sendMessageAsync(FreespaceDeviceId id,
@@ -888,9 +2063,31 @@ int freespace_sendMessageAsync(FreespaceDeviceId id,
 
 int freespace_getNextTimeout(int* timeoutMsOut) {
     struct timeval tv;
-    int hotplugTimeout = freespace_hotplug_timeout();
+    int hotplugTimeout;
+    int closeTimeout = nextCloseTimeout();
     int timeoutMs;
 
+#ifdef FREESPACE_LIBUSB_HOTPLUG
+    if (useLibusbHotplug) {
+        // libusb's own timeouts cover hotplug.
+        hotplugTimeout = -1;
+    } else
+#endif
+    {
+        hotplugTimeout = freespace_hotplug_timeout();
+    }
+
+    if (__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE) || appHandlesEvents) {
+        // The event thread or the application takes care of libusb's
+        // timeouts.
+        timeoutMs = hotplugTimeout > 0 ? hotplugTimeout : -1;
+        if (closeTimeout >= 0 && (timeoutMs < 0 || closeTimeout < timeoutMs)) {
+            timeoutMs = closeTimeout;
+        }
+        *timeoutMsOut = timeoutMs;
+        return FREESPACE_SUCCESS;
+    }
+
     int rc = libusb_get_next_timeout(freespace_libusb_context, &tv);
     if (rc == 1) {
         // libusb has a timeout
@@ -906,27 +2103,55 @@ int freespace_getNextTimeout(int* timeoutMsOut) {
         // No one has a timeout.
         timeoutMs = -1;
     }
+    if (closeTimeout >= 0 && (timeoutMs < 0 || closeTimeout < timeoutMs)) {
+        // An asynchronous close is waiting.
+        timeoutMs = closeTimeout;
+    }
     *timeoutMsOut = timeoutMs;
     return libusb_to_freespace_error(rc);
 }
 
 int freespace_perform() {
     struct timeval tv = {0, 0};
-    int rc;
+    int rc = LIBUSB_SUCCESS;
+    int i;
+
+    if (__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE)) {
+        // Reset the wakeup before looking at the queues so that
+        // nothing queued after this point gets missed.
+        uint64_t count;
+        while (read(wakeReadFd, &count, sizeof(count)) > 0) {
+        }
+    } else if (!appHandlesEvents) {
+        // Handle libusb events first so that hotplug notifications
+        // delivered by libusb get applied by this call.
+        rc = libusb_handle_events_timeout(freespace_libusb_context, &tv);
+    }
 
     scanDevices();
 
-    rc = libusb_handle_events_timeout(freespace_libusb_context, &tv);
+    if (__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE)) {
+        for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
+            if (devices[i] != NULL && devices[i]->state_ == FREESPACE_OPENED) {
+                dispatchQueuedReports(devices[i]);
+            }
+        }
+    }
+
+    finishPendingCloses();
+    reapZombies();
+
     return libusb_to_freespace_error(rc);
 }
 
 static void pollfd_added_cb(int fd, short events, void* user_data) {
-    if (userAddedCallback != NULL) {
+    // libusb's descriptors belong to the event thread while it runs.
+    if (userAddedCallback != NULL && !__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE)) {
         userAddedCallback(fd, events);
     }
 }
 static void pollfd_removed_cb(int fd, void* user_data) {
-    if (userRemovedCallback != NULL) {
+    if (userRemovedCallback != NULL && !__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE)) {
         userRemovedCallback(fd);
     }
 }
@@ -936,7 +2161,10 @@ void freespace_setFileDescriptorCallbacks(freespace_pollfdAddedCallback addedCal
     userAddedCallback = addedCallback;
     userRemovedCallback = removedCallback;
 
-    libusb_set_pollfd_notifiers(freespace_libusb_context, pollfd_added_cb, pollfd_removed_cb, NULL);
+    // Leave the notifiers alone when they belong to the application.
+    if (!appHandlesEvents) {
+        libusb_set_pollfd_notifiers(freespace_libusb_context, pollfd_added_cb, pollfd_removed_cb, NULL);
+    }
 }
 
 int freespace_syncFileDescriptors() {
@@ -948,7 +2176,20 @@ int freespace_syncFileDescriptors() {
     }
 
     // Add the hotplug code's fd
-    userAddedCallback(freespace_hotplug_getFD(), POLLIN);
+#ifdef FREESPACE_LIBUSB_HOTPLUG
+    if (!useLibusbHotplug)
+#endif
+    {
+        userAddedCallback(freespace_hotplug_getFD(), POLLIN);
+    }
+
+    if (__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE)) {
+        userAddedCallback(wakeReadFd, POLLIN);
+        return FREESPACE_SUCCESS;
+    }
+    if (appHandlesEvents) {
+        return FREESPACE_SUCCESS;
+    }
 
     // Add all of libusb's handles
     usbfds = libusb_get_pollfds(freespace_libusb_context);
@@ -960,6 +2201,125 @@ int freespace_syncFileDescriptors() {
     return FREESPACE_SUCCESS;
 }
 
+static void wakeApplication() {
+    uint64_t one = 1;
+    ssize_t rc;
+
+    // The wakeup only needs to be pending, so a full pipe is fine.
+    rc = write(wakeWriteFd, &one, sizeof(one));
+    (void) rc;
+}
+
+static void* eventThreadMain(void* arg) {
+    while (!__atomic_load_n(&eventThreadStop, __ATOMIC_ACQUIRE)) {
+        struct timeval tv = {0, 100000};
+        libusb_handle_events_timeout_completed(freespace_libusb_context, &tv, &eventThreadStop);
+    }
+    return NULL;
+}
+
+static void notifyLibusbFileDescriptors(int added) {
+    const struct libusb_pollfd** usbfds;
+    int i;
+
+    usbfds = libusb_get_pollfds(freespace_libusb_context);
+    if (usbfds == NULL) {
+        return;
+    }
+    for (i = 0; usbfds[i] != NULL; i++) {
+        if (added && userAddedCallback != NULL) {
+            userAddedCallback(usbfds[i]->fd, usbfds[i]->events);
+        } else if (!added && userRemovedCallback != NULL) {
+            userRemovedCallback(usbfds[i]->fd);
+        }
+    }
+    free(usbfds);
+}
+
+int freespace_startEventThread(enum freespace_eventThreadDispatch dispatch) {
+    int fds[2];
+    int rc;
+
+    if (__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE) || appHandlesEvents) {
+        return FREESPACE_ERROR_BUSY;
+    }
+
+#ifdef __linux__
+    fds[0] = eventfd(0, EFD_NONBLOCK | EFD_CLOEXEC);
+    if (fds[0] < 0) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    fds[1] = fds[0];
+#else
+    if (pipe(fds) < 0) {
+        return FREESPACE_ERROR_UNEXPECTED;
+    }
+    fcntl(fds[0], F_SETFL, O_NONBLOCK);
+    fcntl(fds[1], F_SETFL, O_NONBLOCK);
+#endif
+    wakeReadFd = fds[0];
+    wakeWriteFd = fds[1];
+
+    // Take libusb's file descriptors away from the application.
+    notifyLibusbFileDescriptors(0);
+
+    eventThreadDispatch = dispatch;
+    __atomic_store_n(&eventThreadStop, 0, __ATOMIC_RELEASE);
+    __atomic_store_n(&eventThreadRunning, 1, __ATOMIC_RELEASE);
+    rc = pthread_create(&eventThread, NULL, eventThreadMain, NULL);
+    if (rc != 0) {
+        __atomic_store_n(&eventThreadRunning, 0, __ATOMIC_RELEASE);
+        notifyLibusbFileDescriptors(1);
+        close(wakeReadFd);
+        if (wakeWriteFd != wakeReadFd) {
+            close(wakeWriteFd);
+        }
+        wakeReadFd = -1;
+        wakeWriteFd = -1;
+        return FREESPACE_ERROR_COULD_NOT_CREATE_THREAD;
+    }
+
+    if (userAddedCallback != NULL) {
+        userAddedCallback(wakeReadFd, POLLIN);
+    }
+    return FREESPACE_SUCCESS;
+}
+
+void freespace_stopEventThread() {
+    int i;
+
+    if (!__atomic_load_n(&eventThreadRunning, __ATOMIC_ACQUIRE)) {
+        return;
+    }
+
+    __atomic_store_n(&eventThreadStop, 1, __ATOMIC_RELEASE);
+#if defined(LIBUSB_API_VERSION) && (LIBUSB_API_VERSION >= 0x01000105)
+    libusb_interrupt_event_handler(freespace_libusb_context);
+#endif
+    pthread_join(eventThread, NULL);
+
+    // Deliver what the event thread left behind.
+    for (i = 0; i < FREESPACE_MAXIMUM_DEVICE_COUNT; i++) {
+        if (devices[i] != NULL && devices[i]->state_ == FREESPACE_OPENED) {
+            dispatchQueuedReports(devices[i]);
+        }
+    }
+    __atomic_store_n(&eventThreadRunning, 0, __ATOMIC_RELEASE);
+
+    if (userRemovedCallback != NULL) {
+        userRemovedCallback(wakeReadFd);
+    }
+    close(wakeReadFd);
+    if (wakeWriteFd != wakeReadFd) {
+        close(wakeWriteFd);
+    }
+    wakeReadFd = -1;
+    wakeWriteFd = -1;
+
+    // Hand libusb's file descriptors back to the application.
+    notifyLibusbFileDescriptors(1);
+}
+
 int freespace_private_setReceiveCallback(FreespaceDeviceId id,
                                          freespace_receiveCallback callback,
                                          void* cookie) {
@@ -980,14 +2340,14 @@ int freespace_private_setReceiveCallback(FreespaceDeviceId id,
         // Need to run the callback on all received messages.
         struct FreespaceReceiveTransfer* rt;
         rt = &device->receiveQueue_[device->receiveQueueHead_];
-        while (rt->submitted_ == 0) {
+        while (__atomic_load_n(&rt->submitted_, __ATOMIC_ACQUIRE) == 0) {
             callback(device->id_,
                      (const uint8_t*) rt->buffer_,
                      rt->transfer_->actual_length,
                      cookie,
                      libusb_transfer_status_to_freespace_error(rt->transfer_->status));
 
-            rt->submitted_ = 1;
+            __atomic_store_n(&rt->submitted_, 1, __ATOMIC_RELEASE);
             libusb_submit_transfer(rt->transfer_);
             device->receiveQueueHead_++;
             if (device->receiveQueueHead_ >= FREESPACE_RECEIVE_QUEUE_SIZE) {
@@ -1023,7 +2383,7 @@ int freespace_setReceiveMessageCallback(FreespaceDeviceId id,
         // Need to run the callback on all received messages.
         struct FreespaceReceiveTransfer* rt;
         rt = &device->receiveQueue_[device->receiveQueueHead_];
-        while (rt->submitted_ == 0) {
+        while (__atomic_load_n(&rt->submitted_, __ATOMIC_ACQUIRE) == 0) {
             rc = freespace_decode_message((const uint8_t*) rt->buffer_, rt->transfer_->actual_length, &m, device->api_->hVer_);
             if (rc == FREESPACE_SUCCESS) {
                 callback(device->id_,
@@ -1037,7 +2397,7 @@ int freespace_setReceiveMessageCallback(FreespaceDeviceId id,
                          rc);
             }
 
-            rt->submitted_ = 1;
+            __atomic_store_n(&rt->submitted_, 1, __ATOMIC_RELEASE);
             libusb_submit_transfer(rt->transfer_);
             device->receiveQueueHead_++;
             if (device->receiveQueueHead_ >= FREESPACE_RECEIVE_QUEUE_SIZE) {
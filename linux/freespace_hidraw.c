@@ -16,6 +16,7 @@
  */
 
 #include "freespace/freespace.h"
+#include "freespace/freespace_libusb.h"
 #include "freespace/freespace_deviceTable.h"
 #include "freespace_config.h"
 
@@ -247,6 +248,10 @@ int freespace_init() {
     return FREESPACE_SUCCESS;
 }
 
+int freespace_initWithLibusbContext(struct libusb_context* context, int flags) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
 // Disconnect, deallocate device and remove all callbacks
 void freespace_exit() {
     int i;
@@ -401,6 +406,22 @@ void freespace_closeDevice(FreespaceDeviceId id) {
     DEBUG("Closed device %d", id);
 }
 
+int freespace_closeDeviceAsync(FreespaceDeviceId id,
+                               freespace_closeCallback callback,
+                               void* cookie) {
+    struct FreespaceDevice* device = findDeviceById(id);
+    if (device == NULL) {
+        return FREESPACE_ERROR_NOT_FOUND;
+    }
+
+    // Closing doesn't block here, so just do it.
+    freespace_closeDevice(id);
+    if (callback != NULL) {
+        callback(id, cookie, FREESPACE_SUCCESS);
+    }
+    return FREESPACE_SUCCESS;
+}
+
 int freespace_private_send(FreespaceDeviceId id, const uint8_t* message, int length) {
     return FREESPACE_ERROR_UINIMPLEMENTED;
 }
@@ -444,6 +465,48 @@ int freespace_readMessage(FreespaceDeviceId id,
 
 }
 
+int freespace_readMessages(FreespaceDeviceId id,
+                           struct freespace_message* messages,
+                           int maxMessages,
+                           unsigned int timeoutMs,
+                           int* numMessages) {
+    GET_DEVICE_IF_OPEN(id, device);
+    *numMessages = 0;
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
+int freespace_startEventThread(enum freespace_eventThreadDispatch dispatch) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
+void freespace_stopEventThread() {
+}
+
+int freespace_private_sendPipelined(FreespaceDeviceId id,
+                                    const uint8_t* message,
+                                    int length,
+                                    unsigned int timeoutMs,
+                                    freespace_sendCallback callback,
+                                    void* cookie) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
+int freespace_sendMessagePipelined(FreespaceDeviceId id,
+                                   struct freespace_message* message,
+                                   unsigned int timeoutMs,
+                                   freespace_sendCallback callback,
+                                   void* cookie) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
+int freespace_setSendPipelineDepth(FreespaceDeviceId id, int depth) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
+int freespace_waitForSends(FreespaceDeviceId id, unsigned int timeoutMs) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
 int freespace_flush(FreespaceDeviceId id) {
     // TODO
     return FREESPACE_ERROR_UINIMPLEMENTED;
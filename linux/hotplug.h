@@ -18,9 +18,30 @@
 #ifndef _HOTPLUG_H_
 #define _HOTPLUG_H_
 
+#include <stdint.h>
 
 /**
- * Initialize the hotplug file descriptor
+ * Values for the recheck output of freespace_hotplug_perform()
+ */
+#define FREESPACE_HOTPLUG_RESCAN_NONE    0 // Nothing changed
+#define FREESPACE_HOTPLUG_RESCAN_ALL     1 // Rescan every device
+#define FREESPACE_HOTPLUG_RESCAN_DEVICES 2 // Only recheck the devices from freespace_hotplug_nextDevice()
+
+/**
+ * A USB device that a hotplug event reported as added or removed
+ */
+struct freespace_hotplugDevice {
+    int added;          // 1 if the device was added, 0 if removed
+    int busNumber;
+    int deviceAddress;
+    uint16_t idVendor;
+    uint16_t idProduct;
+};
+
+/**
+ * Initialize the hotplug file descriptor. Devices that are already
+ * attached are not reported, so the caller should scan for them
+ * after this returns.
  */
 int freespace_hotplug_init();
 
@@ -48,10 +69,18 @@ int freespace_hotplug_getFD();
 
 /**
  * Handle hotplug event
- * @param recheck set to one when to rescan for new devices.
+ * @param recheck set to one of the FREESPACE_HOTPLUG_RESCAN values
  * Returns FREESPACE_SUCCESS if some kind of hotplug event occurred
  * Returns an error code otherwise
  */
 int freespace_hotplug_perform(int* recheck);
 
+/**
+ * Get the next device to recheck after freespace_hotplug_perform()
+ * returned FREESPACE_HOTPLUG_RESCAN_DEVICES.
+ * @param device where to store the device
+ * Returns 1 if a device was returned and 0 if there are no more
+ */
+int freespace_hotplug_nextDevice(struct freespace_hotplugDevice* device);
+
 #endif // _HOTPLUG_H_
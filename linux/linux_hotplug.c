@@ -15,21 +15,60 @@
  * limitations under the License.
  */
 
+// Needed for struct ucred
+#define _GNU_SOURCE
+
 #include "hotplug.h"
 #include "freespace/freespace.h"
+#include "freespace/freespace_deviceTable.h"
 
 #include <sys/socket.h>
 #include <linux/netlink.h>
+#include <linux/filter.h>
 #include <errno.h>
 #include <fcntl.h>
 #include <unistd.h>
 #include <string.h>
+#include <stdlib.h>
+#include <stdio.h>
+#include <time.h>
 
-#define FREESPACE_HOTPLUG_SETTLING_TIME 100 /*ms*/
+#define FREESPACE_HOTPLUG_SETTLING_TIME 100 /*ms*/ // Quiet time needed when devices can't be tracked
+#define FREESPACE_HOTPLUG_SETTLING_MAX  500 /*ms*/ // Longest wait for device nodes
+#define FREESPACE_HOTPLUG_POLL_TIME       5 /*ms*/ // How often to look for device nodes
+#define FREESPACE_HOTPLUG_UEVENT_SIZE 2048 // UEVENT_BUFFER_SIZE in the kernel
+#define FREESPACE_HOTPLUG_DEVICE_QUEUE_SIZE 16
+#define FREESPACE_HOTPLUG_DEVNODE_SIZE 32
+#define FREESPACE_HOTPLUG_SYSPATH_SIZE 256
 
 // The socket for listening for hotplug events
 static int sock_ = -1;
-static int delay_ = FREESPACE_HOTPLUG_SETTLING_TIME;
+
+// Devices reported by uevents since the last rescan. If too many
+// arrive, fall back to rescanning everything.
+static struct freespace_hotplugDevice pending_[FREESPACE_HOTPLUG_DEVICE_QUEUE_SIZE];
+static char pendingNodes_[FREESPACE_HOTPLUG_DEVICE_QUEUE_SIZE][FREESPACE_HOTPLUG_DEVNODE_SIZE];
+static char pendingSysPaths_[FREESPACE_HOTPLUG_DEVICE_QUEUE_SIZE][FREESPACE_HOTPLUG_SYSPATH_SIZE];
+static int pendingInterfaces_[FREESPACE_HOTPLUG_DEVICE_QUEUE_SIZE];
+static int pendingHead_ = 0;
+static int pendingCount_ = 0;
+static int rescanAll_ = 0;
+
+// Settling state. See freespace_hotplug_perform().
+static int settling_ = 0;
+static long settleDeadline_;
+static long lastEvent_;
+
+// Socket filter that drops every uevent except "add@..." and "remove@...".
+// The subsystem isn't at a fixed offset in the message, so the rest of the
+// filtering is done in parseUevent().
+static struct sock_filter ueventFilter_[] = {
+    BPF_STMT(BPF_LD | BPF_W | BPF_ABS, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x61646440 /* "add@" */, 1, 0),
+    BPF_JUMP(BPF_JMP | BPF_JEQ | BPF_K, 0x72656d6f /* "remo" */, 0, 1),
+    BPF_STMT(BPF_RET | BPF_K, 0xffffffff),
+    BPF_STMT(BPF_RET | BPF_K, 0),
+};
 
 int freespace_hotplug_init() {
     struct sockaddr_nl snl;
@@ -73,6 +112,15 @@ int freespace_hotplug_init() {
         return FREESPACE_ERROR_UNEXPECTED;
     }
 
+    // Only wake up for device additions and removals. This is just an
+    // optimization, so keep going if the kernel doesn't support it.
+    {
+        struct sock_fprog filter;
+        filter.len = sizeof(ueventFilter_) / sizeof(ueventFilter_[0]);
+        filter.filter = ueventFilter_;
+        setsockopt(sock, SOL_SOCKET, SO_ATTACH_FILTER, &filter, sizeof(filter));
+    }
+
     // Set the socket to non-blocking
     rc = fcntl(sock, F_SETFL, O_NONBLOCK);
     if (rc < 0) {
@@ -82,9 +130,12 @@ int freespace_hotplug_init() {
 
     sock_ = sock;
 
-    // See below for details on the state machine. Setting
-    // delay here will signal a rescan the first time through.
-    delay_ = FREESPACE_HOTPLUG_SETTLING_TIME;
+    // The caller enumerates the devices that are already attached, so
+    // there's nothing to report until the first event.
+    settling_ = 0;
+    rescanAll_ = 0;
+    pendingHead_ = 0;
+    pendingCount_ = 0;
     return FREESPACE_SUCCESS;
 }
 
@@ -97,57 +148,315 @@ int freespace_hotplug_getFD() {
     return sock_;
 }
 
+// Milliseconds from an arbitrary fixed point.
+static long nowMs() {
+    struct timespec now;
+    clock_gettime(CLOCK_MONOTONIC, &now);
+    return (long) now.tv_sec * 1000 + now.tv_nsec / 1000000;
+}
+
 int freespace_hotplug_timeout() {
-    return delay_;
+    long left;
+
+    if (!settling_) {
+        return -1;
+    }
+
+    // Keep polling for device nodes until the deadline.
+    left = settleDeadline_ - nowMs();
+    if (left < 1) {
+        return 1;
+    } else if (left > FREESPACE_HOTPLUG_POLL_TIME) {
+        return FREESPACE_HOTPLUG_POLL_TIME;
+    }
+    return (int) left;
+}
+
+// Return the value of key in a uevent or NULL if it's not there.
+static const char* findUeventKey(const char* buf, int length, const char* key) {
+    size_t keyLength = strlen(key);
+    int i = 0;
+
+    // The first string is the ACTION@DEVPATH summary. The KEY=value
+    // strings follow, each terminated by a '\0'.
+    while (i < length) {
+        const char* entry = &buf[i];
+        size_t entryLength = strnlen(entry, length - i);
+        if (entryLength > keyLength && entry[keyLength] == '=' &&
+            memcmp(entry, key, keyLength) == 0) {
+            return entry + keyLength + 1;
+        }
+        i += entryLength + 1;
+    }
+    return NULL;
+}
+
+static int isKnownVendor(uint16_t idVendor) {
+    int i;
+    for (i = 0; i < freespace_deviceAPITableNum; i++) {
+        if (freespace_deviceAPITable[i].idVendor_ == idVendor) {
+            return 1;
+        }
+    }
+    return 0;
+}
+
+// Return the interface that freespace_openDevice() claims on a device, or
+// -1 if the device isn't in the device table.
+static int lookupControlInterface(uint16_t idVendor, uint16_t idProduct) {
+    int i;
+    for (i = 0; i < freespace_deviceAPITableNum; i++) {
+        const struct FreespaceDeviceAPI* api = &freespace_deviceAPITable[i];
+        if (api->idVendor_ == idVendor &&
+            (idProduct & api->mask_) == (api->idProduct_ & api->mask_)) {
+            return api->controlInterfaceNumber_;
+        }
+    }
+    return -1;
+}
+
+// Parse a uevent and fill in device, its /dev node and its sysfs path if
+// it's a Freespace USB device being added or removed. Returns 1 if the
+// event is interesting and 0 if not.
+static int parseUevent(const char* buf, int length,
+                       struct freespace_hotplugDevice* device,
+                       char* devNode, char* sysPath) {
+    const char* action = findUeventKey(buf, length, "ACTION");
+    const char* subsystem = findUeventKey(buf, length, "SUBSYSTEM");
+    const char* devtype = findUeventKey(buf, length, "DEVTYPE");
+    const char* product = findUeventKey(buf, length, "PRODUCT");
+    const char* busnum = findUeventKey(buf, length, "BUSNUM");
+    const char* devnum = findUeventKey(buf, length, "DEVNUM");
+    const char* devname = findUeventKey(buf, length, "DEVNAME");
+    const char* devpath = findUeventKey(buf, length, "DEVPATH");
+    char* end;
+    unsigned long value;
+
+    if (action == NULL || subsystem == NULL) {
+        return 0;
+    }
+    if (strcmp(action, "add") == 0) {
+        device->added = 1;
+    } else if (strcmp(action, "remove") == 0) {
+        device->added = 0;
+    } else {
+        return 0;
+    }
+
+    // Interfaces and hidraw nodes come and go along with their USB
+    // device, so only the device level events matter here.
+    if (strcmp(subsystem, "usb") != 0 || devtype == NULL || strcmp(devtype, "usb_device") != 0) {
+        return 0;
+    }
+    if (product == NULL || busnum == NULL || devnum == NULL) {
+        return 0;
+    }
+
+    // PRODUCT is "vendor/product/bcdDevice" in hex.
+    value = strtoul(product, &end, 16);
+    if (*end != '/') {
+        return 0;
+    }
+    device->idVendor = (uint16_t) value;
+    value = strtoul(end + 1, &end, 16);
+    if (*end != '/') {
+        return 0;
+    }
+    device->idProduct = (uint16_t) value;
+    if (!isKnownVendor(device->idVendor)) {
+        return 0;
+    }
+
+    device->busNumber = (int) strtol(busnum, NULL, 10);
+    device->deviceAddress = (int) strtol(devnum, NULL, 10);
+
+    // DEVNAME is relative to /dev, e.g. bus/usb/001/005.
+    devNode[0] = '\0';
+    if (devname != NULL) {
+        snprintf(devNode, FREESPACE_HOTPLUG_DEVNODE_SIZE, "/dev/%s", devname);
+    }
+
+    // DEVPATH is relative to /sys, e.g. /devices/pci0000:00/.../usb1/1-2.
+    sysPath[0] = '\0';
+    if (devpath != NULL &&
+        snprintf(sysPath, FREESPACE_HOTPLUG_SYSPATH_SIZE, "/sys%s", devpath) >= FREESPACE_HOTPLUG_SYSPATH_SIZE) {
+        sysPath[0] = '\0';
+    }
+    return 1;
+}
+
+static void queueDevice(const struct freespace_hotplugDevice* device,
+                        const char* devNode, const char* sysPath) {
+    int index;
+
+    if (pendingCount_ == FREESPACE_HOTPLUG_DEVICE_QUEUE_SIZE) {
+        rescanAll_ = 1;
+        return;
+    }
+    index = (pendingHead_ + pendingCount_) % FREESPACE_HOTPLUG_DEVICE_QUEUE_SIZE;
+    pending_[index] = *device;
+    strcpy(pendingNodes_[index], devNode);
+    strcpy(pendingSysPaths_[index], sysPath);
+    pendingInterfaces_[index] = lookupControlInterface(device->idVendor, device->idProduct);
+    pendingCount_++;
+}
+
+// Check if the kernel has finished setting up an interface of a USB
+// device. Interfaces appear once the device is configured, and a driver
+// link appears once probing is done, by which time usbhid has created the
+// interface's hidraw node. Until then freespace_openDevice() would race
+// the kernel for the interface.
+static int isInterfaceReady(const char* sysPath, int interfaceNumber) {
+    char path[FREESPACE_HOTPLUG_SYSPATH_SIZE + 64];
+    char config[8];
+    const char* name;
+    ssize_t length;
+    int fd;
+
+    // The active configuration is empty until the device is configured.
+    snprintf(path, sizeof(path), "%s/bConfigurationValue", sysPath);
+    fd = open(path, O_RDONLY);
+    if (fd < 0) {
+        return 0;
+    }
+    length = read(fd, config, sizeof(config) - 1);
+    close(fd);
+    if (length <= 0) {
+        return 0;
+    }
+    config[length] = '\0';
+
+    // Interfaces are named <device>:<configuration>.<interface>
+    name = strrchr(sysPath, '/');
+    name = (name == NULL) ? sysPath : name + 1;
+    snprintf(path, sizeof(path), "%s/%s:%d.%d/driver",
+             sysPath, name, (int) strtol(config, NULL, 10), interfaceNumber);
+    return access(path, F_OK) == 0;
+}
+
+// Check if the pending devices are ready to be opened.
+static int isSettled(long now) {
+    int i;
+
+    if (now >= settleDeadline_) {
+        return 1;
+    }
+
+    // Without per device information, wait for the events to stop.
+    if (rescanAll_) {
+        return now - lastEvent_ >= FREESPACE_HOTPLUG_SETTLING_TIME;
+    }
+
+    // Added devices are ready once udev has created their device node
+    // and given us access to it, and the kernel has set up the interface
+    // that gets claimed. Removed devices need no waiting.
+    for (i = 0; i < pendingCount_; i++) {
+        int index = (pendingHead_ + i) % FREESPACE_HOTPLUG_DEVICE_QUEUE_SIZE;
+        if (!pending_[index].added) {
+            continue;
+        }
+        if (pendingNodes_[index][0] == '\0') {
+            if (now - lastEvent_ < FREESPACE_HOTPLUG_SETTLING_TIME) {
+                return 0;
+            }
+        } else if (access(pendingNodes_[index], R_OK | W_OK) != 0) {
+            return 0;
+        }
+        if (pendingSysPaths_[index][0] != '\0' && pendingInterfaces_[index] >= 0 &&
+            !isInterfaceReady(pendingSysPaths_[index], pendingInterfaces_[index])) {
+            return 0;
+        }
+    }
+    return 1;
 }
 
 int freespace_hotplug_perform(int* recheck) {
-    char buf[16];
+    char buf[FREESPACE_HOTPLUG_UEVENT_SIZE];
+    char cred[CMSG_SPACE(sizeof(struct ucred))];
+    struct sockaddr_nl snl;
+    struct iovec iov;
+    struct msghdr msg;
+    struct cmsghdr* cmsg;
+    struct ucred* ucred;
+    struct freespace_hotplugDevice device;
+    char devNode[FREESPACE_HOTPLUG_DEVNODE_SIZE];
+    char sysPath[FREESPACE_HOTPLUG_SYSPATH_SIZE];
     int rc;
     int gotEvent = 0;
+    long now;
 
-    // The uevent queue receives notifications on
-    // device insertion, removal, and some changes. We
-    // don't care what happens here. We just need to
-    // know when to call into libusb to rescan the
-    // USB bus.
-    // NOTE: buf doesn't need to be large. The kernel
-    //       will truncate notifications to fit inside
-    //       buf and even though this looks like a
-    //       stream interface, the kernel does not
-    //       split messages up.
+    // The uevent queue receives notifications on device insertion,
+    // removal, and some changes. Only USB devices from vendors in the
+    // device table are worth rescanning for.
     for (;;) {
         // Drain the uevent queue until an error
-        rc = recv(sock_, buf, sizeof(buf), 0);
-        if (rc > 0) {
-            gotEvent = 1;
-        } else {
+        iov.iov_base = buf;
+        iov.iov_len = sizeof(buf) - 1;
+        memset(&msg, 0, sizeof(msg));
+        msg.msg_name = &snl;
+        msg.msg_namelen = sizeof(snl);
+        msg.msg_iov = &iov;
+        msg.msg_iovlen = 1;
+        msg.msg_control = cred;
+        msg.msg_controllen = sizeof(cred);
+
+        rc = recvmsg(sock_, &msg, 0);
+        if (rc <= 0) {
             break;
         }
+        buf[rc] = '\0';
+
+        // Only trust messages from the kernel.
+        cmsg = CMSG_FIRSTHDR(&msg);
+        if (snl.nl_pid != 0 || cmsg == NULL || cmsg->cmsg_type != SCM_CREDENTIALS) {
+            continue;
+        }
+        ucred = (struct ucred*) CMSG_DATA(cmsg);
+        if (ucred->uid != 0) {
+            continue;
+        }
+
+        if (parseUevent(buf, rc, &device, devNode, sysPath)) {
+            queueDevice(&device, devNode, sysPath);
+            gotEvent = 1;
+        }
     }
+    rc = (errno == EAGAIN) ? FREESPACE_SUCCESS : FREESPACE_ERROR_IO;
 
-    // USB insertions cause a lot of events over a fraction
-    // of a second. Wait until the system settles if we get
-    // an event.
+    // USB insertions cause a lot of events over a fraction of a second,
+    // and the device can't be opened until udev has set up its device
+    // node and probed its interfaces. Hold off reporting the devices until
+    // their nodes are accessible and their interfaces are set up, or until
+    // FREESPACE_HOTPLUG_SETTLING_MAX passes.
+    now = nowMs();
     if (gotEvent) {
-        // Never recheck immediately.
-        *recheck = 0;
-        delay_ = FREESPACE_HOTPLUG_SETTLING_TIME;
-    } else {
-        // If we were delaying and now there are no events,
-        // then signal a recheck. This happens on our
-        // settling time timeout or if the user's event loop
-        // polls us superfluously.
-        if (delay_ > 0) {
-            *recheck = 1;
-            delay_ = 0;
+        lastEvent_ = now;
+        if (!settling_) {
+            settling_ = 1;
+            settleDeadline_ = now + FREESPACE_HOTPLUG_SETTLING_MAX;
+        }
+    }
+
+    *recheck = FREESPACE_HOTPLUG_RESCAN_NONE;
+    if (settling_ && isSettled(now)) {
+        if (rescanAll_) {
+            *recheck = FREESPACE_HOTPLUG_RESCAN_ALL;
+            rescanAll_ = 0;
+            pendingCount_ = 0;
         } else {
-            *recheck = 0;
+            *recheck = FREESPACE_HOTPLUG_RESCAN_DEVICES;
         }
+        settling_ = 0;
     }
-    if (errno == EAGAIN) {
-        return FREESPACE_SUCCESS;
-    } else {
-        return FREESPACE_ERROR_IO;
+    return rc;
+}
+
+int freespace_hotplug_nextDevice(struct freespace_hotplugDevice* device) {
+    if (pendingCount_ == 0) {
+        return 0;
     }
+    *device = pending_[pendingHead_];
+    pendingHead_ = (pendingHead_ + 1) % FREESPACE_HOTPLUG_DEVICE_QUEUE_SIZE;
+    pendingCount_--;
+    return 1;
 }
@@ -0,0 +1,89 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check the generated decoders' handling of bit and nibble fields
+// against a plain shift and mask of each byte. The check itself is
+// generated with the codecs in test mode, so it covers every message.
+// Also check that freespace_decode_message() applies the validation
+// level that is set, since the default level takes a path of its own.
+
+#include <freespace/freespace_codecs.h>
+#include <stdio.h>
+#include <string.h>
+
+static int checkLevel(int validation, const uint8_t* report, int length, int expected) {
+    struct freespace_message m;
+    int rc;
+
+    freespace_setDecodeValidation(validation);
+    rc = freespace_decode_message(report, length, &m, 2);
+    freespace_setDecodeValidation(FREESPACE_VALIDATION_DEFAULT);
+    if (rc != expected) {
+        printf("Validation level %d, length %d: got %d, expected %d\n", validation, length, rc, expected);
+        return 1;
+    }
+    if (rc == FREESPACE_SUCCESS && m.messageType != FREESPACE_MESSAGE_MOTIONENGINEOUTPUT) {
+        printf("Validation level %d: decoded message type %d\n", validation, m.messageType);
+        return 1;
+    }
+    return 0;
+}
+
+static int checkValidation(void) {
+    struct freespace_message m;
+    uint8_t report[64];
+    int length;
+    int failures = 0;
+
+    memset(&m, 0, sizeof(m));
+    m.messageType = FREESPACE_MESSAGE_MOTIONENGINEOUTPUT;
+    m.ver = 2;
+    memset(report, 0, sizeof(report));
+    length = freespace_encode_message(&m, report, sizeof(report));
+    if (length <= 0) {
+        printf("Encoding MotionEngineOutput failed: %d\n", length);
+        return 1;
+    }
+
+    // Only the strict level rejects trailing bytes.
+    failures += checkLevel(FREESPACE_VALIDATION_TRUSTED, report, length + 1, FREESPACE_SUCCESS);
+    failures += checkLevel(FREESPACE_VALIDATION_DEFAULT, report, length + 1, FREESPACE_SUCCESS);
+    failures += checkLevel(FREESPACE_VALIDATION_STRICT, report, length + 1, FREESPACE_ERROR_MALFORMED_MESSAGE);
+    failures += checkLevel(FREESPACE_VALIDATION_STRICT, report, length, FREESPACE_SUCCESS);
+
+    // Every level rejects a short report.
+    failures += checkLevel(FREESPACE_VALIDATION_TRUSTED, report, length - 1, FREESPACE_ERROR_BUFFER_TOO_SMALL);
+    failures += checkLevel(FREESPACE_VALIDATION_DEFAULT, report, length - 1, FREESPACE_ERROR_BUFFER_TOO_SMALL);
+    failures += checkLevel(FREESPACE_VALIDATION_STRICT, report, length - 1, FREESPACE_ERROR_BUFFER_TOO_SMALL);
+
+    if (freespace_setDecodeValidation(FREESPACE_VALIDATION_STRICT + 1) != FREESPACE_ERROR_UNEXPECTED ||
+        freespace_getDecodeValidation() != FREESPACE_VALIDATION_DEFAULT) {
+        printf("An unknown validation level was accepted\n");
+        failures++;
+    }
+    return failures;
+}
+
+int main(void) {
+    int failures = freespace_checkBitDecoders();
+    failures += checkValidation();
+    if (failures != 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,97 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that the header-only C++ message API decodes reports the same
+// way as the C codecs, and that the printers show the same values.
+
+#include <freespace/freespace_codecs.h>
+#include <freespace/freespace_messages.hpp>
+#include <freespace/freespace_printers.h>
+#include <cstdio>
+#include <cstring>
+
+static int failures = 0;
+
+// Decode a version 2 UserFrame with the given quaternion in both
+// languages and compare the synthesized angularPosA, through the getters
+// and as printed.
+static void checkUserFrame(int16_t b, int16_t c, int16_t d, int expected) {
+    using L = freespace::Layout<freespace::UserFrame, 2>;
+    uint8_t report[L::size] = {};
+    struct freespace_message m;
+
+    report[0] = L::id;
+    report[1] = static_cast<uint8_t>(L::size);
+    L::angularPosB::store(report, b);
+    L::angularPosC::store(report, c);
+    L::angularPosD::store(report, d);
+
+    if (freespace_decode_message(report, L::size, &m, 2) != FREESPACE_SUCCESS ||
+        m.messageType != FREESPACE_MESSAGE_USERFRAME) {
+        std::printf("UserFrame(%d, %d, %d): C decode failed\n", b, c, d);
+        failures++;
+        return;
+    }
+    std::optional<freespace::UserFrame> cpp = freespace::decode<freespace::UserFrame, 2>(freespace::ConstBytes(report, L::size));
+    if (!cpp) {
+        std::printf("UserFrame(%d, %d, %d): C++ decode failed\n", b, c, d);
+        failures++;
+        return;
+    }
+
+    int fromC = freespace_UserFrame_angularPosA(&m.userFrame, 2);
+    int fromCpp = freespace::UserFrame_angularPosA(*cpp, 2);
+    if (fromC != fromCpp || (expected >= 0 && fromC != expected)) {
+        std::printf("UserFrame(%d, %d, %d): angularPosA is %d in C and %d in C++, expected %d\n",
+                    b, c, d, fromC, fromCpp, expected);
+        failures++;
+    }
+
+    char text[FREESPACE_PRINT_MAX_LENGTH] = "";
+    char field[32];
+    std::snprintf(field, sizeof(field), " angularPosA=%d ", fromC);
+    if (freespace_formatMessage(text, sizeof(text), &m, FREESPACE_PRINT_TEXT) < 0 || std::strstr(text, field) == nullptr) {
+        std::printf("UserFrame(%d, %d, %d): printed as %s, expected%s\n", b, c, d, text, field);
+        failures++;
+    }
+}
+
+int main() {
+    uint32_t state = 12345;
+    int i;
+
+    checkUserFrame(0, 0, 0, 16384);
+    checkUserFrame(16384, 0, 0, 0);
+    // B^2 + C^2 + D^2 overflows an int and is above 16384^2.
+    checkUserFrame(-32768, -32768, -32768, 0);
+    checkUserFrame(32767, 32767, 32767, 0);
+    checkUserFrame(16384, 16384, 0, 0);
+
+    for (i = 0; i < 10000; i++) {
+        state ^= state << 13;
+        state ^= state >> 17;
+        state ^= state << 5;
+        checkUserFrame(static_cast<int16_t>(state), static_cast<int16_t>(state >> 8),
+                       static_cast<int16_t>(state >> 16), -1);
+    }
+
+    if (failures != 0) {
+        std::printf("%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
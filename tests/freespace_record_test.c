@@ -0,0 +1,258 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that recordings read back correctly, and that a damaged index
+// can't send the reader outside the file.
+
+#include <freespace/freespace_record.h>
+#include <stdio.h>
+#include <stdlib.h>
+#include <string.h>
+
+#define PATH "freespace_record_test.rec"
+#define REPORTS 40000
+#define FIRST_TIMESTAMP 1000
+#define INTERVAL 10
+#define REPORT_SIZE 8
+
+// The parts of the file layout that the test needs to find the index.
+#define FILE_HEADER_SIZE 16
+#define RECORD_HEADER_SIZE 16
+#define FOOTER_SIZE 32
+#define KIND_INDEX 1
+#define KIND_DIRECTORY 2
+
+static int failures = 0;
+
+static uint64_t get64(const uint8_t* p) {
+    return (uint64_t) p[0] | ((uint64_t) p[1] << 8) | ((uint64_t) p[2] << 16) | ((uint64_t) p[3] << 24) |
+           ((uint64_t) p[4] << 32) | ((uint64_t) p[5] << 40) | ((uint64_t) p[6] << 48) | ((uint64_t) p[7] << 56);
+}
+
+static void put64(uint8_t* p, uint64_t v) {
+    int i;
+    for (i = 0; i < 8; i++) {
+        p[i] = (uint8_t) (v >> (8 * i));
+    }
+}
+
+static int writeRecording(void) {
+    struct freespace_recorder* recorder;
+    uint8_t report[REPORT_SIZE];
+    int i;
+
+    if (freespace_recorder_open(&recorder, PATH) != FREESPACE_SUCCESS) {
+        printf("can't create %s\n", PATH);
+        return 0;
+    }
+    for (i = 0; i < REPORTS; i++) {
+        memset(report, 0, sizeof(report));
+        memcpy(report, &i, sizeof(i));
+        freespace_recorder_write(recorder, FIRST_TIMESTAMP + (uint64_t) i * INTERVAL, 1, 2, report, sizeof(report));
+    }
+    return freespace_recorder_close(recorder) == FREESPACE_SUCCESS;
+}
+
+static uint8_t* readFile(long* size) {
+    FILE* fp = fopen(PATH, "rb");
+    uint8_t* data;
+
+    if (fp == NULL) {
+        return NULL;
+    }
+    fseek(fp, 0, SEEK_END);
+    *size = ftell(fp);
+    fseek(fp, 0, SEEK_SET);
+    data = (uint8_t*) malloc(*size);
+    if (data != NULL && fread(data, 1, *size, fp) != (size_t) *size) {
+        free(data);
+        data = NULL;
+    }
+    fclose(fp);
+    return data;
+}
+
+static void writeFile(const uint8_t* data, long size) {
+    FILE* fp = fopen(PATH, "wb");
+    if (fp != NULL) {
+        fwrite(data, 1, size, fp);
+        fclose(fp);
+    }
+}
+
+// Point every index entry at offset(entry) instead of its report.
+static int corruptIndex(uint8_t* data, long size, uint64_t (*offset)(uint64_t entry, long size)) {
+    long pos = FILE_HEADER_SIZE;
+    int count = 0;
+
+    while (pos + RECORD_HEADER_SIZE <= size - FOOTER_SIZE) {
+        uint8_t* p = data + pos;
+        int length = p[14] | (p[15] << 8);
+        if (p[12] == KIND_DIRECTORY) {
+            break;
+        }
+        if (p[12] == KIND_INDEX) {
+            uint32_t entries = p[16] | (p[17] << 8) | (p[18] << 16) | ((uint32_t) p[19] << 24);
+            uint32_t i;
+            for (i = 0; i < entries; i++) {
+                uint8_t* entry = p + RECORD_HEADER_SIZE + 8 + i * 16 + 8;
+                put64(entry, offset(get64(entry), size));
+                count++;
+            }
+        }
+        pos += RECORD_HEADER_SIZE + length;
+    }
+    return count;
+}
+
+static uint64_t wrapping(uint64_t entry, long size) {
+    (void) entry;
+    (void) size;
+    return (uint64_t) 0 - RECORD_HEADER_SIZE;
+}
+
+static uint64_t pastEnd(uint64_t entry, long size) {
+    (void) entry;
+    return (uint64_t) size - 8;
+}
+
+static uint64_t inFileHeader(uint64_t entry, long size) {
+    (void) entry;
+    (void) size;
+    return 3;
+}
+
+static uint64_t midRecord(uint64_t entry, long size) {
+    (void) size;
+    return entry + 5;
+}
+
+// Open the recording and check what it reads. With exact set, the
+// reports must be the ones written; otherwise reading just has to stay
+// within the recording and finish.
+static void checkRecording(const char* name, int exact, int complete) {
+    static const uint64_t times[] = {
+        0, FIRST_TIMESTAMP, FIRST_TIMESTAMP + 5, FIRST_TIMESTAMP + 64 * INTERVAL,
+        FIRST_TIMESTAMP + 12345 * INTERVAL + 1, FIRST_TIMESTAMP + 16384 * INTERVAL,
+        FIRST_TIMESTAMP + (REPORTS - 1) * (uint64_t) INTERVAL, FIRST_TIMESTAMP + REPORTS * (uint64_t) INTERVAL,
+        (uint64_t) -1
+    };
+    struct freespace_recording* recording;
+    struct freespace_recordingInfo info;
+    struct freespace_recordedReport report;
+    uint64_t cursor;
+    int i;
+
+    if (freespace_recording_open(&recording, PATH) != FREESPACE_SUCCESS) {
+        printf("%s: open failed\n", name);
+        failures++;
+        return;
+    }
+    if (freespace_recording_getInfo(recording, &info) != FREESPACE_SUCCESS) {
+        printf("%s: getInfo failed\n", name);
+        failures++;
+    } else if (exact && (info.reportCount != REPORTS || info.complete != complete ||
+                         info.firstTimestampUs != FIRST_TIMESTAMP ||
+                         info.lastTimestampUs != FIRST_TIMESTAMP + (REPORTS - 1) * (uint64_t) INTERVAL)) {
+        printf("%s: getInfo gave %llu reports, complete %d, times %llu to %llu\n", name,
+               (unsigned long long) info.reportCount, info.complete,
+               (unsigned long long) info.firstTimestampUs, (unsigned long long) info.lastTimestampUs);
+        failures++;
+    }
+
+    for (i = 0; i < (int) (sizeof(times) / sizeof(times[0])); i++) {
+        uint64_t expected = times[i] <= FIRST_TIMESTAMP ? 0 : (times[i] - FIRST_TIMESTAMP + INTERVAL - 1) / INTERVAL;
+        int rc;
+        int n = 0;
+
+        if (freespace_recording_seek(recording, times[i], &cursor) != FREESPACE_SUCCESS) {
+            printf("%s: seek to %llu failed\n", name, (unsigned long long) times[i]);
+            failures++;
+            continue;
+        }
+        rc = freespace_recording_next(recording, &cursor, &report);
+        if (exact) {
+            int index = -1;
+            if (rc == FREESPACE_SUCCESS) {
+                memcpy(&index, report.report, sizeof(index));
+            }
+            if (expected >= REPORTS ? rc != FREESPACE_ERROR_NO_DATA : (rc != FREESPACE_SUCCESS || index != (int) expected)) {
+                printf("%s: seek to %llu found report %d, expected %llu\n", name,
+                       (unsigned long long) times[i], index, (unsigned long long) expected);
+                failures++;
+            }
+        }
+        // Read to the end, which must stop.
+        while (rc == FREESPACE_SUCCESS && n++ <= REPORTS) {
+            rc = freespace_recording_next(recording, &cursor, &report);
+        }
+        if (rc != FREESPACE_ERROR_NO_DATA) {
+            printf("%s: reading from %llu didn't reach the end\n", name, (unsigned long long) times[i]);
+            failures++;
+        }
+    }
+    freespace_recording_close(recording);
+}
+
+int main(void) {
+    uint8_t* original;
+    uint8_t* data;
+    long size;
+
+    if (!writeRecording() || (original = readFile(&size)) == NULL || (data = (uint8_t*) malloc(size)) == NULL) {
+        printf("can't write the recording\n");
+        return 1;
+    }
+    checkRecording("intact", 1, 1);
+
+    writeFile(original, size - FOOTER_SIZE);
+    checkRecording("no footer", 1, 0);
+
+    memcpy(data, original, size);
+    if (corruptIndex(data, size, wrapping) == 0) {
+        printf("no index entries found\n");
+        failures++;
+    }
+    writeFile(data, size);
+    checkRecording("wrapping offsets", 1, 1);
+    writeFile(data, size - FOOTER_SIZE);
+    checkRecording("wrapping offsets, no footer", 1, 0);
+
+    memcpy(data, original, size);
+    corruptIndex(data, size, pastEnd);
+    writeFile(data, size);
+    checkRecording("offsets past the end", 1, 1);
+
+    memcpy(data, original, size);
+    corruptIndex(data, size, inFileHeader);
+    writeFile(data, size);
+    checkRecording("offsets in the file header", 1, 1);
+
+    memcpy(data, original, size);
+    corruptIndex(data, size, midRecord);
+    writeFile(data, size);
+    checkRecording("offsets inside records", 0, 1);
+
+    free(data);
+    free(original);
+    remove(PATH);
+    if (failures != 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -0,0 +1,158 @@
+/* * libfreespace - library for communicating with Freespace devices
+ *
+ * Copyright 2013-15 Hillcrest Laboratories, Inc.
+ *
+ * Licensed under the Apache License, Version 2.0 (the "License");
+ * you may not use this file except in compliance with the License.
+ * You may obtain a copy of the License at
+ *
+ *   http://www.apache.org/licenses/LICENSE-2.0
+ *
+ * Unless required by applicable law or agreed to in writing, software
+ * distributed under the License is distributed on an "AS IS" BASIS,
+ * WITHOUT WARRANTIES OR CONDITIONS OF ANY KIND, either express or implied.
+ * See the License for the specific language governing permissions and
+ * limitations under the License.
+ */
+
+// Check that freespace_util_convertMotionEngineOutputs gives bit-identical
+// values to the freespace_util_get* functions, for every MotionEngineOutput
+// format and for batch sizes that leave a remainder after the SIMD loops.
+
+#include <freespace/freespace_util.h>
+#include <stdio.h>
+#include <string.h>
+
+#define PACKETS 100
+
+typedef int (*sectionGetter)(const struct freespace_MotionEngineOutput*, struct MultiAxisSensor*);
+
+// The getters in the order of the FREESPACE_ME_* bits.
+static const sectionGetter sectionGetters[] = {
+    freespace_util_getAcceleration,
+    freespace_util_getAccNoGravity,
+    freespace_util_getAngularVelocity,
+    freespace_util_getMagnetometer,
+    freespace_util_getTemperature,
+    freespace_util_getInclination,
+    freespace_util_getCompassHeading,
+    freespace_util_getAngPos,
+    freespace_util_getActClass,
+};
+
+#define SECTIONS ((int) (sizeof(sectionGetters) / sizeof(sectionGetters[0])))
+
+static const int meFormats[] = { 0, 1, 3 };
+static const int counts[] = { 1, 3, 4, 7, 8, 31, PACKETS };
+
+// Values converted in a batch, indexed by section, coordinate (w, x, y, z)
+// and packet.
+static float convertedValues[SECTIONS][4][PACKETS];
+
+static uint32_t randomState = 12345;
+
+static uint32_t nextRandom(void) {
+    randomState ^= randomState << 13;
+    randomState ^= randomState >> 17;
+    randomState ^= randomState << 5;
+    return randomState;
+}
+
+// Point every array of a batch conversion at convertedValues.
+static void bindConvertedValues(struct MotionEngineOutputArrays* arrays) {
+    struct MultiAxisSensorArrays* members[SECTIONS];
+    int i;
+
+    members[0] = &arrays->acceleration;
+    members[1] = &arrays->accNoGravity;
+    members[2] = &arrays->angularVelocity;
+    members[3] = &arrays->magnetometer;
+    members[4] = &arrays->temperature;
+    members[5] = &arrays->inclination;
+    members[6] = &arrays->compassHeading;
+    members[7] = &arrays->angPos;
+    members[8] = &arrays->actClass;
+    for (i = 0; i < SECTIONS; i++) {
+        members[i]->w = convertedValues[i][0];
+        members[i]->x = convertedValues[i][1];
+        members[i]->y = convertedValues[i][2];
+        members[i]->z = convertedValues[i][3];
+    }
+}
+
+// Random packets in one of the documented formats with all of its
+// sections enabled, as real packets are.
+static void makePackets(struct freespace_MotionEngineOutput* packets, int format) {
+    int i;
+    int j;
+
+    for (i = 0; i < PACKETS; i++) {
+        uint8_t* bytes = (uint8_t*) &packets[i];
+        for (j = 0; j < (int) sizeof(packets[i]); j++) {
+            bytes[j] = (uint8_t) nextRandom();
+        }
+        packets[i].formatSelect = (uint8_t) format;
+        packets[i].ff0 = packets[i].ff1 = packets[i].ff2 = packets[i].ff3 = 1;
+        packets[i].ff4 = packets[i].ff5 = packets[i].ff6 = packets[i].ff7 = 1;
+    }
+}
+
+static int checkConversion(const struct freespace_MotionEngineOutput* packets, int count, int format) {
+    struct MotionEngineOutputArrays arrays;
+    int failures = 0;
+    int i;
+    int k;
+
+    bindConvertedValues(&arrays);
+    memset(convertedValues, 0, sizeof(convertedValues));
+    if (freespace_util_convertMotionEngineOutputs(packets, count, &arrays) != 0) {
+        printf("batch conversion failed: format %d, %d packets\n", format, count);
+        return 1;
+    }
+    for (i = 0; i < SECTIONS; i++) {
+        for (k = 0; k < count; k++) {
+            struct MultiAxisSensor sensor;
+            float expected[4];
+            int present;
+            int c;
+
+            memset(&sensor, 0, sizeof(sensor));
+            present = sectionGetters[i](&packets[k], &sensor) == 0;
+            expected[0] = sensor.w;
+            expected[1] = sensor.x;
+            expected[2] = sensor.y;
+            expected[3] = sensor.z;
+            for (c = 0; c < 4; c++) {
+                if (memcmp(&expected[c], &convertedValues[i][c][k], sizeof(float)) != 0) {
+                    break;
+                }
+            }
+            if (present != ((arrays.present >> i) & 1) || c < 4) {
+                printf("batch conversion mismatch: format %d, %d packets, section %d, packet %d\n",
+                       format, count, i, k);
+                failures++;
+                break;
+            }
+        }
+    }
+    return failures;
+}
+
+int main(void) {
+    struct freespace_MotionEngineOutput packets[PACKETS];
+    int failures = 0;
+    int f;
+    int n;
+
+    for (f = 0; f < (int) (sizeof(meFormats) / sizeof(meFormats[0])); f++) {
+        makePackets(packets, meFormats[f]);
+        for (n = 0; n < (int) (sizeof(counts) / sizeof(counts[0])); n++) {
+            failures += checkConversion(packets, counts[n], meFormats[f]);
+        }
+    }
+    if (failures != 0) {
+        printf("%d failures\n", failures);
+        return 1;
+    }
+    return 0;
+}
@@ -497,6 +497,22 @@ LIBFREESPACE_API void freespace_closeDevice(FreespaceDeviceId id) {
     freespace_private_forceCloseDevice(device);
 }
 
+LIBFREESPACE_API int freespace_closeDeviceAsync(FreespaceDeviceId id,
+                                                freespace_closeCallback callback,
+                                                void* cookie) {
+    struct FreespaceDeviceStruct* device = freespace_private_getDeviceById(id);
+    if (device == NULL) {
+        return FREESPACE_ERROR_NOT_FOUND;
+    }
+
+    // Closing doesn't block here, so just do it.
+    freespace_closeDevice(id);
+    if (callback != NULL) {
+        callback(id, cookie, FREESPACE_SUCCESS);
+    }
+    return FREESPACE_SUCCESS;
+}
+
 static int prepareSend(FreespaceDeviceId id, struct FreespaceSendStruct** sendOut, const char* report, int length) {
     int idx;
     int retVal;
@@ -778,6 +794,31 @@ LIBFREESPACE_API int freespace_sendMessageAsync(FreespaceDeviceId id,
     return freespace_private_sendAsync(id, msgBuf, retVal, timeoutMs, callback, cookie);
 }
 
+int freespace_private_sendPipelined(FreespaceDeviceId id,
+                                    const uint8_t* message,
+                                    int length,
+                                    unsigned int timeoutMs,
+                                    freespace_sendCallback callback,
+                                    void* cookie) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
+LIBFREESPACE_API int freespace_sendMessagePipelined(FreespaceDeviceId id,
+                                                   struct freespace_message* message,
+                                                   unsigned int timeoutMs,
+                                                   freespace_sendCallback callback,
+                                                   void* cookie) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
+LIBFREESPACE_API int freespace_setSendPipelineDepth(FreespaceDeviceId id, int depth) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
+LIBFREESPACE_API int freespace_waitForSends(FreespaceDeviceId id, unsigned int timeoutMs) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
 int freespace_private_read(FreespaceDeviceId id,
                            uint8_t* message,
                            int maxLength,
@@ -881,6 +922,44 @@ LIBFREESPACE_API int freespace_readMessage(FreespaceDeviceId id,
     }
 }
 
+LIBFREESPACE_API int freespace_readMessages(FreespaceDeviceId id,
+                                            struct freespace_message* messages,
+                                            int maxMessages,
+                                            unsigned int timeoutMs,
+                                            int* numMessages) {
+    int retVal;
+    uint8_t buffer[FREESPACE_MAX_INPUT_MESSAGE_SIZE];
+    int actLen;
+    struct FreespaceDeviceInfo info;
+
+    *numMessages = 0;
+    retVal = freespace_getDeviceInfo(id, &info);
+    if (retVal != FREESPACE_SUCCESS || maxMessages <= 0) {
+        return retVal;
+    }
+
+    // Wait for the first report, then only take what has already
+    // been received.
+    retVal = freespace_private_read(id, buffer, sizeof(buffer), timeoutMs, &actLen);
+    while (retVal == FREESPACE_SUCCESS) {
+        retVal = freespace_decode_message(buffer, actLen, &messages[*numMessages], info.hVer);
+        if (retVal == FREESPACE_SUCCESS) {
+            *numMessages = *numMessages + 1;
+            if (*numMessages == maxMessages) {
+                break;
+            }
+        } else if (*numMessages == 0) {
+            return retVal;
+        }
+        retVal = freespace_private_read(id, buffer, sizeof(buffer), 0, &actLen);
+    }
+
+    if (*numMessages > 0) {
+        return FREESPACE_SUCCESS;
+    }
+    return retVal;
+}
+
 LIBFREESPACE_API int freespace_flush(FreespaceDeviceId id) {
     int idx;
 
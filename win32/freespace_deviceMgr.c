@@ -19,6 +19,7 @@
 #include "freespace_device.h"
 #include "freespace_discovery.h"
 #include "freespace_discoveryDetail.h"
+#include "freespace/freespace_libusb.h"
 #include <strsafe.h>
 #include <malloc.h>
 #include "freespace_config.h"
@@ -75,6 +76,10 @@ LIBFREESPACE_API int freespace_init() {
     return FREESPACE_SUCCESS;
 }
 
+LIBFREESPACE_API int freespace_initWithLibusbContext(struct libusb_context* context, int flags) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
 LIBFREESPACE_API void freespace_exit() {
     int i;
 
@@ -150,6 +155,13 @@ LIBFREESPACE_API int freespace_syncFileDescriptors() {
     return FREESPACE_SUCCESS;
 }
 
+LIBFREESPACE_API int freespace_startEventThread(enum freespace_eventThreadDispatch dispatch) {
+    return FREESPACE_ERROR_UINIMPLEMENTED;
+}
+
+LIBFREESPACE_API void freespace_stopEventThread() {
+}
+
 LIBFREESPACE_API int freespace_getNextTimeout(int* timeoutMsOut) {
     // TODO
     *timeoutMsOut = 0xffffffff;